@@ -0,0 +1,440 @@
+#include "bench.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+
+#include "instruction.h"
+#include "log.h"
+#include "cpu.h"
+#include "spu.h"
+#include "bios.h"
+#include "ram.h"
+#include "scratchpad.h"
+#include "interconnect.h"
+#include "dma.h"
+#include "fastmem.h"
+
+
+#define DISPATCH_ITERATIONS     20000000
+#define MEMORY_ITERATIONS       20000000
+#define DMA_ITERATIONS          200
+#define DMA_BLOCK_SIZE          0x1000          // Words
+#define DMA_BLOCK_COUNT         0x40            // 1MB transfers
+#define DMA_WORDS               (DMA_BLOCK_SIZE * DMA_BLOCK_COUNT)
+
+#define LOOP_START              0x80010000
+#define LOOP_END                0x8001002C
+#define LOOP_ITERATIONS         0xF0000
+#define LOOP_INSTRUCTIONS       (3 + LOOP_ITERATIONS * 8)
+#define LOOP_CYCLES             (LOOP_INSTRUCTIONS * INSTRUCTION_CYCLES + LOOP_ITERATIONS * RAM_READ_CYCLES)
+
+#define BRANCH_END              0x80010030
+#define BRANCH_INSTRUCTIONS     (3 + LOOP_ITERATIONS * 8 + LOOP_ITERATIONS / 16)
+#define BRANCH_CYCLES           (BRANCH_INSTRUCTIONS * INSTRUCTION_CYCLES)
+
+#define CALL_END                0x8001001C
+#define CALL_INSTRUCTIONS       (2 + LOOP_ITERATIONS * 8)
+#define CALL_CYCLES             (CALL_INSTRUCTIONS * INSTRUCTION_CYCLES)
+
+CPU *cpu;
+SPU *spu;
+BIOS *bios;
+RAM *ram;
+Scratchpad *scratchpad;
+Interconnect *inter;
+DMA *dma;
+
+
+// ALU instructions without side effects outside of the CPU
+const uint32_t DISPATCH_PROGRAM[] = {
+    0x00411021,     // addu $2, $2, $1
+    0x00412026,     // xor $4, $2, $1
+    0x000428C0,     // sll $5, $4, 3
+    0x2421FFFF,     // addiu $1, $1, -1
+    0x3C01000F,     // lui $1, 0x000F
+    0x00E63823,     // subu $7, $7, $6
+    0x34214321,     // ori $1, $1, 0x4321
+    0x0022782A,     // slt $15, $1, $2
+};
+
+// Typical game loop: ALU, RAM accesses and a backward branch
+const uint32_t LOOP_PROGRAM[] = {
+    0x3C01000F,     // lui $1, 0x000F (LOOP_ITERATIONS)
+    0x24020000,     // addiu $2, $0, 0
+    0x3C038002,     // lui $3, 0x8002
+    0x00411021,     // loop: addu $2, $2, $1
+    0x00412026,     // xor $4, $2, $1
+    0x000428C0,     // sll $5, $4, 3
+    0xAC650000,     // sw $5, 0($3)
+    0x8C660000,     // lw $6, 0($3)
+    0x2421FFFF,     // addiu $1, $1, -1
+    0x1420FFF9,     // bne $1, $0, loop
+    0x00E63823,     // subu $7, $7, $6
+    0x0800400B,     // j LOOP_END
+    0x00000000,     // nop
+};
+
+// Loop body split by a branch taken 15 times out of 16
+const uint32_t BRANCH_PROGRAM[] = {
+    0x3C01000F,     // lui $1, 0x000F (LOOP_ITERATIONS)
+    0x24020000,     // addiu $2, $0, 0
+    0x24050000,     // addiu $5, $0, 0
+    0x00411021,     // loop: addu $2, $2, $1
+    0x3024000F,     // andi $4, $1, 0x0F
+    0x14800002,     // bne $4, $0, skip
+    0x00000000,     // nop
+    0x24A50001,     // addiu $5, $5, 1
+    0x00413026,     // skip: xor $6, $2, $1
+    0x2421FFFF,     // addiu $1, $1, -1
+    0x1420FFF8,     // bne $1, $0, loop
+    0x00000000,     // nop
+    0x0800400C,     // j BRANCH_END
+    0x00000000,     // nop
+};
+
+// Function call and return in a loop
+const uint32_t CALL_PROGRAM[] = {
+    0x3C01000F,     // lui $1, 0x000F (LOOP_ITERATIONS)
+    0x24020000,     // addiu $2, $0, 0
+    0x0C004009,     // loop: jal function
+    0x00411021,     // addu $2, $2, $1
+    0x2421FFFF,     // addiu $1, $1, -1
+    0x1420FFFC,     // bne $1, $0, loop
+    0x00000000,     // nop
+    0x08004007,     // j CALL_END
+    0x00000000,     // nop
+    0x00412026,     // function: xor $4, $2, $1
+    0x03E00008,     // jr $ra
+    0x000428C0,     // sll $5, $4, 3
+};
+
+
+/**
+ * @brief      Benchmarked guest loop, loaded at LOOP_START
+ */
+struct Program {
+    const uint32_t *code;
+    size_t size;
+    uint32_t end;               // Reached once the loop is over
+    size_t instructions;        // Executed until end
+    uint64_t cycles;
+};
+
+const Program LOOP = {
+    LOOP_PROGRAM, sizeof(LOOP_PROGRAM) / sizeof(uint32_t),
+    LOOP_END, LOOP_INSTRUCTIONS, LOOP_CYCLES
+};
+
+const Program BRANCH = {
+    BRANCH_PROGRAM, sizeof(BRANCH_PROGRAM) / sizeof(uint32_t),
+    BRANCH_END, BRANCH_INSTRUCTIONS, BRANCH_CYCLES
+};
+
+const Program CALL = {
+    CALL_PROGRAM, sizeof(CALL_PROGRAM) / sizeof(uint32_t),
+    CALL_END, CALL_INSTRUCTIONS, CALL_CYCLES
+};
+
+
+void show_usage()
+{
+    std::cerr << "Measure CPU dispatch and execution speed\n";
+    std::cerr << "Usage: bench\n";
+}
+
+
+bool bench_init()
+{
+    cpu = new CPU();
+    spu = new SPU();
+    bios = new BIOS();  // Benchmarks run from RAM, no BIOS needed
+    ram = new RAM();
+    scratchpad = new Scratchpad();
+    inter = new Interconnect();
+    dma = new DMA();
+
+    bool running = true;
+    running &= cpu->init();
+    running &= spu->init();
+    running &= ram->init();
+    running &= scratchpad->init();
+    running &= inter->init(spu, bios, ram, scratchpad);
+    running &= dma->init(cpu, ram, nullptr);
+
+    if (running) {
+        cpu->set_inter(inter);
+        inter->set_dma(dma);
+    }
+
+    return running;
+}
+
+
+double elapsed(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    return duration.count();
+}
+
+
+void report(const char *description, double seconds, size_t instructions)
+{
+    printf("%-32s %8.2f ns/instruction %10.2f MIPS\n",
+        description,
+        seconds * 1e9 / instructions,
+        instructions / seconds / 1e6
+    );
+}
+
+
+void report_accesses(const char *description, double seconds, size_t accesses)
+{
+    printf("%-32s %8.2f ns/access      %10.2f M accesses/s\n",
+        description,
+        seconds * 1e9 / accesses,
+        accesses / seconds / 1e6
+    );
+}
+
+
+/**
+ * @brief      Cost of instruction dispatch alone (no fetch, no load delay)
+ */
+void bench_dispatch()
+{
+    size_t size = sizeof(DISPATCH_PROGRAM) / sizeof(uint32_t);
+
+    cpu->reset();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<DISPATCH_ITERATIONS; i++) {
+        cpu->decode_and_execute_switch(DISPATCH_PROGRAM[i % size]);
+    }
+    report("Dispatch: switch", elapsed(start), DISPATCH_ITERATIONS);
+
+    cpu->reset();
+    start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<DISPATCH_ITERATIONS; i++) {
+        cpu->decode_and_execute(DISPATCH_PROGRAM[i % size]);
+    }
+    report("Dispatch: table", elapsed(start), DISPATCH_ITERATIONS);
+}
+
+
+/**
+ * @brief      Run a loop program until it reaches its end
+ * @param[in]  batched  Through run_for: threaded interpreter, chained blocks
+ */
+void run_loop(const char *description, const Program &program, ExecutionMode mode, bool batched)
+{
+    for (size_t i=0; i<program.size; i++) {
+        inter->store<uint32_t>(LOOP_START + i * 4, program.code[i]);
+    }
+
+    cpu->reset();
+    cpu->set_mode(mode);
+    cpu->force_set_PC(LOOP_START);
+
+    auto start = std::chrono::steady_clock::now();
+    if (batched) {
+        cpu->run_for(program.cycles);
+    } else if (mode == MODE_INTERPRETER) {
+        for (size_t i=0; i<program.instructions; i++) {
+            cpu->run_next();
+        }
+    } else {
+        while (cpu->get_PC() != program.end) {
+            cpu->run_block();
+        }
+    }
+    double seconds = elapsed(start);
+
+    if (cpu->get_PC() != program.end) {
+        printf("%-32s did not reach the end of the loop\n", description);
+        return;
+    }
+
+    report(description, seconds, program.instructions);
+}
+
+
+/**
+ * @brief      Cost of guest memory accesses: RAM store, RAM load, BIOS load
+ * Page table lookups against the address decoding they replace, the
+ * scratchpad must be as fast as RAM
+ */
+void bench_memory()
+{
+    uint32_t sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i=0; i<MEMORY_ITERATIONS; i++) {
+        uint32_t offset = (i * 4) & 0xFFFC;
+
+        inter->decode_store<uint32_t>(mask_region(0x80000000 + offset), i);
+        sum += inter->decode_load<uint32_t>(mask_region(0x80000000 + offset));
+        sum += inter->decode_load<uint32_t>(mask_region(0xBFC00000 + offset));
+    }
+    report_accesses("Memory: address decoding", elapsed(start), MEMORY_ITERATIONS * 3);
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i=0; i<MEMORY_ITERATIONS; i++) {
+        uint32_t offset = (i * 4) & 0xFFFC;
+
+        inter->store<uint32_t>(0x80000000 + offset, i);
+        sum += inter->load<uint32_t>(0x80000000 + offset);
+        sum += inter->load<uint32_t>(0xBFC00000 + offset);
+    }
+    report_accesses("Memory: page table", elapsed(start), MEMORY_ITERATIONS * 3);
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i=0; i<MEMORY_ITERATIONS; i++) {
+        uint32_t offset = (i * 4) & (SCRATCHPAD_SIZE - 4);
+
+        inter->store<uint32_t>(SCRATCHPAD_START + offset, i);
+        sum += inter->load<uint32_t>(SCRATCHPAD_START + offset);
+        sum += inter->load<uint32_t>(SCRATCHPAD_START + (offset ^ 4));
+    }
+    report_accesses("Memory: scratchpad", elapsed(start), MEMORY_ITERATIONS * 3);
+
+    // Device registers: GPU status, SPU (last of the I/O page)
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i=0; i<MEMORY_ITERATIONS; i++) {
+        uint32_t offset = (i * 2) & 0x1FE;
+
+        inter->store<uint16_t>(SPU_START + offset, i);
+        sum += inter->load<uint16_t>(SPU_START + offset);
+        sum += inter->load<uint32_t>(GPU_START + 4);
+    }
+    report_accesses("Memory: I/O registers", elapsed(start), MEMORY_ITERATIONS * 3);
+
+    Fastmem fastmem;
+    if (fastmem.init(inter, ram, bios, scratchpad)) {
+        inter->set_fastmem(&fastmem);
+
+        start = std::chrono::steady_clock::now();
+        for (uint32_t i=0; i<MEMORY_ITERATIONS; i++) {
+            uint32_t offset = (i * 4) & 0xFFFC;
+
+            inter->store<uint32_t>(0x80000000 + offset, i);
+            sum += inter->load<uint32_t>(0x80000000 + offset);
+            sum += inter->load<uint32_t>(0xBFC00000 + offset);
+        }
+        report_accesses("Memory: fastmem", elapsed(start), MEMORY_ITERATIONS * 3);
+
+        inter->set_fastmem(nullptr);
+    }
+
+    // Keep the loads alive
+    if (sum == 0xFFFFFFFF) {
+        printf("\n");
+    }
+}
+
+
+// Device end of the DMA channel, sums the words it gets
+void dma_sink(void *device, const uint8_t *data, size_t size)
+{
+    uint32_t *sum = (uint32_t*) device;
+
+    for (size_t i=0; i<size; i+=4) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        *sum += word;
+    }
+}
+
+
+/**
+ * @brief      RAM to device transfers: DMA channel against the word by word
+ * bus loads it replaces
+ */
+void bench_dma()
+{
+    uint32_t sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i=0; i<DMA_ITERATIONS; i++) {
+        uint32_t words[1];
+
+        for (uint32_t j=0; j<DMA_WORDS; j++) {
+            words[0] = inter->load<uint32_t>(0x80000000 + j * 4);
+            dma_sink(&sum, (const uint8_t*) words, sizeof(words));
+        }
+    }
+    report_accesses("DMA: bus loads", elapsed(start), (size_t) DMA_ITERATIONS * DMA_WORDS);
+
+    dma->set_port(DMA_GPU, {&sum, nullptr, dma_sink});
+    inter->store<uint32_t>(DMA_START + DMA_DPCR, DMA_DPCR_ENABLE(DMA_GPU));
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i=0; i<DMA_ITERATIONS; i++) {
+        inter->store<uint32_t>(DMA_START + DMA_GPU * DMA_CHANNEL_STRIDE + DMA_MADR, 0);
+        inter->store<uint32_t>(DMA_START + DMA_GPU * DMA_CHANNEL_STRIDE + DMA_BCR,
+            DMA_BLOCK_COUNT << 16 | DMA_BLOCK_SIZE);
+        inter->store<uint32_t>(DMA_START + DMA_GPU * DMA_CHANNEL_STRIDE + DMA_CHCR,
+            DMA_CHCR_START | DMA_CHCR_FROM_RAM | DMA_SYNC_REQUEST << DMA_CHCR_SYNC_SHIFT);
+    }
+    report_accesses("DMA: block transfer", elapsed(start), (size_t) DMA_ITERATIONS * DMA_WORDS);
+
+    dma->reset();
+
+    // Keep the loads alive
+    if (sum == 0xFFFFFFFF) {
+        printf("\n");
+    }
+}
+
+
+void bench_execution()
+{
+    run_loop("Execution: run_next", LOOP, MODE_INTERPRETER, false);
+    run_loop("Execution: run_for (threaded)", LOOP, MODE_INTERPRETER, true);
+
+    // Same loop fetched from the instruction cache
+    inter->store<uint32_t>(CACHE_CONTROL_START, CACHE_CONTROL_ICACHE);
+    run_loop("Execution: run_next (I-cache)", LOOP, MODE_INTERPRETER, false);
+    inter->store<uint32_t>(CACHE_CONTROL_START, 0);
+
+    run_loop("Execution: cached interpreter", LOOP, MODE_CACHED, false);
+    run_loop("Execution: recompiler", LOOP, MODE_RECOMPILER, false);
+
+    // Blocks chained in a superblock by the cached interpreter
+    run_loop("Branches: run_for (threaded)", BRANCH, MODE_INTERPRETER, true);
+    run_loop("Branches: cached interpreter", BRANCH, MODE_CACHED, false);
+    run_loop("Branches: recompiler", BRANCH, MODE_RECOMPILER, false);
+
+    // Blocks found from the previous one instead of the dispatch
+    run_loop("Calls: run_for (threaded)", CALL, MODE_INTERPRETER, true);
+    run_loop("Calls: cached interpreter", CALL, MODE_CACHED, false);
+    run_loop("Calls: cached (chained)", CALL, MODE_CACHED, true);
+    run_loop("Calls: recompiler", CALL, MODE_RECOMPILER, false);
+    run_loop("Calls: recompiler (chained)", CALL, MODE_RECOMPILER, true);
+}
+
+
+int main(int argc, char *argv[])
+{
+    info("PSX benchmark\n");
+
+    if (argc != 1) {
+        show_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    (void) argv;
+
+    if (!bench_init()) {
+        error("Unable to initialize the emulator\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_dispatch();
+    bench_memory();
+    bench_dma();
+    bench_execution();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,4 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#endif /* BENCH_H */
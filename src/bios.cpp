@@ -6,6 +6,12 @@
 #include "bios.h"
 
 
+BIOS::BIOS()
+{
+    allocate(BIOS_SIZE);
+}
+
+
 BIOS::~BIOS()
 {
 }
@@ -0,0 +1,205 @@
+#include "block.h"
+
+#include <algorithm>
+
+#include "interconnect.h"
+
+// Flags of RAM words
+#define CODE_BLOCK          0x01    // In a block, from its address on
+#define CODE_TRACE          0x02    // In a segment of a superblock
+
+
+/**
+ * @brief      Initialize the block cache
+ * @return     true in case of success, false otherwise
+ */
+bool BlockCache::init()
+{
+    ram_blocks.resize(RAM_WORDS);
+    bios_blocks.resize(BIOS_WORDS);
+    ram_code.resize(RAM_WORDS);
+
+    flush();
+
+    return true;
+}
+
+
+/**
+ * @brief      Drop every cached block
+ */
+void BlockCache::flush()
+{
+    for (auto &block : ram_blocks) {
+        block.reset();
+    }
+
+    for (auto &block : bios_blocks) {
+        block.reset();
+    }
+
+    std::fill(ram_code.begin(), ram_code.end(), 0);
+
+    traces.clear();
+    garbage.clear();
+
+    generation++;
+}
+
+
+/**
+ * @brief      Free invalidated blocks
+ * Must not be called while a block is executing
+ */
+void BlockCache::collect()
+{
+    if (!garbage.empty()) {
+        garbage.clear();
+    }
+}
+
+
+/**
+ * @brief      Tells if code at the given physical address can be cached
+ */
+bool BlockCache::cacheable(uint32_t address)
+{
+    return in_range(address, RAM_START, RAM_SIZE) ||
+           in_range(address, BIOS_START, BIOS_SIZE);
+}
+
+
+std::unique_ptr<Block> *BlockCache::slot(uint32_t address)
+{
+    if (in_range(address, RAM_START, RAM_SIZE)) {
+        return &ram_blocks[(address - RAM_START) >> 2];
+    }
+
+    else if (in_range(address, BIOS_START, BIOS_SIZE)) {
+        return &bios_blocks[(address - BIOS_START) >> 2];
+    }
+
+    return nullptr;
+}
+
+
+/**
+ * @brief      Find the block starting at the given physical address
+ * @return     The block or nullptr if there is none
+ */
+Block *BlockCache::find(uint32_t address)
+{
+    std::unique_ptr<Block> *block = slot(address);
+    if (!block) {
+        return nullptr;
+    }
+
+    return block->get();
+}
+
+
+/**
+ * @brief      Stores a freshly decoded block
+ * @return     The stored block
+ */
+Block *BlockCache::insert(std::unique_ptr<Block> block)
+{
+    std::unique_ptr<Block> *destination = slot(block->address);
+    if (!destination) {
+        return nullptr;
+    }
+
+    if (in_range(block->address, RAM_START, RAM_SIZE)) {
+        uint32_t word = (block->address - RAM_START) >> 2;
+
+        for (size_t i=0; i<block->size(); i++) {
+            ram_code[word + i] |= CODE_BLOCK;
+        }
+    }
+
+    for (size_t i=1; i<block->segments.size(); i++) {
+        const Segment &segment = block->segments[i];
+
+        if (in_range(segment.address, RAM_START, RAM_SIZE)) {
+            uint32_t word = (segment.address - RAM_START) >> 2;
+
+            for (size_t j=0; j<segment.size; j++) {
+                ram_code[word + j] |= CODE_TRACE;
+            }
+        }
+    }
+
+    if (!block->segments.empty()) {
+        traces.push_back(block.get());
+    }
+
+    if (*destination) {
+        discard(*destination);
+    }
+
+    *destination = std::move(block);
+
+    return destination->get();
+}
+
+
+/**
+ * @brief      Invalidate a cached block, freed once it is not executed anymore
+ */
+void BlockCache::discard(std::unique_ptr<Block> &block)
+{
+    block->valid = false;
+
+    if (!block->segments.empty()) {
+        auto trace = std::find(traces.begin(), traces.end(), block.get());
+        *trace = traces.back();
+        traces.pop_back();
+    }
+
+    garbage.push_back(std::move(block));
+    generation++;
+}
+
+
+/**
+ * @brief      Drop every block covering the given RAM word
+ */
+void BlockCache::invalidate_word(uint32_t word)
+{
+    if (ram_code[word] & CODE_BLOCK) {
+        uint32_t first = 0;
+        if (word >= BLOCK_MAX_SIZE) {
+            first = word - BLOCK_MAX_SIZE + 1;
+        }
+
+        for (uint32_t i=first; i<=word; i++) {
+            std::unique_ptr<Block> &block = ram_blocks[i];
+
+            if (block && i + block->size() > word) {
+                discard(block);
+            }
+        }
+    }
+
+    // Segments are anywhere in memory: only hot code gets there
+    if (ram_code[word] & CODE_TRACE) {
+        uint32_t address = RAM_START + (word << 2);
+
+        for (size_t i=0; i<traces.size(); ) {
+            const Block *trace = traces[i];
+
+            bool covered = false;
+            for (const Segment &segment : trace->segments) {
+                covered |= in_range(address, segment.address, segment.size * 4);
+            }
+
+            if (covered) {
+                discard(*slot(trace->address));  // Replaced by the last one
+            } else {
+                i++;
+            }
+        }
+    }
+
+    ram_code[word] = 0;
+}
@@ -0,0 +1,197 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ram.h"
+#include "bios.h"
+
+#define BLOCK_MAX_SIZE      64      // Maximum instructions in a block
+#define BLOCK_HOT_THRESHOLD 32      // Executions before a block heads a superblock
+#define TRACE_MAX_BLOCKS    8       // Blocks chained in a superblock
+#define BLOCK_LINKS         2       // Successors remembered by a block
+#define RAM_WORDS           (RAM_SIZE / 4)
+#define BIOS_WORDS          (BIOS_SIZE / 4)
+
+class CPU;
+struct Op;
+struct Block;
+
+typedef void (*op_handler)(CPU *cpu, const Op &op);
+
+/**
+ * @brief      Recompiled block
+ * @return     Block it was left from: native code continues to its successors
+ */
+typedef Block *(*native_block)(CPU *cpu);
+
+
+/**
+ * @brief      Pre-decoded instruction
+ * Fields are extracted once when the block is built
+ */
+struct Op {
+    op_handler handler;
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t rd;
+    uint8_t imm5;
+    uint32_t imm;           // imm16_se, handlers truncate it to imm16 if needed
+    uint32_t data;          // Raw instruction
+};
+
+
+/**
+ * @brief      How a block is left: where its successor is looked for
+ */
+enum BlockExit : uint8_t {
+    EXIT_DIRECT,            // Fixed targets: fallthrough, branches, J
+    EXIT_CALL,              // JAL: returns to the end of the block
+    EXIT_INDIRECT,          // JR to any register but $ra
+    EXIT_INDIRECT_CALL,     // JALR
+    EXIT_RETURN,            // JR $ra
+};
+
+
+/**
+ * @brief      Block found at a guest address
+ * Only valid while no block was dropped from the cache since: the block
+ * may be freed after that
+ */
+struct Link {
+    uint32_t PC;            // Guest address
+    Block *block;
+    uint64_t generation;    // BlockCache generation when found
+};
+
+
+/**
+ * @brief      Contiguous guest code in a superblock
+ */
+struct Segment {
+    uint32_t address;       // Physical address of the first instruction
+    uint32_t size;          // Instructions
+};
+
+
+/**
+ * @brief      Guest basic block
+ * Ends with a branch and its delay slot or after BLOCK_MAX_SIZE instructions
+ *
+ * A superblock chains a hot block with the blocks its branches most likely
+ * go to: ops of every segment follow each other, a segment is left as soon
+ * as PC is not at its address (side exit).
+ */
+struct Block {
+    uint32_t address;       // Physical address of the first instruction
+    bool valid;             // False once guest code overwrote the block
+    bool idle;              // Wait loop: polls memory until an event occurs
+    BlockExit exit;         // Ending jump, of the last segment for a superblock
+    std::vector<Op> ops;
+    native_block code;      // Recompiled block if any
+    std::vector<Segment> segments;  // Superblock only, the first is the head
+
+    // Profile of basic blocks
+    uint32_t hits;          // Executions
+    uint32_t taken;         // Executions that left through the ending branch
+
+    Link links[BLOCK_LINKS];    // Blocks that ran next
+
+    /**
+     * @brief      Instructions contiguous from the block address
+     */
+    size_t size() const
+    {
+        return segments.empty() ? ops.size() : segments[0].size;
+    }
+
+    /**
+     * @brief      Physical address following the last instruction, where a
+     * call returns
+     */
+    uint32_t end() const
+    {
+        if (segments.empty()) {
+            return address + ops.size() * 4;
+        }
+
+        return segments.back().address + segments.back().size * 4;
+    }
+};
+
+
+/**
+ * @brief      Pre-decoded blocks indexed by physical address
+ * Blocks are dropped when guest code writes over them
+ */
+class BlockCache {
+    std::vector<std::unique_ptr<Block>> ram_blocks;
+    std::vector<std::unique_ptr<Block>> bios_blocks;
+
+    // Flags RAM words covered by at least one block (CODE_BLOCK) or by a
+    // segment of a superblock (CODE_TRACE)
+    std::vector<uint8_t> ram_code;
+
+    // Superblocks, searched when one of their segments is written
+    std::vector<Block *> traces;
+
+    // Invalidated blocks, freed once they are not executed anymore
+    std::vector<std::unique_ptr<Block>> garbage;
+
+    // Incremented whenever a block is dropped: links to it turn stale
+    uint64_t generation = 0;
+
+    friend class Recompiler;
+
+    std::unique_ptr<Block> *slot(uint32_t address);
+    void discard(std::unique_ptr<Block> &block);
+    void invalidate_word(uint32_t word);
+
+public:
+    bool init();
+    void flush();
+    void collect();
+
+    static bool cacheable(uint32_t address);
+
+    Block *find(uint32_t address);
+    Block *insert(std::unique_ptr<Block> block);
+
+    uint64_t get_generation()
+    {
+        return generation;
+    }
+
+    /**
+     * @brief      Called on every RAM store
+     * @param[in]  offset  Offset of the store in RAM
+     */
+    void invalidate(uint32_t offset)
+    {
+        uint32_t word = offset >> 2;
+
+        if (ram_code[word]) {
+            invalidate_word(word);
+        }
+    }
+
+    /**
+     * @brief      Called on bulk RAM writes (DMA, BIOS routines)
+     * @param[in]  offset  Offset of the first byte written in RAM
+     * @param[in]  length  Number of bytes written
+     */
+    void invalidate_range(uint32_t offset, uint32_t length)
+    {
+        uint32_t end = (offset + length + 3) >> 2;
+
+        for (uint32_t word = offset >> 2; word < end; word++) {
+            if (ram_code[word]) {
+                invalidate_word(word);
+            }
+        }
+    }
+};
+
+#endif /* BLOCK_H */
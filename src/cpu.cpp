@@ -2,21 +2,287 @@
 
 #include <stdlib.h>
 #include <inttypes.h>
+#include <memory>
+#include <type_traits>
 
 #include "imgui.h"
 
 #include "log.h"
 #include "instruction.h"
 #include "common.h"
+#include "kernel.h"
+#include "routines.h"
 
 
+#define SR_IEC                      0x000001    // Interrupts enabled
 #define SR_CACHE_ISOLATION          0x010000
 
-#define BcondZ_BGEZ_MASK            0b00001
-#define BcondZ_LINK_MASK            0b10000
+#define CAUSE_IP                    0x00FF00    // Interrupts pending (SR mask)
+#define CAUSE_IP_SOFTWARE           0x000300    // Written with MTC0
+#define CAUSE_IP_HARDWARE           0x000400    // Interrupt controller
 
 #define EXEC_STACK_SIZE             50
 
+// Threaded dispatch needs labels as values (GNU extension)
+#if defined(__GNUC__)
+    #define COMPUTED_GOTO
+#endif
+
+
+/******************************************************
+ *
+ * Dispatch tables
+ *
+ ******************************************************/
+
+typedef void (*instruction_handler)(CPU *cpu, uint32_t data);
+
+/**
+ * @brief      Handlers of an opcode
+ */
+struct Opcode {
+    instruction_handler execute;    // Extract fields from the instruction
+    op_handler execute_op;          // Step and use fields from a pre-decoded Op
+    op_handler execute_straight;    // Same, for straight-line instructions
+};
+
+/**
+ * @brief      Immediate value as expected by the opcode handler
+ * Unsigned handlers get the zero extended value
+ */
+template<typename I>
+I immediate(uint32_t imm16_se)
+{
+    if constexpr (std::is_signed<I>::value) {
+        return (I) imm16_se;
+    } else {
+        return (I) (uint16_t) imm16_se;
+    }
+}
+
+// Opcode shapes: how fields are given to the CPU opcode handler
+
+template<typename I, void (CPU::*F)(size_t, size_t, I)>
+struct RsRtImm {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rs(data), get_rt(data), immediate<I>(get_imm16_se(data))); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rs, op.rt, immediate<I>(op.imm)); }
+};
+
+template<void (CPU::*F)(size_t, int32_t)>
+struct RsImm {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rs(data), get_imm16_se(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rs, (int32_t) op.imm); }
+};
+
+template<void (CPU::*F)(size_t, uint16_t)>
+struct RtImm {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rt(data), get_imm16(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rt, (uint16_t) op.imm); }
+};
+
+template<void (CPU::*F)(uint32_t)>
+struct Imm26 {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_imm26(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(get_imm26(op.data)); }
+};
+
+template<void (CPU::*F)(uint32_t)>
+struct Data {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(data); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.data); }
+};
+
+template<void (CPU::*F)()>
+struct None {
+    static void execute(CPU *cpu, uint32_t) { (cpu->*F)(); }
+    static void execute_op(CPU *cpu, const Op &) { (cpu->*F)(); }
+};
+
+template<void (CPU::*F)(size_t, size_t, uint8_t)>
+struct RtRdImm5 {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rt(data), get_rd(data), get_imm5(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rt, op.rd, op.imm5); }
+};
+
+template<void (CPU::*F)(size_t, size_t, size_t)>
+struct RsRtRd {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rs(data), get_rt(data), get_rd(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rs, op.rt, op.rd); }
+};
+
+template<void (CPU::*F)(size_t, size_t)>
+struct RsRt {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rs(data), get_rt(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rs, op.rt); }
+};
+
+template<void (CPU::*F)(size_t, size_t)>
+struct RsRd {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rs(data), get_rd(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rs, op.rd); }
+};
+
+template<void (CPU::*F)(size_t)>
+struct Rs {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rs(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rs); }
+};
+
+template<void (CPU::*F)(size_t)>
+struct Rd {
+    static void execute(CPU *cpu, uint32_t data) { (cpu->*F)(get_rd(data)); }
+    static void execute_op(CPU *cpu, const Op &op) { (cpu->*F)(op.rd); }
+};
+
+// Writes $zero and cannot raise exceptions: only the step remains
+struct Nop {
+    static void execute(CPU *, uint32_t) {}
+    static void execute_op(CPU *, const Op &) {}
+};
+
+struct Illegal {
+    static void execute(CPU *cpu, uint32_t) { cpu->exception(EXCEPTION_ILLEGAL_INSTRUCTIONS); }
+    static void execute_op(CPU *cpu, const Op &) { cpu->exception(EXCEPTION_ILLEGAL_INSTRUCTIONS); }
+};
+
+// Second level dispatch on the secondary opcode
+struct Special {
+    static void execute(CPU *cpu, uint32_t data);
+    static void execute_op(CPU *cpu, const Op &op) { execute(cpu, op.data); }
+};
+
+/**
+ * @brief      Step then execute a pre-decoded instruction of the given shape
+ */
+template<bool straight, typename S>
+struct Step {
+    static void execute_op(CPU *cpu, const Op &op) { cpu->step<straight, S>(op); }
+};
+
+template<typename S>
+constexpr Opcode opcode()
+{
+    return { &S::execute, &Step<false, S>::execute_op, &Step<true, S>::execute_op };
+}
+
+constexpr std::array<Opcode, 64> make_primary_table()
+{
+    std::array<Opcode, 64> table {};
+    for (size_t i=0; i<table.size(); i++) {
+        table[i] = opcode<Illegal>();
+    }
+
+    table[0x00] = opcode<Special>();
+    table[0x01] = opcode<RsRtImm<int32_t, &CPU::BcondZ>>();
+    table[0x02] = opcode<Imm26<&CPU::J>>();
+    table[0x03] = opcode<Imm26<&CPU::JAL>>();
+    table[0x04] = opcode<RsRtImm<int32_t, &CPU::BEQ>>();
+    table[0x05] = opcode<RsRtImm<int32_t, &CPU::BNE>>();
+    table[0x06] = opcode<RsImm<&CPU::BLEZ>>();
+    table[0x07] = opcode<RsImm<&CPU::BGTZ>>();
+    table[0x08] = opcode<RsRtImm<int32_t, &CPU::ADDI>>();
+    table[0x09] = opcode<RsRtImm<int32_t, &CPU::ADDIU>>();
+    table[0x0A] = opcode<RsRtImm<int32_t, &CPU::SLTI>>();
+    table[0x0B] = opcode<RsRtImm<int32_t, &CPU::SLTIU>>();
+    table[0x0C] = opcode<RsRtImm<uint32_t, &CPU::ANDI>>();
+    table[0x0D] = opcode<RsRtImm<uint16_t, &CPU::ORI>>();
+    table[0x0E] = opcode<RsRtImm<uint16_t, &CPU::XORI>>();
+    table[0x0F] = opcode<RtImm<&CPU::LUI>>();
+    table[0x10] = opcode<Data<&CPU::COP0>>();
+    table[0x11] = opcode<None<&CPU::COP1>>();
+    table[0x12] = opcode<Data<&CPU::COP2>>();
+    table[0x13] = opcode<None<&CPU::COP3>>();
+    table[0x20] = opcode<RsRtImm<int32_t, &CPU::LB>>();
+    table[0x21] = opcode<RsRtImm<int32_t, &CPU::LH<>>>();
+    table[0x22] = opcode<RsRtImm<int32_t, &CPU::LWL>>();
+    table[0x23] = opcode<RsRtImm<int32_t, &CPU::LW<>>>();
+    table[0x24] = opcode<RsRtImm<int32_t, &CPU::LBU>>();
+    table[0x25] = opcode<RsRtImm<int32_t, &CPU::LHU<>>>();
+    table[0x26] = opcode<RsRtImm<int32_t, &CPU::LWR>>();
+    table[0x28] = opcode<RsRtImm<int32_t, &CPU::SB>>();
+    table[0x29] = opcode<RsRtImm<int32_t, &CPU::SH<>>>();
+    table[0x2A] = opcode<RsRtImm<int32_t, &CPU::SWL>>();
+    table[0x2B] = opcode<RsRtImm<int32_t, &CPU::SW<>>>();
+    table[0x2E] = opcode<RsRtImm<int32_t, &CPU::SWR>>();
+    table[0x30] = opcode<None<&CPU::LWC0>>();
+    table[0x31] = opcode<None<&CPU::LWC1>>();
+    table[0x32] = opcode<Data<&CPU::LWC2>>();
+    table[0x33] = opcode<None<&CPU::LWC3>>();
+    table[0x38] = opcode<None<&CPU::SWC0>>();
+    table[0x39] = opcode<None<&CPU::SWC1>>();
+    table[0x3A] = opcode<Data<&CPU::SWC2>>();
+    table[0x3B] = opcode<None<&CPU::SWC3>>();
+    table[0x3F] = opcode<Imm26<&CPU::HLE>>();
+
+    return table;
+}
+
+constexpr std::array<Opcode, 64> make_special_table()
+{
+    std::array<Opcode, 64> table {};
+    for (size_t i=0; i<table.size(); i++) {
+        table[i] = opcode<Illegal>();
+    }
+
+    table[0x00] = opcode<RtRdImm5<&CPU::SLL>>();
+    table[0x02] = opcode<RtRdImm5<&CPU::SRL>>();
+    table[0x03] = opcode<RtRdImm5<&CPU::SRA>>();
+    table[0x04] = opcode<RsRtRd<&CPU::SLLV>>();
+    table[0x06] = opcode<RsRtRd<&CPU::SRLV>>();
+    table[0x07] = opcode<RsRtRd<&CPU::SRAV>>();
+    table[0x08] = opcode<Rs<&CPU::JR>>();
+    table[0x09] = opcode<RsRd<&CPU::JALR>>();
+    table[0x0C] = opcode<None<&CPU::SYSCALL>>();
+    table[0x0D] = opcode<None<&CPU::BREAK>>();
+    table[0x10] = opcode<Rd<&CPU::MFHI>>();
+    table[0x11] = opcode<Rs<&CPU::MTHI>>();
+    table[0x12] = opcode<Rd<&CPU::MFLO>>();
+    table[0x13] = opcode<Rs<&CPU::MTLO>>();
+    table[0x18] = opcode<RsRt<&CPU::MULT>>();
+    table[0x19] = opcode<RsRt<&CPU::MULTU>>();
+    table[0x1A] = opcode<RsRt<&CPU::DIV>>();
+    table[0x1B] = opcode<RsRt<&CPU::DIVU>>();
+    table[0x20] = opcode<RsRtRd<&CPU::ADD>>();
+    table[0x21] = opcode<RsRtRd<&CPU::ADDU>>();
+    table[0x22] = opcode<RsRtRd<&CPU::SUB>>();
+    table[0x23] = opcode<RsRtRd<&CPU::SUBU>>();
+    table[0x24] = opcode<RsRtRd<&CPU::AND>>();
+    table[0x25] = opcode<RsRtRd<&CPU::OR>>();
+    table[0x26] = opcode<RsRtRd<&CPU::XOR>>();
+    table[0x27] = opcode<RsRtRd<&CPU::NOR>>();
+    table[0x2A] = opcode<RsRtRd<&CPU::SLT>>();
+    table[0x2B] = opcode<RsRtRd<&CPU::SLTU>>();
+
+    return table;
+}
+
+/**
+ * @brief      Primary opcodes for an address known to be aligned when decoded
+ * Loads and stores skip the alignment check
+ */
+constexpr std::array<Opcode, 64> make_aligned_table()
+{
+    std::array<Opcode, 64> table = make_primary_table();
+
+    table[0x21] = opcode<RsRtImm<int32_t, &CPU::LH<true>>>();
+    table[0x23] = opcode<RsRtImm<int32_t, &CPU::LW<true>>>();
+    table[0x25] = opcode<RsRtImm<int32_t, &CPU::LHU<true>>>();
+    table[0x29] = opcode<RsRtImm<int32_t, &CPU::SH<true>>>();
+    table[0x2B] = opcode<RsRtImm<int32_t, &CPU::SW<true>>>();
+
+    return table;
+}
+
+constexpr std::array<Opcode, 64> PRIMARY_TABLE = make_primary_table();
+constexpr std::array<Opcode, 64> SPECIAL_TABLE = make_special_table();
+constexpr std::array<Opcode, 64> ALIGNED_TABLE = make_aligned_table();
+constexpr Opcode NOP_OPCODE = opcode<Nop>();
+
+void Special::execute(CPU *cpu, uint32_t data)
+{
+    SPECIAL_TABLE[get_secondary_opcode(data)].execute(cpu, data);
+}
+
 
 CPU::~CPU()
 {
@@ -28,6 +294,10 @@ CPU::~CPU()
  */
 bool CPU::init()
 {
+    if (!cache.init() || !gte.init()) {
+        return false;
+    }
+
     reset();
 
     return true;
@@ -39,12 +309,13 @@ bool CPU::init()
 void CPU::reset()
 {
     reg[0] = 0;
-    out_reg[0] = 0;
     for (size_t i=1; i<REG_COUNT; i++) {
         reg[i] = DEFAULT_REG;
-        out_reg[i] = DEFAULT_REG;
     }
 
+    load_reg = 0;
+    delay_reg = 0;
+
     PC = DEFAULT_PC;
     nextPC = DEFAULT_PC + INSTRUCTION_LENGTH;
     HI = DEFAULT_REG;
@@ -52,27 +323,32 @@ void CPU::reset()
 
     isBranch = false;
     isDelaySlot = false;
-}
 
-/**
- * @brief      Exceture pending load if any
- */
-void CPU::run_load()
-{
-    // Execute pending load
-    set_reg(load_reg, load_value);
-    load_reg = 0;
+    cycles = 0;
+    target = 0;
+    hilo_ready = 0;
+    gte_ready = 0;
+
+    // Hardware interrupt line is driven by the interrupt controller
+    CAUSE &= CAUSE_IP_HARDWARE;
+    update_interrupt();
+
+    icache.reset();
+    gte.reset();
+    flush_blocks();
 }
 
 void CPU::run_next()
 {
+    cycles += INSTRUCTION_CYCLES;
+
     currentPC = PC; // Used to set EPC in case of exception
     if (currentPC % 4 != 0) {
         exception(EXCEPTION_LOAD_ADDRESS_ERROR);
         return;
     }
 
-    uint32_t instruction = load<uint32_t>(PC);
+    uint32_t instruction = fetch(PC);
 
     PC = nextPC;
     nextPC += INSTRUCTION_LENGTH;
@@ -85,11 +361,442 @@ void CPU::run_next()
 
     decode_and_execute(instruction);
 
-    // Set input registers for the next instruction
-    reg = out_reg;
+    // Load of the previous instruction lands now
+    commit_load();
+}
+
+/**
+ * @brief      Execute the pre-decoded block starting at PC
+ * Falls back to run_next when not in cached mode or when PC is not cacheable.
+ * Recompiled blocks only continue to their successors before target
+ */
+void CPU::run_block()
+{
+    if (interrupt_pending) {
+        interrupt();
+    }
+
+    dispatch();
+}
+
+/**
+ * @brief      Look up the block at PC and execute it
+ * @param[out] link  Where to remember the block found, if any
+ * @return     The block executed, nullptr if none was or if it must be
+ * dispatched every time
+ */
+Block *CPU::dispatch(Link *link)
+{
+    if (mode == MODE_INTERPRETER || PC % 4 != 0) {
+        run_next();
+        return nullptr;
+    }
+
+    // No block is executing: invalidated ones can be freed
+    cache.collect();
+
+    if (mode == MODE_RECOMPILER && recompiler.full()) {
+        flush_blocks();
+    }
+
+    uint64_t generation = cache.get_generation();
+    uint32_t start = PC;
+    uint32_t address = mask_region(PC);
+    bool linkable = true;
+
+    if (routines && address == ROUTINES_A0_VECTOR) {
+        // Load of the jump delay slot lands before the function reads it
+        run_load();
+        commit_load();
+
+        if (routines->call()) {
+            return nullptr;
+        }
+
+        // Function may be native again on the next call
+        linkable = false;
+    }
+
+    Block *block = cache.find(address);
+    if (!block) {
+        block = compile_block(address);
+    }
+
+    if (!block) {
+        run_next();
+        return nullptr;
+    }
+
+    // No block dropped meanwhile: the link owner is still there
+    if (link && linkable && cache.get_generation() == generation) {
+        *link = {start, block, generation};
+    }
+
+    block = execute(block, start);
+
+    return linkable ? block : nullptr;
+}
+
+/**
+ * @brief      Execute a block entered at the given guest address
+ * @return     The block executed: a superblock replaces a block getting hot,
+ * recompiled blocks return the last block they continued to
+ */
+Block *CPU::execute(Block *block, uint32_t start)
+{
+    if (mode == MODE_RECOMPILER) {
+        if (!block->code) {
+            block->code = recompiler.compile(block);
+        }
+
+        // Native code does not start in a delay slot
+        if (block->code && !isBranch) {
+            Block *last = block->code(this);
+
+            if (last->idle) {
+                skip_idle(last, start - block->address + last->address);
+            }
+            return last;
+        }
+    }
+
+    // Superblocks are not recompiled
+    if (mode == MODE_CACHED && block->hits == BLOCK_HOT_THRESHOLD && !block->idle) {
+        block = compile_trace(block);
+    }
+
+    if (!block->segments.empty()) {
+        run_trace(block, start);
+        return block;
+    }
+
+    // Instructions are fetched as they are reached, like the interpreter
+    // does: lines the block is left before are not filled
+    bool cached = icache.caches(start);
+    uint32_t fetch = cached ? 0 : inter->get_fetch_cycles(start);
+
+    uint32_t expectedPC = PC;
+    for (const Op &op : block->ops) {
+        // Left the block (branch taken, exception) or block overwritten
+        if (PC != expectedPC || !block->valid) {
+            break;
+        }
+
+        if (cached && (expectedPC == start || expectedPC % ICACHE_LINE_SIZE == 0)) {
+            fetch_line(expectedPC);
+        }
+        cycles += fetch;
+
+        op.handler(this, op);
+
+        expectedPC += INSTRUCTION_LENGTH;
+    }
+
+    block->hits++;
+    if (PC != expectedPC) {
+        block->taken++;
+    }
+
+    if (block->idle) {
+        skip_idle(block, start);
+    }
+
+    return block;
+}
+
+/**
+ * @brief      Execute blocks until the cycle counter reaches target
+ * The next block comes from the links of the one that ran, the return
+ * address stack or the indirect target cache: the dispatch (and its cache
+ * lookup) only runs when none knows the block at PC, and links it for
+ * the next time
+ */
+void CPU::run_blocks()
+{
+    Block *previous = nullptr;
+    uint32_t start = 0;
+
+    while (cycles < target) {
+        Link *link = nullptr;
+        Block *block = nullptr;
+        if (previous) {
+            block = successor(previous, start, &link);
+        }
+
+        start = PC;
+        if (block) {
+            block = execute(block, start);
+        } else {
+            block = dispatch(link);
+        }
+
+        // Recompiled blocks may have continued to others, in the same region
+        if (block) {
+            start += block->address - mask_region(start);
+        }
+
+        previous = block;
+    }
 }
 
+/**
+ * @brief      Block at PC, following the one that just ran
+ * @param[in]  previous  Block that just ran
+ * @param[in]  start     Guest address it was entered at
+ * @param[out] link      Where to remember the block at PC if not found
+ * @return     The block or nullptr if it must be dispatched
+ */
+Block *CPU::successor(Block *previous, uint32_t start, Link **link)
+{
+    if (!previous->valid) {
+        return nullptr;
+    }
+
+    uint64_t generation = cache.get_generation();
+    Block *owner = previous;
+
+    switch(previous->exit) {
+    case EXIT_DIRECT:
+        break;
+    case EXIT_CALL:
+        ras_top = (ras_top + 1) % RAS_SIZE;
+        ras[ras_top] = {start - previous->address + previous->end(), previous, generation};
+        break;
+    case EXIT_INDIRECT_CALL:
+        ras_top = (ras_top + 1) % RAS_SIZE;
+        ras[ras_top] = {start - previous->address + previous->end(), previous, generation};
+
+        return indirect_target(link);
+    case EXIT_RETURN: {
+        // Returning where predicted: the call site links the block there
+        const Link &call = ras[ras_top];
+        ras_top = (ras_top + RAS_SIZE - 1) % RAS_SIZE;
+
+        if (call.PC != PC || call.generation != generation) {
+            return indirect_target(link);
+        }
+
+        owner = call.block;
+        break;
+    }
+    case EXIT_INDIRECT:
+        return indirect_target(link);
+    }
+
+    return linked(owner, link);
+}
+
+/**
+ * @brief      Block at PC among the links of a block
+ * @param[out] link      Link to replace if not found
+ * @return     The block or nullptr if not linked
+ */
+Block *CPU::linked(Block *owner, Link **link)
+{
+    uint64_t generation = cache.get_generation();
+
+    for (Link &candidate : owner->links) {
+        if (candidate.PC == PC && candidate.generation == generation) {
+            return candidate.block;
+        }
+    }
+
+    *link = &owner->links[0];
+    if (owner->links[0].generation == generation) {
+        *link = &owner->links[1];
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief      Block at PC in the indirect target cache
+ * @param[out] link      Entry to replace if not found
+ * @return     The block or nullptr if not cached
+ */
+Block *CPU::indirect_target(Link **link)
+{
+    Link &entry = indirect[(PC >> 2) % INDIRECT_CACHE_SIZE];
+
+    if (entry.PC == PC && entry.generation == cache.get_generation()) {
+        return entry.block;
+    }
+
+    *link = &entry;
+
+    return nullptr;
+}
+
+/**
+ * @brief      Execute a superblock
+ * Segments after the head are side exits: left as soon as PC is not where
+ * the recorded branch directions went
+ */
+void CPU::run_trace(const Block *block, uint32_t start)
+{
+    // Segments are physical, PC stays in the region of the head
+    uint32_t region = start - block->address;
+    const Op *op = block->ops.data();
+
+    bool cached = icache.caches(start);
+    uint32_t fetch = cached ? 0 : inter->get_fetch_cycles(start);
+
+    for (const Segment &segment : block->segments) {
+        uint32_t expectedPC = region + segment.address;
+        if (PC != expectedPC) {
+            return;
+        }
+
+        for (const Op *end = op + segment.size; op != end; op++) {
+            // Left the segment (exception) or superblock overwritten
+            if (PC != expectedPC || !block->valid) {
+                return;
+            }
+
+            if (cached && (op == end - segment.size || expectedPC % ICACHE_LINE_SIZE == 0)) {
+                fetch_line(expectedPC);
+            }
+            cycles += fetch;
+
+            op->handler(this, *op);
+
+            expectedPC += INSTRUCTION_LENGTH;
+        }
+    }
+}
+
+/**
+ * @brief      Load an instruction cache line from memory
+ * The fetch stalls until the whole line is read
+ */
+void CPU::fill_line(ICacheLine &line, uint32_t address)
+{
+    uint32_t start = address & ~(ICACHE_LINE_SIZE - 1);
+
+    for (size_t i=0; i<ICACHE_LINE_WORDS; i++) {
+        line.words[i] = inter->peek<uint32_t>(start + i * 4);
+    }
+
+    line.tag = ICache::tag(start);
+    cycles += inter->get_line_fill_cycles(start);
+}
+
+/**
+ * @brief      Execute guest code for the given number of cycles
+ * The budget may be overrun by the last instruction or block executed
+ */
+void CPU::run_for(uint64_t budget)
+{
+    run_until(cycles + budget);
+}
+
+/**
+ * @brief      Execute guest code until the cycle counter reaches target
+ * Lets the caller batch host work (events, drawing, devices) between calls
+ * instead of doing it after every instruction. The target is lowered by
+ * stop_at when an earlier event gets scheduled meanwhile, or when an
+ * interrupt becomes pending: it is taken on the next call
+ */
+void CPU::run_until(uint64_t target)
+{
+    this->target = target;
+
+    if (interrupt_pending) {
+        interrupt();
+    }
+
+    if (mode == MODE_INTERPRETER) {
+        run_interpreter();
+        return;
+    }
+
+    run_blocks();
+}
+
+/**
+ * @brief      Interpret instructions until the cycle counter reaches target
+ * Same as calling run_next in a loop, dispatching with computed goto when
+ * the compiler supports it: each handler jumps straight to the next one
+ */
+void CPU::run_interpreter()
+{
+#ifdef COMPUTED_GOTO
+    static const void *labels[64] = {
+        &&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+        &&op_08, &&op_09, &&op_0A, &&op_0B, &&op_0C, &&op_0D, &&op_0E, &&op_0F,
+        &&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+        &&op_18, &&op_19, &&op_1A, &&op_1B, &&op_1C, &&op_1D, &&op_1E, &&op_1F,
+        &&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+        &&op_28, &&op_29, &&op_2A, &&op_2B, &&op_2C, &&op_2D, &&op_2E, &&op_2F,
+        &&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+        &&op_38, &&op_39, &&op_3A, &&op_3B, &&op_3C, &&op_3D, &&op_3E, &&op_3F,
+    };
+
+    uint32_t data;
+
+    // Same as run_next, unaligned PC is left to it to raise the exception
+    #define DISPATCH() \
+        if (cycles >= target || PC % 4 != 0) { \
+            goto done; \
+        } \
+        cycles += INSTRUCTION_CYCLES; \
+        currentPC = PC; \
+        data = fetch(PC); \
+        PC = nextPC; \
+        nextPC += INSTRUCTION_LENGTH; \
+        run_load(); \
+        isDelaySlot = isBranch; \
+        isBranch = false; \
+        goto *labels[get_primary_opcode(data)];
+
+    // Table index is constant: handlers get inlined in each label
+    #define OPCODE(n) \
+        op_##n: \
+            PRIMARY_TABLE[0x##n].execute(this, data); \
+            commit_load(); \
+            DISPATCH();
+
+dispatch:
+    DISPATCH();
+
+    OPCODE(00) OPCODE(01) OPCODE(02) OPCODE(03) OPCODE(04) OPCODE(05) OPCODE(06) OPCODE(07)
+    OPCODE(08) OPCODE(09) OPCODE(0A) OPCODE(0B) OPCODE(0C) OPCODE(0D) OPCODE(0E) OPCODE(0F)
+    OPCODE(10) OPCODE(11) OPCODE(12) OPCODE(13) OPCODE(14) OPCODE(15) OPCODE(16) OPCODE(17)
+    OPCODE(18) OPCODE(19) OPCODE(1A) OPCODE(1B) OPCODE(1C) OPCODE(1D) OPCODE(1E) OPCODE(1F)
+    OPCODE(20) OPCODE(21) OPCODE(22) OPCODE(23) OPCODE(24) OPCODE(25) OPCODE(26) OPCODE(27)
+    OPCODE(28) OPCODE(29) OPCODE(2A) OPCODE(2B) OPCODE(2C) OPCODE(2D) OPCODE(2E) OPCODE(2F)
+    OPCODE(30) OPCODE(31) OPCODE(32) OPCODE(33) OPCODE(34) OPCODE(35) OPCODE(36) OPCODE(37)
+    OPCODE(38) OPCODE(39) OPCODE(3A) OPCODE(3B) OPCODE(3C) OPCODE(3D) OPCODE(3E) OPCODE(3F)
+
+    #undef OPCODE
+    #undef DISPATCH
+
+done:
+    // Unaligned PC: run_next raises the exception, then dispatch resumes
+    if (cycles < target) {
+        run_next();
+        goto dispatch;
+    }
+#else
+    while (cycles < target) {
+        run_next();
+    }
+#endif
+}
+
+/**
+ * @brief      Execute the instruction through the dispatch tables
+ */
 void CPU::decode_and_execute(uint32_t data)
+{
+    PRIMARY_TABLE[get_primary_opcode(data)].execute(this, data);
+}
+
+/**
+ * @brief      Execute the instruction through nested switches
+ * Reference dispatch, kept to benchmark the dispatch tables against it
+ */
+void CPU::decode_and_execute_switch(uint32_t data)
 {
     //debug("[CPU] PC: 0x%08x Instruction: 0x%08x ", PC, data);
     //decode(data);
@@ -137,6 +844,7 @@ void CPU::decode_and_execute(uint32_t data)
     case 0x39: SWC1(); break;
     case 0x3A: SWC2(data); break;
     case 0x3B: SWC3(); break;
+    case 0x3F: HLE(get_imm26(data)); break;
     default: exception(EXCEPTION_ILLEGAL_INSTRUCTIONS); break;
     }
 }
@@ -156,8 +864,9 @@ void CPU::exception(uint32_t cause)
     SR &= ~MASK_6_BITS;                // Clear 6 last bits
     SR |= (mode << 2) & MASK_6_BITS;   // Shift mode and store back in SR
 
-    // CAUSE register updated with exception code (bits [6:2])
-    CAUSE = cause << 2;
+    // CAUSE register updated with exception code (bits [6:2]), pending
+    // interrupts are kept
+    CAUSE = (CAUSE & CAUSE_IP) | (cause << 2);
     EPC = currentPC;
 
     if (isDelaySlot) {
@@ -170,6 +879,36 @@ void CPU::exception(uint32_t cause)
     // No delay slot for exceptions
     PC = handler;
     nextPC = PC + INSTRUCTION_LENGTH;
+
+    // Interrupts are disabled until RFE
+    update_interrupt();
+}
+
+/**
+ * @brief      Take the pending interrupt before the instruction at PC
+ * Only done between blocks (or batches of interpreted instructions)
+ */
+void CPU::interrupt()
+{
+    // Load in flight lands before the handler runs
+    run_load();
+    commit_load();
+
+    // A GTE command there runs anyway: handlers skip it when returning
+    if (!isBranch && PC % 4 == 0) {
+        uint32_t next = inter->peek<uint32_t>(PC);
+
+        if (get_primary_opcode(next) == 0x12 && (get_cop_opcode(next) & 0b10000)) {
+            COP2(next);
+        }
+    }
+
+    // Return address is the branch when interrupting its delay slot
+    currentPC = PC;
+    isDelaySlot = isBranch;
+    isBranch = false;
+
+    exception(EXCEPTION_INTERRUPT);
 }
 
 void CPU::branch(uint32_t offset)
@@ -181,6 +920,57 @@ void CPU::branch(uint32_t offset)
 void CPU::set_inter(Interconnect* inter)
 {
     this->inter = inter;
+    this->inter->set_cache(&cache);
+    this->inter->set_icache(&icache);
+    this->inter->set_clock(&cycles);
+}
+
+/**
+ * @brief      Set the hardware interrupt line (interrupt controller)
+ */
+void CPU::set_irq(bool active)
+{
+    if (active) {
+        CAUSE |= CAUSE_IP_HARDWARE;
+    } else {
+        CAUSE &= ~CAUSE_IP_HARDWARE;
+    }
+
+    update_interrupt();
+}
+
+/**
+ * @brief      Handle kernel calls with the given HLE kernel (none if nullptr)
+ */
+void CPU::set_kernel(Kernel *kernel)
+{
+    this->kernel = kernel;
+}
+
+/**
+ * @brief      Run BIOS functions natively (disabled if nullptr)
+ */
+void CPU::set_routines(Routines *routines)
+{
+    this->routines = routines;
+}
+
+/**
+ * @brief      Select how instructions are executed
+ * @return     true in case of success, false if the recompiler cannot run
+ * on this host
+ */
+bool CPU::set_mode(ExecutionMode mode)
+{
+    if (mode == MODE_RECOMPILER && !recompiler.init(this)) {
+        error("Recompiler not available on this host\n");
+        return false;
+    }
+
+    this->mode = mode;
+    flush_blocks();
+
+    return true;
 }
 
 void CPU::print_registers()
@@ -203,15 +993,19 @@ void CPU::display_registers(bool *status)
         ImGui::BeginChild("registers");
 
         ImGui::Text("PC: 0x%08X", PC);
+        ImGui::Text("Cycles: %" PRIu64, cycles);
         ImGui::Separator();
         ImGui::Text("HI: 0x%08X LOW: 0x%08X", HI, LO);
         ImGui::Text("SR: 0x%08X", SR);
         ImGui::Text("CAUSE: 0x%08X EPC: 0x%08X", CAUSE, EPC);
         ImGui::Separator();
         for (size_t i=0; i<REG_COUNT; i++) {
-            ImGui::Text("R%02zu: 0x%08x OUT_R%02zu: 0x%08x", i, reg[i], i, out_reg[i]);
+            ImGui::Text("R%02zu: 0x%08x", i, reg[i]);
         }
         ImGui::Separator();
+        ImGui::Text("Pending load: R%02zu = 0x%08x", load_reg, load_value);
+        ImGui::Text("Load delay: R%02zu = 0x%08x", delay_reg, delay_value);
+        ImGui::Separator();
 
         ImGui::Columns(2, "boolean", false);
 
@@ -248,7 +1042,7 @@ void CPU::display_execution(bool *status)
 
             uint32_t address = PC + (i * INSTRUCTION_LENGTH);
             if (inter->canLoad32(address)) {
-                uint32_t data = load<uint32_t>(address);
+                uint32_t data = inter->peek<uint32_t>(address);
 
                 decode(buffer, INSTRUCTION_MAX_SIZE, data);
                 ImGui::Text("0x%08X %s", data, buffer);
@@ -279,8 +1073,13 @@ int32_t CPU::get_reg_se(size_t index)
 
 void CPU::set_reg(size_t index, uint32_t value)
 {
-    out_reg[index] = value;
-    out_reg[0] = 0;
+    reg[index] = value;
+    reg[0] = 0;
+
+    // Current instruction wins over the load in flight
+    if (delay_reg == index) {
+        delay_reg = 0;
+    }
 }
 
 
@@ -295,7 +1094,7 @@ void CPU::set_reg(size_t index, uint32_t value)
  */
 uint32_t CPU::force_get_reg(size_t index)
 {
-    reg = out_reg;
+    commit_load();
     return get_reg(index);
 }
 
@@ -305,7 +1104,7 @@ uint32_t CPU::force_get_reg(size_t index)
 void CPU::force_set_reg(size_t index, uint32_t value)
 {
     set_reg(index, value);
-    reg = out_reg;
+    commit_load();
 }
 
 uint32_t CPU::get_PC()
@@ -313,6 +1112,22 @@ uint32_t CPU::get_PC()
     return PC;
 }
 
+uint64_t CPU::get_cycles()
+{
+    return cycles;
+}
+
+/**
+ * @brief      Jump to the given address (used for testing purposes)
+ */
+void CPU::force_set_PC(uint32_t address)
+{
+    PC = address;
+    nextPC = address + INSTRUCTION_LENGTH;
+    isBranch = false;
+    isDelaySlot = false;
+}
+
 uint32_t CPU::get_HI()
 {
     return HI;
@@ -506,8 +1321,24 @@ void CPU::COP1()
 
 void CPU::COP2(uint32_t data)
 {
-    error("Unhandled COP2 GTE: 0x%08x", data);
-    exit(1);
+    uint8_t opcode = get_cop_opcode(data);              // Bits 25 - 21
+
+    // GTE command
+    if (opcode & 0b10000) {
+        wait_gte();
+        gte_ready = cycles + gte.execute(data & GTE_COMMAND_MASK);
+        return;
+    }
+
+    switch(opcode) {
+    case 0b00000: MFC2(get_rt(data), get_rd(data)); break;
+    case 0b00010: CFC2(get_rt(data), get_rd(data)); break;
+    case 0b00100: MTC2(get_rt(data), get_rd(data)); break;
+    case 0b00110: CTC2(get_rt(data), get_rd(data)); break;
+    default:
+        error("Unhandled COP2 OPCODE: 0x%02x (inst: 0x%08x)\n", opcode, data);
+        exit(1);
+    }
 }
 
 void CPU::COP3()
@@ -525,10 +1356,11 @@ void CPU::LB(size_t rs, size_t rt, int32_t imm16_se)
     load_value = (uint32_t) value;
 }
 
+template<bool aligned>
 void CPU::LH(size_t rs, size_t rt, int32_t imm16_se)
 {
     uint32_t address = get_reg(rs) + imm16_se;
-    if (address % 2 != 0) {
+    if (!aligned && address % 2 != 0) {
         exception(EXCEPTION_LOAD_ADDRESS_ERROR);
     } else {
         int16_t value = (int16_t) load<uint16_t>(address);
@@ -543,8 +1375,11 @@ void CPU::LWL(size_t rs, size_t rt, int32_t imm16_se)
 {
     uint32_t address = get_reg(rs) + imm16_se;
 
-    // Bypass load delay
-    uint32_t value = out_reg[rt];
+    // Bypass load delay: merge with the load in flight
+    uint32_t value = get_reg(rt);
+    if (delay_reg == rt) {
+        value = delay_value;
+    }
 
     // Load the word containing the left part the unaligned addressed word
     uint32_t aligned_address = address & ~0x00000003; // Clear two last bits
@@ -565,10 +1400,11 @@ void CPU::LWL(size_t rs, size_t rt, int32_t imm16_se)
     load_value = value;
 }
 
+template<bool aligned>
 void CPU::LW(size_t rs, size_t rt, int32_t imm16_se)
 {
     uint32_t address = get_reg(rs) + imm16_se;
-    if (address % 4 != 0) {
+    if (!aligned && address % 4 != 0) {
         exception(EXCEPTION_LOAD_ADDRESS_ERROR);
     } else {
         // Create a pending load
@@ -584,10 +1420,11 @@ void CPU::LBU(size_t rs, size_t rt, int32_t imm16_se)
     load_value = (uint32_t) load<uint8_t>(get_reg(rs) + imm16_se);
 }
 
+template<bool aligned>
 void CPU::LHU(size_t rs, size_t rt, int32_t imm16_se)
 {
     uint32_t address = get_reg(rs) + imm16_se;
-    if (address % 2 != 0) {
+    if (!aligned && address % 2 != 0) {
         exception(EXCEPTION_LOAD_ADDRESS_ERROR);
     } else {
         // Create a pending load
@@ -600,8 +1437,11 @@ void CPU::LWR(size_t rs, size_t rt, int32_t imm16_se)
 {
     uint32_t address = get_reg(rs) + imm16_se;
 
-    // Bypass load delay
-    uint32_t value = out_reg[rt];
+    // Bypass load delay: merge with the load in flight
+    uint32_t value = get_reg(rt);
+    if (delay_reg == rt) {
+        value = delay_value;
+    }
 
     // Load the word containing the left part the unaligned addressed word
     uint32_t aligned_address = address & ~0x00000003; // Clear two last bits
@@ -624,23 +1464,14 @@ void CPU::LWR(size_t rs, size_t rt, int32_t imm16_se)
 
 void CPU::SB(size_t rs, size_t rt, int32_t imm16_se)
 {
-    if (SR & SR_CACHE_ISOLATION) {
-        //debug("Ignoring store8 while cache is isolated\n");
-        return;
-    }
-
     store<uint8_t>(get_reg(rs) + imm16_se, (uint8_t) get_reg(rt));
 }
 
+template<bool aligned>
 void CPU::SH(size_t rs, size_t rt, int32_t imm16_se)
 {
-    if (SR & SR_CACHE_ISOLATION) {
-        //debug("Ignoring store16 while cache is isolated\n");
-        return;
-    }
-
     uint32_t address = get_reg(rs) + imm16_se;
-    if (address % 2 != 0) {
+    if (!aligned && address % 2 != 0) {
         exception(EXCEPTION_STORE_ADDRESS_ERROR);
     } else {
         store<uint16_t>(address, (uint16_t) get_reg(rt));
@@ -653,7 +1484,7 @@ void CPU::SWL(size_t rs, size_t rt, int32_t imm16_se)
     uint32_t value = get_reg(rt);
 
     uint32_t aligned_address = address & ~0x00000003; // Clear two last bits
-    uint32_t memory = load<uint32_t>(aligned_address);
+    uint32_t memory = inter->peek<uint32_t>(aligned_address);
     switch(address & 0x03) {
     case 0: memory = (memory & 0xFFFFFF00) | (value >> 24); break;
     case 1: memory = (memory & 0xFFFF0000) | (value >> 16); break;
@@ -665,15 +1496,11 @@ void CPU::SWL(size_t rs, size_t rt, int32_t imm16_se)
     store<uint32_t>(address, memory);
 }
 
+template<bool aligned>
 void CPU::SW(size_t rs, size_t rt, int32_t imm16_se)
 {
-    if (SR & SR_CACHE_ISOLATION) {
-        //debug("Ignoring store32 while cache is isolated\n");
-        return;
-    }
-
     uint32_t address = get_reg(rs) + imm16_se;
-    if (address % 4 != 0) {
+    if (!aligned && address % 4 != 0) {
         exception(EXCEPTION_STORE_ADDRESS_ERROR);
     } else {
         store<uint32_t>(address, get_reg(rt));
@@ -686,7 +1513,7 @@ void CPU::SWR(size_t rs, size_t rt, int32_t imm16_se)
     uint32_t value = get_reg(rt);
 
     uint32_t aligned_address = address & ~0x00000003; // Clear two last bits
-    uint32_t memory = load<uint32_t>(aligned_address);
+    uint32_t memory = inter->peek<uint32_t>(aligned_address);
     switch(address & 0x03) {
     case 0: memory = (memory & 0x00000000) | (value << 0); break;
     case 1: memory = (memory & 0x000000FF) | (value << 8); break;
@@ -710,8 +1537,16 @@ void CPU::LWC1()
 
 void CPU::LWC2(uint32_t data)
 {
-    error("Unhandled GTE LWC 0x%08x\n", data);
-    exit(1);
+    uint32_t address = get_reg(get_rs(data)) + get_imm16_se(data);
+    if (address % 4 != 0) {
+        exception(EXCEPTION_LOAD_ADDRESS_ERROR);
+        return;
+    }
+
+    uint32_t value = load<uint32_t>(address);
+
+    wait_gte();
+    gte.write_data(get_rt(data), value);
 }
 
 void CPU::LWC3()
@@ -731,8 +1566,14 @@ void CPU::SWC1()
 
 void CPU::SWC2(uint32_t data)
 {
-    error("Unhandled GTE SWC 0x%08x\n", data);
-    exit(1);
+    uint32_t address = get_reg(get_rs(data)) + get_imm16_se(data);
+    if (address % 4 != 0) {
+        exception(EXCEPTION_STORE_ADDRESS_ERROR);
+        return;
+    }
+
+    wait_gte();
+    store<uint32_t>(address, gte.read_data(get_rt(data)));
 }
 
 void CPU::SWC3()
@@ -740,6 +1581,23 @@ void CPU::SWC3()
     exception(EXCEPTION_COPROCESSOR_ERROR);
 }
 
+/**
+ * @brief      Kernel call placed at the kernel entry points by the HLE kernel
+ * Reserved instruction when running a real BIOS
+ */
+void CPU::HLE(uint32_t imm26)
+{
+    if (!kernel) {
+        exception(EXCEPTION_ILLEGAL_INSTRUCTIONS);
+        return;
+    }
+
+    // Arguments loaded in the delay slot of the call are visible
+    commit_load();
+
+    kernel->call(imm26);
+}
+
 
 /******************************************************
  *
@@ -788,9 +1646,13 @@ void CPU::JR(size_t rs)
 
 void CPU::JALR(size_t rs, size_t rd)
 {
+    // Jump address is read before rd is written
+    uint32_t address = get_reg(rs);
+
     set_reg(rd, nextPC);
 
-    JR(rs);
+    isBranch = true;
+    nextPC = address;
 }
 
 void CPU::SYSCALL()
@@ -803,8 +1665,24 @@ void CPU::BREAK()
     exception(EXCEPTION_BREAK);
 }
 
+/**
+ * @brief      Latency of a multiplication
+ * @param[in]  magnitude  Significant bits of rs
+ */
+static uint32_t mult_cycles(uint32_t magnitude)
+{
+    if (magnitude < 0x800) {
+        return MULT_FAST_CYCLES;
+    } else if (magnitude < 0x100000) {
+        return MULT_CYCLES;
+    }
+
+    return MULT_SLOW_CYCLES;
+}
+
 void CPU::MFHI(size_t rd)
 {
+    wait_hilo();
     set_reg(rd, HI);
 }
 
@@ -815,6 +1693,7 @@ void CPU::MTHI(size_t rs)
 
 void CPU::MFLO(size_t rd)
 {
+    wait_hilo();
     set_reg(rd, LO);
 }
 
@@ -832,6 +1711,14 @@ void CPU::MULT(size_t rs, size_t rt)
 
     HI = (uint32_t) (v >> 32);
     LO = (uint32_t) v;
+
+    // Magnitude of rs: negative values count their leading ones
+    uint32_t magnitude = get_reg(rs);
+    if ((int32_t) magnitude < 0) {
+        magnitude = ~magnitude;
+    }
+
+    hilo_ready = cycles + mult_cycles(magnitude);
 }
 
 void CPU::MULTU(size_t rs, size_t rt)
@@ -843,6 +1730,8 @@ void CPU::MULTU(size_t rs, size_t rt)
 
     HI = (uint32_t) (v >> 32);
     LO = (uint32_t) v;
+
+    hilo_ready = cycles + mult_cycles(get_reg(rs));
 }
 
 void CPU::DIV(size_t rs, size_t rt)
@@ -869,6 +1758,8 @@ void CPU::DIV(size_t rs, size_t rt)
         HI = (uint32_t)(numerator % denominator);
         LO = (uint32_t)(numerator / denominator);
     }
+
+    hilo_ready = cycles + DIV_CYCLES;
 }
 
 void CPU::DIVU(size_t rs, size_t rt)
@@ -885,6 +1776,8 @@ void CPU::DIVU(size_t rs, size_t rt)
         HI = numerator % denominator;
         LO = numerator / denominator;
     }
+
+    hilo_ready = cycles + DIV_CYCLES;
 }
 
 void CPU::ADD(size_t rs, size_t rt, size_t rd)
@@ -944,7 +1837,7 @@ void CPU::XOR(size_t rs, size_t rt, size_t rd)
 
 void CPU::NOR(size_t rs, size_t rt, size_t rd)
 {
-    set_reg(rd, !(get_reg(rs) | get_reg(rt)));
+    set_reg(rd, ~(get_reg(rs) | get_reg(rt)));
 }
 
 void CPU::SLT(size_t rs, size_t rt, size_t rd)
@@ -996,13 +1889,12 @@ void CPU::MTC0(size_t rt, size_t rd)
         }
         break;
     case 12:
-        SR = get_reg(rt);
+        set_SR(value);
         break;
     case 13:
-        if (value != 0) {
-            error("Unhandled write COP0 CAUSE\n");
-            exit(1);
-        }
+        // Only the software interrupts can be written
+        CAUSE = (CAUSE & ~CAUSE_IP_SOFTWARE) | (value & CAUSE_IP_SOFTWARE);
+        update_interrupt();
         break;
     default:
         error("Unhandled write COP0 register: %zu\n", rd);
@@ -1010,10 +1902,438 @@ void CPU::MTC0(size_t rt, size_t rd)
     }
 }
 
+/**
+ * @brief      Write the status register
+ * Cache isolation is forwarded to the Interconnect only here
+ */
+void CPU::set_SR(uint32_t value)
+{
+    SR = value;
+
+    if (inter) {
+        inter->set_isolated(SR & SR_CACHE_ISOLATION);
+    }
+
+    update_interrupt();
+}
+
+/**
+ * @brief      Recompute whether an interrupt is to be taken
+ * Called when SR, CAUSE or the interrupt line change instead of checking
+ * them for every instruction. The running batch ends to take it
+ */
+void CPU::update_interrupt()
+{
+    interrupt_pending = (SR & SR_IEC) && (SR & CAUSE & CAUSE_IP);
+
+    if (interrupt_pending) {
+        stop_at(cycles);
+    }
+}
+
 void CPU::RFE()
 {
     // Restore the pre-exception mode
     uint32_t mode = SR & MASK_6_BITS;  // Store last 6 bits
     SR &= ~MASK_6_BITS;                // Clear last 6 bits
     SR |= (mode >> 2);                 // Shift the stack to the right
+
+    update_interrupt();
+}
+
+void CPU::MFC2(size_t rt, size_t rd)
+{
+    wait_gte();
+
+    // Create a pending load
+    load_reg = rt;
+    load_value = gte.read_data(rd);
+}
+
+void CPU::CFC2(size_t rt, size_t rd)
+{
+    wait_gte();
+
+    load_reg = rt;
+    load_value = gte.read_control(rd);
+}
+
+void CPU::MTC2(size_t rt, size_t rd)
+{
+    wait_gte();
+
+    gte.write_data(rd, get_reg(rt));
+}
+
+void CPU::CTC2(size_t rt, size_t rd)
+{
+    wait_gte();
+
+    gte.write_control(rd, get_reg(rt));
+}
+
+
+/******************************************************
+ *
+ * Cached interpreter
+ *
+ ******************************************************/
+
+/**
+ * @brief      Extract once every field of an instruction
+ * The handler is the cheapest one given what is known when decoding
+ * @param[in]  straight  Not first of its block, not after a branch or a load
+ */
+static Op decode_op(uint32_t data, bool straight)
+{
+    Op op;
+    op.rs = get_rs(data);
+    op.rt = get_rt(data);
+    op.rd = get_rd(data);
+    op.imm5 = get_imm5(data);
+    op.imm = get_imm16_se(data);
+    op.data = data;
+
+    const Opcode *opcode;
+    uint8_t primary = get_primary_opcode(data);
+
+    if (is_pure(data) && get_destination(data) == 0) {
+        opcode = &NOP_OPCODE;
+    } else if (primary == 0x00) {
+        opcode = &SPECIAL_TABLE[get_secondary_opcode(data)];
+    } else if (op.rs == 0 && op.imm % 4 == 0) {
+        // Address is the immediate: aligned to any access size
+        opcode = &ALIGNED_TABLE[primary];
+    } else {
+        opcode = &PRIMARY_TABLE[primary];
+    }
+
+    op.handler = straight ? opcode->execute_straight : opcode->execute_op;
+
+    return op;
+}
+
+/**
+ * @brief      Registers used by an instruction allowed in a wait loop
+ * @param[out] reads   Registers read (0 if none)
+ * @param[out] write   Register written (0 if none)
+ * @param[out] load    True if the write is delayed (load)
+ * @return     false if the instruction may have side effects
+ */
+static bool idle_registers(uint32_t data, size_t reads[2], size_t *write, bool *load)
+{
+    size_t rs = get_rs(data);
+    size_t rt = get_rt(data);
+    size_t rd = get_rd(data);
+
+    reads[0] = 0;
+    reads[1] = 0;
+    *write = 0;
+    *load = false;
+
+    uint8_t opcode = get_primary_opcode(data);
+
+    switch(opcode) {
+    case 0x00:
+        switch(get_secondary_opcode(data)) {
+        case 0x00: case 0x02: case 0x03:                    // SLL SRL SRA
+            reads[0] = rt; *write = rd; return true;
+        case 0x04: case 0x06: case 0x07:                    // SLLV SRLV SRAV
+        case 0x21: case 0x23:                               // ADDU SUBU
+        case 0x24: case 0x25: case 0x26: case 0x27:         // AND OR XOR NOR
+        case 0x2A: case 0x2B:                               // SLT SLTU
+            reads[0] = rs; reads[1] = rt; *write = rd; return true;
+        default:
+            return false;
+        }
+    case 0x01:                                              // BcondZ
+        reads[0] = rs;
+        return !(rt & BcondZ_LINK_MASK);
+    case 0x02:                                              // J
+        return true;
+    case 0x04: case 0x05:                                   // BEQ BNE
+        reads[0] = rs; reads[1] = rt; return true;
+    case 0x06: case 0x07:                                   // BLEZ BGTZ
+        reads[0] = rs; return true;
+    case 0x09: case 0x0A: case 0x0B:                        // ADDIU SLTI SLTIU
+    case 0x0C: case 0x0D: case 0x0E:                        // ANDI ORI XORI
+        reads[0] = rs; *write = rt; return true;
+    case 0x0F:                                              // LUI
+        *write = rt; return true;
+    case 0x20: case 0x21: case 0x23: case 0x24: case 0x25:  // LB LH LW LBU LHU
+        reads[0] = rs; *write = rt; *load = true; return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief      Tells if the block is a wait loop
+ *
+ * The block branches back to its start, has no side effect but loads, and
+ * only reads registers that are either not written by the loop or written
+ * earlier in the same iteration. Each iteration then does the exact same
+ * thing until a loaded value changes.
+ */
+static bool is_idle_loop(const Block &block)
+{
+    size_t count = block.ops.size();
+    if (count < 2) {
+        return false;
+    }
+
+    // Branch (before its delay slot) back to the start of the block
+    uint32_t branch = block.ops[count - 2].data;
+    uint32_t branch_address = block.address + (count - 2) * INSTRUCTION_LENGTH;
+    uint32_t target;
+
+    switch(get_primary_opcode(branch)) {
+    case 0x01: case 0x04: case 0x05: case 0x06: case 0x07:
+        target = branch_address + INSTRUCTION_LENGTH + (get_imm16_se(branch) << 2);
+        break;
+    case 0x02:
+        target = get_imm26(branch) << 2;
+        break;
+    default:
+        return false;
+    }
+
+    if ((target & 0x0FFFFFFF) != (block.address & 0x0FFFFFFF)) {
+        return false;
+    }
+
+    size_t reads[2];
+    size_t write;
+    bool load;
+
+    bool written[REG_COUNT] = {false};
+    for (const Op &op : block.ops) {
+        if (!idle_registers(op.data, reads, &write, &load)) {
+            return false;
+        }
+
+        written[write] = true;
+    }
+
+    bool visible[REG_COUNT] = {false};
+    size_t pending = 0;
+    for (const Op &op : block.ops) {
+        idle_registers(op.data, reads, &write, &load);
+
+        for (size_t r : reads) {
+            if (r != 0 && written[r] && !visible[r]) {
+                return false;
+            }
+        }
+
+        // Load delay: the previous load lands after this instruction
+        visible[pending] = true;
+        pending = load ? write : 0;
+
+        if (!load) {
+            visible[write] = true;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief      Skip to the next event when a wait loop iterated
+ * Every load must read a value that only changes with a scheduled event
+ */
+void CPU::skip_idle(const Block *block, uint32_t start)
+{
+    if (PC != start || !block->valid || cycles >= target) {
+        return;
+    }
+
+    for (const Op &op : block->ops) {
+        uint8_t opcode = get_primary_opcode(op.data);
+
+        if (opcode >= 0x20 && !inter->stable(reg[op.rs] + op.imm)) {
+            return;
+        }
+    }
+
+    cycles = target;
+}
+
+/**
+ * @brief      Tells how the block is left, from its ending jump
+ * Also holds for a superblock: its ops end with the last segment
+ */
+static BlockExit block_exit(const Block &block)
+{
+    size_t count = block.ops.size();
+    if (count < 2) {
+        return EXIT_DIRECT;
+    }
+
+    uint32_t jump = block.ops[count - 2].data;
+    if (get_primary_opcode(jump) == 0x03) {                     // JAL
+        return EXIT_CALL;
+    }
+
+    if (get_primary_opcode(jump) != 0x00) {
+        return EXIT_DIRECT;
+    }
+
+    switch(get_secondary_opcode(jump)) {
+    case 0x08:                                                  // JR
+        return get_rs(jump) == RA ? EXIT_RETURN : EXIT_INDIRECT;
+    case 0x09:                                                  // JALR
+        return EXIT_INDIRECT_CALL;
+    default:
+        return EXIT_DIRECT;
+    }
+}
+
+/**
+ * @brief      Drop all cached blocks and the generated code
+ */
+void CPU::flush_blocks()
+{
+    cache.flush();
+    recompiler.flush();
+}
+
+/**
+ * @brief      Decode the guest block starting at the given physical address
+ * The block ends with the delay slot of the first branch
+ * @return     The new block or nullptr if the address cannot be cached
+ */
+Block *CPU::compile_block(uint32_t address)
+{
+    if (!BlockCache::cacheable(address)) {
+        return nullptr;
+    }
+
+    std::unique_ptr<Block> block = std::make_unique<Block>();
+    block->address = address;
+    block->valid = true;
+    block->code = nullptr;
+    block->hits = 0;
+    block->taken = 0;
+
+    bool delay_slot = false;
+    bool straight = false;     // First instruction may follow a branch or a load
+    while (block->ops.size() < BLOCK_MAX_SIZE) {
+        uint32_t current = address + block->ops.size() * INSTRUCTION_LENGTH;
+        if (!BlockCache::cacheable(current)) {
+            break;
+        }
+
+        uint32_t data = inter->peek<uint32_t>(current);
+        block->ops.push_back(decode_op(data, straight));
+
+        if (delay_slot) {
+            break;
+        }
+
+        delay_slot = is_branch(data);
+        straight = !delay_slot && !is_load(data);
+    }
+
+    block->idle = is_idle_loop(*block);
+    block->exit = block_exit(*block);
+
+    return cache.insert(std::move(block));
+}
+
+/**
+ * @brief      Physical address a basic block most likely continues at
+ * Conditional branches go the way they went most often so far
+ * @return     false if unknown: indirect jump or branch never executed
+ */
+static bool likely_successor(const Block &block, uint32_t *successor)
+{
+    size_t count = block.ops.size();
+    uint32_t fallthrough = block.address + count * INSTRUCTION_LENGTH;
+
+    // Ended on its size: the last instruction may be a branch without its
+    // delay slot, the next block starts in it
+    if (count < 2 || !is_branch(block.ops[count - 2].data)) {
+        *successor = fallthrough;
+
+        return !is_branch(block.ops[count - 1].data);
+    }
+
+    uint32_t branch = block.ops[count - 2].data;
+    uint32_t branch_address = block.address + (count - 2) * INSTRUCTION_LENGTH;
+
+    switch(get_primary_opcode(branch)) {
+    case 0x01: case 0x04: case 0x05: case 0x06: case 0x07:     // BcondZ BEQ BNE BLEZ BGTZ
+        if (block.hits == 0) {
+            return false;
+        }
+
+        if (block.taken * 2 > block.hits) {
+            *successor = branch_address + INSTRUCTION_LENGTH + (get_imm16_se(branch) << 2);
+        } else {
+            *successor = fallthrough;
+        }
+        return true;
+    case 0x02: case 0x03:                                       // J JAL
+        *successor = (branch_address & 0xF0000000) | (get_imm26(branch) << 2);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief      Chain a hot block with its likely successors in a superblock
+ * Stops at the head (next dispatch enters the superblock again), at an
+ * unknown successor or when the superblock would exceed BLOCK_MAX_SIZE:
+ * run_until is still overrun by less than a block
+ * @return     The superblock replacing the head, the head if nothing follows
+ */
+Block *CPU::compile_trace(Block *head)
+{
+    std::unique_ptr<Block> trace = std::make_unique<Block>();
+    trace->address = head->address;
+    trace->valid = true;
+    trace->idle = false;
+    trace->ops = head->ops;
+    trace->code = nullptr;
+    trace->segments.push_back({head->address, (uint32_t) head->ops.size()});
+    trace->hits = 0;
+    trace->taken = 0;
+
+    const Block *current = head;
+    uint32_t address;
+    while (trace->segments.size() < TRACE_MAX_BLOCKS && likely_successor(*current, &address)) {
+        if (address == head->address) {
+            break;
+        }
+
+        Block *successor = cache.find(address);
+        if (!successor) {
+            successor = compile_block(address);
+        }
+
+        if (!successor || trace->ops.size() + successor->size() > BLOCK_MAX_SIZE) {
+            break;
+        }
+
+        // First instruction of a segment is decoded as first of its block
+        trace->ops.insert(trace->ops.end(), successor->ops.begin(), successor->ops.begin() + successor->size());
+        trace->segments.push_back({address, (uint32_t) successor->size()});
+
+        // A superblock has no profile of its own
+        if (!successor->segments.empty()) {
+            break;
+        }
+
+        current = successor;
+    }
+
+    if (trace->segments.size() == 1) {
+        return head;
+    }
+
+    trace->exit = block_exit(*trace);
+
+    return cache.insert(std::move(trace));
 }
@@ -5,6 +5,10 @@
 #include  <cstdint>
 
 #include "interconnect.h"
+#include "block.h"
+#include "icache.h"
+#include "gte.h"
+#include "recompiler.h"
 
 #define INSTRUCTION_LENGTH  4 // 4 * 8bits = 32 bits
 #define DEFAULT_PC          0xBFC00000
@@ -12,8 +16,25 @@
 #define REG_COUNT           32
 #define RA                  31  // Return address
 
+// rt field of BcondZ
+#define BcondZ_BGEZ_MASK    0b00001
+#define BcondZ_LINK_MASK    0b10000
+
+#define RAS_SIZE            8       // Return address stack entries
+#define INDIRECT_CACHE_SIZE 256     // Blocks found at JR/JALR targets
+
+#define CPU_FREQUENCY       33868800    // Hz
+#define INSTRUCTION_CYCLES  1           // Cycles taken by an instruction
+
+// HI/LO result latency (multiply depends on the magnitude of rs)
+#define MULT_FAST_CYCLES    6
+#define MULT_CYCLES         9
+#define MULT_SLOW_CYCLES    13
+#define DIV_CYCLES          36
+
 #define BEV_MASK            0x00400000
 
+#define EXCEPTION_INTERRUPT                 0x0
 #define EXCEPTION_LOAD_ADDRESS_ERROR        0x4
 #define EXCEPTION_STORE_ADDRESS_ERROR       0x5
 #define EXCEPTION_SYSCALL                   0x8
@@ -23,13 +44,46 @@
 #define EXCEPTION_OVERFLOW                  0xC
 
 class Interconnect;
+class Kernel;
+class Routines;
+
+
+/**
+ * @brief      How guest instructions are executed
+ */
+enum ExecutionMode : int {
+    MODE_INTERPRETER,       // Fetch and decode every instruction (reference)
+    MODE_CACHED,            // Execute pre-decoded basic blocks
+    MODE_RECOMPILER,        // Execute blocks translated to native code
+};
 
 
 /**
  * @brief      CPU for the PSX
  */
 class CPU {
-    Interconnect *inter;
+    friend class Recompiler;
+    friend class Kernel;
+    friend class Routines;
+    friend class DMA;
+
+    Interconnect *inter = nullptr;
+    Kernel *kernel = nullptr;   // HLE kernel replacing the BIOS, if any
+    Routines *routines = nullptr;   // Native BIOS functions, if enabled
+
+    ExecutionMode mode = MODE_INTERPRETER;
+    BlockCache cache;
+    ICache icache;
+    GTE gte;
+    Recompiler recompiler;
+
+    // Return address stack: links hold the call site, whose own links give
+    // the block returned to
+    std::array<Link, RAS_SIZE> ras = {};
+    size_t ras_top = 0;
+
+    // Blocks found at the targets of indirect jumps, hashed by address
+    std::array<Link, INDIRECT_CACHE_SIZE> indirect = {};
 
     // Registers
     std::array<uint32_t, REG_COUNT> reg;
@@ -37,24 +91,42 @@ class CPU {
     uint32_t HI;
     uint32_t LO;
 
+    uint64_t cycles;        // Cycles elapsed since reset
+    uint64_t target;        // Cycle at which run_until returns
+    uint64_t hilo_ready;    // Cycle at which MULT/DIV results are in HI/LO
+    uint64_t gte_ready;     // Cycle at which the GTE command is done
+
+    // Cost of each instruction fetch of the recompiled block running, 0 if
+    // its lines are fetched through the instruction cache
+    uint32_t fetch_cycles = 0;
+
     uint32_t currentPC;     // Set EPC for exceptions
     uint32_t nextPC;
 
     bool isBranch;          // True if we are branching
     bool isDelaySlot;       // True if we are in a delay slot
 
-    // Emulates load delay: Contains output of current instructions
-    std::array<uint32_t, REG_COUNT> out_reg;
-
-    // Pending load (if load_reg != 0 thre is a pending load)
+    // Pending load set by the current instruction (none if load_reg == 0)
     size_t load_reg = 0;
     uint32_t load_value = 0;
 
+    // Emulates load delay: load in flight, written back once the current
+    // instruction is over (none if delay_reg == 0)
+    size_t delay_reg = 0;
+    uint32_t delay_value = 0;
+
     // COP0 registers
     uint32_t SR;
     uint32_t CAUSE;         // cop0 13: Cause Register
     uint32_t EPC;           // cop0 14: EPC
 
+    // SR and CAUSE let an interrupt through, checked between blocks
+    bool interrupt_pending = false;
+
+    void set_SR(uint32_t value);
+    void update_interrupt();
+    void interrupt();
+
     template<typename T>
     void store(uint32_t address, T value)
     {
@@ -67,19 +139,161 @@ class CPU {
         return inter->load<T>(address);
     }
 
+    /**
+     * @brief      Fetch an instruction, through the instruction cache when
+     * it caches the address. Uncached fetches stall for the memory access
+     */
+    uint32_t fetch(uint32_t address)
+    {
+        if (icache.caches(address)) {
+            ICacheLine &line = icache.line(address);
+
+            if (line.tag != ICache::tag(address)) {
+                fill_line(line, address);
+            }
+
+            return line.words[(address / 4) % ICACHE_LINE_WORDS];
+        }
+
+        cycles += inter->get_fetch_cycles(address);
+
+        return inter->peek<uint32_t>(address);
+    }
+
+    /**
+     * @brief      Fetch the line of a pre-decoded instruction through the
+     * instruction cache: charges its miss as the interpreter would
+     */
+    void fetch_line(uint32_t address)
+    {
+        ICacheLine &line = icache.line(address);
+
+        if (line.tag != ICache::tag(address)) {
+            fill_line(line, address);
+        }
+    }
+
+    void fill_line(ICacheLine &line, uint32_t address);
+
+    Block *compile_block(uint32_t address);
+    Block *compile_trace(Block *head);
+    void run_trace(const Block *block, uint32_t start);
+
+    Block *dispatch(Link *link = nullptr);
+    Block *execute(Block *block, uint32_t start);
+    Block *successor(Block *previous, uint32_t start, Link **link);
+    Block *linked(Block *owner, Link **link);
+    Block *indirect_target(Link **link);
+    void run_blocks();
+    void flush_blocks();
+    void skip_idle(const Block *block, uint32_t start);
+
+    void run_interpreter();
+
+    /**
+     * @brief      Stall until the MULT/DIV in progress is done
+     */
+    void wait_hilo()
+    {
+        if (cycles < hilo_ready) {
+            cycles = hilo_ready;
+        }
+    }
+
+    /**
+     * @brief      Stall until the GTE command in progress is done
+     */
+    void wait_gte()
+    {
+        if (cycles < gte_ready) {
+            cycles = gte_ready;
+        }
+    }
+
 public:
     ~CPU();
 
+    /**
+     * @brief      Execute a pre-decoded instruction with the given shape
+     * Same as run_next without fetch and decode. Straight-line instructions
+     * (not first of their block, not after a branch or a load) have neither a
+     * load in flight nor a branch before them: that bookkeeping is skipped
+     */
+    template<bool straight, typename S>
+    void step(const Op &op)
+    {
+        currentPC = PC;
+        PC = nextPC;
+        nextPC += INSTRUCTION_LENGTH;
+        cycles += INSTRUCTION_CYCLES;
+
+        if constexpr (straight) {
+            isDelaySlot = false;
+
+            S::execute_op(this, op);
+        } else {
+            run_load();
+
+            isDelaySlot = isBranch;
+            isBranch = false;
+
+            S::execute_op(this, op);
+
+            commit_load();
+        }
+    }
+
     bool init();
     void reset();
-    void run_load();
+
+    /**
+     * @brief      Put the pending load in flight
+     * Its value is written back once the next instruction is over
+     */
+    void run_load()
+    {
+        delay_reg = load_reg;
+        delay_value = load_value;
+        load_reg = 0;
+    }
+
+    /**
+     * @brief      Write back the load in flight if any
+     */
+    void commit_load()
+    {
+        reg[delay_reg] = delay_value;
+        reg[0] = 0;
+        delay_reg = 0;
+    }
+
     void run_next();
+    void run_block();
+    void run_for(uint64_t budget);
+    void run_until(uint64_t target);
+
+    /**
+     * @brief      Return from run_until at the given cycle if it is earlier
+     * Used when a device schedules an event while the CPU is running
+     */
+    void stop_at(uint64_t cycle)
+    {
+        if (cycle < target) {
+            target = cycle;
+        }
+    }
     void decode_and_execute(uint32_t data);
+    void decode_and_execute_switch(uint32_t data);
+
+    bool set_mode(ExecutionMode mode);
 
     void exception(uint32_t cause);
     void branch(uint32_t offset);
 
     void set_inter(Interconnect* inter);
+    void set_kernel(Kernel *kernel);
+    void set_routines(Routines *routines);
+    void set_irq(bool active);
 
     void print_registers();
     void display_registers(bool *status);
@@ -93,6 +307,8 @@ public:
     uint32_t force_get_reg(size_t index);
     void force_set_reg(size_t index, uint32_t value);
     uint32_t get_PC();
+    uint64_t get_cycles();
+    void force_set_PC(uint32_t address);
     uint32_t get_HI();
     uint32_t get_LO();
 
@@ -118,15 +334,20 @@ public:
     void COP2(uint32_t data);
     void COP3();
     void LB(size_t rs, size_t rt, int32_t imm16_se);
+    template<bool aligned = false>
     void LH(size_t rs, size_t rt, int32_t imm16_se);
     void LWL(size_t rs, size_t rt, int32_t imm16_se);
+    template<bool aligned = false>
     void LW(size_t rs, size_t rt, int32_t imm16_se);
     void LBU(size_t rs, size_t rt, int32_t imm16_se);
+    template<bool aligned = false>
     void LHU(size_t rs, size_t rt, int32_t imm16_se);
     void LWR(size_t rs, size_t rt, int32_t imm16_se);
     void SB(size_t rs, size_t rt, int32_t imm16_se);
+    template<bool aligned = false>
     void SH(size_t rs, size_t rt, int32_t imm16_se);
     void SWL(size_t rs, size_t rt, int32_t imm16_se);
+    template<bool aligned = false>
     void SW(size_t rs, size_t rt, int32_t imm16_se);
     void SWR(size_t rs, size_t rt, int32_t imm16_se);
     void LWC0();
@@ -137,6 +358,7 @@ public:
     void SWC1();
     void SWC2(uint32_t data);
     void SWC3();
+    void HLE(uint32_t imm26);
 
     // SPECIAL Opcodes
     void SLL(size_t rt, size_t rd, uint8_t imm5);
@@ -172,6 +394,12 @@ public:
     void MFC0(size_t rt, size_t rd);
     void MTC0(size_t rt, size_t rd);
     void RFE();
+
+    // COP2 Opcodes
+    void MFC2(size_t rt, size_t rd);
+    void CFC2(size_t rt, size_t rd);
+    void MTC2(size_t rt, size_t rd);
+    void CTC2(size_t rt, size_t rd);
 };
 
 #endif /* CPU_H */
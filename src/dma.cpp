@@ -0,0 +1,371 @@
+#include "dma.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "log.h"
+#include "cpu.h"
+#include "ram.h"
+#include "irq.h"
+
+
+/**
+ * @brief      Initialize the DMA controller
+ * @param      cpu   CPU stalled by the transfers
+ * @param      ram   RAM the channels transfer to or from
+ * @param      irq   Interrupt controller receiving the DMA interrupt
+ * @return     true in case of success, false otherwise
+ */
+bool DMA::init(CPU *cpu, RAM *ram, IRQ *irq)
+{
+    this->cpu = cpu;
+    this->ram = ram;
+    this->irq = irq;
+
+    for (size_t i=0; i<DMA_CHANNEL_COUNT; i++) {
+        channels[i].port = {nullptr, nullptr, nullptr};
+    }
+
+    reset();
+
+    return true;
+}
+
+
+/**
+ * @brief      All channels idle and disabled, devices stay connected
+ */
+void DMA::reset()
+{
+    for (size_t i=0; i<DMA_CHANNEL_COUNT; i++) {
+        channels[i].base = 0;
+        channels[i].block = 0;
+        channels[i].control = 0;
+    }
+
+    channels[DMA_OTC].control = DMA_OTC_FIXED;
+
+    control = DMA_DPCR_DEFAULT;
+    interrupt = 0;
+}
+
+
+/**
+ * @brief      Connect the device of a channel
+ */
+void DMA::set_port(DMAChannel channel, const DMAPort &port)
+{
+    channels[channel].port = port;
+}
+
+
+uint32_t DMA::read(uint32_t offset)
+{
+    switch(offset) {
+    case DMA_DPCR: return control;
+    case DMA_DICR: return interrupt;
+    }
+
+    size_t channel = offset / DMA_CHANNEL_STRIDE;
+    if (channel >= DMA_CHANNEL_COUNT) {
+        return 0;
+    }
+
+    switch(offset % DMA_CHANNEL_STRIDE) {
+    case DMA_MADR: return channels[channel].base;
+    case DMA_BCR: return channels[channel].block;
+    case DMA_CHCR: return channels[channel].control;
+    default: return 0;
+    }
+}
+
+
+void DMA::write(uint32_t offset, uint32_t value)
+{
+    switch(offset) {
+    case DMA_DPCR:
+        control = value;
+
+        // Enabling a channel starts its pending transfer
+        for (size_t i=0; i<DMA_CHANNEL_COUNT; i++) {
+            if (active((DMAChannel) i)) {
+                run((DMAChannel) i);
+            }
+        }
+        return;
+    case DMA_DICR:
+        write_interrupt(value);
+        return;
+    }
+
+    size_t channel = offset / DMA_CHANNEL_STRIDE;
+    if (channel >= DMA_CHANNEL_COUNT) {
+        error("Unhandled store to DMA register: 0x%08x: 0x%08x\n", offset, value);
+        return;
+    }
+
+    switch(offset % DMA_CHANNEL_STRIDE) {
+    case DMA_MADR:
+        channels[channel].base = value & 0xFFFFFF;
+        break;
+    case DMA_BCR:
+        channels[channel].block = value;
+        break;
+    case DMA_CHCR:
+        write_control((DMAChannel) channel, value);
+        break;
+    }
+}
+
+
+/**
+ * @brief      Write CHCR, starts the transfer if the channel is enabled
+ */
+void DMA::write_control(DMAChannel channel, uint32_t value)
+{
+    if (channel == DMA_OTC) {
+        value = (value & DMA_OTC_WRITABLE) | DMA_OTC_FIXED;
+    } else {
+        value &= DMA_CHCR_WRITABLE;
+    }
+
+    channels[channel].control = value;
+
+    if (active(channel)) {
+        run(channel);
+    }
+}
+
+
+/**
+ * @brief      Write DICR, flags written with 1 are acknowledged
+ */
+void DMA::write_interrupt(uint32_t value)
+{
+    uint32_t flags = interrupt & ~value & DMA_DICR_FLAGS;
+
+    interrupt = (interrupt & DMA_DICR_MASTER_FLAG) | (value & DMA_DICR_WRITABLE) | flags;
+
+    update_interrupt();
+}
+
+
+/**
+ * @brief      Update the master flag, the interrupt is raised when it gets set
+ */
+void DMA::update_interrupt()
+{
+    uint32_t enabled = (interrupt >> 16) & (interrupt >> 24) & 0x7F;
+    bool master = (interrupt & DMA_DICR_FORCE) ||
+        ((interrupt & DMA_DICR_MASTER_ENABLE) && enabled);
+    bool raised = interrupt & DMA_DICR_MASTER_FLAG;
+
+    if (master) {
+        interrupt |= DMA_DICR_MASTER_FLAG;
+    } else {
+        interrupt &= ~DMA_DICR_MASTER_FLAG;
+    }
+
+    if (master && !raised && irq) {
+        irq->raise(IRQ_DMA);
+    }
+}
+
+
+/**
+ * @brief      Tells if the channel has a transfer to run
+ * Manual transfers also wait for the trigger bit
+ */
+bool DMA::active(DMAChannel channel)
+{
+    uint32_t chcr = channels[channel].control;
+
+    if (!(control & DMA_DPCR_ENABLE(channel)) || !(chcr & DMA_CHCR_START)) {
+        return false;
+    }
+
+    return DMA_CHCR_SYNC(chcr) != DMA_SYNC_MANUAL || (chcr & DMA_CHCR_TRIGGER);
+}
+
+
+/**
+ * @brief      Run the whole transfer of the channel then signal completion
+ */
+void DMA::run(DMAChannel channel)
+{
+    DMAChannelState &state = channels[channel];
+
+    if (channel == DMA_OTC) {
+        clear_table(channel);
+    } else if (DMA_CHCR_SYNC(state.control) == DMA_SYNC_LIST) {
+        run_list(channel);
+    } else {
+        run_block(channel);
+    }
+
+    state.control &= ~(DMA_CHCR_START | DMA_CHCR_TRIGGER);
+
+    if (interrupt & DMA_DICR_ENABLE(channel)) {
+        interrupt |= DMA_DICR_FLAG(channel);
+    }
+
+    update_interrupt();
+}
+
+
+/**
+ * @brief      Manual and request modes: BCR words at once or BCR blocks
+ * Only request mode moves MADR to the end of the transfer
+ */
+void DMA::run_block(DMAChannel channel)
+{
+    DMAChannelState &state = channels[channel];
+
+    uint32_t size = state.block & 0xFFFF;
+    uint32_t count = state.block >> 16;
+    uint32_t words = size ? size : 0x10000;
+    bool decrement = state.control & DMA_CHCR_DECREMENT;
+
+    if (DMA_CHCR_SYNC(state.control) == DMA_SYNC_REQUEST) {
+        words *= count ? count : 0x10000;
+    }
+
+    transfer(channel, state.base, words, state.control & DMA_CHCR_FROM_RAM, decrement);
+    stall(words);
+
+    if (DMA_CHCR_SYNC(state.control) == DMA_SYNC_REQUEST) {
+        uint32_t length = words * 4;
+
+        state.base = (decrement ? state.base - length : state.base + length) & 0xFFFFFF;
+        state.block &= 0xFFFF;
+    }
+}
+
+
+/**
+ * @brief      Linked list mode: sends the packets of each node to the device
+ * A node header holds its word count (high byte) and the next node address
+ */
+void DMA::run_list(DMAChannel channel)
+{
+    DMAChannelState &state = channels[channel];
+
+    if (!(state.control & DMA_CHCR_FROM_RAM)) {
+        error("Unhandled DMA linked list to RAM on channel %d\n", channel);
+        return;
+    }
+
+    // Every node takes at least a word: a longer list loops
+    uint32_t address = state.base;
+    for (size_t i=0; i<(RAM_SIZE) / 4; i++) {
+        uint32_t header = ram->load<uint32_t>(address & DMA_ADDRESS_MASK);
+        uint32_t words = header >> 24;
+
+        transfer(channel, address + 4, words, true, false);
+        stall(words + 1);
+
+        address = header & 0xFFFFFF;
+        if (address & DMA_LIST_END) {
+            state.base = address;
+            return;
+        }
+    }
+
+    error("DMA linked list does not end: 0x%08x\n", state.base);
+    state.base = address;
+}
+
+
+/**
+ * @brief      OTC: links each ordering table entry to the previous one, the
+ * first one ends the list
+ */
+void DMA::clear_table(DMAChannel channel)
+{
+    DMAChannelState &state = channels[channel];
+
+    uint32_t words = state.block & 0xFFFF;
+    if (words == 0) {
+        words = 0x10000;
+    }
+
+    // The table goes down from MADR, it is written from its lowest address
+    // in runs broken where it wraps around RAM
+    std::vector<uint32_t> table;
+    uint32_t address = state.base & DMA_ADDRESS_MASK;
+    uint32_t done = 0;
+
+    while (done < words) {
+        uint32_t count = std::min(words - done, address / 4 + 1);
+        uint32_t start = address - (count - 1) * 4;
+
+        table.resize(count);
+        for (uint32_t i=0; i<count; i++) {
+            uint32_t next = (address - i * 4 - 4) & DMA_ADDRESS_MASK;
+
+            table[count - 1 - i] = guest_endian(done + i == words - 1 ? DMA_OTC_END : next);
+        }
+
+        ram->write_block(start, table.data(), count * 4);
+        written(start, count * 4);
+
+        done += count;
+        address = (start - 4) & DMA_ADDRESS_MASK;
+    }
+
+    stall(words);
+}
+
+
+/**
+ * @brief      Move words between RAM and the device of the channel
+ * Runs of RAM are copied as one block and handed to the device in one call,
+ * going forward they only break where the address wraps around RAM
+ */
+void DMA::transfer(DMAChannel channel, uint32_t address, uint32_t words, bool from_ram, bool decrement)
+{
+    const DMAPort &port = channels[channel].port;
+
+    if (from_ram ? !port.write : !port.read) {
+        debug("DMA transfer without device on channel %d\n", channel);
+        return;
+    }
+
+    while (words > 0) {
+        uint32_t offset = address & DMA_ADDRESS_MASK;
+        uint32_t count = decrement ? 1 : std::min(words, ((RAM_SIZE) - offset) / 4);
+        uint32_t length = count * 4;
+
+        buffer.resize(length);
+
+        if (from_ram) {
+            ram->read_block(offset, buffer.data(), length);
+            port.write(port.device, buffer.data(), length);
+        } else {
+            port.read(port.device, buffer.data(), length);
+            ram->write_block(offset, buffer.data(), length);
+            written(offset, length);
+        }
+
+        address = decrement ? address - 4 : address + count * 4;
+        words -= count;
+    }
+}
+
+
+/**
+ * @brief      Drop the cached code overwritten in RAM
+ */
+void DMA::written(uint32_t offset, uint32_t length)
+{
+    cpu->cache.invalidate_range(offset, length);
+}
+
+
+/**
+ * @brief      Charge the CPU for the bus time taken by the transfer
+ */
+void DMA::stall(uint32_t words)
+{
+    cpu->cycles += words * DMA_WORD_CYCLES;
+}
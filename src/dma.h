@@ -0,0 +1,180 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Registers, offsets in DMA_START
+#define DMA_CHANNEL_STRIDE      0x10
+#define DMA_MADR                0x00    // Base address
+#define DMA_BCR                 0x04    // Block size and count
+#define DMA_CHCR                0x08    // Channel control
+#define DMA_DPCR                0x70    // Channels priority and enable
+#define DMA_DICR                0x74    // Interrupts
+
+// Channel control
+#define DMA_CHCR_FROM_RAM       0x00000001
+#define DMA_CHCR_DECREMENT      0x00000002
+#define DMA_CHCR_SYNC_SHIFT     9
+#define DMA_CHCR_SYNC(chcr)     (((chcr) >> DMA_CHCR_SYNC_SHIFT) & 0x03)
+#define DMA_CHCR_START          0x01000000  // Busy until the transfer is done
+#define DMA_CHCR_TRIGGER        0x10000000  // Starts a manual transfer
+#define DMA_CHCR_WRITABLE       0x71770703
+#define DMA_OTC_WRITABLE        0x51000000  // OTC always goes backward to RAM
+#define DMA_OTC_FIXED           DMA_CHCR_DECREMENT
+
+#define DMA_DPCR_DEFAULT        0x07654321
+#define DMA_DPCR_ENABLE(c)      (0x08 << ((c) * 4))
+
+#define DMA_DICR_WRITABLE       0x00FF803F
+#define DMA_DICR_FORCE          0x00008000
+#define DMA_DICR_MASTER_ENABLE  0x00800000
+#define DMA_DICR_FLAGS          0x7F000000  // Writing 1 acknowledges
+#define DMA_DICR_MASTER_FLAG    0x80000000
+#define DMA_DICR_ENABLE(c)      (0x00010000 << (c))
+#define DMA_DICR_FLAG(c)        (0x01000000 << (c))
+
+#define DMA_ADDRESS_MASK        0x1FFFFC
+#define DMA_LIST_END            0x800000    // Next address of the last node
+#define DMA_OTC_END             0xFFFFFF
+#define DMA_WORD_CYCLES         1           // CPU is stalled during transfers
+
+class CPU;
+class RAM;
+class IRQ;
+
+
+enum DMAChannel {
+    DMA_MDEC_IN,
+    DMA_MDEC_OUT,
+    DMA_GPU,
+    DMA_CDROM,
+    DMA_SPU,
+    DMA_PIO,
+    DMA_OTC,            // Clears ordering tables in RAM, no device
+    DMA_CHANNEL_COUNT
+};
+
+enum DMASync {
+    DMA_SYNC_MANUAL,    // Whole transfer at once, on trigger
+    DMA_SYNC_REQUEST,   // Blocks when the device asks for them
+    DMA_SYNC_LIST,      // Linked list of packets (GPU)
+};
+
+/**
+ * @brief      Copy a block of RAM to the device
+ * @param      data  Copy of guest memory, words in guest byte order
+ */
+typedef void (*dma_write)(void *device, const uint8_t *data, size_t size);
+
+/**
+ * @brief      Fill a block of RAM from the device
+ * @param      data  Copied to guest memory, words in guest byte order
+ */
+typedef void (*dma_read)(void *device, uint8_t *data, size_t size);
+
+
+/**
+ * @brief      Device at the end of a DMA channel
+ * Data of a channel without device is dropped, RAM is left untouched
+ */
+struct DMAPort {
+    void *device;           // Passed back to the callbacks
+    dma_read read;          // Device to RAM, nullptr if not handled
+    dma_write write;        // RAM to device, nullptr if not handled
+};
+
+
+/**
+ * @brief      Registers of a channel
+ */
+struct DMAChannelState {
+    uint32_t base;          // MADR
+    uint32_t block;         // BCR
+    uint32_t control;       // CHCR
+    DMAPort port;
+};
+
+
+/**
+ * @brief      DMA controller
+ *
+ * Transfers run to completion as soon as a channel is started: contiguous
+ * runs of RAM are copied to or from the devices with one block copy instead
+ * of a bus access per word, and the CPU is charged for the stall. Request
+ * mode is not paced by the devices, all blocks are moved at once.
+ */
+class DMA {
+    CPU *cpu = nullptr;
+    RAM *ram = nullptr;
+    IRQ *irq = nullptr;
+
+    DMAChannelState channels[DMA_CHANNEL_COUNT];
+    uint32_t control;       // DPCR
+    uint32_t interrupt;     // DICR
+
+    // Copy of the run of RAM being transferred
+    std::vector<uint8_t> buffer;
+
+    uint32_t read(uint32_t offset);
+    void write(uint32_t offset, uint32_t value);
+    void write_control(DMAChannel channel, uint32_t value);
+    void write_interrupt(uint32_t value);
+    void update_interrupt();
+
+    bool active(DMAChannel channel);
+    void run(DMAChannel channel);
+    void run_block(DMAChannel channel);
+    void run_list(DMAChannel channel);
+    void clear_table(DMAChannel channel);
+    void transfer(DMAChannel channel, uint32_t address, uint32_t words, bool from_ram, bool decrement);
+    void written(uint32_t offset, uint32_t length);
+    void stall(uint32_t words);
+
+public:
+    bool init(CPU *cpu, RAM *ram, IRQ *irq);
+    void reset();
+
+    void set_port(DMAChannel channel, const DMAPort &port);
+
+    /**
+     * @brief      Read a register, 8 and 16 bits accesses read part of it
+     */
+    template <typename T>
+    T load(uint32_t offset)
+    {
+        if constexpr (sizeof(T) == sizeof(uint32_t)) {
+            return read(offset);
+        } else {
+            uint32_t shift = (offset & 3) * 8;
+
+            return (T) (read(offset & ~3) >> shift);
+        }
+    }
+
+    /**
+     * @brief      Write a register, 8 and 16 bits accesses keep the bits
+     * outside of them
+     */
+    template <typename T>
+    void store(uint32_t offset, T value)
+    {
+        if constexpr (sizeof(T) == sizeof(uint32_t)) {
+            write(offset, value);
+        } else {
+            uint32_t shift = (offset & 3) * 8;
+            uint32_t written = (uint32_t) (T) ~0 << shift;
+            uint32_t current = read(offset & ~3);
+
+            // Interrupt flags are acknowledged by writing 1: keep them as 0
+            if ((offset & ~3) == DMA_DICR) {
+                current &= ~DMA_DICR_FLAGS;
+            }
+
+            write(offset & ~3, (current & ~written) | (uint32_t) value << shift);
+        }
+    }
+};
+
+#endif /* DMA_H */
@@ -0,0 +1,198 @@
+#include "fastmem.h"
+
+#ifdef FASTMEM_AVAILABLE
+    #include <signal.h>
+    #include <ucontext.h>
+    #include <sys/mman.h>
+#endif
+
+#include "log.h"
+#include "ram.h"
+#include "bios.h"
+#include "scratchpad.h"
+#include "interconnect.h"
+
+
+#ifdef FASTMEM_AVAILABLE
+
+// Bounds of the fastmem_sites section, provided by the linker
+extern "C" const FastmemSite __start_fastmem_sites[] __attribute__((weak));
+extern "C" const FastmemSite __stop_fastmem_sites[] __attribute__((weak));
+
+// Fault handler state: a single guest address space is trapped at a time
+static Interconnect *trapped_inter = nullptr;
+static struct sigaction previous_action;
+static bool handler_installed = false;
+
+
+/**
+ * @brief      Find the access site of a faulting instruction
+ * @return     The site or nullptr if the fault is not a guest access
+ */
+static const FastmemSite *find_site(uint64_t address)
+{
+    for (const FastmemSite *site = __start_fastmem_sites; site < __stop_fastmem_sites; site++) {
+        if (site->access == address) {
+            return site;
+        }
+    }
+
+    return nullptr;
+}
+
+
+/**
+ * @brief      Emulates a guest access that hit an unmapped page
+ * The access goes through address decoding then execution resumes after the
+ * faulting instruction
+ */
+static void fault_handler(int signal, siginfo_t *info, void *context)
+{
+    greg_t *registers = ((ucontext_t*) context)->uc_mcontext.gregs;
+    const FastmemSite *site = find_site(registers[REG_RIP]);
+
+    if (!site || !trapped_inter) {
+        // Not a guest access: let the previous handler crash the program
+        sigaction(SIGSEGV, &previous_action, nullptr);
+        return;
+    }
+
+    (void) signal;
+    (void) info;
+
+    uint32_t address = (uint32_t) registers[REG_RSI];
+    uint32_t value = (uint32_t) registers[REG_RDX];
+
+    switch(site->kind) {
+    case FASTMEM_LOAD8: registers[REG_RAX] = trapped_inter->decode_load<uint8_t>(address); break;
+    case FASTMEM_LOAD16: registers[REG_RAX] = trapped_inter->decode_load<uint16_t>(address); break;
+    case FASTMEM_LOAD32: registers[REG_RAX] = trapped_inter->decode_load<uint32_t>(address); break;
+    case FASTMEM_STORE8: trapped_inter->decode_store<uint8_t>(address, value); break;
+    case FASTMEM_STORE16: trapped_inter->decode_store<uint16_t>(address, value); break;
+    case FASTMEM_STORE32: trapped_inter->decode_store<uint32_t>(address, value); break;
+    }
+
+    registers[REG_RIP] = site->resume;
+}
+
+#endif
+
+
+Fastmem::~Fastmem()
+{
+#ifdef FASTMEM_AVAILABLE
+    if (base) {
+        munmap(base, FASTMEM_SIZE);
+        trapped_inter = nullptr;
+    }
+#endif
+}
+
+
+/**
+ * @brief      Map guest memory and install the fault handler
+ * @param      inter  Interconnect handling trapped accesses
+ * @return     true in case of success, false if fastmem is not available
+ */
+bool Fastmem::init(Interconnect *inter, RAM *ram, BIOS *bios, Scratchpad *scratchpad)
+{
+#ifdef FASTMEM_AVAILABLE
+    if (ram->get_fd() < 0 || scratchpad->get_fd() < 0 || !__start_fastmem_sites) {
+        return false;
+    }
+
+    void *memory = mmap(
+        nullptr, FASTMEM_SIZE,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0
+    );
+
+    if (memory == MAP_FAILED) {
+        error("Unable to reserve fastmem region\n");
+        return false;
+    }
+
+    base = (uint8_t*) memory;
+
+    // Every RAM mirror shares the same pages
+    for (uint32_t offset=0; offset<(RAM_MIRROR_SIZE); offset+=(RAM_SIZE)) {
+        void *mirror = mmap(
+            base + RAM_START + offset, RAM_SIZE,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED,
+            ram->get_fd(), 0
+        );
+
+        if (mirror == MAP_FAILED) {
+            error("Unable to map RAM in fastmem region\n");
+            munmap(base, FASTMEM_SIZE);
+            base = nullptr;
+            return false;
+        }
+    }
+
+    void *scratch = mmap(
+        base + SCRATCHPAD_START, SCRATCHPAD_BACKING_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED,
+        scratchpad->get_fd(), 0
+    );
+
+    if (scratch == MAP_FAILED) {
+        error("Unable to map scratchpad in fastmem region\n");
+        munmap(base, FASTMEM_SIZE);
+        base = nullptr;
+        return false;
+    }
+
+    // The BIOS is a read only copy: stores to it trap and are reported
+    uint8_t *rom = base + BIOS_START;
+    if (mprotect(rom, BIOS_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        error("Unable to map BIOS in fastmem region\n");
+        munmap(base, FASTMEM_SIZE);
+        base = nullptr;
+        return false;
+    }
+
+    memcpy(rom, bios->get_data(), BIOS_SIZE);
+    mprotect(rom, BIOS_SIZE, PROT_READ);
+
+    if (!handler_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &fault_handler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+
+        if (sigaction(SIGSEGV, &action, &previous_action) != 0) {
+            error("Unable to install fastmem fault handler\n");
+            munmap(base, FASTMEM_SIZE);
+            base = nullptr;
+            return false;
+        }
+
+        handler_installed = true;
+    }
+
+    trapped_inter = inter;
+
+    return true;
+#else
+    (void) inter;
+    (void) ram;
+    (void) bios;
+    (void) scratchpad;
+
+    return false;
+#endif
+}
+
+
+/**
+ * @brief      Host address of the guest physical address 0
+ */
+uint8_t *Fastmem::get_base()
+{
+    return base;
+}
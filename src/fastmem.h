@@ -0,0 +1,138 @@
+#ifndef FASTMEM_H
+#define FASTMEM_H
+
+#include <cstdint>
+#include <cstring>
+
+// Guest accesses are trapped through the host page protection
+#if defined(__linux__) && defined(__x86_64__)
+    #define FASTMEM_AVAILABLE
+#endif
+
+#define FASTMEM_SIZE        0x20000000  // Physical address space (512MB)
+
+// Kinds of access sites
+#define FASTMEM_LOAD8       0
+#define FASTMEM_LOAD16      1
+#define FASTMEM_LOAD32      2
+#define FASTMEM_STORE8      3
+#define FASTMEM_STORE16     4
+#define FASTMEM_STORE32     5
+
+class Interconnect;
+class RAM;
+class BIOS;
+class Scratchpad;
+
+
+/**
+ * @brief      Host instruction accessing guest memory
+ * Listed in the fastmem_sites section so a fault can be resumed
+ */
+struct FastmemSite {
+    uint64_t access;        // Address of the faulting instruction
+    uint64_t resume;        // Address of the next instruction
+    uint64_t kind;          // FASTMEM_LOAD8 to FASTMEM_STORE32
+};
+
+
+/**
+ * @brief      Guest physical address space backed by host virtual memory
+ *
+ * RAM (and its mirrors), the scratchpad and the BIOS are mapped at their
+ * physical address in a reserved host region, everything else is left
+ * inaccessible. Accesses are a plain base + offset, the ones hitting I/O
+ * registers fault and the SIGSEGV handler hands them to the Interconnect
+ * address decoding.
+ */
+class Fastmem {
+    uint8_t *base = nullptr;
+
+public:
+    ~Fastmem();
+
+    bool init(Interconnect *inter, RAM *ram, BIOS *bios, Scratchpad *scratchpad);
+    uint8_t *get_base();
+};
+
+
+#ifdef FASTMEM_AVAILABLE
+
+#define FASTMEM_STRING(x)   #x
+#define FASTMEM_KIND(x)     FASTMEM_STRING(x)
+
+// Records the access instruction in the fastmem_sites section, in the same
+// section group as the code ("?") so it is dropped with discarded duplicates
+#define FASTMEM_SITE(instruction, kind) \
+    "1: " instruction "\n" \
+    "2:\n" \
+    ".pushsection fastmem_sites, \"aw?\"\n" \
+    ".balign 8\n" \
+    ".quad 1b, 2b, " FASTMEM_KIND(kind) "\n" \
+    ".popsection\n"
+
+/**
+ * @brief      Load from the fastmem region
+ * Registers are fixed (address in rsi, value in eax) for the fault handler
+ */
+template<typename T>
+T fastmem_load(uint8_t *base, uint32_t address)
+{
+    uint32_t value;
+
+    if constexpr (sizeof(T) == sizeof(uint8_t)) {
+        asm volatile(FASTMEM_SITE("movzbl (%%rdi,%%rsi), %%eax", FASTMEM_LOAD8)
+            : "=a"(value) : "D"(base), "S"((uint64_t) address) : "memory");
+    } else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+        asm volatile(FASTMEM_SITE("movzwl (%%rdi,%%rsi), %%eax", FASTMEM_LOAD16)
+            : "=a"(value) : "D"(base), "S"((uint64_t) address) : "memory");
+    } else {
+        asm volatile(FASTMEM_SITE("movl (%%rdi,%%rsi), %%eax", FASTMEM_LOAD32)
+            : "=a"(value) : "D"(base), "S"((uint64_t) address) : "memory");
+    }
+
+    return (T) value;
+}
+
+/**
+ * @brief      Store to the fastmem region
+ * Registers are fixed (address in rsi, value in edx) for the fault handler
+ */
+template<typename T>
+void fastmem_store(uint8_t *base, uint32_t address, T value)
+{
+    uint32_t data = value;
+
+    if constexpr (sizeof(T) == sizeof(uint8_t)) {
+        asm volatile(FASTMEM_SITE("movb %%dl, (%%rdi,%%rsi)", FASTMEM_STORE8)
+            : : "D"(base), "S"((uint64_t) address), "d"(data) : "memory");
+    } else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+        asm volatile(FASTMEM_SITE("movw %%dx, (%%rdi,%%rsi)", FASTMEM_STORE16)
+            : : "D"(base), "S"((uint64_t) address), "d"(data) : "memory");
+    } else {
+        asm volatile(FASTMEM_SITE("movl %%edx, (%%rdi,%%rsi)", FASTMEM_STORE32)
+            : : "D"(base), "S"((uint64_t) address), "d"(data) : "memory");
+    }
+}
+
+#else
+
+// Never called: fastmem cannot be enabled on this host
+template<typename T>
+T fastmem_load(uint8_t *base, uint32_t address)
+{
+    T value;
+    memcpy(&value, base + address, sizeof(T));
+
+    return value;
+}
+
+template<typename T>
+void fastmem_store(uint8_t *base, uint32_t address, T value)
+{
+    memcpy(base + address, &value, sizeof(T));
+}
+
+#endif
+
+#endif /* FASTMEM_H */
@@ -0,0 +1,1100 @@
+#include "gte.h"
+
+#include <algorithm>
+
+#ifdef GTE_SIMD
+    #include <immintrin.h>
+#endif
+
+#include "log.h"
+
+
+const uint32_t FLAG_MAC_POS[] = {GTE_FLAG_MAC0_POS, GTE_FLAG_MAC1_POS, GTE_FLAG_MAC2_POS, GTE_FLAG_MAC3_POS};
+const uint32_t FLAG_MAC_NEG[] = {GTE_FLAG_MAC0_NEG, GTE_FLAG_MAC1_NEG, GTE_FLAG_MAC2_NEG, GTE_FLAG_MAC3_NEG};
+const uint32_t FLAG_IR[] = {GTE_FLAG_IR0, GTE_FLAG_IR1, GTE_FLAG_IR2, GTE_FLAG_IR3};
+
+// Cycles taken by each command, 0 for unused opcodes
+const uint32_t COMMAND_CYCLES[64] = {
+    0, 15, 0, 0, 0, 0, 8, 0, 0, 0, 0, 0, 6, 0, 0, 0,
+    8, 8, 8, 19, 13, 0, 44, 0, 0, 0, 0, 17, 11, 0, 14, 0,
+    30, 0, 0, 0, 0, 0, 0, 0, 5, 8, 17, 0, 0, 5, 6, 0,
+    23, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 5, 39,
+};
+
+const char *KERNEL_NAMES[GTE_KERNEL_COUNT] = {"scalar", "SSE4.1", "AVX2"};
+
+
+/**
+ * @brief      Reciprocals used by the perspective division
+ */
+struct UNRTable {
+    uint8_t values[GTE_UNR_TABLE_SIZE];
+
+    UNRTable()
+    {
+        for (int i=0; i<GTE_UNR_TABLE_SIZE; i++) {
+            values[i] = std::max(0, (0x40000 / (i + 0x100) + 1) / 2 - 0x101);
+        }
+    }
+};
+
+const UNRTable UNR_TABLE;
+
+
+/**
+ * @brief      Truncate an accumulator to 44 bits
+ */
+static int64_t sign_extend44(int64_t value)
+{
+    return (int64_t) ((uint64_t) value << 20) >> 20;
+}
+
+
+/**
+ * @brief      Overflow flags of MAC1-3 accumulators
+ * @param[in]  positive  Bit i set if MACi+1 overflowed (same for negative)
+ */
+static uint32_t overflow_flags(uint32_t positive, uint32_t negative)
+{
+    uint32_t flags = 0;
+
+    for (size_t i=0; i<3; i++) {
+        if (positive & (1 << i)) {
+            flags |= FLAG_MAC_POS[i + 1];
+        }
+        if (negative & (1 << i)) {
+            flags |= FLAG_MAC_NEG[i + 1];
+        }
+    }
+
+    return flags;
+}
+
+
+static uint32_t transform_scalar(
+    const int16_t matrix[3][3],
+    const int32_t translation[3],
+    const int16_t vectors[][3],
+    size_t count,
+    int64_t results[][3])
+{
+    uint32_t positive = 0;
+    uint32_t negative = 0;
+
+    for (size_t k=0; k<count; k++) {
+        for (size_t i=0; i<3; i++) {
+            int64_t sum = translation ? (int64_t) translation[i] * 0x1000 : 0;
+
+            for (size_t j=0; j<3; j++) {
+                sum += (int32_t) matrix[i][j] * vectors[k][j];
+
+                positive |= (sum > GTE_MAC_MAX) << i;
+                negative |= (sum < GTE_MAC_MIN) << i;
+                sum = sign_extend44(sum);
+            }
+
+            results[k][i] = sum;
+        }
+    }
+
+    return overflow_flags(positive, negative);
+}
+
+
+#ifdef GTE_SIMD
+
+/**
+ * @brief      One 64 bits lane per matrix row
+ * Without 64 bits comparisons, overflow shows in the bits above 44 once the
+ * sum is biased by 2^43
+ */
+__attribute__((target("sse4.1")))
+static uint32_t transform_sse41(
+    const int16_t matrix[3][3],
+    const int32_t translation[3],
+    const int16_t vectors[][3],
+    size_t count,
+    int64_t results[][3])
+{
+    const __m128i bias = _mm_set1_epi64x(1LL << 43);
+    const __m128i low = _mm_set1_epi64x((1LL << 44) - 1);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i rows01[3];
+    __m128i rows2[3];
+    for (size_t j=0; j<3; j++) {
+        rows01[j] = _mm_set_epi64x(matrix[1][j], matrix[0][j]);
+        rows2[j] = _mm_set_epi64x(0, matrix[2][j]);
+    }
+
+    __m128i base01 = zero;
+    __m128i base2 = zero;
+    if (translation) {
+        base01 = _mm_set_epi64x((int64_t) translation[1] * 0x1000, (int64_t) translation[0] * 0x1000);
+        base2 = _mm_set_epi64x(0, (int64_t) translation[2] * 0x1000);
+    }
+
+    uint32_t positive = 0;
+    uint32_t negative = 0;
+
+    for (size_t k=0; k<count; k++) {
+        __m128i sum01 = base01;
+        __m128i sum2 = base2;
+
+        for (size_t j=0; j<3; j++) {
+            __m128i vector = _mm_set1_epi64x(vectors[k][j]);
+            sum01 = _mm_add_epi64(sum01, _mm_mul_epi32(rows01[j], vector));
+            sum2 = _mm_add_epi64(sum2, _mm_mul_epi32(rows2[j], vector));
+
+            __m128i biased01 = _mm_add_epi64(sum01, bias);
+            __m128i biased2 = _mm_add_epi64(sum2, bias);
+            uint32_t fit = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_andnot_si128(low, biased01), zero)));
+            fit |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_andnot_si128(low, biased2), zero))) << 2;
+            uint32_t sign = _mm_movemask_pd(_mm_castsi128_pd(sum01));
+            sign |= _mm_movemask_pd(_mm_castsi128_pd(sum2)) << 2;
+
+            positive |= ~fit & ~sign & 0x07;
+            negative |= ~fit & sign & 0x07;
+
+            sum01 = _mm_sub_epi64(_mm_and_si128(biased01, low), bias);
+            sum2 = _mm_sub_epi64(_mm_and_si128(biased2, low), bias);
+        }
+
+        _mm_storeu_si128((__m128i*) &results[k][0], sum01);
+        results[k][2] = _mm_cvtsi128_si64(sum2);
+    }
+
+    return overflow_flags(positive, negative);
+}
+
+
+/**
+ * @brief      One 64 bits lane per matrix row, the fourth one is unused
+ */
+__attribute__((target("avx2")))
+static uint32_t transform_avx2(
+    const int16_t matrix[3][3],
+    const int32_t translation[3],
+    const int16_t vectors[][3],
+    size_t count,
+    int64_t results[][3])
+{
+    const __m256i max = _mm256_set1_epi64x(GTE_MAC_MAX);
+    const __m256i min = _mm256_set1_epi64x(GTE_MAC_MIN);
+    const __m256i bias = _mm256_set1_epi64x(1LL << 43);
+    const __m256i low = _mm256_set1_epi64x((1LL << 44) - 1);
+
+    __m256i columns[3];
+    for (size_t j=0; j<3; j++) {
+        columns[j] = _mm256_set_epi64x(0, matrix[2][j], matrix[1][j], matrix[0][j]);
+    }
+
+    __m256i base = _mm256_setzero_si256();
+    if (translation) {
+        base = _mm256_set_epi64x(
+            0,
+            (int64_t) translation[2] * 0x1000,
+            (int64_t) translation[1] * 0x1000,
+            (int64_t) translation[0] * 0x1000
+        );
+    }
+
+    uint32_t positive = 0;
+    uint32_t negative = 0;
+
+    for (size_t k=0; k<count; k++) {
+        __m256i sum = base;
+
+        for (size_t j=0; j<3; j++) {
+            sum = _mm256_add_epi64(sum, _mm256_mul_epi32(columns[j], _mm256_set1_epi64x(vectors[k][j])));
+
+            positive |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(sum, max)));
+            negative |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(min, sum)));
+
+            // No 64 bits arithmetic shift: sign extend through the bias
+            sum = _mm256_sub_epi64(_mm256_and_si256(_mm256_add_epi64(sum, bias), low), bias);
+        }
+
+        alignas(32) int64_t lanes[4];
+        _mm256_store_si256((__m256i*) lanes, sum);
+        results[k][0] = lanes[0];
+        results[k][1] = lanes[1];
+        results[k][2] = lanes[2];
+    }
+
+    return overflow_flags(positive, negative);
+}
+
+#endif
+
+
+/**
+ * @brief      Select the fastest kernel supported by the host
+ * @return     true in case of success, false otherwise
+ */
+bool GTE::init()
+{
+    set_kernel(GTE_KERNEL_SCALAR);
+
+    for (size_t i=GTE_KERNEL_SCALAR; i<GTE_KERNEL_COUNT; i++) {
+        if (supported((GTEKernel) i)) {
+            set_kernel((GTEKernel) i);
+        }
+    }
+
+    reset();
+
+    return true;
+}
+
+
+/**
+ * @brief      Clear every register
+ */
+void GTE::reset()
+{
+    for (size_t i=0; i<GTE_REG_COUNT; i++) {
+        write_data(i, 0);
+        write_control(i, 0);
+    }
+}
+
+
+bool GTE::supported(GTEKernel kernel)
+{
+    switch(kernel) {
+    case GTE_KERNEL_SCALAR: return true;
+#ifdef GTE_SIMD
+    case GTE_KERNEL_SSE41: return __builtin_cpu_supports("sse4.1");
+    case GTE_KERNEL_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+    default: return false;
+    }
+}
+
+
+const char *GTE::kernel_name(GTEKernel kernel)
+{
+    return kernel < GTE_KERNEL_COUNT ? KERNEL_NAMES[kernel] : "?";
+}
+
+
+/**
+ * @brief      Use the given implementation for matrix-vector products
+ * Falls back to the scalar reference when the host does not support it
+ */
+void GTE::set_kernel(GTEKernel kernel)
+{
+    if (!supported(kernel)) {
+        kernel = GTE_KERNEL_SCALAR;
+    }
+
+    this->kernel = kernel;
+
+    switch(kernel) {
+#ifdef GTE_SIMD
+    case GTE_KERNEL_SSE41: transform = &transform_sse41; break;
+    case GTE_KERNEL_AVX2: transform = &transform_avx2; break;
+#endif
+    default: transform = &transform_scalar; break;
+    }
+}
+
+
+GTEKernel GTE::get_kernel()
+{
+    return kernel;
+}
+
+
+/**
+ * @brief      Read a packed pair of matrix elements (cop2r32-36 for RT)
+ */
+static uint32_t read_matrix(const int16_t matrix[3][3], size_t index)
+{
+    const int16_t *elements = &matrix[0][0];
+
+    if (index == 4) {
+        return (int32_t) elements[8];
+    }
+
+    return (uint16_t) elements[index * 2] | ((uint16_t) elements[index * 2 + 1] << 16);
+}
+
+
+static void write_matrix(int16_t matrix[3][3], size_t index, uint32_t value)
+{
+    int16_t *elements = &matrix[0][0];
+
+    elements[index * 2] = (int16_t) value;
+    if (index < 4) {
+        elements[index * 2 + 1] = (int16_t) (value >> 16);
+    }
+}
+
+
+uint32_t GTE::read_data(size_t index)
+{
+    switch(index) {
+    case 0: case 2: case 4:
+        return (uint16_t) V[index / 2][0] | ((uint16_t) V[index / 2][1] << 16);
+    case 1: case 3: case 5:
+        return (int32_t) V[index / 2][2];
+    case 6:
+        return RGBC[0] | (RGBC[1] << 8) | (RGBC[2] << 16) | (RGBC[3] << 24);
+    case 7:
+        return OTZ;
+    case 8: case 9: case 10: case 11:
+        return (int32_t) IR[index - 8];
+    case 12: case 13: case 14:
+        return (uint16_t) SXY[index - 12][0] | ((uint16_t) SXY[index - 12][1] << 16);
+    case 15:
+        return read_data(14);
+    case 16: case 17: case 18: case 19:
+        return SZ[index - 16];
+    case 20: case 21: case 22:
+        return RGB[index - 20];
+    case 23:
+        return RES1;
+    case 24: case 25: case 26: case 27:
+        return MAC[index - 24];
+    case 28: case 29:
+        // IRGB reads as ORGB: IR1-3 as a 15 bits color
+        return std::clamp(IR[1] >> 7, 0, 0x1F) |
+            (std::clamp(IR[2] >> 7, 0, 0x1F) << 5) |
+            (std::clamp(IR[3] >> 7, 0, 0x1F) << 10);
+    case 30:
+        return LZCS;
+    case 31:
+        return LZCR;
+    default:
+        error("Invalid GTE data register: %zu\n", index);
+        exit(1);
+    }
+}
+
+
+void GTE::write_data(size_t index, uint32_t value)
+{
+    switch(index) {
+    case 0: case 2: case 4:
+        V[index / 2][0] = (int16_t) value;
+        V[index / 2][1] = (int16_t) (value >> 16);
+        break;
+    case 1: case 3: case 5:
+        V[index / 2][2] = (int16_t) value;
+        break;
+    case 6:
+        for (size_t i=0; i<4; i++) {
+            RGBC[i] = value >> (i * 8);
+        }
+        break;
+    case 7:
+        OTZ = value;
+        break;
+    case 8: case 9: case 10: case 11:
+        IR[index - 8] = (int16_t) value;
+        break;
+    case 12: case 13: case 14:
+        SXY[index - 12][0] = (int16_t) value;
+        SXY[index - 12][1] = (int16_t) (value >> 16);
+        break;
+    case 15:
+        push_sxy((int16_t) value, (int16_t) (value >> 16));
+        break;
+    case 16: case 17: case 18: case 19:
+        SZ[index - 16] = value;
+        break;
+    case 20: case 21: case 22:
+        RGB[index - 20] = value;
+        break;
+    case 23:
+        RES1 = value;
+        break;
+    case 24: case 25: case 26: case 27:
+        MAC[index - 24] = value;
+        break;
+    case 28:
+        // 15 bits color expanded to IR1-3
+        IR[1] = (value & 0x1F) << 7;
+        IR[2] = ((value >> 5) & 0x1F) << 7;
+        IR[3] = ((value >> 10) & 0x1F) << 7;
+        break;
+    case 29:
+        break;  // Read only (ORGB)
+    case 30:
+        // Count of leading bits equal to the sign bit
+        LZCS = value;
+        value = (value & 0x80000000) ? ~value : value;
+        LZCR = value ? __builtin_clz(value) : 32;
+        break;
+    case 31:
+        break;  // Read only (LZCR)
+    default:
+        error("Invalid GTE data register: %zu\n", index);
+        exit(1);
+    }
+}
+
+
+uint32_t GTE::read_control(size_t index)
+{
+    switch(index) {
+    case 0: case 1: case 2: case 3: case 4:
+        return read_matrix(RT, index);
+    case 5: case 6: case 7:
+        return TR[index - 5];
+    case 8: case 9: case 10: case 11: case 12:
+        return read_matrix(LLM, index - 8);
+    case 13: case 14: case 15:
+        return BK[index - 13];
+    case 16: case 17: case 18: case 19: case 20:
+        return read_matrix(LCM, index - 16);
+    case 21: case 22: case 23:
+        return FC[index - 21];
+    case 24: return OFX;
+    case 25: return OFY;
+    case 26: return (int32_t) (int16_t) H;  // Unsigned but read sign extended
+    case 27: return (int32_t) DQA;
+    case 28: return DQB;
+    case 29: return (int32_t) ZSF3;
+    case 30: return (int32_t) ZSF4;
+    case 31: return FLAG;
+    default:
+        error("Invalid GTE control register: %zu\n", index);
+        exit(1);
+    }
+}
+
+
+void GTE::write_control(size_t index, uint32_t value)
+{
+    switch(index) {
+    case 0: case 1: case 2: case 3: case 4:
+        write_matrix(RT, index, value);
+        break;
+    case 5: case 6: case 7:
+        TR[index - 5] = value;
+        break;
+    case 8: case 9: case 10: case 11: case 12:
+        write_matrix(LLM, index - 8, value);
+        break;
+    case 13: case 14: case 15:
+        BK[index - 13] = value;
+        break;
+    case 16: case 17: case 18: case 19: case 20:
+        write_matrix(LCM, index - 16, value);
+        break;
+    case 21: case 22: case 23:
+        FC[index - 21] = value;
+        break;
+    case 24: OFX = value; break;
+    case 25: OFY = value; break;
+    case 26: H = value; break;
+    case 27: DQA = value; break;
+    case 28: DQB = value; break;
+    case 29: ZSF3 = value; break;
+    case 30: ZSF4 = value; break;
+    case 31:
+        FLAG = value & GTE_FLAG_WRITABLE;
+        if (FLAG & GTE_FLAG_ERROR_MASK) {
+            FLAG |= GTE_FLAG_ERROR;
+        }
+        break;
+    default:
+        error("Invalid GTE control register: %zu\n", index);
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief      Execute a command
+ * @param[in]  command  Lower 25 bits of the COP2 instruction
+ * @return     Cycles taken by the command
+ */
+uint32_t GTE::execute(uint32_t command)
+{
+    uint32_t opcode = GTE_OPCODE(command);
+    uint32_t shift = GTE_SF(command) * 12;
+    bool lm = GTE_LM(command);
+
+    FLAG = 0;
+
+    switch(opcode) {
+    case GTE_RTPS: RTP(1, shift, lm); break;
+    case GTE_NCLIP: NCLIP(); break;
+    case GTE_OP: OP(shift, lm); break;
+    case GTE_DPCS: DPCS(read_data(6), shift, lm); break;
+    case GTE_INTPL: INTPL(shift, lm); break;
+    case GTE_MVMVA: MVMVA(command, shift, lm); break;
+    case GTE_NCDS: NC(1, opcode, shift, lm); break;
+    case GTE_CDP: CC(opcode, shift, lm); break;
+    case GTE_NCDT: NC(3, opcode, shift, lm); break;
+    case GTE_NCCS: NC(1, opcode, shift, lm); break;
+    case GTE_CC: CC(opcode, shift, lm); break;
+    case GTE_NCS: NC(1, opcode, shift, lm); break;
+    case GTE_NCT: NC(3, opcode, shift, lm); break;
+    case GTE_SQR: SQR(shift, lm); break;
+    case GTE_DCPL: DCPL(shift, lm); break;
+    case GTE_DPCT:
+        // Depth cue the color FIFO, its front moves with each push
+        for (size_t i=0; i<3; i++) {
+            DPCS(RGB[0], shift, lm);
+        }
+        break;
+    case GTE_AVSZ3: AVSZ(ZSF3, SZ[1] + SZ[2] + SZ[3]); break;
+    case GTE_AVSZ4: AVSZ(ZSF4, SZ[0] + SZ[1] + SZ[2] + SZ[3]); break;
+    case GTE_RTPT: RTP(3, shift, lm); break;
+    case GTE_GPF: GPF(shift, lm); break;
+    case GTE_GPL: GPL(shift, lm); break;
+    case GTE_NCCT: NC(3, opcode, shift, lm); break;
+    default:
+        error("Unhandled GTE command: 0x%02x (0x%07x)\n", opcode, command);
+        exit(1);
+    }
+
+    if (FLAG & GTE_FLAG_ERROR_MASK) {
+        FLAG |= GTE_FLAG_ERROR;
+    }
+
+    return COMMAND_CYCLES[opcode];
+}
+
+
+const char *GTE::command_name(uint32_t command)
+{
+    switch(GTE_OPCODE(command)) {
+    case GTE_RTPS: return "RTPS";
+    case GTE_NCLIP: return "NCLIP";
+    case GTE_OP: return "OP";
+    case GTE_DPCS: return "DPCS";
+    case GTE_INTPL: return "INTPL";
+    case GTE_MVMVA: return "MVMVA";
+    case GTE_NCDS: return "NCDS";
+    case GTE_CDP: return "CDP";
+    case GTE_NCDT: return "NCDT";
+    case GTE_NCCS: return "NCCS";
+    case GTE_CC: return "CC";
+    case GTE_NCS: return "NCS";
+    case GTE_NCT: return "NCT";
+    case GTE_SQR: return "SQR";
+    case GTE_DCPL: return "DCPL";
+    case GTE_DPCT: return "DPCT";
+    case GTE_AVSZ3: return "AVSZ3";
+    case GTE_AVSZ4: return "AVSZ4";
+    case GTE_RTPT: return "RTPT";
+    case GTE_GPF: return "GPF";
+    case GTE_GPL: return "GPL";
+    case GTE_NCCT: return "NCCT";
+    default: return "Invalid";
+    }
+}
+
+
+/**
+ * @brief      Flag overflows of a 44 bits accumulator (MAC1-3)
+ * @return     The value truncated to 44 bits
+ */
+int64_t GTE::check_mac(size_t index, int64_t value)
+{
+    if (value > GTE_MAC_MAX) {
+        FLAG |= FLAG_MAC_POS[index];
+    } else if (value < GTE_MAC_MIN) {
+        FLAG |= FLAG_MAC_NEG[index];
+    }
+
+    return sign_extend44(value);
+}
+
+
+void GTE::set_mac(size_t index, int64_t value, uint32_t shift)
+{
+    MAC[index] = (int32_t) (check_mac(index, value) >> shift);
+}
+
+
+/**
+ * @brief      Saturate IR1-3 to -8000h..7FFFh (0..7FFFh with lm)
+ */
+void GTE::set_ir(size_t index, int64_t value, bool lm)
+{
+    int64_t min = lm ? 0 : -0x8000;
+
+    if (value < min || value > 0x7FFF) {
+        FLAG |= FLAG_IR[index];
+    }
+
+    IR[index] = std::clamp<int64_t>(value, min, 0x7FFF);
+}
+
+
+void GTE::set_mac_ir(size_t index, int64_t value, uint32_t shift, bool lm)
+{
+    set_mac(index, value, shift);
+    set_ir(index, MAC[index], lm);
+}
+
+
+/**
+ * @brief      Flag overflows of MAC0, 32 bits wide
+ */
+void GTE::check_mac0(int64_t value)
+{
+    if (value > INT32_MAX) {
+        FLAG |= GTE_FLAG_MAC0_POS;
+    } else if (value < INT32_MIN) {
+        FLAG |= GTE_FLAG_MAC0_NEG;
+    }
+}
+
+
+void GTE::set_mac0(int64_t value)
+{
+    check_mac0(value);
+
+    MAC[0] = (int32_t) value;
+}
+
+
+void GTE::set_ir0(int64_t value)
+{
+    if (value < 0 || value > 0x1000) {
+        FLAG |= GTE_FLAG_IR0;
+    }
+
+    IR[0] = std::clamp<int64_t>(value, 0, 0x1000);
+}
+
+
+void GTE::set_otz(int64_t value)
+{
+    if (value < 0 || value > 0xFFFF) {
+        FLAG |= GTE_FLAG_SZ3;
+    }
+
+    OTZ = std::clamp<int64_t>(value, 0, 0xFFFF);
+}
+
+
+void GTE::push_sz(int64_t value)
+{
+    if (value < 0 || value > 0xFFFF) {
+        FLAG |= GTE_FLAG_SZ3;
+    }
+
+    SZ[0] = SZ[1];
+    SZ[1] = SZ[2];
+    SZ[2] = SZ[3];
+    SZ[3] = std::clamp<int64_t>(value, 0, 0xFFFF);
+}
+
+
+void GTE::push_sxy(int64_t x, int64_t y)
+{
+    if (x < -0x400 || x > 0x3FF) {
+        FLAG |= GTE_FLAG_SX2;
+    }
+    if (y < -0x400 || y > 0x3FF) {
+        FLAG |= GTE_FLAG_SY2;
+    }
+
+    SXY[0][0] = SXY[1][0];
+    SXY[0][1] = SXY[1][1];
+    SXY[1][0] = SXY[2][0];
+    SXY[1][1] = SXY[2][1];
+    SXY[2][0] = std::clamp<int64_t>(x, -0x400, 0x3FF);
+    SXY[2][1] = std::clamp<int64_t>(y, -0x400, 0x3FF);
+}
+
+
+/**
+ * @brief      Push MAC1-3 / 16 to the color FIFO, with the command code
+ */
+void GTE::push_color()
+{
+    const uint32_t flags[] = {GTE_FLAG_R, GTE_FLAG_G, GTE_FLAG_B};
+    uint32_t color = RGBC[3] << 24;
+
+    for (size_t i=0; i<3; i++) {
+        int32_t value = MAC[i + 1] >> 4;
+
+        if (value < 0 || value > 0xFF) {
+            FLAG |= flags[i];
+        }
+
+        color |= std::clamp(value, 0, 0xFF) << (i * 8);
+    }
+
+    RGB[0] = RGB[1];
+    RGB[1] = RGB[2];
+    RGB[2] = color;
+}
+
+
+/**
+ * @brief      H / SZ3 as a 1.16 fixed point number
+ * Newton-Raphson reciprocal seeded from the UNR table, as the hardware does
+ */
+uint32_t GTE::divide()
+{
+    if (H >= SZ[3] * 2) {
+        FLAG |= GTE_FLAG_DIVIDE;
+        return 0x1FFFF;
+    }
+
+    int z = __builtin_clz(SZ[3]) - 16;
+    uint64_t n = (uint64_t) H << z;
+    int64_t d = SZ[3] << z;
+    int64_t u = UNR_TABLE.values[(d - 0x7FC0) >> 7] + 0x101;
+
+    d = (0x2000080 - d * u) >> 8;
+    d = (0x0000080 + d * u) >> 8;
+
+    return std::min<uint64_t>(0x1FFFF, (n * d + 0x8000) >> 16);
+}
+
+
+/**
+ * @brief      [MAC1-3] = [IR1-3] = (translation * 1000h + matrix * vector) >> shift
+ */
+void GTE::multiply(const int16_t matrix[3][3], const int32_t translation[3], const int16_t vector[3], uint32_t shift, bool lm)
+{
+    int64_t sum[1][3];
+    FLAG |= transform(matrix, translation, (const int16_t (*)[3]) vector, 1, sum);
+
+    for (size_t i=0; i<3; i++) {
+        set_mac_ir(i + 1, sum[0][i], shift, lm);
+    }
+}
+
+
+/**
+ * @brief      MVMVA with the far color as translation
+ * Hardware bug: the first column only raises flags (and sets IR), the
+ * result is the product of the two other columns
+ */
+void GTE::multiply_far_color(const int16_t matrix[3][3], const int16_t vector[3], uint32_t shift, bool lm)
+{
+    for (size_t i=0; i<3; i++) {
+        int64_t sum = check_mac(i + 1, (int64_t) FC[i] * 0x1000 + (int32_t) matrix[i][0] * vector[0]);
+        set_ir(i + 1, (int32_t) (sum >> shift), false);
+
+        sum = check_mac(i + 1, (int32_t) matrix[i][1] * vector[1]);
+        set_mac_ir(i + 1, sum + (int32_t) matrix[i][2] * vector[2], shift, lm);
+    }
+}
+
+
+/**
+ * @brief      Perspective projection of a transformed vertex
+ * @param[in]  sum   TR * 1000h + RT * V, before the shift
+ * @param[in]  last  Depth cueing is only computed for the last vertex
+ */
+void GTE::project(const int64_t sum[3], uint32_t shift, bool lm, bool last)
+{
+    for (size_t i=0; i<3; i++) {
+        set_mac(i + 1, sum[i], shift);
+    }
+    set_ir(1, MAC[1], lm);
+    set_ir(2, MAC[2], lm);
+
+    // IR3 saturation is flagged on the unshifted Z, even with sf=0
+    int64_t min = lm ? 0 : -0x8000;
+    int64_t z = sum[2] >> 12;
+    if (z < min || z > 0x7FFF) {
+        FLAG |= GTE_FLAG_IR3;
+    }
+    IR[3] = std::clamp<int64_t>(MAC[3], min, 0x7FFF);
+
+    push_sz(z);
+
+    int64_t factor = divide();
+    int64_t x = factor * IR[1] + OFX;
+    int64_t y = factor * IR[2] + OFY;
+
+    // MAC0 overflows are flagged, the value is not kept
+    check_mac0(x);
+    check_mac0(y);
+
+    push_sxy((int32_t) (x >> 16), (int32_t) (y >> 16));
+
+    if (last) {
+        int64_t depth = factor * DQA + DQB;
+
+        set_mac0(depth);
+        set_ir0(depth >> 12);
+    }
+}
+
+
+/**
+ * @brief      Interpolate [MAC1-3] toward the far color by IR0
+ */
+void GTE::interpolate(int64_t mac1, int64_t mac2, int64_t mac3, uint32_t shift, bool lm)
+{
+    const int64_t mac[] = {mac1, mac2, mac3};
+
+    // [IR1-3] = (FC * 1000h - MAC) >> shift, saturated without lm
+    for (size_t i=0; i<3; i++) {
+        set_mac_ir(i + 1, (int64_t) FC[i] * 0x1000 - mac[i], shift, false);
+    }
+
+    // [MAC1-3] = (IR * IR0 + MAC) >> shift
+    for (size_t i=0; i<3; i++) {
+        set_mac_ir(i + 1, (int32_t) IR[i + 1] * IR[0] + mac[i], shift, lm);
+    }
+}
+
+
+/**
+ * @brief      Light a vertex from its LLM * V product
+ * [IR1-3] = (BK * 1000h + LCM * IR) >> shift
+ */
+void GTE::light(const int64_t sum[3], uint32_t shift, bool lm)
+{
+    for (size_t i=0; i<3; i++) {
+        set_mac_ir(i + 1, sum[i], shift, lm);
+    }
+
+    const int16_t ir[3] = {IR[1], IR[2], IR[3]};
+    multiply(LCM, BK, ir, shift, lm);
+}
+
+
+/**
+ * @brief      Multiply the light by the color (NCCS, CC)
+ */
+void GTE::color(uint32_t shift, bool lm)
+{
+    for (size_t i=0; i<3; i++) {
+        set_mac_ir(i + 1, (int64_t) RGBC[i] * IR[i + 1] * 16, shift, lm);
+    }
+}
+
+
+/**
+ * @brief      Multiply the light by the color then depth cue (NCDS, CDP)
+ */
+void GTE::depth_cue(uint32_t shift, bool lm)
+{
+    interpolate(
+        (int64_t) RGBC[0] * IR[1] * 16,
+        (int64_t) RGBC[1] * IR[2] * 16,
+        (int64_t) RGBC[2] * IR[3] * 16,
+        shift,
+        lm
+    );
+}
+
+
+/**
+ * @brief      RTPS / RTPT: transform and project V0 (to V2)
+ * The three products of RTPT are computed at once, FLAG accumulates them
+ * in any order
+ */
+void GTE::RTP(size_t count, uint32_t shift, bool lm)
+{
+    int64_t sums[3][3];
+    FLAG |= transform(RT, TR, V, count, sums);
+
+    for (size_t k=0; k<count; k++) {
+        project(sums[k], shift, lm, k == count - 1);
+    }
+}
+
+
+/**
+ * @brief      Normal clipping: winding of the screen triangle
+ */
+void GTE::NCLIP()
+{
+    set_mac0(
+        (int64_t) SXY[0][0] * SXY[1][1] + SXY[1][0] * SXY[2][1] + SXY[2][0] * SXY[0][1] -
+        (int64_t) SXY[0][0] * SXY[2][1] - SXY[1][0] * SXY[0][1] - SXY[2][0] * SXY[1][1]
+    );
+}
+
+
+/**
+ * @brief      Outer product of IR by the RT diagonal
+ */
+void GTE::OP(uint32_t shift, bool lm)
+{
+    int64_t d1 = RT[0][0];
+    int64_t d2 = RT[1][1];
+    int64_t d3 = RT[2][2];
+
+    set_mac(1, IR[3] * d2 - IR[2] * d3, shift);
+    set_mac(2, IR[1] * d3 - IR[3] * d1, shift);
+    set_mac(3, IR[2] * d1 - IR[1] * d2, shift);
+
+    for (size_t i=1; i<=3; i++) {
+        set_ir(i, MAC[i], lm);
+    }
+}
+
+
+/**
+ * @brief      Depth cue a color (RGBC for DPCS, front of the FIFO for DPCT)
+ */
+void GTE::DPCS(uint32_t rgb, uint32_t shift, bool lm)
+{
+    interpolate(
+        (int64_t) (rgb & 0xFF) << 16,
+        (int64_t) ((rgb >> 8) & 0xFF) << 16,
+        (int64_t) ((rgb >> 16) & 0xFF) << 16,
+        shift,
+        lm
+    );
+
+    push_color();
+}
+
+
+void GTE::INTPL(uint32_t shift, bool lm)
+{
+    interpolate((int64_t) IR[1] * 0x1000, (int64_t) IR[2] * 0x1000, (int64_t) IR[3] * 0x1000, shift, lm);
+
+    push_color();
+}
+
+
+/**
+ * @brief      Multiply vector by matrix and add vector
+ */
+void GTE::MVMVA(uint32_t command, uint32_t shift, bool lm)
+{
+    const int16_t (*matrix)[3];
+    int16_t garbage[3][3];
+
+    switch(GTE_MX(command)) {
+    case 0: matrix = RT; break;
+    case 1: matrix = LLM; break;
+    case 2: matrix = LCM; break;
+    default:
+        // Reserved: reads a mix of registers
+        garbage[0][0] = -(RGBC[0] << 4);
+        garbage[0][1] = RGBC[0] << 4;
+        garbage[0][2] = IR[0];
+        garbage[1][0] = garbage[1][1] = garbage[1][2] = RT[0][2];
+        garbage[2][0] = garbage[2][1] = garbage[2][2] = RT[1][1];
+        matrix = garbage;
+        break;
+    }
+
+    int16_t vector[3];
+    switch(GTE_VX(command)) {
+    case 0: case 1: case 2:
+        std::copy(V[GTE_VX(command)], V[GTE_VX(command)] + 3, vector);
+        break;
+    default:
+        std::copy(IR + 1, IR + 4, vector);
+        break;
+    }
+
+    switch(GTE_TX(command)) {
+    case 0: multiply(matrix, TR, vector, shift, lm); break;
+    case 1: multiply(matrix, BK, vector, shift, lm); break;
+    case 2: multiply_far_color(matrix, vector, shift, lm); break;
+    default: multiply(matrix, nullptr, vector, shift, lm); break;
+    }
+}
+
+
+/**
+ * @brief      Normal color commands: NCS/NCT, NCCS/NCCT, NCDS/NCDT
+ * The LLM * V products of the three vertices are computed at once
+ */
+void GTE::NC(size_t count, uint32_t opcode, uint32_t shift, bool lm)
+{
+    int64_t sums[3][3];
+    FLAG |= transform(LLM, nullptr, V, count, sums);
+
+    for (size_t k=0; k<count; k++) {
+        light(sums[k], shift, lm);
+
+        switch(opcode) {
+        case GTE_NCCS: case GTE_NCCT: color(shift, lm); break;
+        case GTE_NCDS: case GTE_NCDT: depth_cue(shift, lm); break;
+        default: break;
+        }
+
+        push_color();
+    }
+}
+
+
+/**
+ * @brief      Color commands lighting IR: CC and CDP
+ */
+void GTE::CC(uint32_t opcode, uint32_t shift, bool lm)
+{
+    const int16_t ir[3] = {IR[1], IR[2], IR[3]};
+    multiply(LCM, BK, ir, shift, lm);
+
+    if (opcode == GTE_CDP) {
+        depth_cue(shift, lm);
+    } else {
+        color(shift, lm);
+    }
+
+    push_color();
+}
+
+
+void GTE::SQR(uint32_t shift, bool lm)
+{
+    for (size_t i=1; i<=3; i++) {
+        set_mac_ir(i, (int32_t) IR[i] * IR[i], shift, lm);
+    }
+}
+
+
+/**
+ * @brief      Depth cue the color multiplied by IR
+ */
+void GTE::DCPL(uint32_t shift, bool lm)
+{
+    depth_cue(shift, lm);
+
+    push_color();
+}
+
+
+/**
+ * @brief      Average Z: OTZ = factor * sum >> 12
+ */
+void GTE::AVSZ(int16_t factor, uint32_t sum)
+{
+    int64_t value = (int64_t) factor * sum;
+
+    set_mac0(value);
+    set_otz(value >> 12);
+}
+
+
+/**
+ * @brief      General purpose interpolation: [MAC1-3] = IR * IR0
+ */
+void GTE::GPF(uint32_t shift, bool lm)
+{
+    for (size_t i=1; i<=3; i++) {
+        set_mac_ir(i, (int32_t) IR[i] * IR[0], shift, lm);
+    }
+
+    push_color();
+}
+
+
+/**
+ * @brief      General purpose interpolation with base: [MAC1-3] += IR * IR0
+ */
+void GTE::GPL(uint32_t shift, bool lm)
+{
+    for (size_t i=1; i<=3; i++) {
+        set_mac_ir(i, (int64_t) MAC[i] * (1 << shift) + (int32_t) IR[i] * IR[0], shift, lm);
+    }
+
+    push_color();
+}
@@ -0,0 +1,199 @@
+#ifndef GTE_H
+#define GTE_H
+
+#include <cstdint>
+#include <cstddef>
+
+// SIMD kernels are built for x86-64 hosts and picked at runtime from the CPU
+// features, define GTE_SCALAR to only build the scalar reference
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(GTE_SCALAR)
+    #define GTE_SIMD
+#endif
+
+#define GTE_REG_COUNT           32
+
+// Command fields
+#define GTE_COMMAND_MASK        0x1FFFFFF
+#define GTE_OPCODE(command)     ((command) & 0x3F)
+#define GTE_LM(command)         (((command) >> 10) & 0x01)  // Saturate IR to 0..7FFFh
+#define GTE_SF(command)         (((command) >> 19) & 0x01)  // Shift results by 12
+#define GTE_MX(command)         (((command) >> 17) & 0x03)  // MVMVA matrix
+#define GTE_VX(command)         (((command) >> 15) & 0x03)  // MVMVA vector
+#define GTE_TX(command)         (((command) >> 13) & 0x03)  // MVMVA translation
+
+// Commands
+#define GTE_RTPS                0x01
+#define GTE_NCLIP               0x06
+#define GTE_OP                  0x0C
+#define GTE_DPCS                0x10
+#define GTE_INTPL               0x11
+#define GTE_MVMVA               0x12
+#define GTE_NCDS                0x13
+#define GTE_CDP                 0x14
+#define GTE_NCDT                0x16
+#define GTE_NCCS                0x1B
+#define GTE_CC                  0x1C
+#define GTE_NCS                 0x1E
+#define GTE_NCT                 0x20
+#define GTE_SQR                 0x28
+#define GTE_DCPL                0x29
+#define GTE_DPCT                0x2A
+#define GTE_AVSZ3               0x2D
+#define GTE_AVSZ4               0x2E
+#define GTE_RTPT                0x30
+#define GTE_GPF                 0x3D
+#define GTE_GPL                 0x3E
+#define GTE_NCCT                0x3F
+
+// FLAG register
+#define GTE_FLAG_ERROR          0x80000000  // Any of GTE_FLAG_ERROR_MASK
+#define GTE_FLAG_MAC1_POS       0x40000000  // MAC1-3 larger than 43 bits
+#define GTE_FLAG_MAC2_POS       0x20000000
+#define GTE_FLAG_MAC3_POS       0x10000000
+#define GTE_FLAG_MAC1_NEG       0x08000000
+#define GTE_FLAG_MAC2_NEG       0x04000000
+#define GTE_FLAG_MAC3_NEG       0x02000000
+#define GTE_FLAG_IR1            0x01000000  // IR1-3 saturated
+#define GTE_FLAG_IR2            0x00800000
+#define GTE_FLAG_IR3            0x00400000
+#define GTE_FLAG_R              0x00200000  // Color FIFO saturated to 0..FFh
+#define GTE_FLAG_G              0x00100000
+#define GTE_FLAG_B              0x00080000
+#define GTE_FLAG_SZ3            0x00040000  // SZ3 or OTZ saturated to 0..FFFFh
+#define GTE_FLAG_DIVIDE         0x00020000  // Perspective division overflow
+#define GTE_FLAG_MAC0_POS       0x00010000  // MAC0 larger than 31 bits
+#define GTE_FLAG_MAC0_NEG       0x00008000
+#define GTE_FLAG_SX2            0x00004000  // SX2/SY2 saturated to -400h..3FFh
+#define GTE_FLAG_SY2            0x00002000
+#define GTE_FLAG_IR0            0x00001000  // IR0 saturated to 0..1000h
+#define GTE_FLAG_ERROR_MASK     0x7F87E000
+#define GTE_FLAG_WRITABLE       0x7FFFF000
+
+// MAC1-3 accumulators are 44 bits wide
+#define GTE_MAC_MAX             0x7FFFFFFFFFFLL
+#define GTE_MAC_MIN             (-0x80000000000LL)
+
+#define GTE_UNR_TABLE_SIZE      0x101
+
+
+/**
+ * @brief      Implementations of the matrix-vector products
+ */
+enum GTEKernel {
+    GTE_KERNEL_SCALAR,          // Reference
+    GTE_KERNEL_SSE41,
+    GTE_KERNEL_AVX2,
+    GTE_KERNEL_COUNT
+};
+
+
+/**
+ * @brief      Multiply vectors by a matrix and add a translation (times
+ * 1000h, none if nullptr) in 44 bits accumulators
+ * Results are sign extended from 44 bits, as the hardware truncates them
+ * after each addition
+ * @return     MAC1-3 overflow flags raised by any of the additions
+ */
+typedef uint32_t (*GTETransform)(
+    const int16_t matrix[3][3],
+    const int32_t translation[3],
+    const int16_t vectors[][3],
+    size_t count,
+    int64_t results[][3]
+);
+
+
+/**
+ * @brief      Geometry Transformation Engine: coprocessor 2
+ * Fixed point vector and matrix maths used to transform, light and project
+ * vertices
+ */
+class GTE {
+    // Data registers (cop2r0-31)
+    int16_t V[3][3];        // Vectors 0-2 (X, Y, Z)
+    uint8_t RGBC[4];        // Color and GPU command code
+    uint16_t OTZ;           // Average Z
+    int16_t IR[4];          // Interpolation factor and vector
+    int16_t SXY[3][2];      // Screen XY FIFO
+    uint16_t SZ[4];         // Screen Z FIFO
+    uint32_t RGB[3];        // Color FIFO
+    uint32_t RES1;          // Prohibited, keeps its value
+    int32_t MAC[4];         // Accumulators
+    uint32_t LZCS;          // Leading zeroes/ones count source and result
+    uint32_t LZCR;
+
+    // Control registers (cop2r32-63)
+    int16_t RT[3][3];       // Rotation matrix
+    int32_t TR[3];          // Translation vector
+    int16_t LLM[3][3];      // Light source matrix
+    int32_t BK[3];          // Background color
+    int16_t LCM[3][3];      // Light color matrix
+    int32_t FC[3];          // Far color
+    int32_t OFX;            // Screen offset
+    int32_t OFY;
+    uint16_t H;             // Projection plane distance
+    int16_t DQA;            // Depth cueing coefficient and offset
+    int32_t DQB;
+    int16_t ZSF3;           // Average Z scale factors
+    int16_t ZSF4;
+    uint32_t FLAG;
+
+    GTEKernel kernel;
+    GTETransform transform;
+
+    int64_t check_mac(size_t index, int64_t value);
+    void set_mac(size_t index, int64_t value, uint32_t shift);
+    void set_ir(size_t index, int64_t value, bool lm);
+    void set_mac_ir(size_t index, int64_t value, uint32_t shift, bool lm);
+    void check_mac0(int64_t value);
+    void set_mac0(int64_t value);
+    void set_ir0(int64_t value);
+    void set_otz(int64_t value);
+    void push_sz(int64_t value);
+    void push_sxy(int64_t x, int64_t y);
+    void push_color();
+
+    uint32_t divide();
+    void multiply(const int16_t matrix[3][3], const int32_t translation[3], const int16_t vector[3], uint32_t shift, bool lm);
+    void multiply_far_color(const int16_t matrix[3][3], const int16_t vector[3], uint32_t shift, bool lm);
+
+    void project(const int64_t sum[3], uint32_t shift, bool lm, bool last);
+    void interpolate(int64_t mac1, int64_t mac2, int64_t mac3, uint32_t shift, bool lm);
+    void light(const int64_t sum[3], uint32_t shift, bool lm);
+    void color(uint32_t shift, bool lm);
+    void depth_cue(uint32_t shift, bool lm);
+
+    void RTP(size_t count, uint32_t shift, bool lm);
+    void NCLIP();
+    void OP(uint32_t shift, bool lm);
+    void DPCS(uint32_t rgb, uint32_t shift, bool lm);
+    void INTPL(uint32_t shift, bool lm);
+    void MVMVA(uint32_t command, uint32_t shift, bool lm);
+    void NC(size_t count, uint32_t opcode, uint32_t shift, bool lm);
+    void CC(uint32_t opcode, uint32_t shift, bool lm);
+    void SQR(uint32_t shift, bool lm);
+    void DCPL(uint32_t shift, bool lm);
+    void AVSZ(int16_t factor, uint32_t sum);
+    void GPF(uint32_t shift, bool lm);
+    void GPL(uint32_t shift, bool lm);
+
+public:
+    bool init();
+    void reset();
+
+    uint32_t read_data(size_t index);
+    void write_data(size_t index, uint32_t value);
+    uint32_t read_control(size_t index);
+    void write_control(size_t index, uint32_t value);
+
+    uint32_t execute(uint32_t command);
+
+    static bool supported(GTEKernel kernel);
+    static const char *kernel_name(GTEKernel kernel);
+    static const char *command_name(uint32_t command);
+
+    void set_kernel(GTEKernel kernel);
+    GTEKernel get_kernel();
+};
+
+#endif /* GTE_H */
@@ -0,0 +1,248 @@
+#include "gte_bench.h"
+
+#include <iostream>
+#include <chrono>
+
+#include "log.h"
+#include "gte.h"
+
+
+#define DEFAULT_ITERATIONS      1000000     // Per command, for each check and measure
+#define STATE_COUNT             4096        // Random register sets
+#define STATE_REUSE             16          // Commands run on a register set when timed
+#define MISMATCH_MAX            8           // Mismatches shown before giving up
+
+// Commands and the fields randomized when checking (sf, lm, MVMVA operands)
+#define RANDOM_FIELDS           ((1 << 19) | (1 << 10))
+#define MVMVA_FIELDS            (RANDOM_FIELDS | (3 << 17) | (3 << 15) | (3 << 13))
+
+
+/**
+ * @brief      Every GTE register, data then control
+ */
+struct GTEState {
+    uint32_t data[GTE_REG_COUNT];
+    uint32_t control[GTE_REG_COUNT];
+};
+
+
+struct GTEBenchCommand {
+    const char *description;
+    uint32_t command;       // Timed
+    uint32_t fields;        // Randomized when checking
+};
+
+
+const GTEBenchCommand COMMANDS[] = {
+    {"RTPT", (1 << 19) | GTE_RTPT, RANDOM_FIELDS},
+    {"MVMVA", (1 << 19) | GTE_MVMVA, MVMVA_FIELDS},
+    {"NCDT", (1 << 19) | (1 << 10) | GTE_NCDT, RANDOM_FIELDS},
+};
+
+GTEState states[STATE_COUNT];
+
+
+void show_usage()
+{
+    std::cerr << "Check SIMD GTE kernels against the scalar reference and measure their speed\n";
+    std::cerr << "Usage: gte_bench [iterations]\n";
+}
+
+
+/**
+ * @brief      Pseudo random numbers, reproducible across runs
+ */
+uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+
+    return *seed;
+}
+
+
+/**
+ * @brief      Fill the register sets
+ * Half of them hold any value, saturating most results, the other half
+ * small values (sign extended 12 bits) closer to actual geometry
+ */
+void generate_states()
+{
+    uint32_t seed = 1;
+
+    for (size_t i=0; i<STATE_COUNT; i++) {
+        for (size_t reg=0; reg<GTE_REG_COUNT; reg++) {
+            uint32_t data = next_random(&seed);
+            uint32_t control = next_random(&seed);
+
+            if (i & 1) {
+                data = (data & 0xF000F000) ? data & 0x07FF07FF : data | 0xF800F800;
+                control = (control & 0xF000F000) ? control & 0x07FF07FF : control | 0xF800F800;
+            }
+
+            states[i].data[reg] = data;
+            states[i].control[reg] = control;
+        }
+    }
+}
+
+
+void load_state(GTE *gte, const GTEState *state)
+{
+    for (size_t reg=0; reg<GTE_REG_COUNT; reg++) {
+        gte->write_data(reg, state->data[reg]);
+        gte->write_control(reg, state->control[reg]);
+    }
+}
+
+
+double elapsed(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    return duration.count();
+}
+
+
+void report(const char *kernel, const char *command, double seconds, size_t operations)
+{
+    printf("%-8s %-8s %8.2f ns/op %10.2f M ops/s\n",
+        kernel,
+        command,
+        seconds * 1e9 / operations,
+        operations / seconds / 1e6
+    );
+}
+
+
+/**
+ * @brief      Run random commands through the scalar and the given kernel
+ * Every data and control register, FLAG included, must be the same
+ * @return     Number of mismatching commands
+ */
+size_t check(GTEKernel kernel, const GTEBenchCommand *command, size_t iterations)
+{
+    GTE scalar;
+    GTE simd;
+    scalar.init();
+    simd.init();
+    scalar.set_kernel(GTE_KERNEL_SCALAR);
+    simd.set_kernel(kernel);
+
+    uint32_t seed = 2;
+    size_t mismatches = 0;
+
+    for (size_t i=0; i<iterations; i++) {
+        const GTEState *state = &states[i % STATE_COUNT];
+        load_state(&scalar, state);
+        load_state(&simd, state);
+
+        uint32_t fields = next_random(&seed) & command->fields;
+        uint32_t opcode = (command->command & ~command->fields) | fields;
+        scalar.execute(opcode);
+        simd.execute(opcode);
+
+        for (size_t reg=0; reg<GTE_REG_COUNT * 2; reg++) {
+            uint32_t expected = reg < GTE_REG_COUNT ? scalar.read_data(reg) : scalar.read_control(reg - GTE_REG_COUNT);
+            uint32_t got = reg < GTE_REG_COUNT ? simd.read_data(reg) : simd.read_control(reg - GTE_REG_COUNT);
+
+            if (expected != got) {
+                error("%s: %s 0x%07x, state %zu: cop2r%zu is 0x%08x, expected 0x%08x\n",
+                    GTE::kernel_name(kernel), command->description, opcode,
+                    i % STATE_COUNT, reg, got, expected
+                );
+
+                mismatches++;
+                break;
+            }
+        }
+
+        if (mismatches >= MISMATCH_MAX) {
+            break;
+        }
+    }
+
+    return mismatches;
+}
+
+
+/**
+ * @brief      Commands per second with the given kernel
+ * Register sets are only reloaded every STATE_REUSE commands so the loads do
+ * not hide the command itself
+ */
+void measure(GTEKernel kernel, const GTEBenchCommand *command, size_t iterations)
+{
+    GTE gte;
+    gte.init();
+    gte.set_kernel(kernel);
+
+    uint32_t sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<iterations; i++) {
+        if (i % STATE_REUSE == 0) {
+            load_state(&gte, &states[(i / STATE_REUSE) % STATE_COUNT]);
+        }
+
+        sum += gte.execute(command->command);
+    }
+    double seconds = elapsed(start);
+
+    // Keep the results alive
+    if (sum + gte.read_control(31) == 0xFFFFFFFF) {
+        printf("\n");
+    }
+
+    report(GTE::kernel_name(kernel), command->description, seconds, iterations);
+}
+
+
+int main(int argc, char *argv[])
+{
+    info("PSX GTE benchmark\n");
+
+    if (argc > 2) {
+        show_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    size_t iterations = DEFAULT_ITERATIONS;
+    if (argc == 2) {
+        iterations = strtoul(argv[1], NULL, 10);
+    }
+
+    if (iterations == 0) {
+        show_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    generate_states();
+
+    size_t mismatches = 0;
+    for (size_t kernel=GTE_KERNEL_SCALAR; kernel<GTE_KERNEL_COUNT; kernel++) {
+        if (!GTE::supported((GTEKernel) kernel)) {
+            printf("%-8s not supported by this host\n", GTE::kernel_name((GTEKernel) kernel));
+            continue;
+        }
+
+        for (const GTEBenchCommand &command : COMMANDS) {
+            if (kernel != GTE_KERNEL_SCALAR) {
+                mismatches += check((GTEKernel) kernel, &command, iterations);
+            }
+
+            measure((GTEKernel) kernel, &command, iterations);
+        }
+    }
+
+    if (mismatches > 0) {
+        error("SIMD kernels do not match the scalar reference\n");
+
+        return EXIT_FAILURE;
+    }
+
+    info("SIMD kernels match the scalar reference\n");
+
+    return EXIT_SUCCESS;
+}
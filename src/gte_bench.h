@@ -0,0 +1,4 @@
+#ifndef GTE_BENCH_H
+#define GTE_BENCH_H
+
+#endif /* GTE_BENCH_H */
@@ -0,0 +1,12 @@
+#include "icache.h"
+
+
+/**
+ * @brief      Invalidate every line
+ */
+void ICache::reset()
+{
+    for (size_t i=0; i<ICACHE_LINE_COUNT; i++) {
+        lines[i].tag = ICACHE_INVALID;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define ICACHE_SIZE             4096
+#define ICACHE_LINE_SIZE        16
+#define ICACHE_LINE_WORDS       (ICACHE_LINE_SIZE / 4)
+#define ICACHE_LINE_COUNT       (ICACHE_SIZE / ICACHE_LINE_SIZE)
+#define ICACHE_INVALID          0xFFFFFFFF  // Tag of a line holding nothing
+#define ICACHE_TAG_MASK         0x1FFFFFF0
+
+// KSEG1 and above are never cached
+#define ICACHE_UNCACHED_START   0xA0000000
+
+
+/**
+ * @brief      Line of the instruction cache
+ */
+struct ICacheLine {
+    uint32_t tag;                       // Physical address of the line
+    uint32_t words[ICACHE_LINE_WORDS];  // Host order instructions
+};
+
+
+/**
+ * @brief      Instruction cache
+ * 4KB direct mapped, used for fetches from KUSEG and KSEG0 once enabled by
+ * the cache control register. Hits are served from the line, misses fill
+ * the whole line
+ */
+class ICache {
+    ICacheLine lines[ICACHE_LINE_COUNT];
+    bool enabled = false;
+
+    friend class Recompiler;
+
+public:
+    void reset();
+
+    void set_enabled(bool enabled)
+    {
+        this->enabled = enabled;
+    }
+
+    /**
+     * @brief      Tells if a fetch from the virtual address uses the cache
+     */
+    bool caches(uint32_t address)
+    {
+        return enabled && address < ICACHE_UNCACHED_START;
+    }
+
+    static uint32_t index(uint32_t address)
+    {
+        return (address / ICACHE_LINE_SIZE) % ICACHE_LINE_COUNT;
+    }
+
+    /**
+     * @brief      Physical address of the line holding a cached address
+     * KSEG0 maps to physical memory by dropping the top bits
+     */
+    static uint32_t tag(uint32_t address)
+    {
+        return address & ICACHE_TAG_MASK;
+    }
+
+    ICacheLine &line(uint32_t address)
+    {
+        return lines[index(address)];
+    }
+
+    bool valid(uint32_t address)
+    {
+        return line(address).tag != ICACHE_INVALID;
+    }
+
+    /**
+     * @brief      Drop the line an address maps to
+     * What a store does while the cache is isolated
+     * @return     Physical address the line was caching, ICACHE_INVALID if none
+     */
+    uint32_t invalidate(uint32_t address)
+    {
+        uint32_t tag = line(address).tag;
+        line(address).tag = ICACHE_INVALID;
+
+        return tag;
+    }
+};
+
+#endif /* ICACHE_H */
@@ -3,80 +3,83 @@
 #include <iostream>
 
 #include "common.h"
+#include "gte.h"
 #include "log.h"
 
 using namespace std;
 
 
-uint8_t get_primary_opcode(uint32_t instruction)
+/**
+ * @brief      Tells if the instruction is a branch or a jump
+ * Such instructions are followed by a delay slot
+ */
+bool is_branch(uint32_t instruction)
 {
-    return extract(instruction, 26, 6);
-}
+    uint8_t opcode = get_primary_opcode(instruction);
 
+    if (opcode == 0x00) {
+        uint8_t opcode_special = get_secondary_opcode(instruction);
 
-uint8_t get_secondary_opcode(uint32_t instruction)
-{
-    return extract(instruction, 0, 6);
-}
-
+        return opcode_special == 0x08 || opcode_special == 0x09;    // JR/JALR
+    }
 
-uint8_t get_cop_opcode(uint32_t instruction)
-{
-    return extract(instruction, 21, 5);
+    return opcode >= 0x01 && opcode <= 0x07;
 }
 
-
-size_t get_rs(uint32_t instruction)
+/**
+ * @brief      Tells if the instruction is a load (leaves a pending load)
+ */
+bool is_load(uint32_t instruction)
 {
-    return extract(instruction, 21, 5);
-}
+    uint8_t opcode = get_primary_opcode(instruction);
 
+    if (opcode == 0x10) {
+        return get_cop_opcode(instruction) == 0b00000;      // MFC0
+    }
 
-size_t get_rt(uint32_t instruction)
-{
-    return extract(instruction, 16, 5);
-}
+    if (opcode == 0x12) {
+        uint8_t cop_opcode = get_cop_opcode(instruction);
 
+        return cop_opcode == 0b00000 || cop_opcode == 0b00010;  // MFC2/CFC2
+    }
 
-size_t get_rd(uint32_t instruction)
-{
-    return extract(instruction, 11, 5);
+    return opcode >= 0x20 && opcode <= 0x26;
 }
 
-
-uint8_t get_imm5(uint32_t instruction)
+/**
+ * @brief      Tells if the instruction only writes a general register
+ * Such instructions cannot raise exceptions (see get_destination)
+ */
+bool is_pure(uint32_t instruction)
 {
-    return extract(instruction, 6, 5);
-}
+    uint8_t opcode = get_primary_opcode(instruction);
 
+    if (opcode == 0x00) {
+        switch(get_secondary_opcode(instruction)) {
+        case 0x00: case 0x02: case 0x03:                    // SLL SRL SRA
+        case 0x04: case 0x06: case 0x07:                    // SLLV SRLV SRAV
+        case 0x21: case 0x23:                               // ADDU SUBU
+        case 0x24: case 0x25: case 0x26: case 0x27:         // AND OR XOR NOR
+        case 0x2A: case 0x2B:                               // SLT SLTU
+            return true;
+        default:
+            return false;
+        }
+    }
 
-uint16_t get_imm16(uint32_t instruction)
-{
-    return extract(instruction, 0, 16);
+    return opcode >= 0x09 && opcode <= 0x0F;                // ADDIU to LUI
 }
 
-
 /**
- * @brief      Same as get_imm16 but gets signed value
- * Signed value is the same a 16bit value but padded with MSB on the left
+ * @brief      Register written by a pure instruction
  */
-int32_t get_imm16_se(uint32_t instruction)
-{
-    int16_t value = get_imm16(instruction) & 0xFFFF;
-
-    return (int32_t) value;
-}
-
-
-uint32_t get_imm26(uint32_t instruction)
+size_t get_destination(uint32_t instruction)
 {
-    return extract(instruction, 0, 26);
-}
-
+    if (get_primary_opcode(instruction) == 0x00) {
+        return get_rd(instruction);
+    }
 
-uint32_t get_comment(uint32_t instruction)
-{
-    return extract(instruction, 6, 20);
+    return get_rt(instruction);
 }
 
 
@@ -251,7 +254,28 @@ void decode(char* buffer, size_t size, uint32_t data)
         snprintf(buffer, size, "COP1");
         break;
     case 0x12:
-        snprintf(buffer, size, "COP2 GTE");
+        if (cop_opcode & 0b10000) {
+            snprintf(buffer, size, "GTE %s 0x%07x", GTE::command_name(data), data & GTE_COMMAND_MASK);
+            break;
+        }
+
+        switch(cop_opcode) {
+        case 0b00000:
+            snprintf(buffer, size, "MFC2 $rt%zu, $rd%zu", get_rt(data), get_rd(data));
+            break;
+        case 0b00010:
+            snprintf(buffer, size, "CFC2 $rt%zu, $rd%zu", get_rt(data), get_rd(data));
+            break;
+        case 0b00100:
+            snprintf(buffer, size, "MTC2 $rt%zu, $rd%zu", get_rt(data), get_rd(data));
+            break;
+        case 0b00110:
+            snprintf(buffer, size, "CTC2 $rt%zu, $rd%zu", get_rt(data), get_rd(data));
+            break;
+        default: snprintf(
+                buffer, size, "COP2 Invalid");
+            break;
+        };
         break;
     case 0x13:
         snprintf(buffer, size, "COP3");
@@ -299,7 +323,7 @@ void decode(char* buffer, size_t size, uint32_t data)
         snprintf(buffer, size, "LWC1");
         break;
     case 0x32:
-        snprintf(buffer, size, "LWC2 GTE");
+        snprintf(buffer, size, "LWC2 $rs%zu, $rt%zu, %d", get_rs(data), get_rt(data), get_imm16_se(data));
         break;
     case 0x33:
         snprintf(buffer, size, "LWC2");
@@ -311,11 +335,14 @@ void decode(char* buffer, size_t size, uint32_t data)
         snprintf(buffer, size, "SWC1");
         break;
     case 0x3A:
-        snprintf(buffer, size, "SWC2 GTE");
+        snprintf(buffer, size, "SWC2 $rs%zu, $rt%zu, %d", get_rs(data), get_rt(data), get_imm16_se(data));
         break;
     case 0x3B:
         snprintf(buffer, size, "SWC3");
         break;
+    case HLE_OPCODE:
+        snprintf(buffer, size, "HLE 0x%02x", get_imm26(data));
+        break;
     default: snprintf(
             buffer, size, "EXCEPTION ILLEGAL");
         break;
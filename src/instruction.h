@@ -1,22 +1,80 @@
 #ifndef INSTRUCTION_H
 #define INSTRUCTION_H
 
+#include <cstddef>
 #include <cstdint>
 
 #define INSTRUCTION_MAX_SIZE            200
 
+// Reserved primary opcode used for the HLE kernel calls
+#define HLE_OPCODE                      0x3F
 
-uint8_t get_primary_opcode(uint32_t instruction);
-uint8_t get_secondary_opcode(uint32_t instruction);
-uint8_t get_cop_opcode(uint32_t instruction);
-size_t get_rs(uint32_t instruction);
-size_t get_rt(uint32_t instruction);
-size_t get_rd(uint32_t instruction);
-uint8_t get_imm5(uint32_t instruction);
-uint16_t get_imm16(uint32_t instruction);
-int32_t get_imm16_se(uint32_t instruction);
-uint32_t get_imm26(uint32_t instruction);
-uint32_t get_comment(uint32_t instruction);
+
+// Field getters are inlined in the instruction handlers
+
+inline uint8_t get_primary_opcode(uint32_t instruction)
+{
+    return (instruction >> 26) & 0x3F;
+}
+
+inline uint8_t get_secondary_opcode(uint32_t instruction)
+{
+    return instruction & 0x3F;
+}
+
+inline uint8_t get_cop_opcode(uint32_t instruction)
+{
+    return (instruction >> 21) & 0x1F;
+}
+
+inline size_t get_rs(uint32_t instruction)
+{
+    return (instruction >> 21) & 0x1F;
+}
+
+inline size_t get_rt(uint32_t instruction)
+{
+    return (instruction >> 16) & 0x1F;
+}
+
+inline size_t get_rd(uint32_t instruction)
+{
+    return (instruction >> 11) & 0x1F;
+}
+
+inline uint8_t get_imm5(uint32_t instruction)
+{
+    return (instruction >> 6) & 0x1F;
+}
+
+inline uint16_t get_imm16(uint32_t instruction)
+{
+    return instruction & 0xFFFF;
+}
+
+/**
+ * @brief      Same as get_imm16 but gets signed value
+ * Signed value is the same a 16bit value but padded with MSB on the left
+ */
+inline int32_t get_imm16_se(uint32_t instruction)
+{
+    return (int32_t) (int16_t) (instruction & 0xFFFF);
+}
+
+inline uint32_t get_imm26(uint32_t instruction)
+{
+    return instruction & 0x03FFFFFF;
+}
+
+inline uint32_t get_comment(uint32_t instruction)
+{
+    return (instruction >> 6) & 0xFFFFF;
+}
+
+bool is_branch(uint32_t instruction);
+bool is_load(uint32_t instruction);
+bool is_pure(uint32_t instruction);
+size_t get_destination(uint32_t instruction);
 
 void decode(char* buffer, size_t size, uint32_t data);
 
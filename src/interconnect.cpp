@@ -1,5 +1,10 @@
 #include "interconnect.h"
 
+#include <algorithm>
+
+#include "irq.h"
+#include "dma.h"
+
 
 const uint32_t REGION_MASK[] = {
     // KUSEG: 2048MB
@@ -12,6 +17,19 @@ const uint32_t REGION_MASK[] = {
     0xFFFFFFFF, 0xFFFFFFFF
 };
 
+// Memory control registers as set up by the BIOS
+const uint32_t MEM_CONTROL_DEFAULT[SYS_CONTROL_SIZE / 4] = {
+    EXPANSION_1_START,
+    EXPANSION_2_START,
+    0x0013243F,     // Expansion 1
+    0x00003022,     // Expansion 3
+    0x0013243F,     // BIOS
+    0x200931E1,     // SPU
+    0x00020843,     // CDROM
+    0x00070777,     // Expansion 2
+    0x00031125,     // COM_DELAY
+};
+
 
 uint32_t mask_region(uint32_t address)
 {
@@ -24,16 +42,441 @@ Interconnect::~Interconnect()
 }
 
 
-bool Interconnect::init(SPU *spu, BIOS *bios, RAM *ram)
+bool Interconnect::init(SPU *spu, BIOS *bios, RAM *ram, Scratchpad *scratchpad)
 {
     this->spu = spu;
     this->bios = bios;
     this->ram = ram;
+    this->scratchpad = scratchpad;
+
+    ram_data = ram->get_data();
+
+    reset();
+    map_pages();
+
+    if (!io.init()) {
+        return false;
+    }
+
+    map_registers();
 
     return true;
 }
 
 
+static uint16_t read_spu(void *, uint32_t)
+{
+    return 0;
+}
+
+static void write_spu(void *, uint32_t, uint16_t)
+{
+}
+
+// SPU registers are 16 bits: words are two halfword accesses
+static uint32_t read_spu32(void *spu, uint32_t offset)
+{
+    return read_spu(spu, offset) | (uint32_t) read_spu(spu, offset + 2) << 16;
+}
+
+static void write_spu32(void *spu, uint32_t offset, uint32_t value)
+{
+    write_spu(spu, offset, value);
+    write_spu(spu, offset + 2, value >> 16);
+}
+
+static void write_ram_size(void *, uint32_t offset, uint32_t value)
+{
+    error("Unhandled store to RAM_SIZE register: 0x%08x: 0x%08x\n", offset, value);
+}
+
+template <typename T>
+static void write_timers(void *, uint32_t offset, T value)
+{
+    error("Unhandled store%zu to TIMERS register: 0x%08x: 0x%04x\n", sizeof(T), offset, value);
+}
+
+static uint32_t read_gpu(void *, uint32_t offset)
+{
+    switch(offset) {
+    // Let the CPU knows GPU is ready
+    case 4: return 0x10000000;
+    default:
+        error("Unhandled load to GPU register: 0x%08x\n", offset);
+        return 0;
+    }
+}
+
+static void write_gpu(void *, uint32_t offset, uint32_t value)
+{
+    error("Unhandled store to GPU register: 0x%08x: 0x%08x\n", offset, value);
+}
+
+static void write_expansion_2(void *, uint32_t offset, uint8_t value)
+{
+    error("Unhandled store to EXPANSION 2 register: 0x%08x: 0x%02x\n", offset, value);
+}
+
+
+/**
+ * @brief      Map the registers handled by the interconnect itself and the
+ * devices not emulated yet
+ * Handlers are given for the widths the registers are accessed with: words
+ * for memory control and GPU, halfwords for the SPU (words are split), bytes
+ * for the expansion 2 POST register
+ */
+void Interconnect::map_registers()
+{
+    // Handlers: read8, read16, read32, write8, write16, write32
+    map_io({"MEM_CONTROL", SYS_CONTROL_START, SYS_CONTROL_SIZE, this,
+        {nullptr, nullptr, read_mem_control, nullptr, nullptr, write_mem_control},
+        io_cycles, true});
+    map_io({"RAM_SIZE", RAM_SIZE_START, RAM_SIZE_SIZE, this,
+        {nullptr, nullptr, nullptr, nullptr, nullptr, write_ram_size},
+        io_cycles, false});
+    map_io({"SPU", SPU_START, SPU_SIZE, spu,
+        {nullptr, read_spu, read_spu32, nullptr, write_spu, write_spu32},
+        access_cycles[REGION_SPU], true});
+    map_io({"TIMERS", TIMERS_START, TIMERS_SIZE, nullptr,
+        {nullptr, nullptr, nullptr, write_timers<uint8_t>, write_timers<uint16_t>, write_timers<uint32_t>},
+        io_cycles, false});
+    map_io({"GPU", GPU_START, GPU_SIZE, nullptr,
+        {nullptr, nullptr, read_gpu, nullptr, nullptr, write_gpu},
+        io_cycles, true});
+    map_io({"EXPANSION_2", EXPANSION_2_START, EXPANSION_2_SIZE, nullptr,
+        {nullptr, nullptr, nullptr, write_expansion_2, nullptr, nullptr},
+        io_cycles, false});
+}
+
+
+/**
+ * @brief      Map the registers of a device on the I/O page
+ * Loads and stores to them reach its callbacks
+ */
+void Interconnect::map_io(const IODevice &device)
+{
+    io.map(device);
+}
+
+
+/**
+ * @brief      Read a memory control register
+ */
+uint32_t Interconnect::read_mem_control(void *device, uint32_t offset)
+{
+    Interconnect *inter = (Interconnect*) device;
+
+    return inter->mem_control[offset >> 2];
+}
+
+
+/**
+ * @brief      Write a memory control register
+ * Expansion base addresses cannot move, delay/size registers set the access
+ * timings
+ */
+void Interconnect::write_mem_control(void *device, uint32_t offset, uint32_t value)
+{
+    Interconnect *inter = (Interconnect*) device;
+
+    switch(offset) {
+    case 0:
+        if (value != EXPANSION_1_START) {
+            error("Bad expansion 1 base address 0x%08x\n", value);
+            exit(1);
+        }
+        break;
+    case 4:
+        if (value != EXPANSION_2_START) {
+            error("Bad expansion 2 base address 0x%08x\n", value);
+            exit(1);
+        }
+        break;
+    default:
+        inter->mem_control[offset >> 2] = value;
+        inter->update_timings();
+        break;
+    }
+}
+
+
+/**
+ * @brief      Point memory pages to their host memory
+ * BIOS pages are read only: stores go through address decoding to be reported
+ */
+void Interconnect::map_pages()
+{
+    for (size_t i=0; i<MEMORY_PAGE_COUNT; i++) {
+        read_pages[i] = {nullptr, nullptr};
+    }
+
+    for (uint32_t offset=0; offset<(RAM_MIRROR_SIZE); offset+=MEMORY_PAGE_SIZE) {
+        uint32_t page = (RAM_START + offset) >> MEMORY_PAGE_SHIFT;
+
+        read_pages[page] = {ram_data + offset % (RAM_SIZE), ram_cycles};
+    }
+
+    for (uint32_t offset=0; offset<(BIOS_SIZE); offset+=MEMORY_PAGE_SIZE) {
+        uint32_t page = (BIOS_START + offset) >> MEMORY_PAGE_SHIFT;
+
+        read_pages[page] = {bios->get_data() + offset, access_cycles[REGION_BIOS]};
+    }
+
+    static_assert(SCRATCHPAD_BACKING_SIZE >= MEMORY_PAGE_SIZE, "Scratchpad does not fill its page");
+
+    uint32_t page = SCRATCHPAD_START >> MEMORY_PAGE_SHIFT;
+    read_pages[page] = {scratchpad->get_data(), scratchpad_cycles};
+
+    map_write_pages();
+}
+
+
+/**
+ * @brief      Point writable pages to their host memory
+ * None while the cache is isolated so every store reaches decode_store
+ */
+void Interconnect::map_write_pages()
+{
+    for (size_t i=0; i<MEMORY_PAGE_COUNT; i++) {
+        write_pages[i] = nullptr;
+    }
+
+    if (isolated) {
+        return;
+    }
+
+    for (uint32_t offset=0; offset<(RAM_MIRROR_SIZE); offset+=MEMORY_PAGE_SIZE) {
+        uint32_t page = (RAM_START + offset) >> MEMORY_PAGE_SHIFT;
+
+        write_pages[page] = ram_data + offset % (RAM_SIZE);
+    }
+
+    write_pages[SCRATCHPAD_START >> MEMORY_PAGE_SHIFT] = scratchpad->get_data();
+}
+
+
+/**
+ * @brief      Restore the memory control registers
+ */
+void Interconnect::reset()
+{
+    for (size_t i=0; i<SYS_CONTROL_SIZE / 4; i++) {
+        mem_control[i] = MEM_CONTROL_DEFAULT[i];
+    }
+
+    update_timings();
+    set_cache_control(0);
+}
+
+
+/**
+ * @brief      Set the block cache to notify of RAM writes
+ */
+void Interconnect::set_cache(BlockCache *cache)
+{
+    this->cache = cache;
+}
+
+
+/**
+ * @brief      Set the CPU cycle counter charged for memory accesses
+ */
+void Interconnect::set_clock(uint64_t *cycles)
+{
+    this->cycles = cycles;
+}
+
+
+/**
+ * @brief      Access guest memory through the fastmem region
+ * @param      fastmem  Mapped guest memory or nullptr to use the page table
+ */
+void Interconnect::set_fastmem(Fastmem *fastmem)
+{
+    fastmem_base = fastmem ? fastmem->get_base() : nullptr;
+
+    this->fastmem = isolated ? nullptr : fastmem_base;
+}
+
+
+/**
+ * @brief      Set the instruction cache stores reach while it is isolated
+ */
+void Interconnect::set_icache(ICache *icache)
+{
+    this->icache = icache;
+
+    set_cache_control(cache_control);
+}
+
+
+/**
+ * @brief      Map the interrupt controller at IRQ_CONTROL_START
+ */
+void Interconnect::set_irq(IRQ *irq)
+{
+    map_io({"IRQ_CONTROL", IRQ_CONTROL_START, IRQ_CONTROL_SIZE, irq,
+        device_handlers<IRQ, IO_WIDTH_8 | IO_WIDTH_16 | IO_WIDTH_32>(), io_cycles, true});
+}
+
+
+/**
+ * @brief      Map the DMA controller at DMA_START
+ * Transfers complete before the store starting them returns: registers only
+ * change on stores
+ */
+void Interconnect::set_dma(DMA *dma)
+{
+    map_io({"DMA", DMA_START, DMA_SIZE, dma,
+        device_handlers<DMA, IO_WIDTH_8 | IO_WIDTH_16 | IO_WIDTH_32>(), io_cycles, true});
+}
+
+
+/**
+ * @brief      Isolate the cache from memory (SR bit 16)
+ * Done once per change of SR: RAM and scratchpad stop being mapped for
+ * stores, so the store fast paths never check the isolation themselves
+ */
+void Interconnect::set_isolated(bool isolated)
+{
+    if (this->isolated == isolated) {
+        return;
+    }
+
+    this->isolated = isolated;
+
+    fastmem = isolated ? nullptr : fastmem_base;
+    map_write_pages();
+}
+
+
+/**
+ * @brief      Store while the cache is isolated
+ * Never reaches the bus: the BIOS flushes the instruction cache this way,
+ * each store invalidates the tag of a line. Code compiled from that line is
+ * dropped as well, it has to be fetched again
+ */
+void Interconnect::isolated_store(uint32_t address)
+{
+    if (!icache) {
+        return;
+    }
+
+    uint32_t line = icache->invalidate(address);
+
+    if (cache && line < (RAM_MIRROR_SIZE)) {
+        line %= (RAM_SIZE);
+
+        for (uint32_t offset=0; offset<ICACHE_LINE_SIZE; offset+=4) {
+            cache->invalidate(line + offset);
+        }
+    }
+}
+
+
+/**
+ * @brief      Write the cache control register
+ * Only the instruction cache enable bit is emulated
+ */
+void Interconnect::set_cache_control(uint32_t value)
+{
+    cache_control = value;
+
+    if (icache) {
+        icache->set_enabled(cache_control & CACHE_CONTROL_ICACHE);
+    }
+}
+
+
+/**
+ * @brief      Compute access costs from the memory control registers
+ *
+ * Delay/size register: bits 4-7 access time, bit 8/10/11 add COM0/COM2/COM3
+ * delays, bit 12 selects a 16 bits data bus (8 bits otherwise).
+ * Wider accesses are split in sequential bus accesses.
+ */
+void Interconnect::update_timings()
+{
+    uint32_t com_delay = mem_control[SYS_CONTROL_COM_DELAY >> 2];
+    int32_t com0 = com_delay & 0xF;
+    int32_t com2 = (com_delay >> 8) & 0xF;
+    int32_t com3 = (com_delay >> 12) & 0xF;
+
+    for (size_t region=0; region<REGION_COUNT; region++) {
+        uint32_t delay = mem_control[(SYS_CONTROL_DELAY >> 2) + region];
+        int32_t access_time = (delay >> 4) & 0xF;
+        bool bus_16 = delay & (1 << 12);
+
+        int32_t first = 0;
+        int32_t sequential = 0;
+        int32_t minimum = 0;
+
+        if (delay & (1 << 8)) {
+            first += com0 - 1;
+            sequential += com0 - 1;
+        }
+
+        if (delay & (1 << 10)) {
+            first += com2;
+            sequential += com2;
+        }
+
+        if (delay & (1 << 11)) {
+            minimum = com3;
+        }
+
+        if (first < 6) {
+            first++;
+        }
+
+        first += access_time + 2;
+        sequential += access_time + 2;
+
+        first = std::max(first, minimum + 6);
+        sequential = std::max(sequential, minimum + 2);
+
+        int32_t byte = first;
+        int32_t half = bus_16 ? first : first + sequential;
+        int32_t word = bus_16 ? first + sequential : first + 3 * sequential;
+
+        // The instruction itself already accounts for one cycle
+        access_cycles[region][0] = std::max(byte - 1, 0);
+        access_cycles[region][1] = std::max(half - 1, 0);
+        access_cycles[region][2] = std::max(word - 1, 0);
+    }
+}
+
+
+/**
+ * @brief      Read cost of a region
+ * @param[in]  size    Access size in bytes (1, 2 or 4)
+ */
+uint32_t Interconnect::get_access_cycles(MemoryRegion region, size_t size)
+{
+    return access_cycles[region][size >> 1];
+}
+
+
+/**
+ * @brief      Cost of an instruction cache line fill
+ * RAM sends the words after the first in a burst, other memory (BIOS) is
+ * read word by word
+ */
+uint32_t Interconnect::get_line_fill_cycles(uint32_t address)
+{
+    uint32_t first = get_fetch_cycles(address);
+
+    if (mask_region(address) < (RAM_MIRROR_SIZE)) {
+        return first + (ICACHE_LINE_WORDS - 1) * RAM_BURST_CYCLES;
+    }
+
+    return first * ICACHE_LINE_WORDS;
+}
+
+
+/**
+ * @brief      Tells if a 32 bits load at the address is handled
+ */
 bool Interconnect::canLoad32(uint32_t address)
 {
     address = mask_region(address);
@@ -43,35 +486,39 @@ bool Interconnect::canLoad32(uint32_t address)
         return false;
     }
 
-    // Is it mapped to RAM ?
-    if (in_range(address, RAM_START, RAM_SIZE)) {
+    if (in_range(address, RAM_START, RAM_SIZE) ||
+        in_range(address, SCRATCHPAD_START, SCRATCHPAD_SIZE) ||
+        in_range(address, BIOS_START, BIOS_SIZE) ||
+        in_range(address, CACHE_CONTROL_START, CACHE_CONTROL_SIZE))
+    {
         return true;
     }
 
-    // Is it mapped to BIOS ?
-    else if (in_range(address, BIOS_START, BIOS_SIZE)) {
-        return true;
-    }
+    const IODevice *device = io.find(address);
 
-    // Is it mapped to SPU ?
-    else if (in_range(address, SPU_START, SPU_SIZE)) {
-        return true;
-    }
+    return device && device->handlers.read32;
+}
 
-    // Is it mapped to GPU ?
-    else if (in_range(address, GPU_START, GPU_SIZE)) {
-        return true;
-    }
 
-    // Is it mapped to DMA ?
-    else if (in_range(address, DMA_START, DMA_SIZE)) {
-        return true;
-    }
+/**
+ * @brief      Tells if the value at the address only changes on stores or
+ * scheduled device events
+ * Free running counters (timers) are not stable: polling them is not a wait
+ * loop that can be skipped
+ */
+bool Interconnect::stable(uint32_t address)
+{
+    address = mask_region(address);
 
-    // IRQ_CONTROL register
-    else if (in_range(address, IRQ_CONTROL_START, IRQ_CONTROL_SIZE)) {
+    if (in_range(address, RAM_START, RAM_MIRROR_SIZE) ||
+        in_range(address, SCRATCHPAD_START, SCRATCHPAD_SIZE) ||
+        in_range(address, BIOS_START, BIOS_SIZE) ||
+        in_range(address, CACHE_CONTROL_START, CACHE_CONTROL_SIZE))
+    {
         return true;
     }
 
-    return false;
+    const IODevice *device = io.find(address);
+
+    return device && device->stable;
 }
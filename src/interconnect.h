@@ -2,11 +2,17 @@
 #define INTERCONNECT_H
 
 #include <cstdint>
+#include <cstring>
 
 #include "log.h"
 #include "spu.h"
 #include "bios.h"
 #include "ram.h"
+#include "scratchpad.h"
+#include "mmio.h"
+#include "block.h"
+#include "icache.h"
+#include "fastmem.h"
 #include "common.h"
 
 #define RAM_START               0x00000000
@@ -15,6 +21,8 @@
 
 #define SYS_CONTROL_START       0x1F801000
 #define SYS_CONTROL_SIZE        36
+#define SYS_CONTROL_DELAY       0x08    // First delay/size register
+#define SYS_CONTROL_COM_DELAY   0x20
 
 #define RAM_SIZE_START          0x1F801060
 #define RAM_SIZE_SIZE           4
@@ -25,6 +33,8 @@
 // KSEG2
 #define CACHE_CONTROL_START     0xFFFE0130
 #define CACHE_CONTROL_SIZE      4
+#define CACHE_CONTROL_ICACHE    0x00000800  // Instruction cache enabled
+#define CACHE_CONTROL_BIOS      0x0001E988  // Set by the BIOS on boot
 
 #define EXPANSION_1_START       0x1F000000
 #define EXPANSION_1_SIZE        8192 * 1024
@@ -44,14 +54,61 @@
 #define EXPANSION_2_START       0x1F802000
 #define EXPANSION_2_SIZE        66
 
+// Page table over the 512MB physical address space
+#define MEMORY_PAGE_SHIFT       12      // 4KB pages (scratchpad and I/O apart)
+#define MEMORY_PAGE_SIZE        (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_MASK        (MEMORY_PAGE_SIZE - 1)
+#define MEMORY_PAGE_COUNT       (0x20000000 >> MEMORY_PAGE_SHIFT)
+
+// RAM is mirrored 4 times over the first 8MB
+#define RAM_MIRROR_SIZE         8 * 1024 * 1024
+
+// Access costs in CPU cycles on top of the instruction itself
+#define RAM_READ_CYCLES         5
+#define RAM_BURST_CYCLES        1       // Each word after the first of a line fill
+#define IO_READ_CYCLES          2
+
+
+/**
+ * @brief      Regions timed by a memory control delay/size register
+ * Listed in the order of their registers from SYS_CONTROL_DELAY
+ */
+enum MemoryRegion {
+    REGION_EXPANSION_1,
+    REGION_EXPANSION_3,
+    REGION_BIOS,
+    REGION_SPU,
+    REGION_CDROM,
+    REGION_EXPANSION_2,
+    REGION_COUNT
+};
+
 class SPU;
 class BIOS;
 class RAM;
+class Scratchpad;
+class IRQ;
+class DMA;
+class BlockCache;
+class ICache;
+class Fastmem;
 
 
+extern const uint32_t REGION_MASK[8];
+
 uint32_t mask_region(uint32_t address);
 
 
+/**
+ * @brief      Page of the physical address space
+ * Memory pages are accessed directly, others go through address decoding
+ */
+struct MemoryPage {
+    uint8_t *memory;            // Host memory or nullptr for I/O and unmapped
+    const uint32_t *cycles;     // Read costs for 8, 16 and 32 bits accesses
+};
+
+
 /**
  * @brief      Handles virtual memory mapping
  * Dispatch read/write request to correct modules and/or memory
@@ -60,13 +117,114 @@ class Interconnect {
     SPU *spu;
     BIOS *bios;
     RAM *ram;
+    Scratchpad *scratchpad;
+
+    // Registers of the devices on the I/O page
+    IOMap io;
+
+    // Pre-decoded code to drop when RAM is written
+    BlockCache *cache = nullptr;
+
+    // Instruction cache receiving the stores while it is isolated
+    ICache *icache = nullptr;
+    bool isolated = false;
+
+    // CPU cycle counter charged with access costs
+    uint64_t *cycles = nullptr;
+
+    // Memory control registers (SYS_CONTROL_START)
+    uint32_t mem_control[SYS_CONTROL_SIZE / 4];
+
+    uint32_t cache_control;
+
+    // Read cost of each region for 8, 16 and 32 bits accesses
+    uint32_t access_cycles[REGION_COUNT][3];
+    const uint32_t ram_cycles[3] = {RAM_READ_CYCLES, RAM_READ_CYCLES, RAM_READ_CYCLES};
+    const uint32_t scratchpad_cycles[3] = {0, 0, 0};
+    const uint32_t io_cycles[3] = {IO_READ_CYCLES, IO_READ_CYCLES, IO_READ_CYCLES};
+
+    // Readable pages and writable pages (RAM and scratchpad)
+    MemoryPage read_pages[MEMORY_PAGE_COUNT];
+    uint8_t *write_pages[MEMORY_PAGE_COUNT];
+    uint8_t *ram_data;
+
+    // Guest physical memory mapped in host memory, replaces the page table
+    // (unused while the cache is isolated)
+    uint8_t *fastmem = nullptr;
+    uint8_t *fastmem_base = nullptr;
+
+    friend class Recompiler;
+
+    void map_pages();
+    void map_write_pages();
+    void isolated_store(uint32_t address);
+    void set_cache_control(uint32_t value);
+    void update_timings();
+    void map_registers();
+
+    static uint32_t read_mem_control(void *device, uint32_t offset);
+    static void write_mem_control(void *device, uint32_t offset, uint32_t value);
+
+    /**
+     * @brief      Charge the CPU for an access
+     * Stores are absorbed by the CPU write buffer, only loads are charged
+     */
+    void charge(uint32_t cost)
+    {
+        if (cycles) {
+            *cycles += cost;
+        }
+    }
+
+    template <typename T>
+    void charge(MemoryRegion region)
+    {
+        charge(access_cycles[region][sizeof(T) >> 1]);
+    }
+
+    /**
+     * @brief      Tells if the address is in the scratchpad page, past the
+     * scratchpad: mapped to its backing, reported by address decoding
+     */
+    static bool scratchpad_padding(uint32_t address)
+    {
+        return address - SCRATCHPAD_PADDING_START < SCRATCHPAD_PADDING_SIZE;
+    }
 
 public:
     ~Interconnect();
 
-    bool init(SPU *spu, BIOS *bios, RAM *ram);
+    bool init(SPU *spu, BIOS *bios, RAM *ram, Scratchpad *scratchpad);
+    void reset();
+    void set_cache(BlockCache *cache);
+    void set_icache(ICache *icache);
+    void set_irq(IRQ *irq);
+    void set_dma(DMA *dma);
+    void map_io(const IODevice &device);
+    void set_isolated(bool isolated);
+    void set_clock(uint64_t *cycles);
+    void set_fastmem(Fastmem *fastmem);
+
+    uint32_t get_access_cycles(MemoryRegion region, size_t size);
+    uint32_t get_line_fill_cycles(uint32_t address);
+
+    /**
+     * @brief      Cost of an instruction fetch bypassing the instruction
+     * cache: a 32 bits read of the memory holding the address
+     */
+    uint32_t get_fetch_cycles(uint32_t address)
+    {
+        uint32_t page = mask_region(address) >> MEMORY_PAGE_SHIFT;
+
+        if (page < MEMORY_PAGE_COUNT && read_pages[page].memory) {
+            return read_pages[page].cycles[sizeof(uint32_t) >> 1];
+        }
+
+        return IO_READ_CYCLES;
+    }
 
     bool canLoad32(uint32_t address);
+    bool stable(uint32_t address);
 
     template <typename T>
     void store(uint32_t address, T value)
@@ -80,89 +238,125 @@ public:
             exit(1);
         }
 
-        // Is it mapped to RAM ?
-        if (in_range(address, RAM_START, RAM_SIZE)) {
-            ram->store<T>(address - RAM_START, value);
+        if (scratchpad_padding(address)) {
+            decode_store<T>(address, value);
+            return;
         }
 
-        // Is it mapped to BIOS ?
-        else if (in_range(address, BIOS_START, BIOS_SIZE)) {
-            error("Unhandled store%lld to BIOS 0x%08x (read only!)\n", sizeof(T), address);
-            exit(1);
-        }
+        if (fastmem && address < FASTMEM_SIZE) {
+            fastmem_store<T>(fastmem, address, value);
 
-        // Is it mapped to EXPANSION 1 or 2 ?
-        else if (in_range(address, SYS_CONTROL_START, SYS_CONTROL_SIZE)) {
-            uint32_t offset = address - SYS_CONTROL_START;
-
-            switch(offset) {
-            case 0:
-                if (value != EXPANSION_1_START) {
-                    error("Bad expansion 1 base address 0x%08x\n", value);
-                    exit(1);
-                }
-                break;
-            case 4:
-                if (value != EXPANSION_2_START) {
-                    error("Bad expansion 2 base address 0x%08x\n", value);
-                    exit(1);
-                }
-                break;
-            default:
-                error("Unhandled store32 to MEM_CONTROL register: 0x%08x: 0x%08x\n", offset, value);
-                //exit(1);
-                break;
+            if (cache && address < (RAM_MIRROR_SIZE)) {
+                cache->invalidate(address & ((RAM_SIZE) - 1));
             }
+
+            return;
         }
 
-        // RAM_SIZE for RAM configuration
-        else if (in_range(address, RAM_SIZE_START, RAM_SIZE_SIZE)) {
-            uint32_t offset = address - RAM_SIZE_START;
-            error("Unhandled store%lld to RAM_SIZE register: 0x%08x: 0x%08x\n", sizeof(T), offset, value);
+        uint32_t page = address >> MEMORY_PAGE_SHIFT;
+
+        if (page < MEMORY_PAGE_COUNT && write_pages[page]) {
+            uint8_t *memory = write_pages[page] + (address & MEMORY_PAGE_MASK);
+
+            value = guest_endian(value);
+            memcpy(memory, &value, sizeof(T));
+
+            // Code only runs from RAM
+            if (cache && address < (RAM_MIRROR_SIZE)) {
+                cache->invalidate(address & ((RAM_SIZE) - 1));
+            }
+
+            return;
         }
 
-        // Is it mapped to SPU ?
-        else if (in_range(address, SPU_START, SPU_SIZE)) {
-            //uint32_t offset = address - SPU_START;
-            //error("Unhandled store%lld to SPU register: 0x%08x: 0x%04x\n", sizeof(T), offset, value);
+        decode_store<T>(address, value);
+    }
+
+    template <typename T>
+    T load(uint32_t address)
+    {
+        address = mask_region(address);
+
+        if (scratchpad_padding(address)) {
+            return decode_load<T>(address);
         }
 
-        // CACHE_CONTROL register
-        else if (in_range(address, CACHE_CONTROL_START, CACHE_CONTROL_SIZE)) {
-            uint32_t offset = address - CACHE_CONTROL_START;
-            error("Unhandled store%lld to CACHE_CONTROL register: 0x%08x: 0x%08x\n", sizeof(T), offset, value);
+        if (fastmem && address < FASTMEM_SIZE) {
+            T value = fastmem_load<T>(fastmem, address);
+
+            // RAM, scratchpad (free) and BIOS are mapped, trapped accesses
+            // were charged
+            if (address < (RAM_MIRROR_SIZE)) {
+                charge(RAM_READ_CYCLES);
+            } else if (address >= BIOS_START) {
+                charge<T>(REGION_BIOS);
+            }
+
+            return value;
         }
 
-        // IRQ_CONTROL register
-        else if (in_range(address, IRQ_CONTROL_START, IRQ_CONTROL_SIZE)) {
-            uint32_t offset = address - IRQ_CONTROL_START;
-            error("Unhandled store%lld to IRQ_CONTROL register: 0x%08x: 0x%04x\n", sizeof(T), offset, value);
+        uint32_t page = address >> MEMORY_PAGE_SHIFT;
+
+        if (page < MEMORY_PAGE_COUNT && read_pages[page].memory) {
+            T value;
+            memcpy(&value, read_pages[page].memory + (address & MEMORY_PAGE_MASK), sizeof(T));
+            value = guest_endian(value);
+
+            charge(read_pages[page].cycles[sizeof(T) >> 1]);
+
+            return value;
         }
 
-        // Is it mapped to DMA ?
-        else if (in_range(address, DMA_START, DMA_SIZE)) {
-            uint32_t offset = address - DMA_START;
-            error("Unhandled store%lld to DMA register: 0x%08x: 0x%08x\n", sizeof(T), offset, value);
+        return decode_load<T>(address);
+    }
+
+    /**
+     * @brief      Store to a physical address, found by address decoding
+     * Reference path, handles I/O registers
+     */
+    template <typename T>
+    void decode_store(uint32_t address, T value)
+    {
+        // Cache isolated: RAM and scratchpad pages are unmapped to get here
+        if (isolated) {
+            isolated_store(address);
         }
 
-        // Is it mapped to TIMERS ?
-        else if (in_range(address, TIMERS_START, TIMERS_SIZE)) {
-            uint32_t offset = address - TIMERS_START;
+        // Is it mapped to RAM ?
+        else if (in_range(address, RAM_START, RAM_SIZE)) {
+            ram->store<T>(address - RAM_START, value);
 
-            error("Unhandled store%lld to TIMERS register: 0x%08x: 0x%04x\n", sizeof(T), offset, value);
+            if (cache) {
+                cache->invalidate(address - RAM_START);
+            }
         }
 
-        // Is it mapped to GPU ?
-        else if (in_range(address, GPU_START, GPU_SIZE)) {
-            uint32_t offset = address - GPU_START;
-            error("Unhandled store%lld to GPU register: 0x%08x: 0x%08x\n", sizeof(T), offset, value);
+        // Is it mapped to the scratchpad ?
+        else if (in_range(address, SCRATCHPAD_START, SCRATCHPAD_SIZE)) {
+            scratchpad->store<T>(address - SCRATCHPAD_START, value);
         }
 
-        // Is it mapped to EXPANSION 2 ?
-        else if (in_range(address, EXPANSION_2_START, EXPANSION_2_SIZE)) {
-            uint32_t offset = address - EXPANSION_2_START;
+        // Is it mapped to BIOS ?
+        else if (in_range(address, BIOS_START, BIOS_SIZE)) {
+            error("Unhandled store%lld to BIOS 0x%08x (read only!)\n", sizeof(T), address);
+            exit(1);
+        }
 
-            error("Unhandled store%lld to EXPANSION 2 register: 0x%08x: 0x%02x\n", sizeof(T), offset, value);
+        // Is it mapped to a device register ?
+        else if (in_range(address, IO_START, IO_SIZE)) {
+            const IODevice *device = io.find(address);
+            io_write<T> write = device ? device->handlers.writer<T>() : nullptr;
+
+            if (write) {
+                write(device->device, address - device->start, value);
+            } else {
+                io.unhandled_store(device, address, value, sizeof(T));
+            }
+        }
+
+        // CACHE_CONTROL register
+        else if (in_range(address, CACHE_CONTROL_START, CACHE_CONTROL_SIZE)) {
+            set_cache_control(value);
         }
 
         else {
@@ -171,58 +365,94 @@ public:
         }
     }
 
+    /**
+     * @brief      Load without charging the CPU
+     * Used for instruction fetches (charged by the CPU with
+     * get_fetch_cycles) and by the debugger
+     */
     template <typename T>
-    T load(uint32_t address)
+    T peek(uint32_t address)
     {
         address = mask_region(address);
 
+        if (scratchpad_padding(address)) {
+            return decode_load<T>(address);
+        }
+
+        if (fastmem && address < FASTMEM_SIZE) {
+            uint64_t *clock = cycles;
+
+            cycles = nullptr;
+            T value = fastmem_load<T>(fastmem, address);
+            cycles = clock;
+
+            return value;
+        }
+
+        uint32_t page = address >> MEMORY_PAGE_SHIFT;
+
+        if (page < MEMORY_PAGE_COUNT && read_pages[page].memory) {
+            T value;
+            memcpy(&value, read_pages[page].memory + (address & MEMORY_PAGE_MASK), sizeof(T));
+
+            return guest_endian(value);
+        }
+
+        uint64_t *clock = cycles;
+
+        cycles = nullptr;
+        T value = decode_load<T>(address);
+        cycles = clock;
+
+        return value;
+    }
+
+    /**
+     * @brief      Load from a physical address, found by address decoding
+     * Reference path, handles I/O registers
+     */
+    template <typename T>
+    T decode_load(uint32_t address)
+    {
         // Is it mapped to RAM ?
         if (in_range(address, RAM_START, RAM_SIZE)) {
+            charge(RAM_READ_CYCLES);
             return ram->load<T>(address - RAM_START);
         }
 
+        // Is it mapped to the scratchpad ?
+        else if (in_range(address, SCRATCHPAD_START, SCRATCHPAD_SIZE)) {
+            return scratchpad->load<T>(address - SCRATCHPAD_START);
+        }
+
         // Is it mapped to BIOS ?
         else if (in_range(address, BIOS_START, BIOS_SIZE)) {
+            charge<T>(REGION_BIOS);
             return bios->load<T>(address - BIOS_START);
         }
 
-        // Is it mapped to SPU ?
-        else if (in_range(address, SPU_START, SPU_SIZE)) {
-            //uint32_t offset = address - SPU_START;
-            //error("Unhandled load%lld to SPU register: 0x%08x\n", sizeof(T), offset);
-            return 0;
+        // Is it mapped to a device register ?
+        else if (in_range(address, IO_START, IO_SIZE)) {
+            const IODevice *device = io.find(address);
+            io_read<T> read = device ? device->handlers.reader<T>() : nullptr;
+
+            if (!read) {
+                return io.unhandled_load(device, address, sizeof(T));
+            }
+
+            charge(device->cycles[sizeof(T) >> 1]);
+            return read(device->device, address - device->start);
         }
 
         // Is it mapped to EXPANSION 1 ?
         else if (in_range(address, EXPANSION_1_START, EXPANSION_1_SIZE)) {
+            charge<T>(REGION_EXPANSION_1);
             return (T) 0xFFFFFFFF;
         }
 
-        // IRQ_CONTROL register
-        else if (in_range(address, IRQ_CONTROL_START, IRQ_CONTROL_SIZE)) {
-            uint32_t offset = address - IRQ_CONTROL_START;
-            error("Unhandled load%lld to IRQ_CONTROL register: 0x%08x\n", sizeof(T), offset);
-            return 0;
-        }
-
-        // Is it mapped to DMA ?
-        else if (in_range(address, DMA_START, DMA_SIZE)) {
-            uint32_t offset = address - DMA_START;
-            error("Unhandled load%lld to DMA register: 0x%08x\n", sizeof(T), offset);
-            return 0;
-        }
-
-        // Is it mapped to GPU ?
-        else if (in_range(address, GPU_START, GPU_SIZE)) {
-            uint32_t offset = address - GPU_START;
-
-            switch(offset) {
-            // Let the CPU knows GPU is ready
-            case 4: return (T) 0x10000000;
-            default:
-                error("Unhandled load%lld to GPU register: 0x%08x\n", sizeof(T), offset);
-                return 0;
-            }
+        // CACHE_CONTROL register
+        else if (in_range(address, CACHE_CONTROL_START, CACHE_CONTROL_SIZE)) {
+            return (T) cache_control;
         }
 
         else {
@@ -0,0 +1,92 @@
+#include "irq.h"
+
+#include "cpu.h"
+
+
+/**
+ * @brief      Initialize the interrupt controller
+ * @param      cpu   CPU receiving the interrupt
+ * @return     true in case of success, false otherwise
+ */
+bool IRQ::init(CPU *cpu)
+{
+    this->cpu = cpu;
+
+    reset();
+
+    return true;
+}
+
+
+/**
+ * @brief      No line raised, all of them masked
+ */
+void IRQ::reset()
+{
+    status = 0;
+    mask = 0;
+
+    update();
+}
+
+
+/**
+ * @brief      Raise the interrupt line of a device
+ * Lines stay raised in I_STAT until acknowledged
+ */
+void IRQ::raise(IRQLine line)
+{
+    status |= 1 << line;
+
+    update();
+}
+
+
+/**
+ * @brief      Tells if a raised line is not masked
+ */
+bool IRQ::active()
+{
+    return (status & mask) != 0;
+}
+
+
+/**
+ * @brief      Forward the interrupt to the CPU
+ */
+void IRQ::update()
+{
+    if (cpu) {
+        cpu->set_irq(active());
+    }
+}
+
+
+uint32_t IRQ::read(uint32_t offset)
+{
+    switch(offset) {
+    case IRQ_STATUS: return status;
+    case IRQ_MASK: return mask;
+    default: return 0;
+    }
+}
+
+
+/**
+ * @param[in]  written  Bits of the register written by the access
+ */
+void IRQ::write(uint32_t offset, uint32_t value, uint32_t written)
+{
+    switch(offset) {
+    case IRQ_STATUS:
+        status &= value | ~written;
+        break;
+    case IRQ_MASK:
+        mask = ((mask & ~written) | (value & written)) & IRQ_LINES_MASK;
+        break;
+    default:
+        return;
+    }
+
+    update();
+}
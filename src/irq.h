@@ -0,0 +1,79 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <cstdint>
+
+// Registers, offsets in IRQ_CONTROL
+#define IRQ_STATUS          0       // I_STAT: raised lines, writing 0 acknowledges
+#define IRQ_MASK            4       // I_MASK: lines reaching the CPU
+#define IRQ_LINES_MASK      0x7FF
+
+class CPU;
+
+
+/**
+ * @brief      Interrupt lines of the devices
+ */
+enum IRQLine {
+    IRQ_VBLANK,
+    IRQ_GPU,
+    IRQ_CDROM,
+    IRQ_DMA,
+    IRQ_TIMER0,
+    IRQ_TIMER1,
+    IRQ_TIMER2,
+    IRQ_CONTROLLER,
+    IRQ_SIO,
+    IRQ_SPU,
+    IRQ_LIGHTPEN,
+    IRQ_COUNT
+};
+
+
+/**
+ * @brief      Interrupt controller
+ * Drives the CPU hardware interrupt (CAUSE bit 10) with I_STAT & I_MASK,
+ * only when one of them changes
+ */
+class IRQ {
+    CPU *cpu = nullptr;
+
+    uint32_t status;
+    uint32_t mask;
+
+    void update();
+    uint32_t read(uint32_t offset);
+    void write(uint32_t offset, uint32_t value, uint32_t written);
+
+public:
+    bool init(CPU *cpu);
+    void reset();
+
+    void raise(IRQLine line);
+    bool active();
+
+    /**
+     * @brief      Read a register, 8 and 16 bits accesses read part of it
+     */
+    template <typename T>
+    T load(uint32_t offset)
+    {
+        uint32_t shift = (offset & 3) * 8;
+
+        return (T) (read(offset & ~3) >> shift);
+    }
+
+    /**
+     * @brief      Write a register, bits outside of the access are kept
+     */
+    template <typename T>
+    void store(uint32_t offset, T value)
+    {
+        uint32_t shift = (offset & 3) * 8;
+        uint32_t written = (uint32_t) (T) ~0 << shift;
+
+        write(offset & ~3, (uint32_t) value << shift, written);
+    }
+};
+
+#endif /* IRQ_H */
@@ -0,0 +1,972 @@
+#include "kernel.h"
+
+#include <fstream>
+#include <cstring>
+#include <cctype>
+
+#include "log.h"
+#include "common.h"
+#include "cpu.h"
+#include "ram.h"
+#include "interconnect.h"
+#include "irq.h"
+
+#define REG_V0      2
+#define REG_A0      4
+#define REG_T1      9
+#define REG_GP      28
+#define REG_SP      29
+#define REG_FP      30
+#define REG_RA      31
+
+#define SR_IEP      0x00000004  // Interrupt enable before the exception
+#define SR_IM2      0x00000400  // Interrupt mask, hardware line 0
+
+#define NOP         0x00000000
+#define JR_RA       0x03E00008
+
+#define COP2_COMMAND_MASK   0xFE000000
+#define COP2_COMMAND        0x4A000000  // GTE command
+
+#define SYSCALL_ENTER_CRITICAL_SECTION  1
+#define SYSCALL_EXIT_CRITICAL_SECTION   2
+#define CAUSE_INTERRUPT                 0x0
+
+static_assert(KERNEL_REG_COUNT == REG_COUNT, "Interrupted registers are not all saved");
+
+#define FD_STDOUT   1
+#define FAILURE     0xFFFFFFFF
+
+
+/**
+ * @brief      Little endian word of the EXE header
+ */
+static uint32_t header(const std::vector<uint8_t> &exe, size_t offset)
+{
+    return exe[offset] | (exe[offset + 1] << 8) | (exe[offset + 2] << 16) | (exe[offset + 3] << 24);
+}
+
+
+/**
+ * @brief      Append a single printf conversion to the output
+ */
+template<typename T>
+static void append_format(std::string &output, const std::string &spec, T value)
+{
+    int length = snprintf(nullptr, 0, spec.c_str(), value);
+    if (length <= 0) {
+        return;
+    }
+
+    std::vector<char> buffer(length + 1);
+    snprintf(buffer.data(), buffer.size(), spec.c_str(), value);
+
+    output.append(buffer.data(), length);
+}
+
+
+/**
+ * @brief      Initialize the kernel
+ * @return     true in case of success, false otherwise
+ */
+bool Kernel::init(CPU *cpu, Interconnect *inter)
+{
+    this->cpu = cpu;
+    this->inter = inter;
+
+    return true;
+}
+
+
+/**
+ * @brief      Install the kernel in RAM and load the executable
+ * The CPU has to be reset first, it starts at the executable entry point
+ */
+void Kernel::reset()
+{
+    for (size_t i=0; i<KERNEL_EVENT_COUNT; i++) {
+        events[i].status = EVENT_FREE;
+    }
+
+    for (size_t i=0; i<KERNEL_PRIORITY_COUNT; i++) {
+        int_handlers[i] = 0;
+    }
+
+    interrupt.active = false;
+
+    heap_next = 0;
+    heap_end = 0;
+    seed = 0;
+
+    // Cache set up as the BIOS leaves it
+    inter->store<uint32_t>(CACHE_CONTROL_START, CACHE_CONTROL_BIOS);
+
+    install();
+
+    if (!exe.empty()) {
+        load();
+    }
+}
+
+
+/**
+ * @brief      Read a PS-X EXE file
+ * @return     true in case of success, false otherwise
+ */
+bool Kernel::load_exe(std::string path)
+{
+    std::ifstream file (path, std::fstream::binary);
+    if (!file) {
+        error("Unable to open executable %s\n", path.c_str());
+        return false;
+    }
+
+    std::vector<uint8_t> data(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>()
+    );
+
+    return set_exe(data);
+}
+
+
+/**
+ * @brief      Use the given PS-X EXE image, loaded on reset
+ * @return     true if the image is valid, false otherwise
+ */
+bool Kernel::set_exe(const std::vector<uint8_t> &data)
+{
+    if (data.size() < EXE_HEADER_SIZE || memcmp(data.data(), EXE_MAGIC, strlen(EXE_MAGIC)) != 0) {
+        error("Not a PS-X EXE file\n");
+        return false;
+    }
+
+    uint32_t address = mask_region(header(data, EXE_TEXT_ADDRESS));
+    uint32_t size = header(data, EXE_TEXT_SIZE);
+
+    if (size > data.size() - EXE_HEADER_SIZE || size > RAM_SIZE || address + size > RAM_SIZE) {
+        error("PS-X EXE does not fit in RAM\n");
+        return false;
+    }
+
+    exe = data;
+
+    return true;
+}
+
+
+/**
+ * @brief      Execute the kernel function of the given entry point
+ * Called by the guest through the kernel call at the entry point, the
+ * function number is in $t1 and arguments in $a0-$a3 then on the stack
+ */
+void Kernel::call(uint32_t vector)
+{
+    uint8_t function = cpu->get_reg(REG_T1);
+
+    switch(vector) {
+    case KERNEL_EXCEPTION_VECTOR: exception(); break;
+    case KERNEL_A0: call_a0(function); break;
+    case KERNEL_B0: call_b0(function); break;
+    case KERNEL_C0: call_c0(function); break;
+    case KERNEL_INT_RETURN: handler_return(); break;
+    default:
+        error("Unhandled kernel entry point 0x%02x\n", vector);
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief      Expand a printf format string read in guest memory
+ * @param[in]  address  Format string
+ * @param[in]  first    Index of the argument of the first conversion
+ */
+std::string Kernel::format(uint32_t address, size_t first)
+{
+    std::string input = read_string(address);
+    std::string output;
+    size_t index = first;
+
+    for (size_t i=0; i<input.size(); i++) {
+        if (input[i] != '%') {
+            output += input[i];
+            continue;
+        }
+
+        // Flags, width and precision are passed to the host printf
+        std::string spec = "%";
+        for (i++; i < input.size() && strchr("-+ #0", input[i]); i++) {
+            spec += input[i];
+        }
+
+        for (; i < input.size() && (isdigit(input[i]) || input[i] == '.' || input[i] == '*'); i++) {
+            if (input[i] == '*') {
+                spec += std::to_string((int32_t) argument(index++));
+            } else {
+                spec += input[i];
+            }
+        }
+
+        // Every integer is 32 bits
+        while (i < input.size() && strchr("hlL", input[i])) {
+            i++;
+        }
+
+        if (i >= input.size()) {
+            break;
+        }
+
+        char conversion = input[i];
+        switch(conversion) {
+        case 'd': case 'i':
+            append_format(output, spec + "d", (int32_t) argument(index++));
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            append_format(output, spec + conversion, argument(index++));
+            break;
+        case 'p':
+            append_format(output, spec + "x", argument(index++));
+            break;
+        case 'c':
+            append_format(output, spec + "c", (int) (uint8_t) argument(index++));
+            break;
+        case 's':
+            append_format(output, spec + "s", read_string(argument(index++)).c_str());
+            break;
+        case '%':
+            output += '%';
+            break;
+        default:
+            output += spec + conversion;
+            break;
+        }
+    }
+
+    return output;
+}
+
+
+/**
+ * @brief      Write the entry points in low RAM
+ */
+void Kernel::install()
+{
+    const uint32_t stubs[] = {KERNEL_A0, KERNEL_B0, KERNEL_C0};
+
+    for (uint32_t vector : stubs) {
+        inter->store<uint32_t>(RAM_START | vector, KERNEL_CALL(vector));
+        inter->store<uint32_t>(RAM_START | (vector + 4), JR_RA);
+        inter->store<uint32_t>(RAM_START | (vector + 8), NOP);
+    }
+
+    // Exception handler and interrupt handlers return by themselves
+    inter->store<uint32_t>(RAM_START | KERNEL_EXCEPTION_VECTOR, KERNEL_CALL(KERNEL_EXCEPTION_VECTOR));
+    inter->store<uint32_t>(RAM_START | (KERNEL_EXCEPTION_VECTOR + 4), NOP);
+    inter->store<uint32_t>(RAM_START | KERNEL_INT_RETURN, KERNEL_CALL(KERNEL_INT_RETURN));
+    inter->store<uint32_t>(RAM_START | (KERNEL_INT_RETURN + 4), NOP);
+
+    // j KERNEL_HALT
+    inter->store<uint32_t>(RAM_START | KERNEL_HALT, 0x08000000 | (KERNEL_HALT >> 2));
+    inter->store<uint32_t>(RAM_START | (KERNEL_HALT + 4), NOP);
+}
+
+
+/**
+ * @brief      Copy the executable in RAM and jump to its entry point
+ */
+void Kernel::load()
+{
+    uint32_t address = header(exe, EXE_TEXT_ADDRESS);
+    uint32_t size = header(exe, EXE_TEXT_SIZE);
+
+    for (uint32_t i=0; i<size; i++) {
+        inter->store<uint8_t>(address + i, exe[EXE_HEADER_SIZE + i]);
+    }
+
+    uint32_t bss = header(exe, EXE_BSS_ADDRESS);
+    uint32_t bss_size = header(exe, EXE_BSS_SIZE);
+    for (uint32_t i=0; i<bss_size; i++) {
+        inter->store<uint8_t>(bss + i, 0);
+    }
+
+    uint32_t stack = KERNEL_STACK;
+    if (header(exe, EXE_STACK_ADDRESS) != 0) {
+        stack = header(exe, EXE_STACK_ADDRESS) + header(exe, EXE_STACK_OFFSET);
+    }
+
+    cpu->force_set_reg(REG_GP, header(exe, EXE_GP));
+    cpu->force_set_reg(REG_SP, stack);
+    cpu->force_set_reg(REG_FP, stack);
+    cpu->force_set_PC(header(exe, EXE_PC));
+
+    // Kernel mode, exceptions through KERNEL_EXCEPTION_VECTOR
+    cpu->set_SR(0);
+}
+
+
+/**
+ * @brief      Argument of the kernel function, the first four are in $a0-$a3
+ */
+uint32_t Kernel::argument(size_t index)
+{
+    if (index < 4) {
+        return cpu->get_reg(REG_A0 + index);
+    }
+
+    return inter->peek<uint32_t>(cpu->get_reg(REG_SP) + index * 4);
+}
+
+
+void Kernel::ret(uint32_t value)
+{
+    cpu->set_reg(REG_V0, value);
+}
+
+
+/**
+ * @brief      Continue execution at the given address instead of $ra
+ */
+void Kernel::jump(uint32_t address)
+{
+    cpu->PC = address;
+    cpu->nextPC = address + INSTRUCTION_LENGTH;
+    cpu->isBranch = false;
+}
+
+
+uint8_t Kernel::read8(uint32_t address)
+{
+    return inter->peek<uint8_t>(address);
+}
+
+
+void Kernel::write8(uint32_t address, uint8_t value)
+{
+    inter->store<uint8_t>(address, value);
+}
+
+
+std::string Kernel::read_string(uint32_t address)
+{
+    std::string value;
+
+    for (size_t i=0; i<KERNEL_STRING_MAX; i++) {
+        char c = read8(address + i);
+        if (c == '\0') {
+            break;
+        }
+
+        value += c;
+    }
+
+    return value;
+}
+
+
+void Kernel::call_a0(uint8_t function)
+{
+    uint32_t a0 = argument(0);
+    uint32_t a1 = argument(1);
+    uint32_t a2 = argument(2);
+
+    switch(function) {
+    case 0x00: ret(FAILURE); break;                                 // FileOpen
+    case 0x01: ret(FAILURE); break;                                 // FileSeek
+    case 0x02: ret(FAILURE); break;                                 // FileRead
+    case 0x03: ret(file_write(a0, a1, a2)); break;                  // FileWrite
+    case 0x04: ret(a0); break;                                      // FileClose
+    case 0x05: ret(FAILURE); break;                                 // FileIoctl
+    case 0x08: ret(FAILURE); break;                                 // FileGetc
+    case 0x09: ret(file_putc(a0, a1)); break;                       // FilePutc
+
+    case 0x06:                                                      // exit
+        info("Guest exited with status %d\n", (int32_t) a0);
+        jump(RAM_START | KERNEL_HALT);
+        break;
+
+    case 0x0E:                                                      // abs
+    case 0x0F:                                                      // labs
+        ret((int32_t) a0 < 0 ? -a0 : a0);
+        break;
+
+    case 0x15: {                                                    // strcat
+        uint32_t dst = a0 + read_string(a0).size();
+        std::string src = read_string(a1);
+        for (size_t i=0; i<=src.size(); i++) {
+            write8(dst + i, i < src.size() ? src[i] : 0);
+        }
+        ret(a0);
+        break;
+    }
+
+    case 0x17:                                                      // strcmp
+        ret(strcmp(read_string(a0).c_str(), read_string(a1).c_str()));
+        break;
+
+    case 0x18:                                                      // strncmp
+        ret(strncmp(read_string(a0).c_str(), read_string(a1).c_str(), a2));
+        break;
+
+    case 0x19: {                                                    // strcpy
+        std::string src = read_string(a1);
+        for (size_t i=0; i<=src.size(); i++) {
+            write8(a0 + i, i < src.size() ? src[i] : 0);
+        }
+        ret(a0);
+        break;
+    }
+
+    case 0x1A: {                                                    // strncpy
+        std::string src = read_string(a1);
+        for (size_t i=0; i<a2; i++) {
+            write8(a0 + i, i < src.size() ? src[i] : 0);
+        }
+        ret(a0);
+        break;
+    }
+
+    case 0x1B:                                                      // strlen
+        ret(read_string(a0).size());
+        break;
+
+    case 0x1E: {                                                    // strchr
+        std::string src = read_string(a0);
+        size_t position = src.find((char) a1);
+        ret(position == std::string::npos ? 0 : a0 + position);
+        break;
+    }
+
+    case 0x25: ret(toupper((uint8_t) a0)); break;                   // toupper
+    case 0x26: ret(tolower((uint8_t) a0)); break;                   // tolower
+
+    case 0x27:                                                      // bcopy
+        for (uint32_t i=0; i<a2; i++) {
+            write8(a1 + i, read8(a0 + i));
+        }
+        break;
+
+    case 0x28:                                                      // bzero
+        for (uint32_t i=0; i<a1; i++) {
+            write8(a0 + i, 0);
+        }
+        break;
+
+    case 0x29:                                                      // bcmp
+    case 0x2D: {                                                    // memcmp
+        int32_t result = 0;
+        for (uint32_t i=0; i<a2 && result == 0; i++) {
+            result = read8(a0 + i) - read8(a1 + i);
+        }
+        ret(result);
+        break;
+    }
+
+    case 0x2A:                                                      // memcpy
+        for (uint32_t i=0; i<a2; i++) {
+            write8(a0 + i, read8(a1 + i));
+        }
+        ret(a0);
+        break;
+
+    case 0x2B:                                                      // memset
+        for (uint32_t i=0; i<a2; i++) {
+            write8(a0 + i, a1);
+        }
+        ret(a0);
+        break;
+
+    case 0x2C:                                                      // memmove
+        if (a0 > a1) {
+            for (uint32_t i=a2; i>0; i--) {
+                write8(a0 + i - 1, read8(a1 + i - 1));
+            }
+        } else {
+            for (uint32_t i=0; i<a2; i++) {
+                write8(a0 + i, read8(a1 + i));
+            }
+        }
+        ret(a0);
+        break;
+
+    case 0x2E: {                                                    // memchr
+        uint32_t result = 0;
+        for (uint32_t i=0; i<a2; i++) {
+            if (read8(a0 + i) == (uint8_t) a1) {
+                result = a0 + i;
+                break;
+            }
+        }
+        ret(result);
+        break;
+    }
+
+    case 0x2F:                                                      // rand
+        seed = seed * 0x41C64E6D + 0x3039;
+        ret((seed >> 16) & 0x7FFF);
+        break;
+
+    case 0x30:                                                      // srand
+        seed = a0;
+        break;
+
+    case 0x33: ret(allocate(a0)); break;                            // malloc
+    case 0x34: break;                                               // free
+
+    case 0x37: {                                                    // calloc
+        uint32_t address = allocate(a0 * a1);
+        for (uint32_t i=0; address && i<a0 * a1; i++) {
+            write8(address + i, 0);
+        }
+        ret(address);
+        break;
+    }
+
+    case 0x39:                                                      // InitHeap
+        heap_next = a0;
+        heap_end = a0 + a1;
+        break;
+
+    case 0x3C: ret(file_putc(a0, FD_STDOUT)); break;                // std_out_putchar
+
+    case 0x3E:                                                      // std_out_puts
+        fputs(read_string(a0).c_str(), stdout);
+        break;
+
+    case 0x3F: {                                                    // printf
+        std::string output = format(a0, 1);
+        fputs(output.c_str(), stdout);
+        ret(output.size());
+        break;
+    }
+
+    case 0x44: break;                                               // FlushCache
+
+    default:
+        unhandled('A', function);
+    }
+}
+
+
+void Kernel::call_b0(uint8_t function)
+{
+    uint32_t a0 = argument(0);
+    uint32_t a1 = argument(1);
+    uint32_t a2 = argument(2);
+    uint32_t a3 = argument(3);
+
+    switch(function) {
+    case 0x00: ret(allocate(a0)); break;                            // alloc_kernel_memory
+    case 0x01: break;                                               // free_kernel_memory
+
+    case 0x07:                                                      // DeliverEvent
+        deliver_event(a0, a1, EVENT_BUSY, EVENT_READY);
+        break;
+
+    case 0x08: ret(open_event(a0, a1, a2, a3)); break;              // OpenEvent
+
+    case 0x09: {                                                    // CloseEvent
+        KernelEvent *event = get_event(a0);
+        if (event) {
+            event->status = EVENT_FREE;
+        }
+        ret(1);
+        break;
+    }
+
+    case 0x0A:                                                      // WaitEvent
+    case 0x0B: {                                                    // TestEvent
+        // Events are only delivered by the guest: waiting cannot block
+        KernelEvent *event = get_event(a0);
+        if (event && event->status == EVENT_READY) {
+            event->status = EVENT_BUSY;
+            ret(1);
+        } else {
+            ret(0);
+        }
+        break;
+    }
+
+    case 0x0C: {                                                    // EnableEvent
+        KernelEvent *event = get_event(a0);
+        if (event && event->status != EVENT_FREE) {
+            event->status = EVENT_BUSY;
+        }
+        ret(1);
+        break;
+    }
+
+    case 0x0D: {                                                    // DisableEvent
+        KernelEvent *event = get_event(a0);
+        if (event && event->status != EVENT_FREE) {
+            event->status = EVENT_DISABLED;
+        }
+        ret(1);
+        break;
+    }
+
+    case 0x12: ret(1); break;                                       // InitPad
+    case 0x13: ret(1); break;                                       // StartPad
+    case 0x14: break;                                               // StopPad
+    case 0x18: break;                                               // SetDefaultExitFromException
+    case 0x19: break;                                               // SetCustomExitFromException
+
+    case 0x20:                                                      // UnDeliverEvent
+        deliver_event(a0, a1, EVENT_READY, EVENT_BUSY);
+        break;
+
+    case 0x32: ret(FAILURE); break;                                 // FileOpen
+    case 0x33: ret(FAILURE); break;                                 // FileSeek
+    case 0x34: ret(FAILURE); break;                                 // FileRead
+    case 0x35: ret(file_write(a0, a1, a2)); break;                  // FileWrite
+    case 0x36: ret(a0); break;                                      // FileClose
+    case 0x37: ret(FAILURE); break;                                 // FileIoctl
+    case 0x3A: ret(FAILURE); break;                                 // FileGetc
+    case 0x3B: ret(file_putc(a0, a1)); break;                       // FilePutc
+
+    case 0x38:                                                      // exit
+        info("Guest exited with status %d\n", (int32_t) a0);
+        jump(RAM_START | KERNEL_HALT);
+        break;
+
+    case 0x3D: ret(file_putc(a0, FD_STDOUT)); break;                // std_out_putchar
+
+    case 0x3F:                                                      // std_out_puts
+        fputs(read_string(a0).c_str(), stdout);
+        break;
+
+    case 0x4A: ret(1); break;                                       // InitCard
+    case 0x4B: ret(1); break;                                       // StartCard
+    case 0x4C: break;                                               // StopCard
+    case 0x56: ret(KERNEL_C0_TABLE); break;                         // GetC0Table
+    case 0x57: ret(KERNEL_B0_TABLE); break;                         // GetB0Table
+    case 0x5B: break;                                               // ChangeClearPad
+
+    default:
+        unhandled('B', function);
+    }
+}
+
+
+void Kernel::call_c0(uint8_t function)
+{
+    uint32_t a0 = argument(0);
+    uint32_t a1 = argument(1);
+
+    switch(function) {
+    // Kernel setup is already done
+    case 0x00:                                                      // EnqueueTimerAndVblankIrqs
+    case 0x01:                                                      // EnqueueSyscallHandler
+    case 0x07:                                                      // InstallExceptionHandlers
+    case 0x08:                                                      // SysInitMemory
+    case 0x0A:                                                      // ChangeClearRCnt
+    case 0x0C:                                                      // InitDefInt
+    case 0x12:                                                      // InstallDevices
+    case 0x1C:                                                      // AdjustA0Table
+        ret(0);
+        break;
+
+    case 0x02:                                                      // SysEnqIntRP
+        if (a0 < KERNEL_PRIORITY_COUNT) {
+            info("Interrupt handler queued: priority %u, 0x%08x\n", a0, a1);
+
+            inter->store<uint32_t>(a1 + INT_HANDLER_NEXT, int_handlers[a0]);
+            int_handlers[a0] = a1;
+        }
+        ret(0);
+        break;
+
+    case 0x03: {                                                    // SysDeqIntRP
+        if (a0 >= KERNEL_PRIORITY_COUNT) {
+            ret(0);
+            break;
+        }
+
+        // Handlers are chained by their first word
+        uint32_t previous = 0;
+        for (uint32_t handler = int_handlers[a0]; handler; handler = inter->peek<uint32_t>(handler)) {
+            if (handler == a1) {
+                uint32_t next = inter->peek<uint32_t>(handler);
+                if (previous) {
+                    inter->store<uint32_t>(previous, next);
+                } else {
+                    int_handlers[a0] = next;
+                }
+                break;
+            }
+
+            previous = handler;
+        }
+        ret(0);
+        break;
+    }
+
+    default:
+        unhandled('C', function);
+    }
+}
+
+
+/**
+ * @brief      Exception handler: system calls and interrupts
+ * Returns to the interrupted code
+ */
+void Kernel::exception()
+{
+    uint32_t code = (cpu->CAUSE >> 2) & MASK_5_BITS;
+    uint32_t address = cpu->EPC;
+
+    switch(code) {
+    case CAUSE_INTERRUPT:
+        // Same as the BIOS: the GTE command interrupted already ran
+        if ((inter->peek<uint32_t>(address) & COP2_COMMAND_MASK) == COP2_COMMAND) {
+            address += INSTRUCTION_LENGTH;
+        }
+
+        enter_interrupt(address);
+        return;
+
+    case EXCEPTION_SYSCALL:
+        switch(argument(0)) {
+        case SYSCALL_ENTER_CRITICAL_SECTION:
+            ret((cpu->SR & SR_IEP) != 0);
+            cpu->SR &= ~(SR_IEP | SR_IM2);
+            break;
+        case SYSCALL_EXIT_CRITICAL_SECTION:
+            cpu->SR |= SR_IEP | SR_IM2;
+            break;
+        }
+
+        address += INSTRUCTION_LENGTH;
+        break;
+
+    default:
+        error("Unhandled exception %u at 0x%08x\n", code, cpu->EPC);
+        exit(1);
+    }
+
+    cpu->RFE();
+    jump(address);
+}
+
+
+/**
+ * @brief      Save the interrupted state and call the first handler
+ * @param[in]  address  Where the interrupted code resumes
+ */
+void Kernel::enter_interrupt(uint32_t address)
+{
+    uint32_t status = inter->peek<uint32_t>(IRQ_CONTROL_START + IRQ_STATUS);
+    uint32_t mask = inter->peek<uint32_t>(IRQ_CONTROL_START + IRQ_MASK);
+
+    // Handler enabling interrupts: acknowledged without nesting the chain
+    if (interrupt.active) {
+        inter->store<uint32_t>(IRQ_CONTROL_START + IRQ_STATUS, ~(status & mask));
+        cpu->RFE();
+        jump(address);
+        return;
+    }
+
+    interrupt.active = true;
+    for (size_t i=0; i<KERNEL_REG_COUNT; i++) {
+        interrupt.reg[i] = cpu->reg[i];
+    }
+    interrupt.HI = cpu->HI;
+    interrupt.LO = cpu->LO;
+    interrupt.address = address;
+    interrupt.lines = status & mask;
+    interrupt.priority = 0;
+    interrupt.handler = 0;
+    interrupt.second = false;
+
+    next_handler();
+}
+
+
+/**
+ * @brief      Call the first function of the next queued handler, leave the
+ * interrupt after the last one
+ */
+void Kernel::next_handler()
+{
+    while (interrupt.priority < KERNEL_PRIORITY_COUNT) {
+        if (interrupt.handler == 0) {
+            interrupt.handler = int_handlers[interrupt.priority];
+        } else {
+            interrupt.handler = inter->peek<uint32_t>(interrupt.handler + INT_HANDLER_NEXT);
+        }
+
+        if (interrupt.handler == 0) {
+            interrupt.priority++;
+            continue;
+        }
+
+        uint32_t first = inter->peek<uint32_t>(interrupt.handler + INT_HANDLER_FIRST);
+        if (first) {
+            interrupt.second = false;
+
+            cpu->reg[REG_SP] = KERNEL_INT_STACK;
+            cpu->reg[REG_RA] = KERNEL_INT_RETURN;
+            jump(first);
+            return;
+        }
+    }
+
+    leave_interrupt();
+}
+
+
+/**
+ * @brief      A handler function returned: the second one is called with the
+ * result of the first one if it is not 0
+ */
+void Kernel::handler_return()
+{
+    if (!interrupt.active) {
+        error("Interrupt handler returned outside of an interrupt\n");
+        exit(1);
+    }
+
+    uint32_t result = cpu->reg[REG_V0];
+    uint32_t second = inter->peek<uint32_t>(interrupt.handler + INT_HANDLER_SECOND);
+
+    if (!interrupt.second && result && second) {
+        interrupt.second = true;
+
+        cpu->reg[REG_A0] = result;
+        cpu->reg[REG_SP] = KERNEL_INT_STACK;
+        cpu->reg[REG_RA] = KERNEL_INT_RETURN;
+        jump(second);
+        return;
+    }
+
+    next_handler();
+}
+
+
+/**
+ * @brief      Acknowledge the lines pending on entry, restore the
+ * interrupted state and return from the exception
+ */
+void Kernel::leave_interrupt()
+{
+    inter->store<uint32_t>(IRQ_CONTROL_START + IRQ_STATUS, ~interrupt.lines);
+
+    for (size_t i=0; i<KERNEL_REG_COUNT; i++) {
+        cpu->reg[i] = interrupt.reg[i];
+    }
+    cpu->HI = interrupt.HI;
+    cpu->LO = interrupt.LO;
+
+    interrupt.active = false;
+
+    cpu->RFE();
+    jump(interrupt.address);
+}
+
+
+void Kernel::unhandled(char table, uint8_t function)
+{
+    error("Unhandled kernel call %c(%02Xh)\n", table, function);
+    exit(1);
+}
+
+
+/**
+ * @brief      Only the standard output (TTY) is available
+ */
+uint32_t Kernel::file_write(uint32_t fd, uint32_t src, uint32_t length)
+{
+    if (fd != FD_STDOUT) {
+        return FAILURE;
+    }
+
+    for (uint32_t i=0; i<length; i++) {
+        fputc(read8(src + i), stdout);
+    }
+
+    return length;
+}
+
+
+uint32_t Kernel::file_putc(uint32_t character, uint32_t fd)
+{
+    if (fd != FD_STDOUT) {
+        return FAILURE;
+    }
+
+    fputc(character, stdout);
+
+    return character;
+}
+
+
+/**
+ * @brief      Allocate in the heap given to InitHeap, memory is never freed
+ * @return     The address or 0 if the heap is full
+ */
+uint32_t Kernel::allocate(uint32_t size)
+{
+    size = (size + 3) & ~3;
+
+    if (size > heap_end - heap_next) {
+        return 0;
+    }
+
+    uint32_t address = heap_next;
+    heap_next += size;
+
+    return address;
+}
+
+
+/**
+ * @brief      Open a disabled event
+ * @return     The event handle or FAILURE if every event is used
+ */
+uint32_t Kernel::open_event(uint32_t event_class, uint32_t spec, uint32_t mode, uint32_t function)
+{
+    for (size_t i=0; i<KERNEL_EVENT_COUNT; i++) {
+        if (events[i].status == EVENT_FREE) {
+            events[i] = {event_class, spec, mode, function, EVENT_DISABLED};
+
+            return EVENT_HANDLE | i;
+        }
+    }
+
+    return FAILURE;
+}
+
+
+/**
+ * @brief      Event of the given handle
+ * @return     The event or nullptr if the handle is invalid
+ */
+KernelEvent *Kernel::get_event(uint32_t handle)
+{
+    uint32_t index = handle & 0xFFFF;
+
+    if ((handle & 0xFFFF0000) != EVENT_HANDLE || index >= KERNEL_EVENT_COUNT) {
+        return nullptr;
+    }
+
+    return &events[index];
+}
+
+
+/**
+ * @brief      Change the status of matching events
+ * Callback events are not called: there is no guest thread to run them on
+ */
+void Kernel::deliver_event(uint32_t event_class, uint32_t spec, uint32_t from, uint32_t to)
+{
+    for (KernelEvent &event : events) {
+        if (event.status == from &&
+            event.mode == EVENT_MODE_READY &&
+            event.event_class == event_class &&
+            event.spec == spec)
+        {
+            event.status = to;
+        }
+    }
+}
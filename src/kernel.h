@@ -0,0 +1,155 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "instruction.h"
+
+// Kernel entry points in RAM, each holds a kernel call then "jr $ra"
+#define KERNEL_EXCEPTION_VECTOR 0x80
+#define KERNEL_HALT             0x90    // Infinite loop reached on exit
+#define KERNEL_A0               0xA0
+#define KERNEL_B0               0xB0
+#define KERNEL_C0               0xC0
+#define KERNEL_INT_RETURN       0xD0    // Return address of interrupt handlers
+
+// Function tables returned by GetB0Table/GetC0Table (same as the BIOS)
+#define KERNEL_B0_TABLE         0x874
+#define KERNEL_C0_TABLE         0x674
+
+#define KERNEL_STACK            0x801FFF00  // Default $sp
+#define KERNEL_STRING_MAX       0x1000      // Longest string read in guest memory
+#define KERNEL_EVENT_COUNT      16
+#define KERNEL_PRIORITY_COUNT   4           // Interrupt handler chains
+#define KERNEL_INT_STACK        0x8000F000  // Below the executables
+#define KERNEL_REG_COUNT        32
+
+// Interrupt handler queued with SysEnqIntRP
+#define INT_HANDLER_NEXT        0x0
+#define INT_HANDLER_SECOND      0x4     // Called with the result of the first
+#define INT_HANDLER_FIRST       0x8     // Checks for its interrupt
+
+// Kernel call: reserved opcode with the entry point as immediate
+#define KERNEL_CALL(vector)     ((HLE_OPCODE << 26) | (vector))
+
+// PS-X EXE header
+#define EXE_HEADER_SIZE         0x800
+#define EXE_MAGIC               "PS-X EXE"
+#define EXE_PC                  0x10
+#define EXE_GP                  0x14
+#define EXE_TEXT_ADDRESS        0x18
+#define EXE_TEXT_SIZE           0x1C
+#define EXE_BSS_ADDRESS         0x28
+#define EXE_BSS_SIZE            0x2C
+#define EXE_STACK_ADDRESS       0x30
+#define EXE_STACK_OFFSET        0x34
+
+// Event handles and status
+#define EVENT_HANDLE            0xF1000000
+#define EVENT_FREE              0x0000
+#define EVENT_DISABLED          0x1000
+#define EVENT_BUSY              0x2000  // Enabled, waiting to be delivered
+#define EVENT_READY             0x4000  // Delivered, not acknowledged yet
+#define EVENT_MODE_CALLBACK     0x1000
+#define EVENT_MODE_READY        0x2000
+
+class CPU;
+class Interconnect;
+
+
+/**
+ * @brief      Kernel event opened with OpenEvent
+ */
+struct KernelEvent {
+    uint32_t event_class;
+    uint32_t spec;
+    uint32_t mode;
+    uint32_t function;
+    uint32_t status;
+};
+
+
+/**
+ * @brief      Interrupted state, restored once the handlers return
+ */
+struct KernelInterrupt {
+    bool active;
+    uint32_t reg[KERNEL_REG_COUNT];
+    uint32_t HI;
+    uint32_t LO;
+    uint32_t address;       // Where the interrupted code resumes
+    uint32_t lines;         // I_STAT & I_MASK on entry, acknowledged on exit
+    size_t priority;        // Chain being walked
+    uint32_t handler;       // Handler being called, 0 before the first
+    bool second;            // Its second function is running
+};
+
+
+/**
+ * @brief      High level emulation of the BIOS kernel
+ *
+ * Replaces the BIOS: A0/B0/C0 functions run natively when the guest jumps
+ * to their entry point, and a PS-X EXE is loaded directly in RAM instead of
+ * being booted from CD. Calls take no guest cycles besides the entry stub.
+ *
+ * Interrupts call the handlers queued with SysEnqIntRP as guest code, by
+ * priority, each of them returning to KERNEL_INT_RETURN. The lines pending
+ * on entry are acknowledged once they all ran.
+ */
+class Kernel {
+    CPU *cpu;
+    Interconnect *inter;
+
+    std::vector<uint8_t> exe;
+
+    KernelEvent events[KERNEL_EVENT_COUNT];
+    uint32_t int_handlers[KERNEL_PRIORITY_COUNT];
+    KernelInterrupt interrupt;
+
+    uint32_t heap_next;
+    uint32_t heap_end;
+    uint32_t seed;
+
+    void install();
+    void load();
+
+    uint32_t argument(size_t index);
+    void ret(uint32_t value);
+    void jump(uint32_t address);
+
+    uint8_t read8(uint32_t address);
+    void write8(uint32_t address, uint8_t value);
+    std::string read_string(uint32_t address);
+
+    void call_a0(uint8_t function);
+    void call_b0(uint8_t function);
+    void call_c0(uint8_t function);
+    void exception();
+    void enter_interrupt(uint32_t address);
+    void next_handler();
+    void handler_return();
+    void leave_interrupt();
+    void unhandled(char table, uint8_t function);
+
+    uint32_t file_write(uint32_t fd, uint32_t src, uint32_t length);
+    uint32_t file_putc(uint32_t character, uint32_t fd);
+    uint32_t allocate(uint32_t size);
+
+    uint32_t open_event(uint32_t event_class, uint32_t spec, uint32_t mode, uint32_t function);
+    KernelEvent *get_event(uint32_t handle);
+    void deliver_event(uint32_t event_class, uint32_t spec, uint32_t from, uint32_t to);
+
+public:
+    bool init(CPU *cpu, Interconnect *inter);
+    void reset();
+
+    bool load_exe(std::string path);
+    bool set_exe(const std::vector<uint8_t> &data);
+
+    void call(uint32_t vector);
+    std::string format(uint32_t address, size_t first);
+};
+
+#endif /* KERNEL_H */
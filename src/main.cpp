@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "log.h"
+#include "cpu.h"
 #include "psx.h"
 
 #include "main.h"
@@ -16,7 +17,26 @@ void show_usage()
     std::cerr << "Usage: psx <option(s)> [ROM]\n"
               << "Options:\n"
               << "\t-h,--help\t\tShow this help message\n"
-              << "\t-b,--boot BOOT\tSpecifies BOOT ROM\n";
+              << "\t-b,--boot BOOT\tSpecifies BOOT ROM (without it, ROM is a PS-X EXE run on an HLE kernel)\n"
+              << "\t-m,--mode MODE\tCPU execution mode: interpreter (default), cached, recompiler\n"
+              << "\t-f,--fastmem\t\tMap guest memory in host memory (Linux x86-64)\n"
+              << "\t-n,--native-bios\tRun BIOS memcpy/memset/bzero/strcpy natively (cached and recompiler modes)\n";
+}
+
+
+bool parse_mode(std::string name, ExecutionMode *mode)
+{
+    if (name == "interpreter") {
+        *mode = MODE_INTERPRETER;
+    } else if (name == "cached") {
+        *mode = MODE_CACHED;
+    } else if (name == "recompiler") {
+        *mode = MODE_RECOMPILER;
+    } else {
+        return false;
+    }
+
+    return true;
 }
 
 
@@ -24,7 +44,7 @@ int main(int argc, char *argv[])
 {
     info("PSX emulation\n");
 
-    if (argc < 2 || argc > 5) {
+    if (argc < 2 || argc > 9) {
         show_usage();
 
         return EXIT_FAILURE;
@@ -33,6 +53,9 @@ int main(int argc, char *argv[])
     std::string rom;
     std::string boot = "";
     std::string palette = "0";
+    ExecutionMode mode = MODE_INTERPRETER;
+    bool fastmem = false;
+    bool routines = false;
 
     for (int i=1; i<argc; ++i) {
         std::string arg = argv[i];
@@ -47,6 +70,22 @@ int main(int argc, char *argv[])
                 show_usage();
                 return EXIT_FAILURE;
             }
+        } else if ((arg == "-m") || (arg == "--mode")) {
+            if (i + 1 < argc) {
+                if (!parse_mode(argv[++i], &mode)) {
+                    error("Unknown execution mode: %s\n", argv[i]);
+                    show_usage();
+                    return EXIT_FAILURE;
+                }
+            } else {
+                error("--mode option requires one argument\n");
+                show_usage();
+                return EXIT_FAILURE;
+            }
+        } else if ((arg == "-f") || (arg == "--fastmem")) {
+            fastmem = true;
+        } else if ((arg == "-n") || (arg == "--native-bios")) {
+            routines = true;
         } else if (i == argc - 1) {
             rom = argv[i];
         } else {
@@ -56,15 +95,15 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (boot.empty()) {
-        error("You need to specify a BIOS file to use\n");
+    if (boot.empty() && rom.empty()) {
+        error("You need to specify a BIOS file or an executable to use\n");
         show_usage();
 
         return EXIT_FAILURE;
     }
 
     PSX *psx = new PSX();
-    if (!psx->init(boot.c_str(), rom.c_str())) {
+    if (!psx->init(boot.c_str(), rom.c_str(), mode, fastmem, routines)) {
         return EXIT_FAILURE;
     }
 
@@ -0,0 +1,129 @@
+#include "memory.h"
+
+#include <cstdlib>
+
+#if defined(__linux__)
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include "log.h"
+
+
+Memory::~Memory()
+{
+    if (owned) {
+        delete[] data;
+    }
+
+#if defined(__linux__)
+    if (fd >= 0) {
+        munmap(data, size);
+        close(fd);
+    }
+#endif
+}
+
+
+/**
+ * @brief      Allocate zeroed host memory
+ * @return     true in case of success, false otherwise
+ */
+bool Memory::allocate(size_t size)
+{
+    data = new uint8_t[size]();
+    this->size = size;
+    owned = true;
+
+    return true;
+}
+
+
+/**
+ * @brief      Allocate zeroed host memory in a memory file
+ * The memory can then be mapped several times (fastmem mirrors)
+ * @return     true in case of success, false if it is not available
+ */
+bool Memory::share(const char *name, size_t size)
+{
+#if defined(__linux__)
+    fd = memfd_create(name, 0);
+
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (memory != MAP_FAILED) {
+            data = (uint8_t*) memory;
+            this->size = size;
+
+            return true;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+#else
+    (void) name;
+    (void) size;
+#endif
+
+    return false;
+}
+
+
+/**
+ * @brief      Copy guest memory out, for DMA transfers
+ */
+void Memory::read_block(uint32_t offset, void *destination, size_t length)
+{
+    if (offset + length > size) {
+        error("Block read out of bounds: 0x%08x (%zu bytes)\n", offset, length);
+        exit(1);
+    }
+
+    memcpy(destination, data + offset, length);
+}
+
+
+/**
+ * @brief      Copy into guest memory, for DMA transfers
+ */
+void Memory::write_block(uint32_t offset, const void *source, size_t length)
+{
+    if (offset + length > size) {
+        error("Block write out of bounds: 0x%08x (%zu bytes)\n", offset, length);
+        exit(1);
+    }
+
+    memcpy(data + offset, source, length);
+}
+
+
+/**
+ * @brief      Copy inside guest memory, the blocks may overlap
+ */
+void Memory::copy_block(uint32_t destination, uint32_t source, size_t length)
+{
+    if (destination + length > size || source + length > size) {
+        error("Block copy out of bounds: 0x%08x to 0x%08x (%zu bytes)\n", source, destination, length);
+        exit(1);
+    }
+
+    memmove(data + destination, data + source, length);
+}
+
+
+/**
+ * @brief      Fill guest memory with a byte
+ */
+void Memory::fill_block(uint32_t offset, uint8_t value, size_t length)
+{
+    if (offset + length > size) {
+        error("Block fill out of bounds: 0x%08x (%zu bytes)\n", offset, length);
+        exit(1);
+    }
+
+    memset(data + offset, value, length);
+}
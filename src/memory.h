@@ -0,0 +1,87 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+
+/**
+ * @brief      Converts between guest (little endian) and host byte order
+ * Does nothing on little endian hosts
+ */
+template<typename T>
+T guest_endian(T value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if constexpr (sizeof(T) == sizeof(uint16_t)) {
+        return __builtin_bswap16(value);
+    } else if constexpr (sizeof(T) == sizeof(uint32_t)) {
+        return __builtin_bswap32(value);
+    }
+#endif
+
+    return value;
+}
+
+
+/**
+ * @brief      Guest memory backing (RAM, BIOS, scratchpad, VRAM, SPU RAM)
+ * Accesses are native width, callers ensure they are aligned and in bounds
+ */
+class Memory {
+protected:
+    uint8_t *data = nullptr;
+    size_t size = 0;
+    bool owned = false;     // Allocated by Memory (RAM may bring its own)
+    int fd = -1;            // Shared memory file, allows mapping mirrors
+
+    bool allocate(size_t size);
+    bool share(const char *name, size_t size);
+
+public:
+    Memory() = default;
+    ~Memory();
+
+    // Owns its allocation or mapping
+    Memory(const Memory&) = delete;
+    Memory &operator=(const Memory&) = delete;
+
+    uint8_t *get_data()
+    {
+        return data;
+    }
+
+    int get_fd()
+    {
+        return fd;
+    }
+
+    size_t get_size()
+    {
+        return size;
+    }
+
+    template<typename T>
+    T load(uint32_t offset)
+    {
+        T value;
+        memcpy(&value, data + offset, sizeof(T));
+
+        return guest_endian(value);
+    }
+
+    template<typename T>
+    void store(uint32_t offset, T value)
+    {
+        value = guest_endian(value);
+        memcpy(data + offset, &value, sizeof(T));
+    }
+
+    void read_block(uint32_t offset, void *destination, size_t length);
+    void write_block(uint32_t offset, const void *source, size_t length);
+    void copy_block(uint32_t destination, uint32_t source, size_t length);
+    void fill_block(uint32_t offset, uint8_t value, size_t length);
+};
+
+#endif /* MEMORY_H */
@@ -0,0 +1,89 @@
+#include "mmio.h"
+
+#include <cstring>
+#include <cstdlib>
+
+#include "log.h"
+
+
+/**
+ * @brief      Initialize the table, no device mapped
+ * @return     true in case of success, false otherwise
+ */
+bool IOMap::init()
+{
+    devices.clear();
+    memset(table, 0, sizeof(table));
+
+    return true;
+}
+
+
+/**
+ * @brief      Map the registers of a device
+ * Mapping again a device at the same address replaces it
+ */
+void IOMap::map(const IODevice &device)
+{
+    if (device.start < IO_START || device.start + device.size > IO_START + IO_SIZE) {
+        error("%s registers out of the I/O page: 0x%08x\n", device.name, device.start);
+        exit(1);
+    }
+
+    size_t index = devices.size();
+    for (size_t i=0; i<devices.size(); i++) {
+        if (devices[i].start == device.start) {
+            index = i;
+        }
+    }
+
+    if (index == devices.size()) {
+        if (index >= IO_DEVICE_MAX) {
+            error("Too many I/O devices, cannot map %s\n", device.name);
+            exit(1);
+        }
+
+        devices.push_back(device);
+    } else {
+        devices[index] = device;
+    }
+
+    memset(table + device.start - IO_START, index + 1, device.size);
+}
+
+
+/**
+ * @brief      Load the device has no callback for
+ * Fatal if the address is not mapped or the device is write only
+ * @return     0 if the device handles loads at other widths
+ */
+uint32_t IOMap::unhandled_load(const IODevice *device, uint32_t address, size_t size)
+{
+    const IOHandlers *handlers = device ? &device->handlers : nullptr;
+
+    if (!handlers || (!handlers->read8 && !handlers->read16 && !handlers->read32)) {
+        error("Unhandled load%zu at 0x%08x\n", size, address);
+        exit(1);
+    }
+
+    error("Unhandled load%zu to %s register: 0x%08x\n", size, device->name, address - device->start);
+
+    return 0;
+}
+
+
+/**
+ * @brief      Store the device has no callback for, dropped
+ * Fatal if the address is not mapped or the device is read only
+ */
+void IOMap::unhandled_store(const IODevice *device, uint32_t address, uint32_t value, size_t size)
+{
+    const IOHandlers *handlers = device ? &device->handlers : nullptr;
+
+    if (!handlers || (!handlers->write8 && !handlers->write16 && !handlers->write32)) {
+        error("Unhandled store%zu at 0x%08x\n", size, address);
+        exit(1);
+    }
+
+    error("Unhandled store%zu to %s register: 0x%08x: 0x%08x\n", size, device->name, address - device->start, value);
+}
@@ -0,0 +1,162 @@
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+
+// I/O ports and expansion 2, decoded through the device table
+#define IO_START            0x1F801000
+#define IO_SIZE             0x2000
+#define IO_DEVICE_MAX       255
+
+// Access widths handled by a device
+#define IO_WIDTH_8          0x01
+#define IO_WIDTH_16         0x02
+#define IO_WIDTH_32         0x04
+
+template <typename T>
+using io_read = T (*)(void *device, uint32_t offset);
+
+template <typename T>
+using io_write = void (*)(void *device, uint32_t offset, T value);
+
+
+/**
+ * @brief      Load and store callbacks of a device for each access width
+ * nullptr if the device does not handle that width: such accesses are
+ * reported and ignored, loads read 0
+ */
+struct IOHandlers {
+    io_read<uint8_t> read8;
+    io_read<uint16_t> read16;
+    io_read<uint32_t> read32;
+    io_write<uint8_t> write8;
+    io_write<uint16_t> write16;
+    io_write<uint32_t> write32;
+
+    template <typename T>
+    io_read<T> reader() const
+    {
+        if constexpr (sizeof(T) == sizeof(uint8_t)) {
+            return read8;
+        } else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+            return read16;
+        } else {
+            return read32;
+        }
+    }
+
+    template <typename T>
+    io_write<T> writer() const
+    {
+        if constexpr (sizeof(T) == sizeof(uint8_t)) {
+            return write8;
+        } else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+            return write16;
+        } else {
+            return write32;
+        }
+    }
+};
+
+
+/**
+ * @brief      Registers of a device mapped on the I/O page
+ * Callbacks get the offset in the device
+ */
+struct IODevice {
+    const char *name;
+    uint32_t start;             // Physical address of the first register
+    uint32_t size;
+    void *device;               // Passed back to the callbacks
+    IOHandlers handlers;
+    const uint32_t *cycles;     // Read costs for 8, 16 and 32 bits accesses
+    bool stable;                // Only changes on stores or scheduled events
+};
+
+
+/**
+ * @brief      Flat table from any I/O page address to its device
+ */
+class IOMap {
+    std::vector<IODevice> devices;
+    uint8_t table[IO_SIZE];     // Index of the device + 1, 0 if unmapped
+
+public:
+    bool init();
+
+    void map(const IODevice &device);
+
+    uint32_t unhandled_load(const IODevice *device, uint32_t address, size_t size);
+    void unhandled_store(const IODevice *device, uint32_t address, uint32_t value, size_t size);
+
+    /**
+     * @brief      Find the device mapped at a physical address
+     * @return     The device or nullptr if none is
+     */
+    const IODevice *find(uint32_t address)
+    {
+        if (!in_range(address, IO_START, IO_SIZE)) {
+            return nullptr;
+        }
+
+        uint8_t index = table[address - IO_START];
+        if (index == 0) {
+            return nullptr;
+        }
+
+        return &devices[index - 1];
+    }
+};
+
+
+/**
+ * @brief      Load callback of a device with load<T>(offset)
+ */
+template <typename D, typename T>
+T device_read(void *device, uint32_t offset)
+{
+    return ((D*) device)->template load<T>(offset);
+}
+
+/**
+ * @brief      Store callback of a device with store<T>(offset, value)
+ */
+template <typename D, typename T>
+void device_write(void *device, uint32_t offset, T value)
+{
+    ((D*) device)->template store<T>(offset, value);
+}
+
+/**
+ * @brief      Callbacks of a device with load<T> and store<T>, instantiated
+ * only for the widths it handles
+ * @param      widths  IO_WIDTH_8, IO_WIDTH_16 and/or IO_WIDTH_32
+ */
+template <typename D, uint32_t widths>
+IOHandlers device_handlers()
+{
+    IOHandlers handlers = {};
+
+    if constexpr ((widths & IO_WIDTH_8) != 0) {
+        handlers.read8 = device_read<D, uint8_t>;
+        handlers.write8 = device_write<D, uint8_t>;
+    }
+
+    if constexpr ((widths & IO_WIDTH_16) != 0) {
+        handlers.read16 = device_read<D, uint16_t>;
+        handlers.write16 = device_write<D, uint16_t>;
+    }
+
+    if constexpr ((widths & IO_WIDTH_32) != 0) {
+        handlers.read32 = device_read<D, uint32_t>;
+        handlers.write32 = device_write<D, uint32_t>;
+    }
+
+    return handlers;
+}
+
+#endif /* MMIO_H */
@@ -15,11 +15,19 @@
 #include "spu.h"
 #include "bios.h"
 #include "ram.h"
+#include "scratchpad.h"
+#include "irq.h"
+#include "dma.h"
 #include "interconnect.h"
+#include "scheduler.h"
+#include "fastmem.h"
+#include "kernel.h"
+#include "routines.h"
 
 #include "psx.h"
 
 #define FPS                     30
+#define CYCLES_PER_FRAME        (CPU_FREQUENCY / 60)    // NTSC
 #define GLSL_VERSION            "#version 130"
 
 #define DEBUGGER_WIDTH          800
@@ -36,7 +44,7 @@ PSX::~PSX()
 }
 
 
-bool PSX::init(std::string bios_path, std::string rom_path)
+bool PSX::init(std::string bios_path, std::string rom_path, ExecutionMode mode, bool use_fastmem, bool use_routines)
 {
     this->bios_path = bios_path;
     this->rom_path = rom_path;
@@ -51,18 +59,62 @@ bool PSX::init(std::string bios_path, std::string rom_path)
     spu = new SPU();
     bios = new BIOS();
     ram = new RAM();
+    scratchpad = new Scratchpad();
+    irq = new IRQ();
+    dma = new DMA();
     inter = new Interconnect();
+    scheduler = new Scheduler();
+    fastmem = new Fastmem();
+    kernel = nullptr;
+    routines = nullptr;
 
     running = true;
     running &= cpu->init();
     running &= spu->init();
-    running &= bios->init(bios_path);
     running &= ram->init();
-    running &= inter->init(spu, bios, ram);
+    running &= scratchpad->init();
+    running &= irq->init(cpu);
+    running &= dma->init(cpu, ram, irq);
+    running &= inter->init(spu, bios, ram, scratchpad);
+    running &= scheduler->init(cpu);
+
+    // No BIOS: the kernel is emulated and the ROM is a PS-X EXE
+    if (bios_path.empty()) {
+        kernel = new Kernel();
+        running &= kernel->init(cpu, inter);
+        running &= kernel->load_exe(rom_path);
+    } else {
+        running &= bios->init(bios_path);
+    }
+
+    // The HLE kernel already runs every function natively
+    if (use_routines && !kernel) {
+        routines = new Routines();
+        running &= routines->init(cpu, ram);
+    }
 
     running &= initGUI();
 
     cpu->set_inter(inter);
+    inter->set_irq(irq);
+    inter->set_dma(dma);
+    cpu->set_kernel(kernel);
+    cpu->set_routines(routines);
+    running &= cpu->set_mode(mode);
+
+    if (use_fastmem) {
+        if (fastmem->init(inter, ram, bios, scratchpad)) {
+            inter->set_fastmem(fastmem);
+        } else {
+            error("Fastmem is not available, using the page table\n");
+        }
+    }
+
+    scheduler->set_handler(EVENT_VBLANK, [](void *psx, uint64_t timestamp) {
+        ((PSX*) psx)->vblank(timestamp);
+    }, this);
+
+    reset();
 
     return running;
 }
@@ -142,10 +194,14 @@ bool PSX::initGUI()
 int PSX::run()
 {
     while (running) {
-        draw();
         handle_events();
 
-        cpu->run_next();
+        frame_done = false;
+        while (!frame_done) {
+            process();
+        }
+
+        draw();
     }
 
     return EXIT_SUCCESS;
@@ -205,9 +261,24 @@ void PSX::draw()
 
 /**
  * @brief      Dispatch process time to each PSX component
+ * The CPU runs up to the next event, then every due event is handled
  */
 void PSX::process()
 {
+    cpu->run_until(scheduler->next_event());
+    scheduler->run(cpu->get_cycles());
+}
+
+
+/**
+ * @brief      End of a frame
+ */
+void PSX::vblank(uint64_t timestamp)
+{
+    frame_done = true;
+    irq->raise(IRQ_VBLANK);
+
+    scheduler->schedule(EVENT_VBLANK, timestamp + CYCLES_PER_FRAME);
 }
 
 
@@ -269,7 +340,19 @@ void PSX::handle_events()
 
 void PSX::reset()
 {
+    // Events are timed on the cycle counter restarting from 0
     cpu->reset();
+    irq->reset();
+    dma->reset();
+    inter->reset();
+    scheduler->reset();
+    spu->reset();
+
+    if (kernel) {
+        kernel->reset();
+    }
+
+    scheduler->schedule(EVENT_VBLANK, CYCLES_PER_FRAME);
 }
 
 
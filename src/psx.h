@@ -8,7 +8,16 @@ class CPU;
 class SPU;
 class BIOS;
 class RAM;
+class Scratchpad;
+class IRQ;
+class DMA;
 class Interconnect;
+class Scheduler;
+class Fastmem;
+class Kernel;
+class Routines;
+
+enum ExecutionMode : int;
 
 class SDL_Window;
 class SDL_PixelFormat;
@@ -22,9 +31,17 @@ class PSX {
     SPU *spu;
     BIOS *bios;
     RAM *ram;
+    Scratchpad *scratchpad;
+    IRQ *irq;
+    DMA *dma;
     Interconnect *inter;
+    Scheduler *scheduler;
+    Fastmem *fastmem;
+    Kernel *kernel;     // HLE kernel when booting without BIOS
+    Routines *routines; // Native BIOS functions when enabled
 
     bool running;
+    bool frame_done;    // Set on vblank
     bool no_boot;
 
     std::string bios_path;
@@ -47,12 +64,14 @@ class PSX {
     void display_breakpoints();
     void display_gpu();
 
+    void vblank(uint64_t timestamp);
+
 public:
     size_t save_slot;
 
     ~PSX();
 
-    bool init(std::string bios_path, std::string rom_path);
+    bool init(std::string bios_path, std::string rom_path, ExecutionMode mode, bool use_fastmem, bool use_routines);
     bool initGUI();
     int run();
     void draw();
@@ -2,18 +2,24 @@
 
 #include <cstring>
 
-
-RAM::~RAM()
-{
-}
+#include "log.h"
 
 
 /**
  * @brief      Initialize the RAM
+ * On Linux the RAM lives in a memory file so it can be mapped several times
+ * (fastmem mirrors), other hosts get plain memory
  * @return     true in case of success, false otherwise
  */
 bool RAM::init()
 {
+    if (!share("psx-ram", RAM_SIZE)) {
+#if defined(__linux__)
+        error("Unable to share the RAM, fastmem will not be available\n");
+#endif
+        allocate(RAM_SIZE);
+    }
+
     memset(data, POISON_VALUE, RAM_SIZE);
 
     return true;
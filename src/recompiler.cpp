@@ -0,0 +1,1385 @@
+#include "recompiler.h"
+
+#include <cstring>
+#include <cstddef>
+#include <initializer_list>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+    #define RECOMPILER_AVAILABLE
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include "log.h"
+#include "cpu.h"
+#include "instruction.h"
+#include "interconnect.h"
+
+
+// x86-64 registers used by the generated code
+#define RAX     0
+#define RCX     1
+#define RDX     2
+#define RBX     3       // CPU object
+#define RSP     4
+#define RSI     6
+#define RDI     7
+#define R12     12      // Branch taken or indirect target, across the delay slot
+#define R13     13      // Virtual address of the block minus its physical address
+
+// Condition codes
+#define CC_B    0x2
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xC
+#define CC_GE   0xD
+#define CC_LE   0xE
+#define CC_G    0xF
+
+static_assert(sizeof(MemoryPage) == 16, "Page table entries are indexed by a shift");
+static_assert(sizeof(Link) == 24, "Indirect cache entries are indexed by a scale of 8");
+static_assert((INDIRECT_CACHE_SIZE & (INDIRECT_CACHE_SIZE - 1)) == 0, "Indirect cache is hashed by a mask");
+
+
+/**
+ * @brief      Tells if the instruction is a load or store emitted inline
+ * LB LH LW LBU LHU SB SH SW: unaligned and coprocessor ones are interpreted
+ */
+static bool is_inline_memory(uint32_t instruction)
+{
+    switch(get_primary_opcode(instruction)) {
+    case 0x20: case 0x21: case 0x23: case 0x24: case 0x25:
+    case 0x28: case 0x29: case 0x2B:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * @brief      Operations of the x86 group 1 (/digit of 0x81)
+ */
+enum Alu : uint8_t {
+    ALU_ADD = 0,
+    ALU_OR = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7,
+};
+
+/**
+ * @brief      Shifts (/digit of 0xC1 and 0xD3)
+ */
+enum Shift : uint8_t {
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7,
+};
+
+
+/**
+ * @brief      Memory operand [base + index * scale + disp]
+ */
+struct Mem {
+    uint8_t base;
+    int8_t index;           // -1 if none
+    uint8_t scale;
+    int32_t disp;
+};
+
+static Mem at(uint8_t base, int32_t disp)
+{
+    return {base, -1, 1, disp};
+}
+
+static Mem at(uint8_t base, uint8_t index, uint8_t scale, int32_t disp)
+{
+    return {base, (int8_t) index, scale, disp};
+}
+
+
+/**
+ * @brief      Writes x86-64 machine code
+ * The CPU object is kept in RBX, guest registers are accessed through it
+ */
+class Emitter {
+    uint8_t *code;
+    size_t size = 0;
+
+    void byte(uint8_t value)
+    {
+        code[size++] = value;
+    }
+
+    void dword(uint32_t value)
+    {
+        memcpy(code + size, &value, sizeof(value));
+        size += sizeof(value);
+    }
+
+    void qword(uint64_t value)
+    {
+        memcpy(code + size, &value, sizeof(value));
+        size += sizeof(value);
+    }
+
+    void opcode(std::initializer_list<uint8_t> bytes)
+    {
+        for (uint8_t value : bytes) {
+            byte(value);
+        }
+    }
+
+    // REX prefix, only when a 64 bits operand or R8-R15 is used
+    void rex(bool wide, uint8_t reg, int8_t index, uint8_t base)
+    {
+        uint8_t value = 0x40 | (wide << 3) | ((reg & 8) >> 1) | (base >> 3);
+        if (index >= 0) {
+            value |= (index & 8) >> 2;
+        }
+
+        if (value != 0x40) {
+            byte(value);
+        }
+    }
+
+    // ModRM (and SIB) of a memory operand, always with a 32 bits displacement
+    void modrm(uint8_t reg, const Mem &mem)
+    {
+        if (mem.index < 0 && (mem.base & 7) != RSP) {
+            byte(0x80 | (reg & 7) << 3 | (mem.base & 7));
+        } else {
+            uint8_t scale = mem.scale == 8 ? 3 : mem.scale == 4 ? 2 : mem.scale == 2 ? 1 : 0;
+            uint8_t index = mem.index < 0 ? RSP : mem.index;    // RSP: no index
+
+            byte(0x80 | (reg & 7) << 3 | RSP);
+            byte(scale << 6 | (index & 7) << 3 | (mem.base & 7));
+        }
+
+        dword(mem.disp);
+    }
+
+    // opcode reg, [mem]
+    void memory(bool wide, std::initializer_list<uint8_t> bytes, uint8_t reg, const Mem &mem)
+    {
+        rex(wide, reg, mem.index, mem.base);
+        opcode(bytes);
+        modrm(reg, mem);
+    }
+
+    // opcode reg, rm with two registers
+    void registers(bool wide, std::initializer_list<uint8_t> bytes, uint8_t reg, uint8_t rm)
+    {
+        rex(wide, reg, -1, rm);
+        opcode(bytes);
+        byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+public:
+    Emitter(uint8_t *code) : code(code) {}
+
+    size_t position() { return size; }
+
+    void push(uint8_t reg) { rex(false, 0, -1, reg); byte(0x50 | (reg & 7)); }
+    void pop(uint8_t reg) { rex(false, 0, -1, reg); byte(0x58 | (reg & 7)); }
+    void ret() { byte(0xC3); }
+
+    // Moves between registers and memory
+    void mov32(uint8_t reg, const Mem &mem) { memory(false, {0x8B}, reg, mem); }
+    void mov32(const Mem &mem, uint8_t reg) { memory(false, {0x89}, reg, mem); }
+    void mov16(const Mem &mem, uint8_t reg) { byte(0x66); memory(false, {0x89}, reg, mem); }
+    void mov8(const Mem &mem, uint8_t reg) { memory(false, {0x88}, reg, mem); }
+    void mov64(uint8_t reg, const Mem &mem) { memory(true, {0x8B}, reg, mem); }
+    void mov64(const Mem &mem, uint8_t reg) { memory(true, {0x89}, reg, mem); }
+    void movzx8(uint8_t reg, const Mem &mem) { memory(false, {0x0F, 0xB6}, reg, mem); }
+    void movsx8(uint8_t reg, const Mem &mem) { memory(false, {0x0F, 0xBE}, reg, mem); }
+    void movzx16(uint8_t reg, const Mem &mem) { memory(false, {0x0F, 0xB7}, reg, mem); }
+    void movsx16(uint8_t reg, const Mem &mem) { memory(false, {0x0F, 0xBF}, reg, mem); }
+    void lea32(uint8_t reg, const Mem &mem) { memory(false, {0x8D}, reg, mem); }
+    void lea64(uint8_t reg, const Mem &mem) { memory(true, {0x8D}, reg, mem); }
+
+    // Moves of immediates
+    void mov32_imm(uint8_t reg, uint32_t imm) { rex(false, 0, -1, reg); byte(0xB8 | (reg & 7)); dword(imm); }
+    void mov64_imm(uint8_t reg, uint64_t imm) { rex(true, 0, -1, reg); byte(0xB8 | (reg & 7)); qword(imm); }
+    void mov32_imm(const Mem &mem, uint32_t imm) { memory(false, {0xC7}, 0, mem); dword(imm); }
+    void mov64_imm(const Mem &mem, int32_t imm) { memory(true, {0xC7}, 0, mem); dword(imm); }
+    void mov8_imm(const Mem &mem, uint8_t imm) { memory(false, {0xC6}, 0, mem); byte(imm); }
+
+    // Moves between registers
+    void mov32_reg(uint8_t dst, uint8_t src) { registers(false, {0x89}, src, dst); }
+    void mov64_reg(uint8_t dst, uint8_t src) { registers(true, {0x89}, src, dst); }
+    void movzx8_reg(uint8_t dst, uint8_t src) { registers(false, {0x0F, 0xB6}, dst, src); }
+    void movsx8_reg(uint8_t dst, uint8_t src) { registers(false, {0x0F, 0xBE}, dst, src); }
+    void movsx16_reg(uint8_t dst, uint8_t src) { registers(false, {0x0F, 0xBF}, dst, src); }
+    void cmov32(uint8_t cc, uint8_t dst, uint8_t src) { registers(false, {0x0F, (uint8_t) (0x40 | cc)}, dst, src); }
+
+    // Arithmetic and logic
+    void alu32(Alu op, uint8_t reg, const Mem &mem) { memory(false, {(uint8_t) (op * 8 + 3)}, reg, mem); }
+    void alu64(Alu op, uint8_t reg, const Mem &mem) { memory(true, {(uint8_t) (op * 8 + 3)}, reg, mem); }
+    void alu64(Alu op, const Mem &mem, uint8_t reg) { memory(true, {(uint8_t) (op * 8 + 1)}, reg, mem); }
+    void alu32_imm(Alu op, uint8_t reg, uint32_t imm) { registers(false, {0x81}, op, reg); dword(imm); }
+    void alu64_imm(Alu op, uint8_t reg, int32_t imm) { registers(true, {0x81}, op, reg); dword(imm); }
+    void alu32_imm(Alu op, const Mem &mem, uint32_t imm) { memory(false, {0x81}, op, mem); dword(imm); }
+    void alu64_imm(Alu op, const Mem &mem, int32_t imm) { memory(true, {0x81}, op, mem); dword(imm); }
+    void alu8_imm(Alu op, const Mem &mem, uint8_t imm) { memory(false, {0x80}, op, mem); byte(imm); }
+    void alu64_reg(Alu op, uint8_t dst, uint8_t src) { registers(true, {(uint8_t) (op * 8 + 1)}, src, dst); }
+    void imul32_imm(uint8_t reg, const Mem &mem, int32_t imm) { memory(false, {0x69}, reg, mem); dword(imm); }
+    void not32(uint8_t reg) { registers(false, {0xF7}, 2, reg); }
+    void test32(uint8_t a, uint8_t b) { registers(false, {0x85}, b, a); }
+    void test64(uint8_t a, uint8_t b) { registers(true, {0x85}, b, a); }
+    void test8_imm(uint8_t reg, uint8_t imm) { registers(false, {0xF6}, 0, reg); byte(imm); }
+    void shift32(Shift op, uint8_t reg, uint8_t imm) { registers(false, {0xC1}, op, reg); byte(imm); }
+    void shift32_cl(Shift op, uint8_t reg) { registers(false, {0xD3}, op, reg); }
+
+    // reg = condition (0 or 1)
+    void setcc(uint8_t cc, uint8_t reg)
+    {
+        registers(false, {0x0F, (uint8_t) (0x90 | cc)}, 0, reg);
+        movzx8_reg(reg, reg);
+    }
+
+    /**
+     * @brief      Calls function(RDI, RSI, RDX) (System V ABI)
+     * The stack is kept 16 bytes aligned by the prologue
+     */
+    void call(const void *function)
+    {
+        mov64_imm(RAX, (uint64_t) function);
+        registers(false, {0xFF}, 2, RAX);
+    }
+
+    void jump(uint8_t reg) { registers(false, {0xFF}, 4, reg); }
+
+    /**
+     * @brief      Conditional jump
+     * @return     Position of the offset to patch
+     */
+    size_t jcc(uint8_t cc)
+    {
+        opcode({0x0F, (uint8_t) (0x80 | cc)});
+        dword(0);
+        return size - 4;
+    }
+
+    /**
+     * @brief      Jump
+     * @return     Position of the offset to patch
+     */
+    size_t jmp()
+    {
+        byte(0xE9);
+        dword(0);
+        return size - 4;
+    }
+
+    void patch(size_t at, size_t target)
+    {
+        int32_t offset = target - (at + 4);
+        memcpy(code + at, &offset, sizeof(offset));
+    }
+
+    /**
+     * @brief      Land the given jumps here
+     */
+    void bind(size_t at)
+    {
+        patch(at, size);
+    }
+
+    void bind(std::vector<size_t> &jumps)
+    {
+        for (size_t at : jumps) {
+            bind(at);
+        }
+
+        jumps.clear();
+    }
+};
+
+
+Recompiler::~Recompiler()
+{
+#ifdef RECOMPILER_AVAILABLE
+    if (buffer) {
+        munmap(buffer, CODE_BUFFER_SIZE);
+    }
+#endif
+}
+
+
+/**
+ * @brief      Allocate the code buffer
+ * Code is written while the buffer is writable, then made executable
+ * @return     true in case of success, false if native code cannot run on
+ * this host
+ */
+bool Recompiler::init(CPU *cpu)
+{
+    this->cpu = cpu;
+
+    uint8_t *base = (uint8_t*) cpu;
+    offset_reg = (uint8_t*) cpu->reg.data() - base;
+    offset_PC = (uint8_t*) &cpu->PC - base;
+    offset_nextPC = (uint8_t*) &cpu->nextPC - base;
+    offset_cycles = (uint8_t*) &cpu->cycles - base;
+    offset_target = (uint8_t*) &cpu->target - base;
+    offset_isBranch = (uint8_t*) &cpu->isBranch - base;
+    offset_load_reg = (uint8_t*) &cpu->load_reg - base;
+    offset_load_value = (uint8_t*) &cpu->load_value - base;
+    offset_interrupt_pending = (uint8_t*) &cpu->interrupt_pending - base;
+    offset_indirect = (uint8_t*) cpu->indirect.data() - base;
+    offset_generation = (uint8_t*) &cpu->cache.generation - base;
+    offset_icache_lines = (uint8_t*) cpu->icache.lines - base;
+    offset_icache_enabled = (uint8_t*) &cpu->icache.enabled - base;
+    offset_fetch_cycles = (uint8_t*) &cpu->fetch_cycles - base;
+
+#ifdef RECOMPILER_AVAILABLE
+    if (buffer) {
+        return true;
+    }
+
+    void *memory = mmap(
+        nullptr, CODE_BUFFER_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+
+    if (memory == MAP_FAILED) {
+        error("Unable to allocate recompiler memory\n");
+        return false;
+    }
+
+    buffer = (uint8_t*) memory;
+    page_size = sysconf(_SC_PAGESIZE);
+
+    flush();
+
+    return true;
+#else
+    error("Recompiler only generates x86-64 code\n");
+
+    return false;
+#endif
+}
+
+
+/**
+ * @brief      Tells if native code can be generated on this host
+ */
+bool Recompiler::available()
+{
+    return buffer != nullptr;
+}
+
+
+/**
+ * @brief      Tells if the buffer may not hold another block
+ */
+bool Recompiler::full()
+{
+    return used + BLOCK_CODE_MAX_SIZE > CODE_BUFFER_SIZE;
+}
+
+
+/**
+ * @brief      Drop all generated code
+ * Blocks referencing it must be flushed as well
+ */
+void Recompiler::flush()
+{
+    used = 0;
+}
+
+
+/**
+ * @brief      Change the protection of the pages holding part of the buffer
+ * Never writable and executable at once
+ * @param[in]  executable  Executable once written, writable otherwise
+ * @return     true in case of success, false otherwise
+ */
+bool Recompiler::protect(size_t start, size_t end, bool executable)
+{
+#ifdef RECOMPILER_AVAILABLE
+    size_t first = start & ~(page_size - 1);
+    size_t last = (end + page_size - 1) & ~(page_size - 1);
+    int protection = executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE;
+
+    if (mprotect(buffer + first, last - first, protection) != 0) {
+        error("Unable to change the protection of recompiled code\n");
+        return false;
+    }
+
+    return true;
+#else
+    (void) start;
+    (void) end;
+    (void) executable;
+
+    return false;
+#endif
+}
+
+
+/**
+ * @brief      Fill a line missing from the instruction cache
+ * Called from generated code reaching the line through a cached address
+ */
+void Recompiler::fill(CPU *cpu, uint32_t address)
+{
+    cpu->fetch_line(address);
+}
+
+
+/**
+ * @brief      Drop the blocks covering a RAM word written by generated code
+ */
+void Recompiler::invalidate(CPU *cpu, uint32_t offset)
+{
+    cpu->cache.invalidate(offset);
+}
+
+
+/**
+ * @brief      Load through address decoding (I/O, unmapped, scratchpad
+ * padding), called from generated code
+ */
+template <typename T>
+uint32_t Recompiler::load(CPU *cpu, uint32_t address)
+{
+    return cpu->load<T>(address);
+}
+
+
+/**
+ * @brief      Store through address decoding (I/O, isolated cache,
+ * scratchpad padding), called from generated code
+ */
+template <typename T>
+void Recompiler::store(CPU *cpu, uint32_t address, uint32_t value)
+{
+    cpu->store<T>(address, (T) value);
+}
+
+
+/**
+ * @brief      Offset of a guest register from the CPU object
+ */
+int32_t Recompiler::reg(size_t index)
+{
+    return offset_reg + index * sizeof(uint32_t);
+}
+
+
+/**
+ * @brief      Add the cost of instructions executed inline to the cycles,
+ * and the fetch cost of the instructions reached since the last charge
+ * Uses ECX
+ */
+void Recompiler::charge(Emitter &emitter, size_t instructions)
+{
+    if (instructions > 0) {
+        emitter.alu64_imm(ALU_ADD, at(RBX, offset_cycles), instructions * INSTRUCTION_CYCLES);
+    }
+
+    if (fetched > 0) {
+        emitter.imul32_imm(RCX, at(RBX, offset_fetch_cycles), fetched);
+        emitter.alu64(ALU_ADD, at(RBX, offset_cycles), RCX);
+    }
+}
+
+
+/**
+ * @brief      PC to the instruction at the given physical address, no branch
+ * pending
+ */
+void Recompiler::set_PC(Emitter &emitter, uint32_t address)
+{
+    emitter.lea32(RAX, at(R13, address));
+    emitter.mov32(at(RBX, offset_PC), RAX);
+    emitter.alu32_imm(ALU_ADD, RAX, INSTRUCTION_LENGTH);
+    emitter.mov32(at(RBX, offset_nextPC), RAX);
+}
+
+
+/**
+ * @brief      EAX = guest address the branch goes to, once its delay slot is
+ * over
+ */
+void Recompiler::branch_destination(Emitter &emitter)
+{
+    switch(branch) {
+    case BRANCH_CONDITIONAL:
+        emitter.lea32(RAX, at(R13, branch_address + 2 * INSTRUCTION_LENGTH));
+        emitter.lea32(RCX, at(R13, branch_target));
+        emitter.test32(R12, R12);
+        emitter.cmov32(CC_NE, RAX, RCX);
+        break;
+    case BRANCH_JUMP:
+        // Region of the delay slot
+        emitter.lea32(RAX, at(R13, branch_address + INSTRUCTION_LENGTH));
+        emitter.alu32_imm(ALU_AND, RAX, 0xF0000000);
+        emitter.alu32_imm(ALU_OR, RAX, branch_target);
+        break;
+    case BRANCH_INDIRECT:
+        emitter.mov32_reg(RAX, R12);
+        break;
+    case BRANCH_NONE:
+        break;
+    }
+}
+
+
+/**
+ * @brief      Write back the CPU state as the interpreter has it before the
+ * given instruction: it can then be executed by its handler
+ */
+void Recompiler::sync(Emitter &emitter, size_t index)
+{
+    charge(emitter, executed);
+    executed = 0;
+    fetched = 0;
+
+    uint32_t address = block->address + index * INSTRUCTION_LENGTH;
+
+    if (branch == BRANCH_NONE) {
+        set_PC(emitter, address);
+    } else {
+        // Delay slot: PC goes to the branch target after it
+        branch_destination(emitter);
+        emitter.mov32(at(RBX, offset_nextPC), RAX);
+        emitter.lea32(RAX, at(R13, address));
+        emitter.mov32(at(RBX, offset_PC), RAX);
+        emitter.mov8_imm(at(RBX, offset_isBranch), 1);
+    }
+
+    if (pending == PENDING_STATIC) {
+        emitter.mov64_imm(at(RBX, offset_load_reg), pending_reg);
+    }
+}
+
+
+/**
+ * @brief      Write back the load in flight once the instruction is over
+ * @param[in]  written  Register written by the instruction (0 if none): it
+ * wins over the load
+ */
+void Recompiler::commit(Emitter &emitter, size_t written)
+{
+    if (pending == PENDING_STATIC && pending_reg != written) {
+        emitter.mov32(RCX, at(RBX, offset_load_value));
+        emitter.mov32(at(RBX, reg(pending_reg)), RCX);
+    }
+
+    if (pending == PENDING_DYNAMIC) {
+        emitter.mov64(RCX, at(RBX, offset_load_reg));
+
+        size_t skip = 0;
+        if (written != 0) {
+            emitter.alu64_imm(ALU_CMP, RCX, written);
+            skip = emitter.jcc(CC_E);
+        }
+
+        emitter.mov32(RDX, at(RBX, offset_load_value));
+        emitter.mov32(at(RBX, RCX, 4, offset_reg), RDX);
+        emitter.mov32_imm(at(RBX, reg(0)), 0);
+
+        if (written != 0) {
+            emitter.bind(skip);
+        }
+
+        emitter.mov64_imm(at(RBX, offset_load_reg), 0);
+    }
+
+    pending = PENDING_NONE;
+}
+
+
+/**
+ * @brief      Leave the block for the guest address in EAX
+ * @param      successor  Where the successor is looked for (links or
+ * indirect cache)
+ */
+void Recompiler::leave(Emitter &emitter, std::vector<size_t> &successor)
+{
+    charge(emitter, executed);
+
+    emitter.mov32(at(RBX, offset_PC), RAX);
+    emitter.lea32(RCX, at(RAX, INSTRUCTION_LENGTH));
+    emitter.mov32(at(RBX, offset_nextPC), RCX);
+
+    if (pending == PENDING_STATIC) {
+        emitter.mov64_imm(at(RBX, offset_load_reg), pending_reg);
+    }
+
+    successor.push_back(emitter.jmp());
+}
+
+
+/**
+ * @brief      Fetch cost of the instructions of the block entered
+ * Same as Interconnect::get_fetch_cycles when entered through an uncached
+ * address, the lines are fetched through the instruction cache otherwise
+ */
+void Recompiler::emit_fetch(Emitter &emitter)
+{
+    const MemoryPage &page = cpu->inter->read_pages[block->address >> MEMORY_PAGE_SHIFT];
+
+    emitter.mov32_imm(at(RBX, offset_fetch_cycles), 0);
+    emitter.alu8_imm(ALU_CMP, at(RBX, offset_icache_enabled), 0);
+    size_t disabled = emitter.jcc(CC_E);
+    emitter.alu32_imm(ALU_CMP, at(RBX, offset_PC), ICACHE_UNCACHED_START);
+    size_t cached = emitter.jcc(CC_B);
+
+    emitter.bind(disabled);
+    emitter.mov64_imm(RAX, (uint64_t) &page.cycles);
+    emitter.mov64(RAX, at(RAX, 0));
+    emitter.mov32(RAX, at(RAX, (sizeof(uint32_t) >> 1) * sizeof(uint32_t)));
+    emitter.mov32(at(RBX, offset_fetch_cycles), RAX);
+
+    emitter.bind(cached);
+}
+
+
+/**
+ * @brief      Fetch the instruction cache line of an instruction, on
+ * reaching it: same as the interpreter when entered through a cached address
+ */
+void Recompiler::emit_icache(Emitter &emitter, size_t index)
+{
+    uint32_t address = block->address + index * INSTRUCTION_LENGTH;
+    int32_t line = offset_icache_lines + ICache::index(address) * sizeof(ICacheLine);
+    std::vector<size_t> skip;
+
+    emitter.alu8_imm(ALU_CMP, at(RBX, offset_icache_enabled), 0);
+    skip.push_back(emitter.jcc(CC_E));
+    emitter.lea32(RSI, at(R13, address));
+    emitter.alu32_imm(ALU_CMP, RSI, ICACHE_UNCACHED_START);
+    skip.push_back(emitter.jcc(CC_AE));
+
+    emitter.alu32_imm(ALU_CMP, at(RBX, line + offsetof(ICacheLine, tag)), ICache::tag(address));
+    skip.push_back(emitter.jcc(CC_E));
+
+    emitter.mov64_reg(RDI, RBX);
+    emitter.call((const void*) &Recompiler::fill);
+
+    emitter.bind(skip);
+}
+
+
+/**
+ * @brief      Execute an instruction through its interpreter handler
+ * Returns to the dispatcher if it left the block (exception, HLE call) or if
+ * it overwrote the block
+ */
+void Recompiler::emit_interpreted(Emitter &emitter, size_t index)
+{
+    const Op &op = block->ops[index];
+
+    sync(emitter, index);
+
+    emitter.mov64_reg(RDI, RBX);
+    emitter.mov64_imm(RSI, (uint64_t) &op);
+    emitter.call((const void*) op.handler);
+
+    pending = is_load(op.data) ? PENDING_DYNAMIC : PENDING_NONE;
+
+    // Delay slot and branch ending the block: exits check PC
+    if (branch != BRANCH_NONE || is_branch(op.data)) {
+        return;
+    }
+
+    uint32_t next = block->address + (index + 1) * INSTRUCTION_LENGTH;
+
+    emitter.lea32(RCX, at(R13, next));
+    emitter.alu32(ALU_CMP, RCX, at(RBX, offset_PC));
+    returns.push_back(emitter.jcc(CC_NE));
+
+    emitter.mov64_imm(RAX, (uint64_t) &block->valid);
+    emitter.alu8_imm(ALU_CMP, at(RAX, 0), 0);
+    returns.push_back(emitter.jcc(CC_E));
+}
+
+
+/**
+ * @brief      Emit an instruction only writing a general register
+ * The result goes straight to the register file
+ * @return     Register written (0 if none)
+ */
+size_t Recompiler::emit_alu(Emitter &emitter, const Op &op)
+{
+    size_t target = get_destination(op.data);
+
+    // Writes to $zero are discarded
+    if (target == 0) {
+        return 0;
+    }
+
+    switch(get_primary_opcode(op.data)) {
+    case 0x00:
+        switch(get_secondary_opcode(op.data)) {
+        case 0x00: emitter.mov32(RAX, at(RBX, reg(op.rt))); emitter.shift32(SHIFT_SHL, RAX, op.imm5); break;
+        case 0x02: emitter.mov32(RAX, at(RBX, reg(op.rt))); emitter.shift32(SHIFT_SHR, RAX, op.imm5); break;
+        case 0x03: emitter.mov32(RAX, at(RBX, reg(op.rt))); emitter.shift32(SHIFT_SAR, RAX, op.imm5); break;
+        case 0x04:
+            emitter.mov32(RAX, at(RBX, reg(op.rt)));
+            emitter.mov32(RCX, at(RBX, reg(op.rs)));
+            emitter.shift32_cl(SHIFT_SHL, RAX);
+            break;
+        case 0x06:
+            emitter.mov32(RAX, at(RBX, reg(op.rt)));
+            emitter.mov32(RCX, at(RBX, reg(op.rs)));
+            emitter.shift32_cl(SHIFT_SHR, RAX);
+            break;
+        case 0x07:
+            emitter.mov32(RAX, at(RBX, reg(op.rt)));
+            emitter.mov32(RCX, at(RBX, reg(op.rs)));
+            emitter.shift32_cl(SHIFT_SAR, RAX);
+            break;
+        case 0x21: emitter.mov32(RAX, at(RBX, reg(op.rs))); emitter.alu32(ALU_ADD, RAX, at(RBX, reg(op.rt))); break;
+        case 0x23: emitter.mov32(RAX, at(RBX, reg(op.rs))); emitter.alu32(ALU_SUB, RAX, at(RBX, reg(op.rt))); break;
+        case 0x24: emitter.mov32(RAX, at(RBX, reg(op.rs))); emitter.alu32(ALU_AND, RAX, at(RBX, reg(op.rt))); break;
+        case 0x25: emitter.mov32(RAX, at(RBX, reg(op.rs))); emitter.alu32(ALU_OR, RAX, at(RBX, reg(op.rt))); break;
+        case 0x26: emitter.mov32(RAX, at(RBX, reg(op.rs))); emitter.alu32(ALU_XOR, RAX, at(RBX, reg(op.rt))); break;
+        case 0x27:
+            emitter.mov32(RAX, at(RBX, reg(op.rs)));
+            emitter.alu32(ALU_OR, RAX, at(RBX, reg(op.rt)));
+            emitter.not32(RAX);
+            break;
+        case 0x2A:
+            emitter.mov32(RAX, at(RBX, reg(op.rs)));
+            emitter.alu32(ALU_CMP, RAX, at(RBX, reg(op.rt)));
+            emitter.setcc(CC_L, RAX);
+            break;
+        case 0x2B:
+            emitter.mov32(RAX, at(RBX, reg(op.rs)));
+            emitter.alu32(ALU_CMP, RAX, at(RBX, reg(op.rt)));
+            emitter.setcc(CC_B, RAX);
+            break;
+        }
+        break;
+    case 0x09:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32_imm(ALU_ADD, RAX, op.imm);
+        break;
+    case 0x0A:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32_imm(ALU_CMP, RAX, op.imm);
+        emitter.setcc(CC_L, RAX);
+        break;
+    case 0x0B:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32_imm(ALU_CMP, RAX, op.imm);
+        emitter.setcc(CC_B, RAX);
+        break;
+    case 0x0C:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32_imm(ALU_AND, RAX, (uint16_t) op.imm);
+        break;
+    case 0x0D:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32_imm(ALU_OR, RAX, (uint16_t) op.imm);
+        break;
+    case 0x0E:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32_imm(ALU_XOR, RAX, (uint16_t) op.imm);
+        break;
+    case 0x0F:
+        emitter.mov32_imm(RAX, (uint16_t) op.imm << 16);
+        break;
+    }
+
+    emitter.mov32(at(RBX, reg(target)), RAX);
+
+    return target;
+}
+
+
+/**
+ * @brief      EAX = guest address accessed by a load or store
+ */
+void Recompiler::emit_address(Emitter &emitter, const Op &op)
+{
+    if (op.rs == 0) {
+        emitter.mov32_imm(RAX, op.imm);
+        return;
+    }
+
+    emitter.mov32(RAX, at(RBX, reg(op.rs)));
+    if (op.imm != 0) {
+        emitter.alu32_imm(ALU_ADD, RAX, op.imm);
+    }
+}
+
+
+/**
+ * @brief      RDX = host address of the guest address in EAX, through the
+ * page table (same as Interconnect::load and Interconnect::store)
+ * Loads are charged the access cost of the page. EDI keeps the guest address
+ * for the slow path, taken for anything but RAM, scratchpad and BIOS, and
+ * stores keep the physical address in ESI
+ */
+void Recompiler::emit_lookup(Emitter &emitter, bool write, size_t size, std::vector<size_t> &slow)
+{
+    Interconnect *inter = cpu->inter;
+
+    emitter.mov32_reg(RDI, RAX);
+
+    // mask_region
+    emitter.mov32_reg(RCX, RAX);
+    emitter.shift32(SHIFT_SHR, RCX, 29);
+    emitter.mov64_imm(RDX, (uint64_t) REGION_MASK);
+    emitter.alu32(ALU_AND, RAX, at(RDX, RCX, 4, 0));
+
+    // Past the scratchpad, in its page
+    emitter.lea32(RCX, at(RAX, -SCRATCHPAD_PADDING_START));
+    emitter.alu32_imm(ALU_CMP, RCX, SCRATCHPAD_PADDING_SIZE);
+    slow.push_back(emitter.jcc(CC_B));
+
+    emitter.mov32_reg(RCX, RAX);
+    emitter.shift32(SHIFT_SHR, RCX, MEMORY_PAGE_SHIFT);
+    emitter.alu32_imm(ALU_CMP, RCX, MEMORY_PAGE_COUNT);
+    slow.push_back(emitter.jcc(CC_AE));
+
+    if (write) {
+        emitter.mov32_reg(RSI, RAX);
+    }
+    emitter.alu32_imm(ALU_AND, RAX, MEMORY_PAGE_MASK);
+
+    if (write) {
+        emitter.mov64_imm(RDX, (uint64_t) inter->write_pages);
+        emitter.mov64(RDX, at(RDX, RCX, 8, 0));
+        emitter.test64(RDX, RDX);
+        slow.push_back(emitter.jcc(CC_E));
+    } else {
+        emitter.shift32(SHIFT_SHL, RCX, 4);
+        emitter.mov64_imm(RDX, (uint64_t) inter->read_pages);
+        emitter.alu64_reg(ALU_ADD, RDX, RCX);
+        emitter.mov64(RCX, at(RDX, offsetof(MemoryPage, memory)));
+        emitter.test64(RCX, RCX);
+        slow.push_back(emitter.jcc(CC_E));
+
+        emitter.mov64(RSI, at(RDX, offsetof(MemoryPage, cycles)));
+        emitter.mov32(RSI, at(RSI, (size >> 1) * sizeof(uint32_t)));
+        emitter.alu64(ALU_ADD, at(RBX, offset_cycles), RSI);
+        emitter.mov64_reg(RDX, RCX);
+    }
+
+    emitter.alu64_reg(ALU_ADD, RDX, RAX);
+}
+
+
+/**
+ * @brief      Unaligned access: the handler raises the exception
+ * The instruction was charged already, its handler charges it again
+ */
+void Recompiler::emit_misaligned(Emitter &emitter, size_t index)
+{
+    const Op &op = block->ops[index];
+
+    emitter.alu64_imm(ALU_SUB, at(RBX, offset_cycles), INSTRUCTION_CYCLES);
+    sync(emitter, index);
+
+    emitter.mov64_reg(RDI, RBX);
+    emitter.mov64_imm(RSI, (uint64_t) &op);
+    emitter.call((const void*) op.handler);
+
+    returns.push_back(emitter.jmp());
+}
+
+
+/**
+ * @brief      Emit LB, LBU, LH, LHU or LW
+ * The value stays in load_value until the next instruction is over
+ */
+void Recompiler::emit_load(Emitter &emitter, size_t index)
+{
+    const Op &op = block->ops[index];
+    uint8_t opcode = get_primary_opcode(op.data);
+    size_t size = opcode == 0x23 ? 4 : (opcode == 0x21 || opcode == 0x25) ? 2 : 1;
+    bool sign = opcode == 0x20 || opcode == 0x21;
+
+    // Device registers may read the cycle counter
+    charge(emitter, executed + 1);
+    executed = 0;
+    fetched = 0;
+
+    emit_address(emitter, op);
+
+    size_t misaligned = 0;
+    if (size > 1) {
+        emitter.test8_imm(RAX, size - 1);
+        misaligned = emitter.jcc(CC_NE);
+    }
+
+    std::vector<size_t> slow;
+    emit_lookup(emitter, false, size, slow);
+
+    switch(size) {
+    case 1:
+        sign ? emitter.movsx8(RSI, at(RDX, 0)) : emitter.movzx8(RSI, at(RDX, 0));
+        break;
+    case 2:
+        sign ? emitter.movsx16(RSI, at(RDX, 0)) : emitter.movzx16(RSI, at(RDX, 0));
+        break;
+    default:
+        emitter.mov32(RSI, at(RDX, 0));
+        break;
+    }
+
+    size_t done = emitter.jmp();
+
+    emitter.bind(slow);
+    emitter.mov32_reg(RSI, RDI);
+    emitter.mov64_reg(RDI, RBX);
+
+    switch(size) {
+    case 1:
+        emitter.call((const void*) &Recompiler::load<uint8_t>);
+        sign ? emitter.movsx8_reg(RSI, RAX) : emitter.mov32_reg(RSI, RAX);
+        break;
+    case 2:
+        emitter.call((const void*) &Recompiler::load<uint16_t>);
+        sign ? emitter.movsx16_reg(RSI, RAX) : emitter.mov32_reg(RSI, RAX);
+        break;
+    default:
+        emitter.call((const void*) &Recompiler::load<uint32_t>);
+        emitter.mov32_reg(RSI, RAX);
+        break;
+    }
+
+    if (size > 1) {
+        size_t loaded = emitter.jmp();
+
+        emitter.bind(misaligned);
+        emit_misaligned(emitter, index);
+
+        emitter.bind(loaded);
+    }
+
+    emitter.bind(done);
+
+    // Loads do not cancel the one in flight
+    commit(emitter, 0);
+
+    if (op.rt != 0) {
+        emitter.mov32(at(RBX, offset_load_value), RSI);
+
+        pending = PENDING_STATIC;
+        pending_reg = op.rt;
+    }
+}
+
+
+/**
+ * @brief      Emit SB, SH or SW
+ * Writing over compiled code drops it: the block is left if it was dropped
+ */
+void Recompiler::emit_store(Emitter &emitter, size_t index)
+{
+    const Op &op = block->ops[index];
+    uint8_t opcode = get_primary_opcode(op.data);
+    size_t size = opcode == 0x2B ? 4 : opcode == 0x29 ? 2 : 1;
+    bool last = index + 1 == block->ops.size();
+
+    // Device registers may read the cycle counter
+    charge(emitter, executed + 1);
+    executed = 0;
+    fetched = 0;
+
+    emit_address(emitter, op);
+
+    size_t misaligned = 0;
+    if (size > 1) {
+        emitter.test8_imm(RAX, size - 1);
+        misaligned = emitter.jcc(CC_NE);
+    }
+
+    std::vector<size_t> slow;
+    emit_lookup(emitter, true, size, slow);
+
+    emitter.mov32(RCX, at(RBX, reg(op.rt)));
+    switch(size) {
+    case 1: emitter.mov8(at(RDX, 0), RCX); break;
+    case 2: emitter.mov16(at(RDX, 0), RCX); break;
+    default: emitter.mov32(at(RDX, 0), RCX); break;
+    }
+
+    // Code only runs from RAM
+    std::vector<size_t> done;
+    emitter.alu32_imm(ALU_CMP, RSI, RAM_MIRROR_SIZE);
+    done.push_back(emitter.jcc(CC_AE));
+
+    emitter.alu32_imm(ALU_AND, RSI, (RAM_SIZE) - 1);
+    emitter.mov32_reg(RDX, RSI);
+    emitter.shift32(SHIFT_SHR, RDX, 2);
+    emitter.mov64_imm(RAX, (uint64_t) cpu->cache.ram_code.data());
+    emitter.alu8_imm(ALU_CMP, at(RAX, RDX, 1, 0), 0);
+    done.push_back(emitter.jcc(CC_E));
+
+    emitter.mov64_reg(RDI, RBX);
+    emitter.call((const void*) &Recompiler::invalidate);
+    size_t written = emitter.jmp();
+
+    emitter.bind(slow);
+    emitter.mov32_reg(RSI, RDI);
+    emitter.mov32(RDX, at(RBX, reg(op.rt)));
+    emitter.mov64_reg(RDI, RBX);
+
+    switch(size) {
+    case 1: emitter.call((const void*) &Recompiler::store<uint8_t>); break;
+    case 2: emitter.call((const void*) &Recompiler::store<uint16_t>); break;
+    default: emitter.call((const void*) &Recompiler::store<uint32_t>); break;
+    }
+
+    emitter.bind(written);
+
+    // Block dropped: leave right after the store (the last instruction
+    // leaves anyway)
+    if (!last) {
+        emitter.mov64_imm(RAX, (uint64_t) &block->valid);
+        emitter.alu8_imm(ALU_CMP, at(RAX, 0), 0);
+        done.push_back(emitter.jcc(CC_NE));
+
+        PendingLoad before = pending;
+        commit(emitter, 0);
+        set_PC(emitter, block->address + (index + 1) * INSTRUCTION_LENGTH);
+        returns.push_back(emitter.jmp());
+        pending = before;
+    }
+
+    if (size > 1) {
+        emitter.bind(misaligned);
+        emit_misaligned(emitter, index);
+    }
+
+    emitter.bind(done);
+
+    commit(emitter, 0);
+}
+
+
+/**
+ * @brief      Emit the branch ending the block
+ * Its condition (or target) is kept in R12 while its delay slot runs
+ */
+void Recompiler::emit_branch(Emitter &emitter, size_t index)
+{
+    const Op &op = block->ops[index];
+    uint32_t address = block->address + index * INSTRUCTION_LENGTH;
+    uint32_t link = address + 2 * INSTRUCTION_LENGTH;
+    size_t written = 0;
+
+    branch_address = address;
+    branch_target = address + INSTRUCTION_LENGTH + (op.imm << 2);
+    branch = BRANCH_CONDITIONAL;
+
+    switch(get_primary_opcode(op.data)) {
+    case 0x00:
+        emitter.mov32(R12, at(RBX, reg(op.rs)));
+        branch = BRANCH_INDIRECT;
+
+        // JALR
+        if (get_secondary_opcode(op.data) == 0x09 && op.rd != 0) {
+            emitter.lea32(RAX, at(R13, link));
+            emitter.mov32(at(RBX, reg(op.rd)), RAX);
+            written = op.rd;
+        }
+        break;
+    case 0x01:
+        emitter.alu32_imm(ALU_CMP, at(RBX, reg(op.rs)), 0);
+        emitter.setcc(op.rt & BcondZ_BGEZ_MASK ? CC_GE : CC_L, RAX);
+        emitter.mov32_reg(R12, RAX);
+
+        // Link only when taken
+        if (op.rt & BcondZ_LINK_MASK) {
+            emitter.test32(R12, R12);
+            size_t not_taken = emitter.jcc(CC_E);
+
+            PendingLoad before = pending;
+            emitter.lea32(RAX, at(R13, link));
+            emitter.mov32(at(RBX, reg(RA)), RAX);
+            commit(emitter, RA);
+            size_t linked = emitter.jmp();
+            pending = before;
+
+            emitter.bind(not_taken);
+            commit(emitter, 0);
+            emitter.bind(linked);
+            return;
+        }
+        break;
+    case 0x02:
+        branch_target = get_imm26(op.data) << 2;
+        branch = BRANCH_JUMP;
+        break;
+    case 0x03:
+        branch_target = get_imm26(op.data) << 2;
+        branch = BRANCH_JUMP;
+
+        emitter.lea32(RAX, at(R13, link));
+        emitter.mov32(at(RBX, reg(RA)), RAX);
+        written = RA;
+        break;
+    case 0x04:
+    case 0x05:
+        emitter.mov32(RAX, at(RBX, reg(op.rs)));
+        emitter.alu32(ALU_CMP, RAX, at(RBX, reg(op.rt)));
+        emitter.setcc(get_primary_opcode(op.data) == 0x04 ? CC_E : CC_NE, RAX);
+        emitter.mov32_reg(R12, RAX);
+        break;
+    case 0x06:
+    case 0x07:
+        emitter.alu32_imm(ALU_CMP, at(RBX, reg(op.rs)), 0);
+        emitter.setcc(get_primary_opcode(op.data) == 0x06 ? CC_LE : CC_G, RAX);
+        emitter.mov32_reg(R12, RAX);
+        break;
+    }
+
+    commit(emitter, written);
+}
+
+
+/**
+ * @brief      Leave the block once its last instruction is over
+ */
+void Recompiler::emit_exit(Emitter &emitter)
+{
+    const Op &last = block->ops.back();
+    uint32_t end = block->address + block->ops.size() * INSTRUCTION_LENGTH;
+
+    // Branch without its delay slot: the dispatcher runs the delay slot
+    if (branch == BRANCH_NONE && is_branch(last.data)) {
+        returns.push_back(emitter.jmp());
+        return;
+    }
+
+    if (branch == BRANCH_NONE) {
+        emitter.lea32(RAX, at(R13, end));
+        leave(emitter, links);
+        return;
+    }
+
+    // Delay slot interpreted: PC is up to date
+    if (!is_pure(last.data) && !is_inline_memory(last.data)) {
+        if (is_branch(last.data)) {
+            returns.push_back(emitter.jmp());
+            return;
+        }
+
+        emitter.mov32(RAX, at(RBX, offset_PC));
+        (branch == BRANCH_INDIRECT ? indirects : links).push_back(emitter.jmp());
+        return;
+    }
+
+    switch(branch) {
+    case BRANCH_CONDITIONAL: {
+        emitter.test32(R12, R12);
+        size_t not_taken = emitter.jcc(CC_E);
+
+        emitter.lea32(RAX, at(R13, branch_target));
+        leave(emitter, links);
+
+        emitter.bind(not_taken);
+        emitter.lea32(RAX, at(R13, end));
+        leave(emitter, links);
+        break;
+    }
+    case BRANCH_JUMP:
+        branch_destination(emitter);
+        leave(emitter, links);
+        break;
+    case BRANCH_INDIRECT:
+        branch_destination(emitter);
+        leave(emitter, indirects);
+        break;
+    case BRANCH_NONE:
+        break;
+    }
+}
+
+
+/**
+ * @brief      Continue to the native code of the successor at the guest
+ * address in EAX, if known and compiled, or return to the dispatcher
+ */
+void Recompiler::emit_successors(Emitter &emitter)
+{
+    std::vector<size_t> found;
+
+    // Returns to the dispatcher once the target is reached, or to take an
+    // interrupt. Wait loops let it skip to the next event
+    auto budget = [&]() {
+        if (block->idle) {
+            returns.push_back(emitter.jmp());
+            return;
+        }
+
+        emitter.mov64(RCX, at(RBX, offset_cycles));
+        emitter.alu64(ALU_CMP, RCX, at(RBX, offset_target));
+        returns.push_back(emitter.jcc(CC_AE));
+        emitter.alu8_imm(ALU_CMP, at(RBX, offset_interrupt_pending), 0);
+        returns.push_back(emitter.jcc(CC_NE));
+        emitter.mov64(RDX, at(RBX, offset_generation));
+    };
+
+    if (!links.empty()) {
+        emitter.bind(links);
+        budget();
+
+        emitter.mov64_imm(RCX, (uint64_t) block->links);
+        for (size_t i=0; i<BLOCK_LINKS; i++) {
+            int32_t link = i * sizeof(Link);
+
+            emitter.alu32(ALU_CMP, RAX, at(RCX, link + offsetof(Link, PC)));
+            size_t other = emitter.jcc(CC_NE);
+            emitter.alu64(ALU_CMP, RDX, at(RCX, link + offsetof(Link, generation)));
+            size_t stale = emitter.jcc(CC_NE);
+
+            emitter.mov64(RCX, at(RCX, link + offsetof(Link, block)));
+            found.push_back(emitter.jmp());
+
+            emitter.bind(other);
+            emitter.bind(stale);
+        }
+
+        returns.push_back(emitter.jmp());
+    }
+
+    if (!indirects.empty()) {
+        emitter.bind(indirects);
+        budget();
+
+        // Entry (PC >> 2) % INDIRECT_CACHE_SIZE, 24 bytes each
+        emitter.mov32_reg(RCX, RAX);
+        emitter.shift32(SHIFT_SHR, RCX, 2);
+        emitter.alu32_imm(ALU_AND, RCX, INDIRECT_CACHE_SIZE - 1);
+        emitter.lea64(RCX, at(RCX, RCX, 2, 0));
+
+        int32_t entry = offset_indirect;
+        emitter.alu32(ALU_CMP, RAX, at(RBX, RCX, 8, entry + offsetof(Link, PC)));
+        returns.push_back(emitter.jcc(CC_NE));
+        emitter.alu64(ALU_CMP, RDX, at(RBX, RCX, 8, entry + offsetof(Link, generation)));
+        returns.push_back(emitter.jcc(CC_NE));
+
+        emitter.mov64(RCX, at(RBX, RCX, 8, entry + offsetof(Link, block)));
+        found.push_back(emitter.jmp());
+    }
+
+    if (!found.empty()) {
+        int32_t code = (const uint8_t*) &block->code - (const uint8_t*) block;
+
+        emitter.bind(found);
+        emitter.mov64(RCX, at(RCX, code));
+        emitter.test64(RCX, RCX);
+        returns.push_back(emitter.jcc(CC_E));
+        emitter.alu64_imm(ALU_ADD, RCX, PROLOGUE_SIZE);
+        emitter.jump(RCX);
+    }
+}
+
+
+/**
+ * @brief      Generate native code for the given block
+ *
+ * The code returns the block it was left from: the last of the chained
+ * blocks. The load delay and the branch delay slot are resolved when
+ * compiling, the CPU state is only written back before calling the
+ * interpreter and when leaving.
+ *
+ * @return     The native block or nullptr if it cannot be generated
+ */
+native_block Recompiler::compile(const Block *block)
+{
+    if (!available() || full()) {
+        return nullptr;
+    }
+
+    if (!protect(used, used + BLOCK_CODE_MAX_SIZE, false)) {
+        return nullptr;
+    }
+
+    this->block = block;
+    pending = PENDING_DYNAMIC;
+    executed = 0;
+    fetched = 0;
+    branch = BRANCH_NONE;
+    returns.clear();
+    links.clear();
+    indirects.clear();
+
+    Emitter emitter(buffer + used);
+
+    // Callee saved registers, 16 bytes aligned stack for the calls
+    emitter.push(RBX);
+    emitter.push(R12);
+    emitter.push(R13);
+    emitter.mov64_reg(RBX, RDI);
+
+    // Chained blocks enter here, with PC at their first instruction
+    if (emitter.position() != PROLOGUE_SIZE) {
+        error("Recompiler prologue is %zu bytes\n", emitter.position());
+        exit(1);
+    }
+
+    emitter.mov32(R13, at(RBX, offset_PC));
+    emitter.alu32_imm(ALU_SUB, R13, block->address);
+
+    emit_fetch(emitter);
+
+    for (size_t i=0; i<block->ops.size(); i++) {
+        const Op &op = block->ops[i];
+        bool last = i + 1 == block->ops.size();
+
+        // Fetched on reaching them, charged with the instructions
+        if (i == 0 || (block->address + i * INSTRUCTION_LENGTH) % ICACHE_LINE_SIZE == 0) {
+            emit_icache(emitter, i);
+        }
+        fetched++;
+
+        if (is_branch(op.data) && branch == BRANCH_NONE && !last) {
+            emit_branch(emitter, i);
+            executed++;
+        } else if (is_pure(op.data)) {
+            commit(emitter, emit_alu(emitter, op));
+            executed++;
+        } else if (is_inline_memory(op.data)) {
+            if (get_primary_opcode(op.data) < 0x28) {
+                emit_load(emitter, i);
+            } else {
+                emit_store(emitter, i);
+            }
+        } else {
+            emit_interpreted(emitter, i);
+        }
+    }
+
+    emit_exit(emitter);
+    emit_successors(emitter);
+
+    emitter.bind(returns);
+    emitter.mov64_imm(RAX, (uint64_t) block);
+    emitter.pop(R13);
+    emitter.pop(R12);
+    emitter.pop(RBX);
+    emitter.ret();
+
+    if (emitter.position() > BLOCK_CODE_MAX_SIZE) {
+        error("Recompiled block at 0x%08x overflows: %zu bytes\n", block->address, emitter.position());
+        exit(1);
+    }
+
+    if (!protect(used, used + emitter.position(), true)) {
+        return nullptr;
+    }
+
+    native_block code = (native_block) (buffer + used);
+
+    // Keep blocks 16 bytes aligned
+    used += (emitter.position() + 15) & ~15;
+
+    return code;
+}
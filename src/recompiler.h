@@ -0,0 +1,134 @@
+#ifndef RECOMPILER_H
+#define RECOMPILER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "block.h"
+
+#define CODE_BUFFER_SIZE        16 * 1024 * 1024
+#define OP_CODE_MAX_SIZE        512     // Generated code of an instruction at most
+#define BLOCK_CODE_MAX_SIZE     (BLOCK_MAX_SIZE * OP_CODE_MAX_SIZE + 1024)
+#define PROLOGUE_SIZE           8       // Chained blocks are entered past it
+
+class CPU;
+class Emitter;
+
+
+/**
+ * @brief      Load in flight while compiling an instruction
+ */
+enum PendingLoad {
+    PENDING_NONE,
+    PENDING_STATIC,         // Loaded by the block: value in load_value
+    PENDING_DYNAMIC,        // Left in load_reg/load_value (previous block,
+                            // interpreted instruction)
+};
+
+
+/**
+ * @brief      Jump ending the block being compiled
+ */
+enum BranchKind {
+    BRANCH_NONE,            // Block ends on its size
+    BRANCH_CONDITIONAL,     // BcondZ BEQ BNE BLEZ BGTZ: taken if R12
+    BRANCH_JUMP,            // J JAL
+    BRANCH_INDIRECT,        // JR JALR: target in R12
+};
+
+
+/**
+ * @brief      x86-64 dynamic recompiler
+ *
+ * Translates pre-decoded blocks to native code. ALU instructions, loads and
+ * stores (RAM, scratchpad and BIOS through the page table) and branches are
+ * emitted inline, the load delay is resolved when compiling. Other
+ * instructions call back the interpreter handlers.
+ *
+ * Blocks ending on a fixed target or an indirect jump continue to the
+ * native code of their successor when the links of the block or the
+ * indirect target cache know it: they only return to the dispatcher when the
+ * successor is unknown, when an interrupt is pending or once the cycle
+ * target is reached.
+ */
+class Recompiler {
+    CPU *cpu = nullptr;
+
+    uint8_t *buffer = nullptr;      // Generated code, executable once written
+    size_t used = 0;
+    size_t page_size = 0;
+
+    // Offsets of the CPU state from the CPU object
+    int32_t offset_reg;
+    int32_t offset_PC;
+    int32_t offset_nextPC;
+    int32_t offset_cycles;
+    int32_t offset_target;
+    int32_t offset_isBranch;
+    int32_t offset_load_reg;
+    int32_t offset_load_value;
+    int32_t offset_interrupt_pending;
+    int32_t offset_indirect;
+    int32_t offset_generation;
+    int32_t offset_icache_lines;
+    int32_t offset_icache_enabled;
+    int32_t offset_fetch_cycles;
+
+    // Block being compiled
+    const Block *block;
+    PendingLoad pending;
+    size_t pending_reg;
+    size_t executed;                // Instructions not charged yet
+    size_t fetched;                 // Instructions whose fetch is not charged yet
+    BranchKind branch;
+    uint32_t branch_address;        // Physical address of the branch
+    uint32_t branch_target;         // Physical address or J field
+    std::vector<size_t> returns;    // Jumps back to the dispatcher
+    std::vector<size_t> links;      // Jumps to the successor in the links
+    std::vector<size_t> indirects;  // Jumps to the successor in the indirect cache
+
+    static void fill(CPU *cpu, uint32_t address);
+    static void invalidate(CPU *cpu, uint32_t offset);
+
+    template <typename T>
+    static uint32_t load(CPU *cpu, uint32_t address);
+
+    template <typename T>
+    static void store(CPU *cpu, uint32_t address, uint32_t value);
+
+    bool protect(size_t start, size_t end, bool executable);
+
+    int32_t reg(size_t index);
+    void charge(Emitter &emitter, size_t instructions);
+    void set_PC(Emitter &emitter, uint32_t address);
+    void branch_destination(Emitter &emitter);
+    void sync(Emitter &emitter, size_t index);
+    void commit(Emitter &emitter, size_t written);
+    void leave(Emitter &emitter, std::vector<size_t> &successor);
+
+    void emit_fetch(Emitter &emitter);
+    void emit_icache(Emitter &emitter, size_t index);
+    void emit_interpreted(Emitter &emitter, size_t index);
+    size_t emit_alu(Emitter &emitter, const Op &op);
+    void emit_address(Emitter &emitter, const Op &op);
+    void emit_lookup(Emitter &emitter, bool write, size_t size, std::vector<size_t> &slow);
+    void emit_misaligned(Emitter &emitter, size_t index);
+    void emit_load(Emitter &emitter, size_t index);
+    void emit_store(Emitter &emitter, size_t index);
+    void emit_branch(Emitter &emitter, size_t index);
+    void emit_exit(Emitter &emitter);
+    void emit_successors(Emitter &emitter);
+
+public:
+    ~Recompiler();
+
+    bool init(CPU *cpu);
+    bool available();
+    bool full();
+    void flush();
+
+    native_block compile(const Block *block);
+};
+
+#endif /* RECOMPILER_H */
@@ -0,0 +1,177 @@
+#include "routines.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include "common.h"
+#include "cpu.h"
+#include "ram.h"
+#include "interconnect.h"
+
+#define REG_V0      2
+#define REG_A0      4
+#define REG_A1      5
+#define REG_A2      6
+#define REG_T1      9
+
+#define A0_STRCPY   0x19
+#define A0_BZERO    0x28
+#define A0_MEMCPY   0x2A
+#define A0_MEMSET   0x2B
+
+
+/**
+ * @brief      Initialize the routines
+ * @return     true in case of success, false otherwise
+ */
+bool Routines::init(CPU *cpu, RAM *ram)
+{
+    this->cpu = cpu;
+    this->ram = ram;
+
+    return true;
+}
+
+
+/**
+ * @brief      Run the A0 function called by the guest natively if possible
+ * Called when the CPU reaches the A0 dispatcher, the function is in $t1
+ * @return     true if the function was executed, PC is then at $ra
+ */
+bool Routines::call()
+{
+    uint32_t function = cpu->reg[REG_T1];
+    uint32_t a0 = cpu->reg[REG_A0];
+    uint32_t a1 = cpu->reg[REG_A1];
+    uint32_t a2 = cpu->reg[REG_A2];
+
+    if (function != A0_STRCPY && function != A0_BZERO &&
+        function != A0_MEMCPY && function != A0_MEMSET)
+    {
+        return false;
+    }
+
+    // Function replaced by the game
+    uint32_t entry = ram->load<uint32_t>(ROUTINES_A0_TABLE + function * 4);
+    if (!in_range(mask_region(entry), BIOS_START, BIOS_SIZE)) {
+        return false;
+    }
+
+    // Null pointers are handled by the BIOS
+    if (a0 == 0) {
+        return false;
+    }
+
+    bool done = false;
+    switch(function) {
+    case A0_STRCPY: done = copy_string(a0, a1); break;
+    case A0_BZERO: done = fill(a0, 0, a1); break;
+    case A0_MEMCPY: done = copy(a0, a1, a2, ROUTINE_COPY_CYCLES); break;
+    case A0_MEMSET: done = fill(a0, a1, a2); break;
+    }
+
+    if (!done) {
+        return false;
+    }
+
+    cpu->set_reg(REG_V0, a0);
+    cpu->cycles += ROUTINE_CALL_CYCLES;
+
+    // Return to the caller
+    cpu->PC = cpu->reg[RA];
+    cpu->nextPC = cpu->PC + INSTRUCTION_LENGTH;
+    cpu->isBranch = false;
+
+    return true;
+}
+
+
+/**
+ * @brief      Tells if the range is in RAM (not a mirror)
+ */
+bool Routines::in_ram(uint32_t address, uint32_t length)
+{
+    uint32_t offset = mask_region(address);
+
+    return offset < RAM_SIZE && length <= RAM_SIZE - offset;
+}
+
+
+/**
+ * @brief      Drop the cached code overwritten in RAM
+ */
+void Routines::written(uint32_t offset, uint32_t length)
+{
+    cpu->cache.invalidate_range(offset, length);
+}
+
+
+/**
+ * @brief      memcpy: forward byte copy
+ * @param[in]  cost  Cycles per byte copied
+ */
+bool Routines::copy(uint32_t dst, uint32_t src, uint32_t length, uint32_t cost)
+{
+    if (!in_ram(dst, length) || !in_ram(src, length)) {
+        return false;
+    }
+
+    dst = mask_region(dst);
+    src = mask_region(src);
+
+    // The guest loop repeats the pattern when copying forward in place
+    if (dst > src && dst < src + length) {
+        return false;
+    }
+
+    ram->copy_block(dst, src, length);
+    written(dst, length);
+
+    cpu->cycles += length * cost;
+
+    return true;
+}
+
+
+/**
+ * @brief      memset/bzero
+ */
+bool Routines::fill(uint32_t dst, uint8_t value, uint32_t length)
+{
+    if (!in_ram(dst, length)) {
+        return false;
+    }
+
+    dst = mask_region(dst);
+
+    ram->fill_block(dst, value, length);
+    written(dst, length);
+
+    cpu->cycles += length * ROUTINE_FILL_CYCLES;
+
+    return true;
+}
+
+
+/**
+ * @brief      strcpy, terminator included
+ */
+bool Routines::copy_string(uint32_t dst, uint32_t src)
+{
+    if (!in_ram(src, 1)) {
+        return false;
+    }
+
+    uint32_t offset = mask_region(src);
+    uint8_t *data = ram->get_data();
+
+    size_t limit = std::min<size_t>(ROUTINES_STRING_MAX, RAM_SIZE - offset);
+    const uint8_t *end = (const uint8_t*) memchr(data + offset, 0, limit);
+    if (!end) {
+        return false;
+    }
+
+    uint32_t length = end - (data + offset) + 1;
+
+    return copy(dst, src, length, ROUTINE_STRCPY_CYCLES);
+}
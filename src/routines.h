@@ -0,0 +1,45 @@
+#ifndef ROUTINES_H
+#define ROUTINES_H
+
+#include <cstdint>
+
+#define ROUTINES_A0_VECTOR      0xA0        // BIOS A0 functions dispatcher
+#define ROUTINES_A0_TABLE       0x200       // A0 function addresses in RAM
+#define ROUTINES_STRING_MAX     0x10000     // Longest string copied natively
+
+// Cycles taken by the BIOS loops, per byte (run from the instruction cache: fetch is free)
+#define ROUTINE_CALL_CYCLES     (8 * INSTRUCTION_CYCLES)    // Dispatch and return
+#define ROUTINE_COPY_CYCLES     (5 * INSTRUCTION_CYCLES + RAM_READ_CYCLES)
+#define ROUTINE_FILL_CYCLES     (4 * INSTRUCTION_CYCLES)
+#define ROUTINE_STRCPY_CYCLES   (6 * INSTRUCTION_CYCLES + RAM_READ_CYCLES)
+
+class CPU;
+class RAM;
+
+
+/**
+ * @brief      Host implementations of hot BIOS library functions
+ *
+ * Calls through the A0 dispatcher to memcpy, memset, bzero and strcpy run as
+ * host memcpy/memset on the RAM backing instead of guest byte loops. Only
+ * functions the A0 table maps to the BIOS ROM are replaced: a function
+ * patched by the game keeps running as guest code.
+ */
+class Routines {
+    CPU *cpu;
+    RAM *ram;
+
+    bool in_ram(uint32_t address, uint32_t length);
+    void written(uint32_t offset, uint32_t length);
+
+    bool copy(uint32_t dst, uint32_t src, uint32_t length, uint32_t cost);
+    bool fill(uint32_t dst, uint8_t value, uint32_t length);
+    bool copy_string(uint32_t dst, uint32_t src);
+
+public:
+    bool init(CPU *cpu, RAM *ram);
+
+    bool call();
+};
+
+#endif /* ROUTINES_H */
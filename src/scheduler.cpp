@@ -0,0 +1,184 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+#include "log.h"
+#include "cpu.h"
+
+
+/**
+ * @brief      Heap order: earliest event on top, ties broken by type
+ */
+static bool later(const ScheduledEvent &a, const ScheduledEvent &b)
+{
+    if (a.timestamp != b.timestamp) {
+        return a.timestamp > b.timestamp;
+    }
+
+    return a.type > b.type;
+}
+
+
+/**
+ * @brief      Initialize the scheduler
+ * @param      cpu   CPU to stop when an earlier event gets scheduled
+ * @return     true in case of success, false otherwise
+ */
+bool Scheduler::init(CPU *cpu)
+{
+    this->cpu = cpu;
+
+    for (size_t i=0; i<EVENT_COUNT; i++) {
+        generation[i] = 0;
+        handlers[i] = nullptr;
+        devices[i] = nullptr;
+    }
+
+    heap.reserve(HEAP_MAX_SIZE);
+
+    reset();
+
+    return true;
+}
+
+
+/**
+ * @brief      Drop every scheduled event, handlers are kept
+ */
+void Scheduler::reset()
+{
+    heap.clear();
+
+    for (size_t i=0; i<EVENT_COUNT; i++) {
+        deadline[i] = EVENT_NEVER;
+        generation[i]++;
+    }
+}
+
+
+/**
+ * @brief      Set the function called when the event is due
+ */
+void Scheduler::set_handler(EventType type, event_handler handler, void *device)
+{
+    handlers[type] = handler;
+    devices[type] = device;
+}
+
+
+/**
+ * @brief      Schedule the event, replaces any previous occurrence
+ * @param[in]  timestamp  CPU cycle at which the event is due
+ */
+void Scheduler::schedule(EventType type, uint64_t timestamp)
+{
+    deadline[type] = timestamp;
+    generation[type]++;
+
+    push(type);
+
+    // The CPU may be running until a later event
+    if (cpu) {
+        cpu->stop_at(timestamp);
+    }
+}
+
+
+/**
+ * @brief      Unschedule the event
+ */
+void Scheduler::cancel(EventType type)
+{
+    deadline[type] = EVENT_NEVER;
+    generation[type]++;
+}
+
+
+/**
+ * @brief      Tells if the event is scheduled
+ */
+bool Scheduler::pending(EventType type)
+{
+    return deadline[type] != EVENT_NEVER;
+}
+
+
+/**
+ * @brief      Timestamp of the earliest event
+ * @return     The timestamp or EVENT_NEVER if nothing is scheduled
+ */
+uint64_t Scheduler::next_event()
+{
+    discard();
+
+    if (heap.empty()) {
+        return EVENT_NEVER;
+    }
+
+    return heap.front().timestamp;
+}
+
+
+/**
+ * @brief      Call handlers of every event due at the given cycle
+ * Handlers may schedule new events, those are run as well if already due
+ */
+void Scheduler::run(uint64_t now)
+{
+    while (next_event() <= now) {
+        ScheduledEvent event = heap.front();
+        std::pop_heap(heap.begin(), heap.end(), later);
+        heap.pop_back();
+
+        EventType type = (EventType) event.type;
+        deadline[type] = EVENT_NEVER;
+        generation[type]++;
+
+        if (!handlers[type]) {
+            error("No handler for event %d\n", type);
+            exit(1);
+        }
+
+        handlers[type](devices[type], event.timestamp);
+    }
+}
+
+
+void Scheduler::push(EventType type)
+{
+    if (heap.size() >= HEAP_MAX_SIZE) {
+        compact();
+    }
+
+    heap.push_back({deadline[type], (uint32_t) type, generation[type]});
+    std::push_heap(heap.begin(), heap.end(), later);
+}
+
+
+/**
+ * @brief      Pop stale entries from the top of the heap
+ */
+void Scheduler::discard()
+{
+    while (!heap.empty() && heap.front().generation != generation[heap.front().type]) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        heap.pop_back();
+    }
+}
+
+
+/**
+ * @brief      Rebuild the heap with only the scheduled events
+ */
+void Scheduler::compact()
+{
+    heap.clear();
+
+    for (size_t i=0; i<EVENT_COUNT; i++) {
+        if (deadline[i] != EVENT_NEVER) {
+            heap.push_back({deadline[i], (uint32_t) i, generation[i]});
+        }
+    }
+
+    std::make_heap(heap.begin(), heap.end(), later);
+}
@@ -0,0 +1,76 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+#include <vector>
+
+#define EVENT_NEVER         UINT64_MAX
+
+// Stale entries tolerated in the heap before it gets compacted
+#define HEAP_MAX_SIZE       256
+
+class CPU;
+
+
+/**
+ * @brief      Device events, at most one of each is scheduled at a time
+ */
+enum EventType {
+    EVENT_VBLANK,
+    EVENT_COUNT
+};
+
+/**
+ * @brief      Called when an event is due
+ * @param      device     Device given with the handler
+ * @param[in]  timestamp  Cycle the event was scheduled for
+ */
+typedef void (*event_handler)(void *device, uint64_t timestamp);
+
+
+/**
+ * @brief      Heap entry of a scheduled event
+ */
+struct ScheduledEvent {
+    uint64_t timestamp;
+    uint32_t type;
+    uint32_t generation;    // Entry is stale if it does not match the event
+};
+
+
+/**
+ * @brief      Orders device events on the CPU cycle counter
+ * The CPU runs until the next event instead of devices being polled after
+ * every instruction
+ */
+class Scheduler {
+    CPU *cpu = nullptr;
+
+    // Min-heap on timestamp, rescheduled/cancelled events leave stale entries
+    std::vector<ScheduledEvent> heap;
+
+    uint64_t deadline[EVENT_COUNT];
+    uint32_t generation[EVENT_COUNT];
+
+    event_handler handlers[EVENT_COUNT];
+    void *devices[EVENT_COUNT];
+
+    void push(EventType type);
+    void discard();
+    void compact();
+
+public:
+    bool init(CPU *cpu);
+    void reset();
+
+    void set_handler(EventType type, event_handler handler, void *device);
+
+    void schedule(EventType type, uint64_t timestamp);
+    void cancel(EventType type);
+    bool pending(EventType type);
+
+    uint64_t next_event();
+    void run(uint64_t now);
+};
+
+#endif /* SCHEDULER_H */
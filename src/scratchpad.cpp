@@ -0,0 +1,16 @@
+#include "scratchpad.h"
+
+
+/**
+ * @brief      Initialize the scratchpad
+ * Shared like the RAM so fastmem can map it
+ * @return     true in case of success, false otherwise
+ */
+bool Scratchpad::init()
+{
+    if (!share("psx-scratchpad", SCRATCHPAD_BACKING_SIZE)) {
+        allocate(SCRATCHPAD_BACKING_SIZE);
+    }
+
+    return true;
+}
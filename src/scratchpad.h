@@ -0,0 +1,26 @@
+#ifndef SCRATCHPAD_H
+#define SCRATCHPAD_H
+
+#include <cstdint>
+
+#include "memory.h"
+
+#define SCRATCHPAD_START        0x1F800000
+#define SCRATCHPAD_SIZE         1024
+
+// Backed by a whole host page so it can be mapped like RAM (page table and
+// fastmem), accesses to the rest of the page go through address decoding
+#define SCRATCHPAD_BACKING_SIZE 4096
+#define SCRATCHPAD_PADDING_START    (SCRATCHPAD_START + SCRATCHPAD_SIZE)
+#define SCRATCHPAD_PADDING_SIZE     (SCRATCHPAD_BACKING_SIZE - SCRATCHPAD_SIZE)
+
+
+/**
+ * @brief      Scratchpad: data cache used as fast RAM
+ */
+class Scratchpad : public Memory {
+public:
+    bool init();
+};
+
+#endif /* SCRATCHPAD_H */
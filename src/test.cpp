@@ -2,6 +2,9 @@
 
 #include <iostream>
 #include <initializer_list>
+#include <cinttypes>
+#include <cstring>
+#include <vector>
 
 #include "instruction.h"
 #include "log.h"
@@ -9,7 +12,15 @@
 #include "spu.h"
 #include "bios.h"
 #include "ram.h"
+#include "scratchpad.h"
+#include "irq.h"
+#include "dma.h"
 #include "interconnect.h"
+#include "scheduler.h"
+#include "fastmem.h"
+#include "kernel.h"
+#include "routines.h"
+#include "gte.h"
 
 
 std::string bios_path = "";
@@ -17,6 +28,9 @@ CPU *cpu;
 SPU *spu;
 BIOS *bios;
 RAM *ram;
+Scratchpad *scratchpad;
+IRQ *irq;
+DMA *dma;
 Interconnect *inter;
 
 
@@ -32,6 +46,9 @@ bool test_init()
     spu = new SPU();
     bios = new BIOS();
     ram = new RAM();
+    scratchpad = new Scratchpad();
+    irq = new IRQ();
+    dma = new DMA();
     inter = new Interconnect();
 
     bool running = true;
@@ -39,10 +56,15 @@ bool test_init()
     running &= spu->init();
     running &= bios->init(bios_path);
     running &= ram->init();
-    running &= inter->init(spu, bios, ram);
+    running &= scratchpad->init();
+    running &= irq->init(cpu);
+    running &= dma->init(cpu, ram, irq);
+    running &= inter->init(spu, bios, ram, scratchpad);
 
     if (running) {
         cpu->set_inter(inter);
+        inter->set_irq(irq);
+        inter->set_dma(dma);
     }
 
     ASSERT(running);
@@ -164,6 +186,54 @@ bool test_store_load()
     return true;
 }
 
+bool test_memory_pages()
+{
+    // Page table and address decoding agree
+    inter->store<uint32_t>(0x80000100, 0x12345678);
+    ASSERT(ram->load<uint32_t>(0x100) == 0x12345678);
+    ASSERT(inter->load<uint32_t>(0x00000100) == inter->decode_load<uint32_t>(0x00000100));
+    ASSERT(inter->load<uint16_t>(0xA0000102) == 0x1234);
+    ASSERT(inter->load<uint8_t>(0x80000101) == 0x56);
+    ASSERT(inter->load<uint32_t>(0xBFC00010) == bios->load<uint32_t>(0x10));
+
+    // RAM mirrors
+    ASSERT(inter->load<uint32_t>(0x00200100) == 0x12345678);
+    ASSERT(inter->load<uint32_t>(0xA0600100) == 0x12345678);
+    inter->store<uint32_t>(0x80400104, 0xCAFEBABE);
+    ASSERT(ram->load<uint32_t>(0x104) == 0xCAFEBABE);
+
+    return true;
+}
+
+bool test_memory_backing()
+{
+    // Guest byte order in memory whatever the host is
+    ram->store<uint32_t>(0x300, 0x11223344);
+    ASSERT(ram->get_data()[0x300] == 0x44);
+    ASSERT(ram->get_data()[0x303] == 0x11);
+    ASSERT(ram->load<uint16_t>(0x302) == 0x1122);
+    ASSERT(ram->load<uint8_t>(0x301) == 0x33);
+    ram->store<uint16_t>(0x300, 0xBEEF);
+    ASSERT(ram->load<uint32_t>(0x300) == 0x1122BEEF);
+
+    // Blocks
+    const uint8_t block[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t copy[8] = {0};
+    ram->write_block(0x400, block, sizeof(block));
+    ASSERT(ram->load<uint32_t>(0x404) == 0x08070605);
+    ram->read_block(0x402, copy, 4);
+    ASSERT(copy[0] == 3 && copy[3] == 6);
+    ram->copy_block(0x402, 0x400, 4);
+    ASSERT(ram->load<uint32_t>(0x404) == 0x08070403);
+    ram->fill_block(0x401, 0xAA, 2);
+    ASSERT(ram->load<uint32_t>(0x400) == 0x02AAAA01);
+
+    ASSERT(ram->get_size() == RAM_SIZE);
+    ASSERT(bios->get_size() == BIOS_SIZE);
+
+    return true;
+}
+
 bool test_DIV()
 {
     cpu->reset();
@@ -227,6 +297,1736 @@ bool test_SUB()
     return true;
 }
 
+/*********************************
+ * EXECUTION MODES
+ *********************************/
+
+#define PROGRAM_START       0x80001000
+#define PROGRAM_END         0x80001018
+
+// Sums 10 + 9 + ... + 1 in $2 then loops forever at PROGRAM_END
+const uint32_t SUM_PROGRAM[] = {
+    0x2401000A,     // addiu $1, $0, 10
+    0x24020000,     // addiu $2, $0, 0
+    0x00411021,     // addu $2, $2, $1
+    0x2421FFFF,     // addiu $1, $1, -1
+    0x1420FFFD,     // bne $1, $0, -3
+    0x00000000,     // nop
+    0x08000406,     // j PROGRAM_END
+    0x00000000,     // nop
+};
+
+// Load delay slot and write over a load in flight
+const uint32_t LOAD_DELAY_PROGRAM[] = {
+    0x8C011000,     // lw $1, 0x1000($0)
+    0x00201021,     // addu $2, $1, $0 (old $1)
+    0x00201821,     // addu $3, $1, $0 (loaded $1)
+    0x8C041000,     // lw $4, 0x1000($0)
+    0x24040007,     // addiu $4, $0, 7 (wins over the load)
+    0x00802821,     // addu $5, $4, $0
+    0x08000406,     // j PROGRAM_END
+    0x00000000,     // nop
+};
+
+#define ALU_END             0x80001064
+
+// Exercises every inlined instruction of the recompiler and a load delay
+const uint32_t ALU_PROGRAM[] = {
+    0x3C018765,     // lui $1, 0x8765
+    0x34214321,     // ori $1, $1, 0x4321
+    0x2402FFFB,     // addiu $2, $0, -5
+    0x00011900,     // sll $3, $1, 4
+    0x00012202,     // srl $4, $1, 8
+    0x00012A03,     // sra $5, $1, 8
+    0x24060003,     // addiu $6, $0, 3
+    0x00C23804,     // sllv $7, $2, $6
+    0x00C24006,     // srlv $8, $2, $6
+    0x00C24807,     // srav $9, $2, $6
+    0x00225021,     // addu $10, $1, $2
+    0x00225823,     // subu $11, $1, $2
+    0x00226024,     // and $12, $1, $2
+    0x00226825,     // or $13, $1, $2
+    0x00227026,     // xor $14, $1, $2
+    0x0022782A,     // slt $15, $1, $2
+    0x0022802B,     // sltu $16, $1, $2
+    0x2851FFFC,     // slti $17, $2, -4
+    0x2C52FFFC,     // sltiu $18, $2, -4
+    0x3033FF00,     // andi $19, $1, 0xFF00
+    0x3834FFFF,     // xori $20, $1, 0xFFFF
+    0x24200001,     // addiu $0, $1, 1
+    0x8C151000,     // lw $21, 0x1000($0)
+    0x02A0B021,     // addu $22, $21, $0 (load delay: old $21)
+    0x02A0B821,     // addu $23, $21, $0
+    0x08000419,     // j ALU_END
+    0x00000000,     // nop
+};
+
+#define EXCEPTION_HANDLER   0x80000080
+
+// Loads and stores emitted inline, their load delay, branches with their
+// delay slot, a store over the running block, NOR and a misaligned load
+const uint32_t MEMORY_PROGRAM[] = {
+    0x3C088000,     // lui $8, 0x8000
+    0x35082000,     // ori $8, $8, 0x2000
+    0x2401FFFE,     // addiu $1, $0, -2
+    0xAD000004,     // sw $0, 4($8)
+    0xAD000008,     // sw $0, 8($8)
+    0xAD010000,     // sw $1, 0($8)
+    0xA5010006,     // sh $1, 6($8)
+    0xA1010009,     // sb $1, 9($8)
+    0x8D020000,     // lw $2, 0($8)
+    0x85030006,     // lh $3, 6($8)
+    0x95040006,     // lhu $4, 6($8)
+    0x81050009,     // lb $5, 9($8)
+    0x91060009,     // lbu $6, 9($8)
+    0x8D070004,     // lw $7, 4($8)
+    0x00E04821,     // addu $9, $7, $0 (old $7)
+    0x8D0A0000,     // lw $10, 0($8)
+    0x240A0001,     // addiu $10, $0, 1 (wins over the load)
+    0x10410002,     // beq $2, $1, +2 (taken)
+    0x240B0005,     // addiu $11, $0, 5
+    0x240C0001,     // addiu $12, $0, 1 (skipped)
+    0x04510002,     // bgezal $2, +2 (not taken, no link)
+    0x240D0007,     // addiu $13, $0, 7
+    0x04500002,     // bltzal $2, +2 (taken)
+    0x8D0E0000,     // lw $14, 0($8)
+    0x01C07821,     // addu $15, $14, $0 (skipped)
+    0x01C08021,     // addu $16, $14, $0 (old $14)
+    0x01C08821,     // addu $17, $14, $0 (loaded $14)
+    0x3C188000,     // lui $24, 0x8000
+    0x37181000,     // ori $24, $24, 0x1000
+    0xAF00007C,     // sw $0, 0x7C($24) (next addiu turns into a nop)
+    0x24160033,     // addiu $22, $0, 0x33
+    0x24170055,     // addiu $23, $0, 0x55 (overwritten)
+    0x3C128000,     // lui $18, 0x8000
+    0x36521090,     // ori $18, $18, 0x1090
+    0x02409809,     // jalr $19, $18
+    0x24140009,     // addiu $20, $0, 9
+    0x0020C827,     // nor $25, $1, $0
+    0x85150001,     // lh $21, 1($8) (address error)
+};
+
+void load_program(uint32_t address, const uint32_t *program, size_t size)
+{
+    for (size_t i=0; i<size; i++) {
+        inter->store<uint32_t>(address + i * 4, program[i]);
+    }
+}
+
+bool run_program(uint32_t start, uint32_t end)
+{
+    cpu->force_set_PC(start);
+
+    for (size_t i=0; i<1000; i++) {
+        cpu->run_block();
+
+        if (cpu->get_PC() == end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool test_cached()
+{
+    cpu->reset();
+    load_program(PROGRAM_START, SUM_PROGRAM, 8);
+
+    cpu->set_mode(MODE_INTERPRETER);
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 55);
+
+    cpu->reset();
+    cpu->set_mode(MODE_CACHED);
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 55);
+
+    // Overwritten code must not run from the cache
+    inter->store<uint32_t>(PROGRAM_START, 0x24010003); // addiu $1, $0, 3
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERTV(cpu->force_get_reg(2) == 6, "Got %u\n", cpu->force_get_reg(2));
+
+    // Same through a RAM mirror
+    inter->store<uint32_t>(PROGRAM_START + 0x200000, 0x24010004); // addiu $1, $0, 4
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERTV(cpu->force_get_reg(2) == 10, "Got %u\n", cpu->force_get_reg(2));
+
+    cpu->set_mode(MODE_INTERPRETER);
+
+    return true;
+}
+
+bool test_load_delay()
+{
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+    load_program(PROGRAM_START, LOAD_DELAY_PROGRAM, 8);
+
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(1) == 0x8C011000);
+    ASSERT(cpu->force_get_reg(2) == DEFAULT_REG);
+    ASSERT(cpu->force_get_reg(3) == 0x8C011000);
+    ASSERT(cpu->force_get_reg(4) == 7);
+    ASSERT(cpu->force_get_reg(5) == 7);
+
+    return true;
+}
+
+bool test_threaded()
+{
+    uint32_t expected[REG_COUNT];
+
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+    load_program(PROGRAM_START, ALU_PROGRAM, 27);
+
+    ASSERT(run_program(PROGRAM_START, ALU_END));
+    for (size_t i=0; i<REG_COUNT; i++) {
+        expected[i] = cpu->force_get_reg(i);
+    }
+
+    // Table dispatch and threaded dispatch must match the reference switch
+    cpu->reset();
+    cpu->force_set_PC(PROGRAM_START);
+    cpu->run_for(25 * (INSTRUCTION_CYCLES + RAM_READ_CYCLES) + RAM_READ_CYCLES);
+    ASSERT(cpu->get_PC() == ALU_END);
+    for (size_t i=0; i<REG_COUNT; i++) {
+        ASSERT_QUIET_SUCCESS(
+            cpu->force_get_reg(i) == expected[i],
+            "$r%zu: got 0x%08x expected 0x%08x", i, cpu->force_get_reg(i), expected[i]
+        );
+    }
+
+    cpu->reset();
+    for (size_t i=0; i<25; i++) {
+        cpu->run_load();
+        cpu->decode_and_execute_switch(ALU_PROGRAM[i]);
+        cpu->commit_load();
+    }
+    for (size_t i=0; i<REG_COUNT; i++) {
+        ASSERT_QUIET_SUCCESS(
+            cpu->force_get_reg(i) == expected[i],
+            "$r%zu: got 0x%08x expected 0x%08x", i, cpu->force_get_reg(i), expected[i]
+        );
+    }
+
+    return true;
+}
+
+bool test_run_for()
+{
+    ExecutionMode modes[] = {MODE_INTERPRETER, MODE_CACHED, MODE_RECOMPILER};
+
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        load_program(PROGRAM_START, SUM_PROGRAM, 8);
+        cpu->force_set_PC(PROGRAM_START);
+
+        // Blocks run to completion: the budget is overrun by less than a block
+        cpu->run_until(1000);
+        ASSERTV(cpu->get_cycles() >= 1000, "mode %d: stopped early\n", mode);
+        ASSERTV(
+            cpu->get_cycles() < 1000 + BLOCK_MAX_SIZE * INSTRUCTION_CYCLES,
+            "mode %d: overrun of %" PRIu64 " cycles\n", mode, cpu->get_cycles() - 1000
+        );
+
+        uint64_t cycles = cpu->get_cycles();
+        cpu->run_for(500);
+        ASSERTV(cpu->get_cycles() >= cycles + 500, "mode %d: budget not used\n", mode);
+
+        // Already past the target: nothing to do
+        cycles = cpu->get_cycles();
+        cpu->run_until(cycles - 1);
+        ASSERT(cpu->get_cycles() == cycles);
+
+        ASSERTV(cpu->force_get_reg(2) == 55, "mode %d: sum is %u\n", mode, cpu->force_get_reg(2));
+        ASSERT(cpu->get_PC() == PROGRAM_END || cpu->get_PC() == PROGRAM_END + 4);
+    }
+
+    return true;
+}
+
+// Polls a RAM word until it is not zero
+const uint32_t WAIT_PROGRAM[] = {
+    0x3C038000,     // lui $3, 0x8000
+    0x8C620100,     // wait: lw $2, 0x100($3)
+    0x00000000,     // nop
+    0x1040FFFD,     // beq $2, $0, wait
+    0x00000000,     // nop
+    0x08000405,     // end: j end
+    0x00000000,     // nop
+};
+
+bool test_idle_loop()
+{
+    ExecutionMode modes[] = {MODE_CACHED, MODE_RECOMPILER};
+
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        inter->store<uint32_t>(0x80000100, 0);
+        load_program(PROGRAM_START, WAIT_PROGRAM, 7);
+        cpu->force_set_PC(PROGRAM_START);
+
+        // Nothing can change the polled word before the target: skipped
+        cpu->run_until(10000);
+        ASSERTV(cpu->get_cycles() == 10000, "mode %d: stopped at %" PRIu64 "\n", mode, cpu->get_cycles());
+        ASSERTV(cpu->get_PC() == PROGRAM_START + 4, "mode %d: PC is 0x%08x\n", mode, cpu->get_PC());
+
+        // An event changed it: the loop exits
+        inter->store<uint32_t>(0x80000100, 1);
+        cpu->run_until(20000);
+        ASSERT(cpu->get_cycles() == 20000);
+        ASSERT(cpu->get_PC() == PROGRAM_START + 0x14 || cpu->get_PC() == PROGRAM_START + 0x18);
+        ASSERT(cpu->force_get_reg(2) == 1);
+    }
+
+    return true;
+}
+
+// Executes count instructions at PROGRAM_START, returns the cycles they took
+uint64_t time_program(const uint32_t *program, size_t count)
+{
+    load_program(PROGRAM_START, program, count);
+    cpu->force_set_PC(PROGRAM_START);
+
+    uint64_t start = cpu->get_cycles();
+    for (size_t i=0; i<count; i++) {
+        cpu->run_next();
+    }
+
+    return cpu->get_cycles() - start;
+}
+
+bool test_timing()
+{
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+    inter->reset();
+
+    // MFLO right after MULT waits for the result, its fetch from RAM is
+    // part of the wait
+    const uint32_t mult_early[] = {
+        0x00220018,     // mult $1, $2
+        0x00001812,     // mflo $3
+    };
+    cpu->force_set_reg(1, 0x12345678);
+    cpu->force_set_reg(2, 3);
+    uint64_t cycles = time_program(mult_early, 2);
+    ASSERTV(cycles == RAM_READ_CYCLES + INSTRUCTION_CYCLES + MULT_SLOW_CYCLES, "got %" PRIu64 "\n", cycles);
+    ASSERT(cpu->force_get_reg(3) == 0x369D0368);
+
+    // Small operand, result ready before MFHI: no stall
+    const uint32_t mult_late[] = {
+        0x00220019,     // multu $1, $2
+        0x00000000, 0x00000000, 0x00000000,
+        0x00000000, 0x00000000, 0x00000000,
+        0x00001810,     // mfhi $3
+    };
+    cpu->force_set_reg(1, 3);
+    cycles = time_program(mult_late, 8);
+    ASSERTV(cycles == 8 * (INSTRUCTION_CYCLES + RAM_READ_CYCLES), "got %" PRIu64 "\n", cycles);
+
+    const uint32_t div_early[] = {
+        0x0022001A,     // div $1, $2
+        0x00000000,     // nop
+        0x00001812,     // mflo $3
+    };
+    cycles = time_program(div_early, 3);
+    ASSERTV(cycles == RAM_READ_CYCLES + INSTRUCTION_CYCLES + DIV_CYCLES, "got %" PRIu64 "\n", cycles);
+    ASSERT(cpu->force_get_reg(3) == 1);
+
+    // Loads are charged the access time of the region, on top of the fetch
+    const uint32_t load_word[] = {
+        0x8C830000,     // lw $3, 0($4)
+    };
+    const uint32_t load_byte[] = {
+        0x80830000,     // lb $3, 0($4)
+    };
+    cpu->force_set_reg(4, 0x80000000);
+    cycles = time_program(load_word, 1);
+    ASSERTV(cycles == INSTRUCTION_CYCLES + 2 * RAM_READ_CYCLES, "got %" PRIu64 "\n", cycles);
+
+    // BIOS on a 8 bits bus: a word takes 4 accesses
+    cpu->force_set_reg(4, 0xBFC00000);
+    ASSERT(inter->get_access_cycles(REGION_BIOS, 4) == 24);
+    cycles = time_program(load_word, 1);
+    ASSERTV(cycles == INSTRUCTION_CYCLES + RAM_READ_CYCLES + 24, "got %" PRIu64 "\n", cycles);
+    cycles = time_program(load_byte, 1);
+    ASSERTV(cycles == INSTRUCTION_CYCLES + RAM_READ_CYCLES + 6, "got %" PRIu64 "\n", cycles);
+
+    // Switch the BIOS to a 16 bits bus
+    inter->store<uint32_t>(0x1F801010, 0x0013343F);
+    ASSERT(inter->load<uint32_t>(0x1F801010) == 0x0013343F);
+    ASSERT(inter->get_access_cycles(REGION_BIOS, 4) == 12);
+    ASSERT(inter->get_access_cycles(REGION_BIOS, 2) == 6);
+    cycles = time_program(load_word, 1);
+    ASSERTV(cycles == INSTRUCTION_CYCLES + RAM_READ_CYCLES + 12, "got %" PRIu64 "\n", cycles);
+
+    inter->reset();
+
+    return true;
+}
+
+// Records the order in which events are handled
+std::vector<int> handled_events;
+
+void record_event(void *device, uint64_t timestamp)
+{
+    (void) timestamp;
+
+    handled_events.push_back(*(int*) device);
+}
+
+// Rescheduled every 100 cycles
+void periodic_event(void *scheduler, uint64_t timestamp)
+{
+    handled_events.push_back(EVENT_VBLANK);
+
+    ((Scheduler*) scheduler)->schedule(EVENT_VBLANK, timestamp + 100);
+}
+
+bool test_scheduler()
+{
+    Scheduler scheduler;
+    int vblank = EVENT_VBLANK;
+
+    ASSERT(scheduler.init(cpu));
+    scheduler.set_handler(EVENT_VBLANK, &record_event, &vblank);
+
+    ASSERT(scheduler.next_event() == EVENT_NEVER);
+
+    // A rescheduled or cancelled event fires at most once
+    scheduler.schedule(EVENT_VBLANK, 100);
+    scheduler.schedule(EVENT_VBLANK, 250);
+    ASSERT(scheduler.pending(EVENT_VBLANK));
+    ASSERT(scheduler.next_event() == 250);
+
+    handled_events.clear();
+    scheduler.run(200);
+    ASSERT(handled_events.empty());
+    scheduler.run(260);
+    ASSERT(handled_events.size() == 1 && handled_events[0] == EVENT_VBLANK);
+    ASSERT(!scheduler.pending(EVENT_VBLANK));
+    ASSERT(scheduler.next_event() == EVENT_NEVER);
+
+    scheduler.schedule(EVENT_VBLANK, 50);
+    scheduler.cancel(EVENT_VBLANK);
+    ASSERT(!scheduler.pending(EVENT_VBLANK));
+    ASSERT(scheduler.next_event() == EVENT_NEVER);
+
+    // Stale entries are dropped when the heap fills up
+    for (uint64_t i=0; i<2 * HEAP_MAX_SIZE; i++) {
+        scheduler.schedule(EVENT_VBLANK, 2 * HEAP_MAX_SIZE - i);
+    }
+    ASSERT(scheduler.next_event() == 1);
+
+    scheduler.reset();
+    ASSERT(scheduler.next_event() == EVENT_NEVER);
+
+    // The CPU runs from one event to the next
+    cpu->reset();
+    cpu->set_mode(MODE_CACHED);
+    load_program(PROGRAM_START, SUM_PROGRAM, 8);
+    cpu->force_set_PC(PROGRAM_START);
+
+    handled_events.clear();
+    scheduler.set_handler(EVENT_VBLANK, &periodic_event, &scheduler);
+    scheduler.schedule(EVENT_VBLANK, 100);
+    for (size_t i=0; i<5; i++) {
+        cpu->run_until(scheduler.next_event());
+        scheduler.run(cpu->get_cycles());
+    }
+    ASSERTV(handled_events.size() == 5, "%zu events\n", handled_events.size());
+    ASSERT(cpu->get_cycles() >= 500 && cpu->get_cycles() < 500 + BLOCK_MAX_SIZE);
+    ASSERT(scheduler.next_event() == 600);
+    ASSERT(cpu->force_get_reg(2) == 55);
+
+    return true;
+}
+
+bool test_scratchpad()
+{
+    // Page table and address decoding agree
+    inter->store<uint32_t>(0x1F800010, 0xA5A55A5A);
+    ASSERT(scratchpad->load<uint32_t>(0x10) == 0xA5A55A5A);
+    ASSERT(inter->decode_load<uint32_t>(0x1F800010) == 0xA5A55A5A);
+    inter->decode_store<uint16_t>(0x1F8003FE, 0xBEEF);
+    ASSERT(inter->load<uint16_t>(0x9F8003FE) == 0xBEEF);
+    ASSERT(inter->load<uint8_t>(0x1F800013) == 0xA5);
+
+    // I/O registers next to it are still decoded
+    ASSERT(inter->load<uint32_t>(0x1F801814) == 0x10000000);
+
+    // No access cost: the scratchpad is the data cache, only the fetch is
+    const uint32_t load_word[] = {
+        0x8C830000,     // lw $3, 0($4)
+    };
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+    cpu->force_set_reg(4, 0x1F800010);
+    ASSERT(time_program(load_word, 1) == INSTRUCTION_CYCLES + RAM_READ_CYCLES);
+
+    return true;
+}
+
+// Flushes a line as the BIOS does then stores once the cache is back
+const uint32_t ISOLATION_PROGRAM[] = {
+    0x3C010001,     // lui $1, 0x0001 (cache isolation)
+    0x40816000,     // mtc0 $1, $12
+    0xAC800000,     // sw $0, 0($4)
+    0xA0800004,     // sb $0, 4($4)
+    0x40806000,     // mtc0 $0, $12
+    0xAC850008,     // sw $5, 8($4)
+};
+
+bool test_cache_isolation()
+{
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+
+    // Isolated stores do not reach RAM
+    inter->store<uint32_t>(0x80002000, 0x11111111);
+    inter->store<uint32_t>(0x80002004, 0x22222222);
+    cpu->force_set_reg(4, 0x80002000);
+    cpu->force_set_reg(5, 0x33333333);
+    time_program(ISOLATION_PROGRAM, 6);
+    ASSERT(inter->load<uint32_t>(0x80002000) == 0x11111111);
+    ASSERT(inter->load<uint32_t>(0x80002004) == 0x22222222);
+    ASSERT(inter->load<uint32_t>(0x80002008) == 0x33333333);
+
+    // Nor the scratchpad
+    inter->set_isolated(true);
+    inter->store<uint32_t>(0x1F800000, 0xFFFFFFFF);
+    inter->set_isolated(false);
+    inter->store<uint32_t>(0x1F800004, 0x44444444);
+    ASSERT(scratchpad->load<uint32_t>(0) != 0xFFFFFFFF);
+    ASSERT(scratchpad->load<uint32_t>(4) == 0x44444444);
+
+    // Code compiled from a flushed line is dropped
+    cpu->reset();
+    cpu->set_mode(MODE_CACHED);
+    inter->store<uint32_t>(CACHE_CONTROL_START, CACHE_CONTROL_ICACHE);
+    load_program(PROGRAM_START, SUM_PROGRAM, 8);
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 55);
+    ram->store<uint32_t>(PROGRAM_START & 0xFFFFF, 0x24010003); // addiu $1, $0, 3
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 55);
+    inter->set_isolated(true);
+    inter->store<uint32_t>(PROGRAM_START + 0x8, 0);
+    inter->set_isolated(false);
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 6);
+    inter->reset();
+
+    return true;
+}
+
+#define DEVICE_START        0x1F801800      // CD-ROM, not emulated
+#define DEVICE_SIZE         4
+
+// Byte registers recording the last access
+struct TestDevice {
+    uint8_t registers[DEVICE_SIZE];
+    size_t size;
+
+    template <typename T>
+    T load(uint32_t offset)
+    {
+        size = sizeof(T);
+
+        T value;
+        memcpy(&value, registers + offset, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void store(uint32_t offset, T value)
+    {
+        size = sizeof(T);
+
+        memcpy(registers + offset, &value, sizeof(T));
+    }
+};
+
+TestDevice device;
+const uint32_t DEVICE_CYCLES[3] = {1, 2, 3};
+
+bool test_io_registry()
+{
+    cpu->reset();
+    inter->reset();
+
+    // Loads, canLoad32 and stable agree on the registered devices
+    ASSERT(inter->canLoad32(SYS_CONTROL_START));
+    ASSERT(inter->canLoad32(IRQ_CONTROL_START));
+    ASSERT(inter->canLoad32(DMA_START));
+    ASSERT(inter->canLoad32(GPU_START + 4));
+    ASSERT(!inter->canLoad32(TIMERS_START));
+    ASSERT(!inter->canLoad32(DEVICE_START));
+    ASSERT(inter->stable(IRQ_CONTROL_START));
+    ASSERT(!inter->stable(TIMERS_START));
+    ASSERT(inter->load<uint32_t>(GPU_START + 4) == 0x10000000);
+    ASSERT(inter->load<uint32_t>(0xBF801010) == 0x0013243F);
+
+    // SPU words are split in halfwords
+    inter->store<uint32_t>(SPU_START, 0x12345678);
+    ASSERT(inter->load<uint32_t>(SPU_START) == 0);
+
+    // Only the widths a device declares get handlers, others are ignored
+    inter->map_io({"TEST", DEVICE_START, DEVICE_SIZE, &device,
+        device_handlers<TestDevice, IO_WIDTH_8 | IO_WIDTH_16>(), DEVICE_CYCLES, false});
+    ASSERT(!inter->canLoad32(DEVICE_START));
+
+    device.size = 0;
+    inter->store<uint32_t>(DEVICE_START, 0x44332211);
+    ASSERT(inter->load<uint32_t>(DEVICE_START) == 0);
+    ASSERT(device.size == 0);
+    ASSERT(inter->load<uint16_t>(GPU_START + 4) == 0);
+
+    // A device mapped afterwards is decoded the same way, at any width
+    inter->map_io({"TEST", DEVICE_START, DEVICE_SIZE, &device,
+        device_handlers<TestDevice, IO_WIDTH_8 | IO_WIDTH_16 | IO_WIDTH_32>(), DEVICE_CYCLES, false});
+    ASSERT(inter->canLoad32(DEVICE_START));
+
+    inter->store<uint32_t>(DEVICE_START, 0x44332211);
+    ASSERT(device.size == 4);
+    inter->store<uint8_t>(DEVICE_START + 3, 0x88);
+    ASSERT(device.size == 1);
+
+    uint64_t cycles = cpu->get_cycles();
+    ASSERT(inter->load<uint16_t>(DEVICE_START + 2) == 0x8833);
+    ASSERT(device.size == 2);
+    ASSERT(cpu->get_cycles() == cycles + 2);
+
+    ASSERT(inter->load<uint32_t>(DEVICE_START) == 0x88332211);
+    ASSERT(cpu->get_cycles() == cycles + 5);
+
+    return true;
+}
+
+#define DMA_REG(channel, reg)   (DMA_START + (channel) * DMA_CHANNEL_STRIDE + (reg))
+
+// Device end of a channel: records the words sent, fills RAM with a count
+struct TestPort {
+    std::vector<uint32_t> words;
+    uint32_t next;
+    size_t calls;
+};
+
+void port_write(void *device, const uint8_t *data, size_t size)
+{
+    TestPort *port = (TestPort*) device;
+
+    port->calls++;
+    for (size_t i=0; i<size; i+=4) {
+        uint32_t word;
+        memcpy(&word, data + i, 4);
+        port->words.push_back(word);
+    }
+}
+
+void port_read(void *device, uint8_t *data, size_t size)
+{
+    TestPort *port = (TestPort*) device;
+
+    port->calls++;
+    for (size_t i=0; i<size; i+=4) {
+        memcpy(data + i, &port->next, 4);
+        port->next++;
+    }
+}
+
+bool test_dma()
+{
+    TestPort port = {};
+
+    cpu->reset();
+    irq->reset();
+    dma->reset();
+    dma->set_port(DMA_GPU, {&port, port_read, port_write});
+
+    ASSERT(inter->load<uint32_t>(DMA_START + DMA_DPCR) == DMA_DPCR_DEFAULT);
+    ASSERT(inter->load<uint16_t>(DMA_START + DMA_DPCR + 2) == DMA_DPCR_DEFAULT >> 16);
+    inter->store<uint8_t>(DMA_START + DMA_DPCR + 3, 0);
+    ASSERT(inter->load<uint32_t>(DMA_START + DMA_DPCR) == (DMA_DPCR_DEFAULT & 0xFFFFFF));
+    inter->store<uint32_t>(DMA_START + DMA_DPCR, DMA_DPCR_ENABLE(DMA_OTC));
+    inter->store<uint32_t>(DMA_START + DMA_DICR, DMA_DICR_MASTER_ENABLE | DMA_DICR_ENABLE(DMA_OTC));
+
+    // OTC: each entry links to the previous one, the first ends the table
+    inter->store<uint32_t>(DMA_REG(DMA_OTC, DMA_MADR), 0x1000C);
+    inter->store<uint32_t>(DMA_REG(DMA_OTC, DMA_BCR), 4);
+    uint64_t cycles = cpu->get_cycles();
+    inter->store<uint32_t>(DMA_REG(DMA_OTC, DMA_CHCR), DMA_CHCR_START | DMA_CHCR_TRIGGER);
+    ASSERT(cpu->get_cycles() == cycles + 4 * DMA_WORD_CYCLES);
+    ASSERT(ram->load<uint32_t>(0x1000C) == 0x10008);
+    ASSERT(ram->load<uint32_t>(0x10004) == 0x10000);
+    ASSERT(ram->load<uint32_t>(0x10000) == DMA_OTC_END);
+    ASSERT(inter->load<uint32_t>(DMA_REG(DMA_OTC, DMA_CHCR)) == DMA_OTC_FIXED);
+
+    // A table wrapping around RAM
+    inter->store<uint32_t>(DMA_REG(DMA_OTC, DMA_MADR), 0x4);
+    inter->store<uint32_t>(DMA_REG(DMA_OTC, DMA_CHCR), DMA_CHCR_START | DMA_CHCR_TRIGGER);
+    ASSERT(ram->load<uint32_t>(0x4) == 0x0);
+    ASSERT(ram->load<uint32_t>(0x0) == 0x1FFFFC);
+    ASSERT(ram->load<uint32_t>(0x1FFFFC) == 0x1FFFF8);
+    ASSERT(ram->load<uint32_t>(0x1FFFF8) == DMA_OTC_END);
+
+    // Completion raised the interrupt, writing the flag acknowledges it
+    uint32_t dicr = inter->load<uint32_t>(DMA_START + DMA_DICR);
+    ASSERT(dicr & DMA_DICR_FLAG(DMA_OTC));
+    ASSERT(dicr & DMA_DICR_MASTER_FLAG);
+    ASSERT(inter->load<uint32_t>(IRQ_CONTROL_START + IRQ_STATUS) == 1 << IRQ_DMA);
+    inter->store<uint16_t>(DMA_START + DMA_DICR, 0);
+    ASSERT(inter->load<uint32_t>(DMA_START + DMA_DICR) == dicr);
+    inter->store<uint32_t>(DMA_START + DMA_DICR, dicr);
+    ASSERT(inter->load<uint32_t>(DMA_START + DMA_DICR) == (dicr & DMA_DICR_WRITABLE));
+
+    // Request mode: all blocks in one call to the device, MADR moves
+    for (uint32_t i=0; i<8; i++) {
+        ram->store<uint32_t>(0x2000 + i * 4, i + 1);
+    }
+
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR), 0x2000);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_BCR), 0x00020004);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_CHCR),
+        DMA_CHCR_START | DMA_CHCR_FROM_RAM | DMA_SYNC_REQUEST << DMA_CHCR_SYNC_SHIFT);
+    ASSERT(port.calls == 0);
+
+    // Waits for the channel to be enabled
+    inter->store<uint32_t>(DMA_START + DMA_DPCR, DMA_DPCR_ENABLE(DMA_GPU));
+    ASSERT(port.calls == 1);
+    ASSERT((port.words == std::vector<uint32_t>{1, 2, 3, 4, 5, 6, 7, 8}));
+    ASSERT(inter->load<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR)) == 0x2020);
+    ASSERT(inter->load<uint32_t>(DMA_REG(DMA_GPU, DMA_BCR)) == 4);
+    ASSERT(!(inter->load<uint32_t>(DMA_REG(DMA_GPU, DMA_CHCR)) & DMA_CHCR_START));
+
+    // Manual mode waits for the trigger, copies to RAM and keeps MADR
+    port.calls = 0;
+    port.next = 0xA0;
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR), 0x3000);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_BCR), 3);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_CHCR), DMA_CHCR_START);
+    ASSERT(port.calls == 0);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_CHCR), DMA_CHCR_START | DMA_CHCR_TRIGGER);
+    ASSERT(port.calls == 1);
+    ASSERT(ram->load<uint32_t>(0x3000) == 0xA0);
+    ASSERT(ram->load<uint32_t>(0x3008) == 0xA2);
+    ASSERT(inter->load<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR)) == 0x3000);
+
+    // Transfers wrapping around RAM are split
+    port.calls = 0;
+    port.words.clear();
+    ram->store<uint32_t>(RAM_SIZE - 4, 0xEE);
+    ram->store<uint32_t>(0, 0xFF);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR), RAM_SIZE - 4);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_BCR), 2);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_CHCR), DMA_CHCR_START | DMA_CHCR_TRIGGER | DMA_CHCR_FROM_RAM);
+    ASSERT(port.calls == 2);
+    ASSERT((port.words == std::vector<uint32_t>{0xEE, 0xFF}));
+
+    // Linked list: packets of each node, until the end marker
+    port.words.clear();
+    ram->store<uint32_t>(0x4000, 0x02004010);
+    ram->store<uint32_t>(0x4004, 0xAA);
+    ram->store<uint32_t>(0x4008, 0xBB);
+    ram->store<uint32_t>(0x4010, 0x01FFFFFF);
+    ram->store<uint32_t>(0x4014, 0xCC);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR), 0x4000);
+    inter->store<uint32_t>(DMA_REG(DMA_GPU, DMA_CHCR),
+        DMA_CHCR_START | DMA_CHCR_FROM_RAM | DMA_SYNC_LIST << DMA_CHCR_SYNC_SHIFT);
+    ASSERT((port.words == std::vector<uint32_t>{0xAA, 0xBB, 0xCC}));
+    ASSERT(inter->load<uint32_t>(DMA_REG(DMA_GPU, DMA_MADR)) == DMA_OTC_END);
+
+    // Interrupt not enabled for the GPU channel
+    ASSERT(!(inter->load<uint32_t>(DMA_START + DMA_DICR) & DMA_DICR_MASTER_FLAG));
+
+    dma->set_port(DMA_GPU, {nullptr, nullptr, nullptr});
+    dma->reset();
+    irq->reset();
+
+    return true;
+}
+
+// Instruction cache line filled from RAM
+#define RAM_LINE_FILL_CYCLES    (RAM_READ_CYCLES + (ICACHE_LINE_WORDS - 1) * RAM_BURST_CYCLES)
+
+// Fills a single cache line
+const uint32_t LINE_PROGRAM[] = {
+    0x24010001,     // addiu $1, $0, 1
+    0x24020002,     // addiu $2, $0, 2
+    0x00221821,     // addu $3, $1, $2
+    0x00000000,     // nop
+};
+
+// Block over two lines, left by an exception on the first one
+const uint32_t FAULT_PROGRAM[] = {
+    0x24010001,     // addiu $1, $0, 1
+    0x8C020001,     // lw $2, 1($0) (address error)
+    0x24030003,     // addiu $3, $0, 3
+    0x24040004,     // addiu $4, $0, 4
+    0x24050005,     // addiu $5, $0, 5
+    0x08000400,     // j PROGRAM_START
+    0x00000000,     // nop
+};
+
+bool test_icache()
+{
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+
+    // Disabled on reset: every fetch reads RAM
+    ASSERT(time_program(LINE_PROGRAM, 4) == 4 * (INSTRUCTION_CYCLES + RAM_READ_CYCLES));
+
+    // A miss fills the line, then fetches hit
+    inter->store<uint32_t>(CACHE_CONTROL_START, CACHE_CONTROL_ICACHE);
+    ASSERT(inter->load<uint32_t>(CACHE_CONTROL_START) == CACHE_CONTROL_ICACHE);
+    ASSERT(time_program(LINE_PROGRAM, 4) == 4 * INSTRUCTION_CYCLES + RAM_LINE_FILL_CYCLES);
+    ASSERT(time_program(LINE_PROGRAM, 4) == 4 * INSTRUCTION_CYCLES);
+    ASSERT(cpu->force_get_reg(3) == 3);
+
+    // Hits come from the line, not memory, KSEG1 bypasses the cache
+    ram->store<uint32_t>(PROGRAM_START & 0xFFFFF, 0x24010005); // addiu $1, $0, 5
+    cpu->force_set_PC(PROGRAM_START);
+    cpu->run_next();
+    ASSERT(cpu->force_get_reg(1) == 1);
+    uint64_t cycles = cpu->get_cycles();
+    cpu->force_set_PC(PROGRAM_START + 0x20000000);
+    cpu->run_next();
+    ASSERT(cpu->force_get_reg(1) == 5);
+    ASSERT(cpu->get_cycles() == cycles + INSTRUCTION_CYCLES + RAM_READ_CYCLES);
+
+    // BIOS fetches cost its memory control timings, its lines are read word
+    // by word
+    uint32_t bios_cycles = inter->get_access_cycles(REGION_BIOS, 4);
+    ASSERT(bios_cycles > RAM_READ_CYCLES);
+    cycles = cpu->get_cycles();
+    cpu->force_set_PC(0xBFC00000);
+    cpu->run_next();
+    ASSERT(cpu->get_cycles() == cycles + INSTRUCTION_CYCLES + bios_cycles);
+    cycles = cpu->get_cycles();
+    cpu->force_set_PC(0x9FC00000);
+    cpu->run_next();
+    ASSERT(cpu->get_cycles() == cycles + INSTRUCTION_CYCLES + ICACHE_LINE_WORDS * bios_cycles);
+
+    // Blocks charge the fetches of their instructions like the interpreter:
+    // 42 instructions up to PROGRAM_END, over two lines
+    ExecutionMode modes[] = {MODE_INTERPRETER, MODE_CACHED, MODE_RECOMPILER};
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        load_program(PROGRAM_START, SUM_PROGRAM, 8);
+
+        inter->store<uint32_t>(CACHE_CONTROL_START, 0);
+        uint64_t start = cpu->get_cycles();
+        ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+        uint64_t uncached = cpu->get_cycles() - start;
+
+        cpu->reset();
+        inter->store<uint32_t>(CACHE_CONTROL_START, CACHE_CONTROL_ICACHE);
+        start = cpu->get_cycles();
+        ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+        uint64_t cached = cpu->get_cycles() - start;
+
+        ASSERTV(
+            cached == uncached - 42 * RAM_READ_CYCLES + 2 * RAM_LINE_FILL_CYCLES,
+            "mode %d: %" PRIu64 " cycles, %" PRIu64 " uncached\n", mode, cached, uncached
+        );
+        ASSERT(cpu->force_get_reg(2) == 55);
+    }
+
+    // Lines after the instruction leaving the block are not fetched
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        load_program(PROGRAM_START, FAULT_PROGRAM, 7);
+        inter->store<uint32_t>(CACHE_CONTROL_START, CACHE_CONTROL_ICACHE);
+        cpu->force_set_PC(PROGRAM_START);
+
+        uint64_t start = cpu->get_cycles();
+        cpu->run_block();
+        if (mode == MODE_INTERPRETER) {
+            cpu->run_block();
+        }
+
+        ASSERTV(
+            cpu->get_cycles() - start == 2 * INSTRUCTION_CYCLES + RAM_LINE_FILL_CYCLES,
+            "mode %d: %" PRIu64 " cycles\n", mode, cpu->get_cycles() - start
+        );
+        ASSERT(cpu->force_get_reg(3) == DEFAULT_REG);
+    }
+
+    inter->reset();
+
+    return true;
+}
+
+/**
+ * @brief      Identity rotation, translation along Z and a 320x240 screen
+ */
+void gte_setup(GTE &gte)
+{
+    gte.reset();
+    gte.write_control(0, 0x00001000);   // RT11 RT12
+    gte.write_control(2, 0x00001000);   // RT22 RT23
+    gte.write_control(4, 0x00001000);   // RT33
+    gte.write_control(7, 1000);         // TRZ
+    gte.write_control(24, 160 << 16);   // OFX
+    gte.write_control(25, 120 << 16);   // OFY
+    gte.write_control(26, 500);         // H
+    gte.write_control(28, 0x800000);    // DQB
+}
+
+bool test_gte()
+{
+    GTE gte;
+    ASSERT(gte.init());
+
+    // Registers are sign or zero extended, FIFOs and conversions
+    gte.write_data(1, 0x1234FFFF);
+    ASSERT(gte.read_data(1) == 0xFFFFFFFF);
+    gte.write_data(7, 0xFFFF8000);
+    ASSERT(gte.read_data(7) == 0x8000);
+    gte.write_data(15, 0x00020001);
+    gte.write_data(15, 0x00040003);
+    ASSERT(gte.read_data(13) == 0x00020001);
+    ASSERT(gte.read_data(14) == 0x00040003);
+    ASSERT(gte.read_data(15) == 0x00040003);
+    gte.write_data(28, 0x7FFF);
+    ASSERT(gte.read_data(9) == 0xF80);
+    ASSERT(gte.read_data(29) == 0x7FFF);
+    gte.write_data(30, 0x00FFFFFF);
+    ASSERT(gte.read_data(31) == 8);
+    gte.write_data(30, 0xFF000000);
+    ASSERT(gte.read_data(31) == 8);
+    gte.write_data(30, 0);
+    ASSERT(gte.read_data(31) == 32);
+    gte.write_control(4, 0x12348000);
+    ASSERT(gte.read_control(4) == 0xFFFF8000);
+    gte.write_control(26, 0x8000);
+    ASSERT(gte.read_control(26) == 0xFFFF8000);
+    gte.write_control(31, 0xFFFFFFFF);
+    ASSERT(gte.read_control(31) == 0xFFFFF000);
+
+    // RTPS: transform and project V0
+    gte_setup(gte);
+    gte.write_data(0, 100 | (50 << 16));
+    gte.execute((1 << 19) | GTE_RTPS);
+    ASSERTV(gte.read_control(31) == 0, "FLAG 0x%08x\n", gte.read_control(31));
+    ASSERT(gte.read_data(25) == 100 && gte.read_data(26) == 50 && gte.read_data(27) == 1000);
+    ASSERT(gte.read_data(9) == 100 && gte.read_data(10) == 50 && gte.read_data(11) == 1000);
+    ASSERT(gte.read_data(19) == 1000);
+    ASSERTV(gte.read_data(14) == (210 | (145 << 16)), "SXY2 0x%08x\n", gte.read_data(14));
+    ASSERT(gte.read_data(24) == 0x800000);
+    ASSERT(gte.read_data(8) == 0x800);
+
+    // RTPT: three vertices through the FIFOs
+    gte.write_data(2, gte.read_data(0));
+    gte.write_data(4, 0);
+    gte.execute((1 << 19) | GTE_RTPT);
+    ASSERT(gte.read_data(12) == (210 | (145 << 16)));
+    ASSERT(gte.read_data(13) == (210 | (145 << 16)));
+    ASSERT(gte.read_data(14) == (160 | (120 << 16)));
+    ASSERT(gte.read_data(17) == 1000 && gte.read_data(18) == 1000 && gte.read_data(19) == 1000);
+
+    // Projection plane too far: division overflow
+    gte.write_control(26, 2000);
+    gte.execute((1 << 19) | GTE_RTPS);
+    ASSERT(gte.read_control(31) == (GTE_FLAG_ERROR | GTE_FLAG_DIVIDE));
+    ASSERT(gte.read_data(14) == (359 | (219 << 16)));
+
+    // MVMVA: 44 bits accumulator overflow, truncated result saturates IR1
+    gte.reset();
+    gte.write_control(0, 0x7FFF);
+    gte.write_control(5, 0x7FFFFFFF);
+    gte.write_data(0, 0x7FFF);
+    gte.execute(GTE_MVMVA);
+    ASSERT(gte.read_control(31) == (GTE_FLAG_ERROR | GTE_FLAG_MAC1_POS | GTE_FLAG_IR1));
+    ASSERT(gte.read_data(25) == 0x3FFEF001);
+    ASSERT(gte.read_data(9) == 0x7FFF);
+
+    // SQR: IR saturation, no error bit for lm
+    gte.write_data(9, 0x7FFF);
+    gte.write_data(10, 0x100);
+    gte.write_data(11, 0xFFFFFF00);
+    gte.execute((1 << 19) | GTE_SQR);
+    ASSERT(gte.read_data(25) == 0x3FFF0 && gte.read_data(9) == 0x7FFF);
+    ASSERT(gte.read_data(26) == 0x10 && gte.read_data(27) == 0x10);
+    ASSERT(gte.read_control(31) == (GTE_FLAG_ERROR | GTE_FLAG_IR1));
+
+    // NCLIP and AVSZ3
+    gte.write_data(12, 0);
+    gte.write_data(13, 10);
+    gte.write_data(14, 10 << 16);
+    gte.execute(GTE_NCLIP);
+    ASSERT(gte.read_data(24) == 100);
+    gte.write_control(29, 0x555);
+    for (size_t i=17; i<=19; i++) {
+        gte.write_data(i, 300);
+    }
+    gte.execute(GTE_AVSZ3);
+    ASSERT(gte.read_data(24) == 0x555 * 900);
+    ASSERT(gte.read_data(7) == 299);
+
+    // OP: cross product with the RT diagonal
+    gte_setup(gte);
+    gte.write_data(9, 1);
+    gte.write_data(10, 2);
+    gte.write_data(11, 3);
+    gte.execute((1 << 19) | GTE_OP);
+    ASSERT(gte.read_data(25) == 1 && gte.read_data(26) == (uint32_t) -2 && gte.read_data(27) == 1);
+
+    // DPCS: interpolate the color toward the far color by IR0
+    gte.write_data(6, 0x40302010);
+    for (size_t i=21; i<=23; i++) {
+        gte.write_control(i, 0x800);
+    }
+    gte.write_data(8, 0);
+    gte.execute((1 << 19) | GTE_DPCS);
+    ASSERT(gte.read_data(22) == 0x40302010);
+    gte.write_data(8, 0x1000);
+    gte.execute((1 << 19) | GTE_DPCS);
+    ASSERT(gte.read_data(22) == 0x40808080);
+    ASSERT(gte.read_data(21) == 0x40302010);
+
+    return true;
+}
+
+/**
+ * @brief      Pseudo random numbers, reproducible across runs
+ */
+uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+
+    return *seed;
+}
+
+bool test_gte_kernels()
+{
+    GTE scalar;
+    GTE simd;
+    ASSERT(scalar.init());
+    ASSERT(simd.init());
+    scalar.set_kernel(GTE_KERNEL_SCALAR);
+
+    const uint32_t commands[] = {
+        (1 << 19) | GTE_RTPT,
+        GTE_RTPS,
+        (1 << 19) | (1 << 10) | GTE_NCDT,
+        (1 << 19) | GTE_NCCT,
+        (1 << 19) | (1 << 17) | (3 << 15) | (1 << 13) | GTE_MVMVA,
+        (1 << 15) | (3 << 13) | GTE_MVMVA,
+    };
+
+    for (size_t kernel=GTE_KERNEL_SSE41; kernel<GTE_KERNEL_COUNT; kernel++) {
+        if (!GTE::supported((GTEKernel) kernel)) {
+            continue;
+        }
+
+        simd.set_kernel((GTEKernel) kernel);
+        uint32_t seed = 1;
+
+        for (size_t i=0; i<1000; i++) {
+            for (size_t reg=0; reg<GTE_REG_COUNT; reg++) {
+                uint32_t data = next_random(&seed);
+                uint32_t control = next_random(&seed);
+                scalar.write_data(reg, data);
+                simd.write_data(reg, data);
+                scalar.write_control(reg, control);
+                simd.write_control(reg, control);
+            }
+
+            uint32_t command = commands[i % (sizeof(commands) / sizeof(uint32_t))];
+            scalar.execute(command);
+            simd.execute(command);
+
+            for (size_t reg=0; reg<GTE_REG_COUNT; reg++) {
+                ASSERTV(scalar.read_data(reg) == simd.read_data(reg), "%s, %s: data %zu\n", GTE::kernel_name((GTEKernel) kernel), GTE::command_name(command), reg);
+                ASSERTV(scalar.read_control(reg) == simd.read_control(reg), "%s, %s: control %zu\n", GTE::kernel_name((GTEKernel) kernel), GTE::command_name(command), reg);
+            }
+        }
+    }
+
+    return true;
+}
+
+// GTE access through coprocessor 2 instructions
+const uint32_t COP2_PROGRAM[] = {
+    0x24010100,     // addiu $1, $0, 0x100
+    0x48814800,     // mtc2 $1, $9 (IR1)
+    0xC88A0000,     // lwc2 $10, 0($4) (IR2)
+    0x4A080028,     // SQR (sf=1)
+    0x4802C800,     // mfc2 $2, $25 (MAC1)
+    0xE89A0004,     // swc2 $26, 4($4) (MAC2)
+    0x4843F800,     // cfc2 $3, $31 (FLAG)
+    0x00000000,     // nop
+};
+
+bool test_cop2()
+{
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+
+    inter->store<uint32_t>(0x80002000, 0x80);
+    inter->store<uint32_t>(0x80002004, 0);
+    cpu->force_set_reg(4, 0x80002000);
+
+    // MFC2 waits for SQR to be done: its fetch from RAM already covers it
+    uint64_t cycles = time_program(COP2_PROGRAM, 8);
+    ASSERTV(cycles == 8 * (INSTRUCTION_CYCLES + RAM_READ_CYCLES) + RAM_READ_CYCLES, "got %" PRIu64 "\n", cycles);
+    ASSERT(cpu->force_get_reg(2) == 0x10);
+    ASSERT(inter->load<uint32_t>(0x80002004) == 0x04);
+    ASSERT(cpu->force_get_reg(3) == 0);
+
+    return true;
+}
+
+#define EXE_START       0x80010000
+#define EXE_END         0x80010034
+
+// Calls strlen, memset and the EnterCriticalSection system call
+const uint32_t KERNEL_PROGRAM[] = {
+    0x3C048001,     // lui $a0, 0x8001
+    0x34840100,     // ori $a0, $a0, 0x0100
+    0x0C000028,     // jal 0xA0
+    0x2409001B,     // addiu $t1, $0, 0x1B (strlen)
+    0x00408021,     // addu $s0, $v0, $0
+    0x3C048001,     // lui $a0, 0x8001
+    0x34840200,     // ori $a0, $a0, 0x0200
+    0x24050055,     // addiu $a1, $0, 0x55
+    0x24060008,     // addiu $a2, $0, 8
+    0x0C000028,     // jal 0xA0
+    0x2409002B,     // addiu $t1, $0, 0x2B (memset)
+    0x24040001,     // addiu $a0, $0, 1
+    0x0000000C,     // syscall
+    0x0800400D,     // end: j end
+    0x00000000,     // nop
+};
+
+#define INT_MAIN        0x80011000
+#define INT_FIRST       0x80011100
+#define INT_SECOND      0x80011110
+#define INT_STRUCT      0x80011180
+#define INT_RESULT      0x80011200
+
+// Unmask vblank, enable interrupts then count in $v0
+const uint32_t INT_MAIN_PROGRAM[] = {
+    0x3C0B1F80,     // lui $11, 0x1F80
+    0x24010001,     // addiu $1, $0, 1
+    0xAD611074,     // sw $1, 0x1074($11) (I_MASK)
+    0x24010401,     // addiu $1, $0, 0x401
+    0x40816000,     // mtc0 $1, $12 (SR: IM2, IEc)
+    0x24420001,     // loop: addiu $v0, $v0, 1
+    0x08004405,     // j loop
+    0x00000000,     // nop
+};
+
+// Handler queued with SysEnqIntRP: the first function returns 7, the
+// second one stores its argument at INT_RESULT
+const uint32_t INT_FIRST_PROGRAM[] = {
+    0x24020007,     // addiu $v0, $0, 7
+    0x03E00008,     // jr $ra
+    0x00000000,     // nop
+};
+
+const uint32_t INT_SECOND_PROGRAM[] = {
+    0x3C088001,     // lui $t0, 0x8001
+    0x03E00008,     // jr $ra
+    0xAD041200,     // sw $a0, 0x1200($t0)
+};
+
+void store_string(uint32_t address, const char *value)
+{
+    for (size_t i=0; i<=strlen(value); i++) {
+        inter->store<uint8_t>(address + i, value[i]);
+    }
+}
+
+// Calls the kernel function with the given arguments, returns $v0
+uint32_t kernel_call(Kernel *kernel, uint32_t vector, uint32_t function, std::initializer_list<uint32_t> args)
+{
+    size_t index = 4;
+    for (uint32_t arg : args) {
+        cpu->force_set_reg(index++, arg);
+    }
+
+    cpu->force_set_reg(9, function);
+    kernel->call(vector);
+
+    return cpu->force_get_reg(2);
+}
+
+bool test_kernel()
+{
+    Kernel kernel;
+    ASSERT(kernel.init(cpu, inter));
+
+    std::vector<uint8_t> exe(EXE_HEADER_SIZE * 2, 0);
+    ASSERT(!kernel.set_exe(exe));
+
+    memcpy(exe.data(), EXE_MAGIC, strlen(EXE_MAGIC));
+    uint32_t header[] = {EXE_START, 0, EXE_START, EXE_HEADER_SIZE};
+    memcpy(&exe[EXE_PC], header, sizeof(header));
+    memcpy(&exe[EXE_HEADER_SIZE], KERNEL_PROGRAM, sizeof(KERNEL_PROGRAM));
+    memcpy(&exe[EXE_HEADER_SIZE + 0x100], "hello", 6);
+    ASSERT(kernel.set_exe(exe));
+
+    cpu->set_kernel(&kernel);
+
+    ExecutionMode modes[] = {MODE_INTERPRETER, MODE_CACHED, MODE_RECOMPILER};
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        kernel.reset();
+        ASSERT(cpu->get_PC() == EXE_START);
+        ASSERT(cpu->force_get_reg(29) == KERNEL_STACK);
+
+        bool done = false;
+        for (size_t i=0; i<1000 && !done; i++) {
+            cpu->run_block();
+            done = cpu->get_PC() == EXE_END;
+        }
+
+        ASSERTV(done, "mode %d: PC is 0x%08x\n", mode, cpu->get_PC());
+        ASSERT(cpu->force_get_reg(16) == 5);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x200) == 0x55555555);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x204) == 0x55555555);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x208) == 0);
+
+        // Interrupts run the queued handlers then resume the interrupted code
+        load_program(INT_MAIN, INT_MAIN_PROGRAM, 8);
+        load_program(INT_FIRST, INT_FIRST_PROGRAM, 3);
+        load_program(INT_SECOND, INT_SECOND_PROGRAM, 3);
+        inter->store<uint32_t>(INT_STRUCT + INT_HANDLER_SECOND, INT_SECOND);
+        inter->store<uint32_t>(INT_STRUCT + INT_HANDLER_FIRST, INT_FIRST);
+        inter->store<uint32_t>(INT_RESULT, 0);
+        kernel_call(&kernel, KERNEL_C0, 0x02, {0, INT_STRUCT});
+
+        cpu->force_set_reg(2, 1000);
+        cpu->force_set_PC(INT_MAIN);
+        for (size_t i=0; i<20; i++) {
+            cpu->run_block();
+        }
+
+        irq->raise(IRQ_VBLANK);
+        for (size_t i=0; i<50; i++) {
+            cpu->run_block();
+        }
+
+        ASSERTV(inter->load<uint32_t>(INT_RESULT) == 7, "mode %d\n", mode);
+        ASSERT(inter->load<uint32_t>(IRQ_CONTROL_START + IRQ_STATUS) == 0);
+        ASSERT(cpu->force_get_reg(2) > 1000);
+        ASSERT(cpu->force_get_reg(29) == KERNEL_STACK);
+        ASSERT(cpu->get_PC() >= INT_MAIN + 0x14 && cpu->get_PC() < INT_MAIN + 0x20);
+    }
+
+    irq->reset();
+
+    // Events are ready once delivered, until tested
+    uint32_t event = kernel_call(&kernel, KERNEL_B0, 0x08, {0xF0000001, 0x20, EVENT_MODE_READY, 0});
+    ASSERT((event & 0xFFFF0000) == EVENT_HANDLE);
+    kernel_call(&kernel, KERNEL_B0, 0x0C, {event});
+    ASSERT(kernel_call(&kernel, KERNEL_B0, 0x0B, {event}) == 0);
+    kernel_call(&kernel, KERNEL_B0, 0x07, {0xF0000001, 0x20});
+    ASSERT(kernel_call(&kernel, KERNEL_B0, 0x0B, {event}) == 1);
+    ASSERT(kernel_call(&kernel, KERNEL_B0, 0x0B, {event}) == 0);
+
+    // Arguments after the fourth are on the stack
+    store_string(EXE_START + 0x300, "%d-%05x-%s%c%%");
+    store_string(EXE_START + 0x320, "ab");
+    cpu->force_set_reg(29, EXE_START + 0x400);
+    inter->store<uint32_t>(EXE_START + 0x410, 'z');
+    uint32_t length = kernel_call(&kernel, KERNEL_A0, 0x1B, {EXE_START + 0x300, (uint32_t) -3, 0x1F, EXE_START + 0x320});
+    ASSERT(length == 14);
+    ASSERT(kernel.format(EXE_START + 0x300, 1) == "-3-0001f-abz%");
+
+    cpu->set_kernel(nullptr);
+
+    return true;
+}
+
+// Calls the BIOS memcpy through the A0 dispatcher
+const uint32_t ROUTINES_PROGRAM[] = {
+    0x3C048001,     // lui $a0, 0x8001
+    0x34840200,     // ori $a0, $a0, 0x0200
+    0x3C058001,     // lui $a1, 0x8001
+    0x34A50100,     // ori $a1, $a1, 0x0100
+    0x24060008,     // addiu $a2, $0, 8
+    0x0C000028,     // jal 0xA0
+    0x2409002A,     // addiu $t1, $0, 0x2A (memcpy)
+    0x0800400A,     // end: j end
+    0x00000000,     // nop
+};
+
+#define ROUTINES_END    0x80010028
+
+// Runs ROUTINES_PROGRAM with memcpy at the given address, returns the cycles taken
+uint64_t time_routine(ExecutionMode mode, uint32_t memcpy_address)
+{
+    cpu->reset();
+    cpu->set_mode(mode);
+
+    load_program(EXE_START, ROUTINES_PROGRAM, 9);
+    store_string(EXE_START + 0x100, "abcdefgh");
+    inter->store<uint32_t>(EXE_START + 0x200, 0);
+    inter->store<uint32_t>(EXE_START + 0x204, 0);
+
+    // Guest dispatcher returns without copying
+    inter->store<uint32_t>(ROUTINES_A0_VECTOR, 0x03E00008);     // jr $ra
+    inter->store<uint32_t>(ROUTINES_A0_VECTOR + 4, 0);
+    inter->store<uint32_t>(ROUTINES_A0_TABLE + 0x2A * 4, memcpy_address);
+
+    cpu->force_set_PC(EXE_START);
+    for (size_t i=0; i<100 && cpu->get_PC() != ROUTINES_END; i++) {
+        cpu->run_block();
+    }
+
+    return cpu->get_cycles();
+}
+
+bool test_routines()
+{
+    Routines routines;
+    ASSERT(routines.init(cpu, ram));
+
+    // Instruction cache left enabled by the kernel: no line fills
+    inter->reset();
+
+    ExecutionMode modes[] = {MODE_CACHED, MODE_RECOMPILER};
+    for (ExecutionMode mode : modes) {
+        // Disabled: guest code runs
+        uint64_t guest = time_routine(mode, 0xBFC01000);
+        ASSERT(cpu->get_PC() == ROUTINES_END);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x200) == 0);
+
+        cpu->set_routines(&routines);
+
+        // Function in the BIOS: native copy, the dispatcher is skipped
+        uint64_t native = time_routine(mode, 0xBFC01000);
+        ASSERT(cpu->get_PC() == ROUTINES_END);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x200) == 0x64636261);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x204) == 0x68676665);
+        ASSERT(cpu->force_get_reg(2) == EXE_START + 0x200);
+        ASSERTV(
+            native == guest - 2 * (INSTRUCTION_CYCLES + RAM_READ_CYCLES) + ROUTINE_CALL_CYCLES + 8 * ROUTINE_COPY_CYCLES,
+            "mode %d: %" PRIu64 " cycles, guest code took %" PRIu64 "\n", mode, native, guest
+        );
+
+        // Function replaced in RAM: guest code runs
+        time_routine(mode, 0x80001000);
+        ASSERT(cpu->get_PC() == ROUTINES_END);
+        ASSERT(inter->load<uint32_t>(EXE_START + 0x200) == 0);
+
+        cpu->set_routines(nullptr);
+    }
+
+    return true;
+}
+
+bool test_fastmem()
+{
+    Fastmem fastmem;
+
+#ifndef FASTMEM_AVAILABLE
+    ASSERT(!fastmem.init(inter, ram, bios, scratchpad));
+    return true;
+#endif
+
+    ASSERT(fastmem.init(inter, ram, bios, scratchpad));
+    inter->set_fastmem(&fastmem);
+
+    // RAM, its mirrors, scratchpad and BIOS are accessed in place
+    inter->store<uint32_t>(0x80000200, 0xDEADC0DE);
+    ASSERT(ram->load<uint32_t>(0x200) == 0xDEADC0DE);
+    ASSERT(inter->load<uint32_t>(0x00600200) == 0xDEADC0DE);
+    inter->store<uint16_t>(0xA0200202, 0x1234);
+    ASSERT(inter->load<uint32_t>(0x80000200) == 0x1234C0DE);
+    ASSERT(inter->load<uint8_t>(0x80000203) == 0x12);
+    ASSERT(inter->load<uint32_t>(0xBFC00010) == bios->load<uint32_t>(0x10));
+    inter->store<uint32_t>(0x1F800020, 0x0BADF00D);
+    ASSERT(scratchpad->load<uint32_t>(0x20) == 0x0BADF00D);
+
+    // Not while the cache is isolated
+    inter->set_isolated(true);
+    inter->store<uint32_t>(0x80000200, 0);
+    ASSERT(inter->load<uint32_t>(0x80000200) == 0x1234C0DE);
+    inter->set_isolated(false);
+    inter->store<uint32_t>(0x80000204, 0xC0FFEE00);
+    ASSERT(ram->load<uint32_t>(0x204) == 0xC0FFEE00);
+
+    // I/O registers trap to address decoding
+    ASSERT(inter->load<uint32_t>(0x1F801814) == 0x10000000);
+    ASSERT(inter->load<uint8_t>(0x1F000000) == 0xFF);
+    inter->store<uint32_t>(0x1F801010, 0x0013343F);
+    ASSERT(inter->load<uint32_t>(0x1F801010) == 0x0013343F);
+    ASSERT(inter->get_access_cycles(REGION_BIOS, 4) == 12);
+    inter->reset();
+
+    // Code runs and is invalidated as with the page table
+    cpu->reset();
+    cpu->set_mode(MODE_CACHED);
+    load_program(PROGRAM_START, SUM_PROGRAM, 8);
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 55);
+    inter->store<uint32_t>(PROGRAM_START + 0x200000, 0x24010003); // addiu $1, $0, 3
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 6);
+
+    // Loads are charged the same
+    const uint32_t load_word[] = {
+        0x8C830000,     // lw $3, 0($4)
+    };
+    cpu->set_mode(MODE_INTERPRETER);
+    cpu->force_set_reg(4, 0x80000000);
+    ASSERT(time_program(load_word, 1) == INSTRUCTION_CYCLES + 2 * RAM_READ_CYCLES);
+
+    inter->set_fastmem(nullptr);
+
+    return true;
+}
+
+bool test_recompiler()
+{
+    uint32_t expected[REG_COUNT];
+
+    cpu->reset();
+    load_program(PROGRAM_START, ALU_PROGRAM, 27);
+
+    cpu->set_mode(MODE_INTERPRETER);
+    ASSERT(run_program(PROGRAM_START, ALU_END));
+    for (size_t i=0; i<REG_COUNT; i++) {
+        expected[i] = cpu->force_get_reg(i);
+    }
+
+    cpu->reset();
+    cpu->set_mode(MODE_RECOMPILER);
+    ASSERT(run_program(PROGRAM_START, ALU_END));
+    for (size_t i=0; i<REG_COUNT; i++) {
+        ASSERT_QUIET_SUCCESS(
+            cpu->force_get_reg(i) == expected[i],
+            "$r%zu: got 0x%08x expected 0x%08x", i, cpu->force_get_reg(i), expected[i]
+        );
+    }
+
+    ExecutionMode modes[] = {MODE_INTERPRETER, MODE_RECOMPILER};
+
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        load_program(PROGRAM_START, MEMORY_PROGRAM, 38);
+
+        ASSERT(run_program(PROGRAM_START, EXCEPTION_HANDLER));
+        for (size_t i=0; i<REG_COUNT; i++) {
+            if (mode == MODE_INTERPRETER) {
+                expected[i] = cpu->force_get_reg(i);
+            }
+
+            ASSERT_QUIET_SUCCESS(
+                cpu->force_get_reg(i) == expected[i],
+                "$r%zu: got 0x%08x expected 0x%08x", i, cpu->force_get_reg(i), expected[i]
+            );
+        }
+    }
+
+    ASSERT(cpu->force_get_reg(3) == 0xFFFFFFFE);
+    ASSERT(cpu->force_get_reg(4) == 0xFFFE);
+    ASSERT(cpu->force_get_reg(5) == 0xFFFFFFFE);
+    ASSERT(cpu->force_get_reg(9) == DEFAULT_REG);
+    ASSERT(cpu->force_get_reg(10) == 1);
+    ASSERT(cpu->force_get_reg(12) == DEFAULT_REG);
+    ASSERT(cpu->force_get_reg(16) == DEFAULT_REG);
+    ASSERT(cpu->force_get_reg(17) == 0xFFFFFFFE);
+    ASSERT(cpu->force_get_reg(23) == DEFAULT_REG);
+    ASSERT(cpu->force_get_reg(31) == 0x80001060);
+    ASSERT(cpu->force_get_reg(19) == 0x80001090);
+    ASSERT(cpu->force_get_reg(25) == 1);
+
+    cpu->reset();
+    load_program(PROGRAM_START, SUM_PROGRAM, 8);
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 55);
+
+    // Overwritten code must not run from the generated code
+    inter->store<uint32_t>(PROGRAM_START, 0x24010003); // addiu $1, $0, 3
+    ASSERT(run_program(PROGRAM_START, PROGRAM_END));
+    ASSERT(cpu->force_get_reg(2) == 6);
+
+    cpu->set_mode(MODE_INTERPRETER);
+
+    return true;
+}
+
+#define INTERRUPT_HANDLER   0x80000080
+#define INTERRUPT_LOOP      0x80001014
+#define I_STAT              (IRQ_CONTROL_START + IRQ_STATUS)
+#define I_MASK              (IRQ_CONTROL_START + IRQ_MASK)
+
+// Unmask vblank, enable interrupts then loop
+const uint32_t INTERRUPT_PROGRAM[] = {
+    0x3C0B1F80,     // lui $11, 0x1F80
+    0x24010001,     // addiu $1, $0, 1
+    0xAD611074,     // sw $1, 0x1074($11) (I_MASK)
+    0x24010401,     // addiu $1, $0, 0x401
+    0x40816000,     // mtc0 $1, $12 (SR: IM2, IEc)
+    0x24420001,     // loop: addiu $2, $2, 1
+    0x08000405,     // j loop
+    0x00000000,     // nop
+};
+
+// Count interrupts, acknowledge them and return
+const uint32_t INTERRUPT_HANDLER_PROGRAM[] = {
+    0x254A0001,     // addiu $10, $10, 1
+    0x3C0B1F80,     // lui $11, 0x1F80
+    0xAD601070,     // sw $0, 0x1070($11) (I_STAT)
+    0x401A7000,     // mfc0 $26, $14 (EPC)
+    0x00000000,     // nop
+    0x03400008,     // jr $26
+    0x42000010,     // rfe
+};
+
+bool test_interrupts()
+{
+    // Controller registers
+    irq->reset();
+    irq->raise(IRQ_VBLANK);
+    irq->raise(IRQ_DMA);
+    ASSERT(inter->load<uint32_t>(I_STAT) == 0x09);
+    inter->store<uint16_t>(I_STAT, 0xFFF7);
+    ASSERT(inter->load<uint32_t>(I_STAT) == 0x01);
+    inter->store<uint32_t>(I_MASK, 0xFFFFFFFF);
+    ASSERT(inter->load<uint16_t>(I_MASK) == IRQ_LINES_MASK);
+    ASSERT(irq->active());
+    inter->store<uint8_t>(I_MASK + 1, 0);
+    ASSERT(inter->load<uint32_t>(I_MASK) == 0xFF);
+
+    ExecutionMode modes[] = {MODE_INTERPRETER, MODE_CACHED, MODE_RECOMPILER};
+
+    for (ExecutionMode mode : modes) {
+        cpu->decode_and_execute(0x40806000);    // mtc0 $0, $12
+        cpu->reset();
+        cpu->set_mode(mode);
+        irq->reset();
+        inter->reset();
+
+        load_program(INTERRUPT_HANDLER, INTERRUPT_HANDLER_PROGRAM, 7);
+        load_program(PROGRAM_START, INTERRUPT_PROGRAM, 8);
+        cpu->force_set_reg(2, 0);
+        cpu->force_set_reg(10, 0);
+        cpu->force_set_PC(PROGRAM_START);
+
+        // Line raised before being unmasked: enabling interrupts ends the batch
+        irq->raise(IRQ_VBLANK);
+        cpu->run_for(1000);
+        ASSERT(cpu->get_cycles() < 1000);
+        ASSERT(cpu->force_get_reg(10) == 0);
+
+        // Taken before the next batch, execution resumes in the loop
+        cpu->run_for(100);
+        ASSERTV(cpu->force_get_reg(10) == 1, "mode %d: got %u\n", mode, cpu->force_get_reg(10));
+        ASSERT(inter->load<uint32_t>(I_STAT) == 0);
+        ASSERT(cpu->get_PC() >= INTERRUPT_LOOP && cpu->get_PC() < INTERRUPT_LOOP + 12);
+
+        uint32_t count = cpu->force_get_reg(2);
+        ASSERT(count > 0);
+
+        irq->raise(IRQ_VBLANK);
+        cpu->run_for(100);
+        ASSERT(cpu->force_get_reg(10) == 2);
+        ASSERT(cpu->force_get_reg(2) > count);
+
+        // Masked line stays in I_STAT
+        inter->store<uint32_t>(I_MASK, 0);
+        irq->raise(IRQ_VBLANK);
+        cpu->run_for(100);
+        ASSERT(cpu->force_get_reg(10) == 2);
+        ASSERT(inter->load<uint32_t>(I_STAT) == 1);
+    }
+
+    irq->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+
+    return true;
+}
+
+#define SPECIALIZED_END     0x80001030
+#define MISALIGNED_START    0x80001100
+
+// Handlers picked when decoding: $zero destination, address known to be
+// aligned, straight-line code after coprocessor loads
+const uint32_t SPECIALIZED_PROGRAM[] = {
+    0x8C011000,     // lw $1, 0x1000($0)
+    0x00200021,     // addu $0, $1, $0 (load in flight)
+    0x00201021,     // addu $2, $1, $0 (loaded $1)
+    0x24060042,     // addiu $6, $0, 0x42
+    0x48864800,     // mtc2 $6, $9 (IR1)
+    0x48034800,     // mfc2 $3, $9
+    0x00602021,     // addu $4, $3, $0 (old $3)
+    0x00602821,     // addu $5, $3, $0 (IR1)
+    0xAC052000,     // sw $5, 0x2000($0)
+    0x94072000,     // lhu $7, 0x2000($0)
+    0x0800040C,     // j SPECIALIZED_END
+    0x00000000,     // nop
+};
+
+bool test_specialized()
+{
+    ExecutionMode modes[] = {MODE_INTERPRETER, MODE_CACHED, MODE_RECOMPILER};
+
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        load_program(PROGRAM_START, SPECIALIZED_PROGRAM, 12);
+
+        ASSERT(run_program(PROGRAM_START, SPECIALIZED_END));
+        ASSERT(cpu->force_get_reg(0) == 0);
+        ASSERT(cpu->force_get_reg(1) == 0x8C011000);
+        ASSERT(cpu->force_get_reg(2) == 0x8C011000);
+        ASSERTV(cpu->force_get_reg(3) == 0x42, "mode %d: got 0x%08x\n", mode, cpu->force_get_reg(3));
+        ASSERTV(cpu->force_get_reg(4) == DEFAULT_REG, "mode %d: got 0x%08x\n", mode, cpu->force_get_reg(4));
+        ASSERT(cpu->force_get_reg(5) == 0x42);
+        ASSERT(cpu->force_get_reg(7) == 0x42);
+
+        // Misaligned address known when decoding still raises the exception
+        inter->store<uint32_t>(MISALIGNED_START, 0x8C071002);   // lw $7, 0x1002($0)
+        cpu->force_set_PC(MISALIGNED_START);
+        cpu->run_block();
+        ASSERT(cpu->get_PC() == 0x80000080);
+        ASSERT(cpu->force_get_reg(7) == 0x42);
+    }
+
+    cpu->set_mode(MODE_INTERPRETER);
+
+    return true;
+}
+
+#define TRACE_END           0x80001030
+#define TRACE_DECREMENT     0x80001024
+
+// Loop body split by a branch taken 15 times out of 16
+const uint32_t TRACE_PROGRAM[] = {
+    0x240100C8,     // addiu $1, $0, 200
+    0x24020000,     // addiu $2, $0, 0
+    0x24050000,     // addiu $5, $0, 0
+    0x00411021,     // loop: addu $2, $2, $1
+    0x3024000F,     // andi $4, $1, 0x0F
+    0x14800002,     // bne $4, $0, skip
+    0x00000000,     // nop
+    0x24A50001,     // addiu $5, $5, 1
+    0x00413026,     // skip: xor $6, $2, $1
+    0x2421FFFF,     // addiu $1, $1, -1 (TRACE_DECREMENT)
+    0x1420FFF8,     // bne $1, $0, loop
+    0x00000000,     // nop
+    0x0800040C,     // j TRACE_END
+    0x00000000,     // nop
+};
+
+// Runs from start to end, returns the number of run_block calls it took
+size_t count_blocks(uint32_t start, uint32_t end)
+{
+    cpu->force_set_PC(start);
+
+    size_t count = 0;
+    while (cpu->get_PC() != end && count < 10000) {
+        cpu->run_block();
+        count++;
+    }
+
+    return count;
+}
+
+bool test_superblocks()
+{
+    uint32_t expected[REG_COUNT];
+
+    cpu->reset();
+    cpu->set_mode(MODE_INTERPRETER);
+    load_program(PROGRAM_START, TRACE_PROGRAM, 14);
+
+    ASSERT(count_blocks(PROGRAM_START, TRACE_END) < 10000);
+    ASSERT(cpu->force_get_reg(2) == 20100);
+    ASSERT(cpu->force_get_reg(5) == 12);
+    for (size_t i=0; i<REG_COUNT; i++) {
+        expected[i] = cpu->force_get_reg(i);
+    }
+    uint64_t cycles = cpu->get_cycles();
+
+    // Loop head and the skip block run as one superblock once hot, the
+    // rare path leaves it through the side exit
+    cpu->reset();
+    cpu->set_mode(MODE_CACHED);
+    size_t count = count_blocks(PROGRAM_START, TRACE_END);
+    ASSERTV(count < 300, "%zu blocks dispatched\n", count);
+    ASSERTV(cpu->get_cycles() == cycles, "took %" PRIu64 " cycles instead of %" PRIu64 "\n", cpu->get_cycles(), cycles);
+    for (size_t i=0; i<REG_COUNT; i++) {
+        ASSERT_QUIET_SUCCESS(
+            cpu->force_get_reg(i) == expected[i],
+            "$r%zu: got 0x%08x expected 0x%08x", i, cpu->force_get_reg(i), expected[i]
+        );
+    }
+
+    // Code overwritten in the second segment only
+    inter->store<uint32_t>(TRACE_DECREMENT, 0x2421FFFE);   // addiu $1, $1, -2
+    ASSERT(count_blocks(PROGRAM_START, TRACE_END) < 10000);
+    ASSERTV(cpu->force_get_reg(2) == 10100, "Got %u\n", cpu->force_get_reg(2));
+
+    cpu->set_mode(MODE_INTERPRETER);
+
+    return true;
+}
+
+#define CALL_END            0x80001024
+#define CALL_FUNCTION       0x8000102C
+
+// Calls the same function from two sites in a loop
+const uint32_t CALL_PROGRAM[] = {
+    0x24010064,     // addiu $1, $0, 100
+    0x24020000,     // addiu $2, $0, 0
+    0x0C00040B,     // loop: jal function
+    0x24030001,     // addiu $3, $0, 1
+    0x0C00040B,     // jal function
+    0x24030002,     // addiu $3, $0, 2
+    0x2421FFFF,     // addiu $1, $1, -1
+    0x1420FFFA,     // bne $1, $0, loop
+    0x00000000,     // nop
+    0x08000409,     // end: j CALL_END
+    0x00000000,     // nop
+    0x00431021,     // function: addu $2, $2, $3
+    0x03E00008,     // jr $ra
+    0x00000000,     // nop
+};
+
+bool test_chaining()
+{
+    ExecutionMode modes[] = {MODE_CACHED, MODE_RECOMPILER};
+
+    for (ExecutionMode mode : modes) {
+        cpu->reset();
+        cpu->set_mode(mode);
+        load_program(PROGRAM_START, CALL_PROGRAM, 14);
+        cpu->force_set_PC(PROGRAM_START);
+
+        // Returns alternate between the call sites
+        cpu->run_until(10000);
+        ASSERTV(cpu->force_get_reg(2) == 300, "mode %d: got %u\n", mode, cpu->force_get_reg(2));
+        ASSERT(cpu->get_PC() == CALL_END || cpu->get_PC() == CALL_END + 4);
+
+        // Links to the overwritten function are dropped
+        inter->store<uint32_t>(CALL_FUNCTION, 0x00431023);    // subu $2, $2, $3
+        cpu->force_set_PC(PROGRAM_START);
+        cpu->run_until(20000);
+        ASSERTV(cpu->force_get_reg(2) == (uint32_t) -300, "mode %d: got %d\n", mode, (int32_t) cpu->force_get_reg(2));
+        ASSERT(cpu->get_PC() == CALL_END || cpu->get_PC() == CALL_END + 4);
+    }
+
+    cpu->set_mode(MODE_INTERPRETER);
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     info("PSX testing\n");
@@ -253,9 +2053,35 @@ int main(int argc, char *argv[])
     test("CPU: ADDIU", &test_ADDIU);
     test("CPU: ORI", &test_ORI);
     test("CPU: Store/Load", &test_store_load);
+    test("Interconnect: Memory pages", &test_memory_pages);
+    test("Memory: Backing", &test_memory_backing);
+    test("Interconnect: Scratchpad", &test_scratchpad);
+    test("Interconnect: Cache isolation", &test_cache_isolation);
+    test("Interconnect: I/O registry", &test_io_registry);
+    test("Interconnect: DMA", &test_dma);
+    test("CPU: Instruction cache", &test_icache);
+    test("GTE: Commands", &test_gte);
+    test("GTE: SIMD kernels", &test_gte_kernels);
+    test("CPU: COP2", &test_cop2);
     test("CPU: DIV", &test_DIV);
     test("CPU: SLT", &test_SLT);
     test("CPU: SUB", &test_SUB);
 
+    test("CPU: Load delay", &test_load_delay);
+    test("CPU: Threaded interpreter", &test_threaded);
+    test("CPU: Cached interpreter", &test_cached);
+    test("CPU: Recompiler", &test_recompiler);
+    test("CPU: Specialized handlers", &test_specialized);
+    test("CPU: Interrupts", &test_interrupts);
+    test("CPU: Superblocks", &test_superblocks);
+    test("CPU: Block chaining", &test_chaining);
+    test("CPU: Run for a cycle budget", &test_run_for);
+    test("CPU: Idle loop", &test_idle_loop);
+    test("CPU: Timing", &test_timing);
+    test("Scheduler", &test_scheduler);
+    test("Interconnect: Fastmem", &test_fastmem);
+    test("Kernel: HLE", &test_kernel);
+    test("Kernel: Native BIOS functions", &test_routines);
+
     return EXIT_SUCCESS;
 }